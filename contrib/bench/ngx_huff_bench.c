@@ -0,0 +1,416 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+/*
+ * The HPACK Huffman benchmark checks the octet table decoder and the
+ * word-at-a-time encoder against the previous nibble decoder and
+ * a bit-wise encoder kept here as references, then times both.
+ *
+ * The checks run randomized round-trips of random strings, split at
+ * a random point, and decode random and truncated input: the return
+ * codes, the output, and the decoding states must be identical.
+ * The decoder and encoder are included to reach their static tables.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include <ngx_http_v2_huff_decode.c>
+#include <ngx_http_v2_huff_encode.c>
+
+
+#define NGX_BENCH_CHECKS  1000000
+#define NGX_BENCH_LOOPS   1000000
+#define NGX_BENCH_LEN     256
+
+
+typedef ngx_int_t (*ngx_bench_decode_pt)(u_char *state, u_char *src,
+    size_t len, u_char **dst, ngx_uint_t last, ngx_log_t *log);
+
+
+static ngx_int_t ngx_bench_check_round_trip(void);
+static ngx_int_t ngx_bench_check_decode(u_char *src, size_t len,
+    ngx_uint_t split);
+static ngx_int_t ngx_bench_decode(ngx_bench_decode_pt decode, u_char *src,
+    size_t len, ngx_uint_t split, u_char *state, u_char *dst, size_t *n);
+static void ngx_bench_time(void);
+static ngx_int_t ngx_bench_nibble_decode(u_char *state, u_char *src,
+    size_t len, u_char **dst, ngx_uint_t last, ngx_log_t *log);
+static size_t ngx_bench_bits_encode(u_char *src, size_t len, u_char *dst,
+    ngx_uint_t lower, ngx_uint_t any);
+static ngx_uint_t ngx_bench_random(void);
+static uint64_t ngx_bench_nsec(void);
+
+
+static ngx_log_t   ngx_bench_log;
+static uint32_t    ngx_bench_seed = 1;
+
+static ngx_str_t   ngx_bench_user_agent = ngx_string(
+    "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 "
+    "(KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36");
+
+
+int ngx_cdecl
+main(int argc, char *const *argv)
+{
+    u_char      src[NGX_BENCH_LEN], enc[NGX_BENCH_LEN];
+    size_t      len, n;
+    ngx_uint_t  i, j;
+
+    ngx_http_v2_huff_decode_init();
+
+    for (i = 0; i < NGX_BENCH_CHECKS; i++) {
+
+        if (ngx_bench_check_round_trip() != NGX_OK) {
+            return 1;
+        }
+
+        /* random input, mostly invalid */
+
+        len = ngx_bench_random() % 64;
+
+        for (j = 0; j < len; j++) {
+            src[j] = (u_char) ngx_bench_random();
+        }
+
+        if (ngx_bench_check_decode(src, len, ngx_bench_random() % (len + 1))
+            != NGX_OK)
+        {
+            return 1;
+        }
+
+        /* valid codes, truncated at a random bit */
+
+        len = 1 + ngx_bench_random() % 64;
+
+        for (j = 0; j < len; j++) {
+            src[j] = (u_char) ngx_bench_random();
+        }
+
+        n = ngx_bench_bits_encode(src, len, enc, 0, 1);
+
+        n = ngx_bench_random() % (n + 1);
+
+        if (n) {
+            enc[n - 1] &= (u_char) (0xff << (ngx_bench_random() % 8));
+        }
+
+        if (ngx_bench_check_decode(enc, n, ngx_bench_random() % (n + 1))
+            != NGX_OK)
+        {
+            return 1;
+        }
+    }
+
+    printf("%d checks passed\n", NGX_BENCH_CHECKS);
+
+    ngx_bench_time();
+
+    return 0;
+}
+
+
+static ngx_int_t
+ngx_bench_check_round_trip(void)
+{
+    u_char      src[NGX_BENCH_LEN], enc[NGX_BENCH_LEN], ref[NGX_BENCH_LEN];
+    u_char      dec[NGX_BENCH_LEN * 2], state;
+    size_t      len, n, m, split;
+    ngx_uint_t  i, lower, printable;
+
+    len = ngx_bench_random() % NGX_BENCH_LEN;
+    lower = ngx_bench_random() & 1;
+    printable = ngx_bench_random() & 1;
+
+    for (i = 0; i < len; i++) {
+        src[i] = printable ? (u_char) (' ' + ngx_bench_random() % 95)
+                           : (u_char) ngx_bench_random();
+    }
+
+    n = ngx_http_v2_huff_encode(src, len, enc, lower);
+    m = ngx_bench_bits_encode(src, len, ref, lower, 0);
+
+    if (n != m || ngx_memcmp(enc, ref, n) != 0) {
+        printf("encode mismatch: length %lu, encoded %lu, reference %lu\n",
+               (unsigned long) len, (unsigned long) n, (unsigned long) m);
+        return NGX_ERROR;
+    }
+
+    if (n == 0) {
+        return NGX_OK;
+    }
+
+    split = ngx_bench_random() % (n + 1);
+
+    if (ngx_bench_check_decode(enc, n, split) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_bench_decode(ngx_http_v2_huff_decode, enc, n, split, &state,
+                         dec, &m)
+        != NGX_OK)
+    {
+        printf("round trip: decoding failed\n");
+        return NGX_ERROR;
+    }
+
+    if (lower) {
+        for (i = 0; i < len; i++) {
+            src[i] = ngx_tolower(src[i]);
+        }
+    }
+
+    if (m != len || ngx_memcmp(dec, src, len) != 0) {
+        printf("round trip: output mismatch\n");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_bench_check_decode(u_char *src, size_t len, ngx_uint_t split)
+{
+    u_char     dec[NGX_BENCH_LEN * 2], ref[NGX_BENCH_LEN * 2];
+    u_char     state, ref_state;
+    size_t     n, m;
+    ngx_int_t  rc, ref_rc;
+
+    rc = ngx_bench_decode(ngx_http_v2_huff_decode, src, len, split, &state,
+                          dec, &n);
+    ref_rc = ngx_bench_decode(ngx_bench_nibble_decode, src, len, split,
+                              &ref_state, ref, &m);
+
+    if (rc != ref_rc || state != ref_state
+        || n != m || ngx_memcmp(dec, ref, n) != 0)
+    {
+        printf("decode mismatch: length %lu, split %lu: "
+               "rc %d/%d, state %d/%d, output %lu/%lu\n",
+               (unsigned long) len, (unsigned long) split,
+               (int) rc, (int) ref_rc, state, ref_state,
+               (unsigned long) n, (unsigned long) m);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_bench_decode(ngx_bench_decode_pt decode, u_char *src, size_t len,
+    ngx_uint_t split, u_char *state, u_char *dst, size_t *n)
+{
+    u_char     *p;
+    ngx_int_t   rc;
+
+    /* the input is split as between two frames */
+
+    *state = 0;
+    p = dst;
+
+    rc = decode(state, src, split, &p, 0, &ngx_bench_log);
+
+    if (rc == NGX_OK) {
+        rc = decode(state, src + split, len - split, &p, 1, &ngx_bench_log);
+    }
+
+    *n = p - dst;
+
+    return rc;
+}
+
+
+static void
+ngx_bench_time(void)
+{
+    u_char      *p, state, enc[NGX_BENCH_LEN], dec[NGX_BENCH_LEN * 2];
+    size_t       n;
+    uint64_t     start, t;
+    ngx_uint_t   i, j;
+
+    static struct {
+        char                 *name;
+        ngx_bench_decode_pt   decode;
+    } decoders[] = {
+        { "nibble", ngx_bench_nibble_decode },
+        { "octet", ngx_http_v2_huff_decode }
+    };
+
+    n = ngx_http_v2_huff_encode(ngx_bench_user_agent.data,
+                                ngx_bench_user_agent.len, enc, 0);
+
+    printf("user agent, %lu octets, %lu encoded\n",
+           (unsigned long) ngx_bench_user_agent.len, (unsigned long) n);
+    printf("%-8s %8s %12s %10s\n", "", "", "ns/string", "MB/s");
+
+    for (i = 0; i < sizeof(decoders) / sizeof(decoders[0]); i++) {
+
+        start = ngx_bench_nsec();
+
+        for (j = 0; j < NGX_BENCH_LOOPS; j++) {
+            state = 0;
+            p = dec;
+
+            if (decoders[i].decode(&state, enc, n, &p, 1, &ngx_bench_log)
+                != NGX_OK)
+            {
+                printf("decoding failed\n");
+                return;
+            }
+        }
+
+        t = ngx_bench_nsec() - start;
+
+        printf("%-8s %8s %12.1f %10.1f\n", "decode", decoders[i].name,
+               (double) t / NGX_BENCH_LOOPS,
+               (double) ngx_bench_user_agent.len * NGX_BENCH_LOOPS * 1000 / t);
+    }
+
+    for (i = 0; i < 2; i++) {
+
+        start = ngx_bench_nsec();
+
+        for (j = 0; j < NGX_BENCH_LOOPS; j++) {
+            if (i) {
+                n = ngx_http_v2_huff_encode(ngx_bench_user_agent.data,
+                                            ngx_bench_user_agent.len, enc, 0);
+
+            } else {
+                n = ngx_bench_bits_encode(ngx_bench_user_agent.data,
+                                          ngx_bench_user_agent.len, enc, 0, 0);
+            }
+
+            if (n == 0) {
+                printf("encoding failed\n");
+                return;
+            }
+        }
+
+        t = ngx_bench_nsec() - start;
+
+        printf("%-8s %8s %12.1f %10.1f\n", "encode", i ? "word" : "bit",
+               (double) t / NGX_BENCH_LOOPS,
+               (double) ngx_bench_user_agent.len * NGX_BENCH_LOOPS * 1000 / t);
+    }
+}
+
+
+/* the decoder before the octets table */
+
+static ngx_int_t
+ngx_bench_nibble_decode(u_char *state, u_char *src, size_t len, u_char **dst,
+    ngx_uint_t last, ngx_log_t *log)
+{
+    u_char  *end, ch, ending;
+
+    ch = 0;
+    ending = 1;
+
+    end = src + len;
+
+    while (src != end) {
+        ch = *src++;
+
+        if (ngx_http_v2_huff_decode_bits(state, &ending, ch >> 4, dst)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        if (ngx_http_v2_huff_decode_bits(state, &ending, ch & 0xf, dst)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    if (last) {
+        if (!ending) {
+            return NGX_ERROR;
+        }
+
+        *state = 0;
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * writes one bit at a time; unless "any" is set, returns 0 if the
+ * result is not shorter than the input, as ngx_http_v2_huff_encode() does
+ */
+
+static size_t
+ngx_bench_bits_encode(u_char *src, size_t len, u_char *dst, ngx_uint_t lower,
+    ngx_uint_t any)
+{
+    size_t                           bits;
+    ngx_uint_t                       i, b;
+    ngx_http_v2_huff_encode_code_t  *table, *code;
+
+    table = lower ? ngx_http_v2_huff_encode_table_lc
+                  : ngx_http_v2_huff_encode_table;
+
+    bits = 0;
+
+    for (i = 0; i < len; i++) {
+        code = &table[src[i]];
+
+        if (!any && (bits + code->len + 7) / 8 >= len) {
+            return 0;
+        }
+
+        for (b = code->len; b--; bits++) {
+
+            if (bits % 8 == 0) {
+                dst[bits / 8] = 0;
+            }
+
+            if (code->code >> b & 1) {
+                dst[bits / 8] |= (u_char) (0x80 >> bits % 8);
+            }
+        }
+    }
+
+    /* padded with the most significant bits of EOS */
+
+    for ( /* void */ ; bits % 8; bits++) {
+        dst[bits / 8] |= (u_char) (0x80 >> bits % 8);
+    }
+
+    return bits / 8;
+}
+
+
+static ngx_uint_t
+ngx_bench_random(void)
+{
+    ngx_bench_seed = ngx_bench_seed * 1103515245 + 12345;
+
+    return ngx_bench_seed >> 8;
+}
+
+
+static uint64_t
+ngx_bench_nsec(void)
+{
+    struct timespec  ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+void
+ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+    const char *fmt, ...)
+{
+}
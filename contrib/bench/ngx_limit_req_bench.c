@@ -0,0 +1,249 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+/*
+ * The limit_req microbenchmark forks 1 to 8 workers which account
+ * requests against a single key of one zone, either with the zone
+ * mutex held around ngx_http_limit_req_lookup() as without "sync=",
+ * or through the per-worker lease of ngx_http_limit_req_shard().
+ * The rate and burst are high enough for no request to be rejected.
+ * The module is included to reach its static functions.  An argument
+ * limits the number of workers.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include <ngx_http_limit_req_module.c>
+
+
+#define NGX_BENCH_LOOPS  2000000
+#define NGX_BENCH_ZONE   (1024 * 1024)
+
+
+static void ngx_bench_run(ngx_uint_t lease, ngx_uint_t workers);
+static void ngx_bench_worker(ngx_uint_t lease);
+static ngx_int_t ngx_bench_zone(ngx_uint_t lease);
+static uint64_t ngx_bench_nsec(void);
+
+
+volatile ngx_msec_t      ngx_current_msec;
+volatile ngx_cycle_t    *ngx_cycle;
+ngx_int_t                ngx_ncpu;
+ngx_pid_t                ngx_pid;
+
+static ngx_log_t                   ngx_bench_log;
+static ngx_cycle_t                 ngx_bench_cycle;
+static ngx_shm_zone_t              ngx_bench_shm_zone;
+static ngx_http_limit_req_ctx_t    ngx_bench_ctx;
+static ngx_http_limit_req_limit_t  ngx_bench_limit;
+static ngx_str_t                   ngx_bench_key = ngx_string("192.0.2.1");
+
+
+int ngx_cdecl
+main(int argc, char *const *argv)
+{
+    ngx_int_t   n;
+    ngx_uint_t  i;
+
+    static ngx_uint_t  workers[] = { 1, 2, 4, 8 };
+
+    ngx_pagesize = getpagesize();
+    for (n = ngx_pagesize; n >>= 1; ngx_pagesize_shift++) { /* void */ }
+
+    ngx_ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    ngx_bench_cycle.log = &ngx_bench_log;
+    ngx_cycle = &ngx_bench_cycle;
+
+    ngx_slab_sizes_init();
+
+    printf("%d CPUs\n", (int) ngx_ncpu);
+    printf("%-8s %8s %12s %14s\n", "workers", "path", "ns/request",
+           "requests/s");
+
+    for (i = 0; i < sizeof(workers) / sizeof(workers[0]); i++) {
+
+        if (argc > 1 && (ngx_uint_t) atoi(argv[1]) < workers[i]) {
+            break;
+        }
+
+        ngx_bench_run(0, workers[i]);
+        ngx_bench_run(1, workers[i]);
+    }
+
+    return 0;
+}
+
+
+static void
+ngx_bench_run(ngx_uint_t lease, ngx_uint_t workers)
+{
+    int         status;
+    uint64_t    start, t;
+    ngx_uint_t  i;
+
+    if (ngx_bench_zone(lease) != NGX_OK) {
+        printf("zone initialization failed\n");
+        exit(1);
+    }
+
+    fflush(stdout);
+
+    start = ngx_bench_nsec();
+
+    for (i = 0; i < workers; i++) {
+
+        switch (fork()) {
+
+        case -1:
+            printf("fork() failed\n");
+            exit(1);
+
+        case 0:
+            ngx_pid = getpid();
+            ngx_bench_worker(lease);
+            exit(0);
+        }
+    }
+
+    while (wait(&status) > 0) { /* void */ }
+
+    t = ngx_bench_nsec() - start;
+
+    printf("%-8lu %8s %12.1f %14.0f\n",
+           (unsigned long) workers, lease ? "lease" : "locked",
+           (double) t / (NGX_BENCH_LOOPS * workers),
+           (double) NGX_BENCH_LOOPS * workers * 1000000000 / t);
+
+    munmap(ngx_bench_shm_zone.shm.addr, NGX_BENCH_ZONE);
+    free(ngx_bench_ctx.shards);
+}
+
+
+static void
+ngx_bench_worker(ngx_uint_t lease)
+{
+    uint32_t    hash;
+    ngx_int_t   rc;
+    ngx_uint_t  i, excess, rejected;
+
+    hash = ngx_crc32_short(ngx_bench_key.data, ngx_bench_key.len);
+    rejected = 0;
+
+    for (i = 0; i < NGX_BENCH_LOOPS; i++) {
+
+        /* the time is updated once per event loop iteration */
+
+        if ((i & 63) == 0) {
+            ngx_current_msec = (ngx_msec_t) (ngx_bench_nsec() / 1000000);
+        }
+
+        if (lease) {
+            rc = ngx_http_limit_req_shard(&ngx_bench_limit, hash,
+                                          &ngx_bench_key, &excess, 1);
+
+        } else {
+            ngx_shmtx_lock(&ngx_bench_ctx.shpool->mutex);
+
+            rc = ngx_http_limit_req_lookup(&ngx_bench_limit, hash,
+                                           &ngx_bench_key, &excess, 1);
+
+            ngx_shmtx_unlock(&ngx_bench_ctx.shpool->mutex);
+        }
+
+        if (rc != NGX_OK) {
+            rejected++;
+        }
+    }
+
+    if (rejected) {
+        printf("worker %d: %lu rejected\n", (int) ngx_pid,
+               (unsigned long) rejected);
+    }
+}
+
+
+static ngx_int_t
+ngx_bench_zone(ngx_uint_t lease)
+{
+    u_char           *addr;
+    ngx_slab_pool_t  *sp;
+
+    addr = mmap(NULL, NGX_BENCH_ZONE, PROT_READ|PROT_WRITE,
+                MAP_ANON|MAP_SHARED, -1, 0);
+    if (addr == MAP_FAILED) {
+        return NGX_ERROR;
+    }
+
+    /* as ngx_init_zone_pool() does */
+
+    sp = (ngx_slab_pool_t *) addr;
+
+    sp->end = addr + NGX_BENCH_ZONE;
+    sp->min_shift = 3;
+    sp->addr = addr;
+
+    if (ngx_shmtx_create(&sp->mutex, &sp->lock, NULL) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_slab_init(sp);
+
+    ngx_memzero(&ngx_bench_ctx, sizeof(ngx_http_limit_req_ctx_t));
+
+    /* 1G r/s, burst=1000000 */
+
+    ngx_bench_ctx.rate = (ngx_uint_t) 1000000000 * 1000;
+
+    if (lease) {
+        ngx_bench_ctx.sync = 100;
+        ngx_bench_ctx.shards = calloc(NGX_HTTP_LIMIT_REQ_SHARDS,
+                                      sizeof(ngx_http_limit_req_shard_t));
+        if (ngx_bench_ctx.shards == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    ngx_memzero(&ngx_bench_shm_zone, sizeof(ngx_shm_zone_t));
+
+    ngx_str_set(&ngx_bench_shm_zone.shm.name, "bench");
+    ngx_bench_shm_zone.shm.addr = addr;
+    ngx_bench_shm_zone.shm.size = NGX_BENCH_ZONE;
+    ngx_bench_shm_zone.data = &ngx_bench_ctx;
+
+    ngx_bench_limit.shm_zone = &ngx_bench_shm_zone;
+    ngx_bench_limit.burst = 1000000 * 1000;
+    ngx_bench_limit.delay = NGX_MAX_INT_T_VALUE;
+
+    return ngx_http_limit_req_init_zone(&ngx_bench_shm_zone, NULL);
+}
+
+
+static uint64_t
+ngx_bench_nsec(void)
+{
+    struct timespec  ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+void
+ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+    const char *fmt, ...)
+{
+}
+
+
+void
+ngx_debug_point(void)
+{
+}
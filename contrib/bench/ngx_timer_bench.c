@@ -0,0 +1,160 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+/*
+ * The event timer microbenchmark compares the rbtree and the timer wheel
+ * on add, re-add (delete and add) and expire of 10k to 1M timers with
+ * random timeouts up to 60s.  Expiration advances the time by 1ms and
+ * calls ngx_event_expire_timers() as the event loop does.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+
+#define NGX_BENCH_TIMEOUT  60000
+
+
+static void ngx_bench_run(ngx_uint_t wheel, ngx_uint_t n);
+static void ngx_bench_handler(ngx_event_t *ev);
+static ngx_msec_t ngx_bench_timeout(void);
+static uint64_t ngx_bench_nsec(void);
+
+
+volatile ngx_msec_t     ngx_current_msec;
+
+static ngx_log_t        ngx_bench_log;
+static ngx_connection_t ngx_bench_connection;
+static ngx_event_t     *ngx_bench_events;
+static ngx_uint_t       ngx_bench_expired;
+static uint32_t         ngx_bench_seed = 1;
+
+
+int ngx_cdecl
+main(int argc, char *const *argv)
+{
+    ngx_uint_t  i, n;
+
+    static ngx_uint_t  counts[] = { 10000, 100000, 1000000 };
+
+    ngx_bench_connection.fd = (ngx_socket_t) -1;
+
+    printf("%-8s %8s %12s %12s %12s\n",
+           "timers", "backend", "add ns", "re-add ns", "expire ns");
+
+    for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        n = counts[i];
+
+        ngx_bench_events = calloc(n, sizeof(ngx_event_t));
+        if (ngx_bench_events == NULL) {
+            return 1;
+        }
+
+        ngx_bench_run(0, n);
+        ngx_bench_run(1, n);
+
+        free(ngx_bench_events);
+    }
+
+    return 0;
+}
+
+
+static void
+ngx_bench_run(ngx_uint_t wheel, ngx_uint_t n)
+{
+    uint64_t      start, add, readd, expire;
+    ngx_uint_t    i;
+    ngx_event_t  *ev;
+
+    ngx_event_timer_wheel = wheel;
+    ngx_current_msec = 1000;
+    ngx_bench_seed = 1;
+    ngx_bench_expired = 0;
+
+    (void) ngx_event_timer_init(&ngx_bench_log);
+
+    for (i = 0; i < n; i++) {
+        ev = &ngx_bench_events[i];
+
+        ngx_memzero(ev, sizeof(ngx_event_t));
+        ev->data = &ngx_bench_connection;
+        ev->log = &ngx_bench_log;
+        ev->handler = ngx_bench_handler;
+    }
+
+    start = ngx_bench_nsec();
+
+    for (i = 0; i < n; i++) {
+        ngx_event_add_timer(&ngx_bench_events[i], ngx_bench_timeout());
+    }
+
+    add = ngx_bench_nsec() - start;
+
+    /* a keepalive connection resets its timer on each request */
+
+    start = ngx_bench_nsec();
+
+    for (i = 0; i < n; i++) {
+        ev = &ngx_bench_events[i];
+
+        ngx_event_del_timer(ev);
+        ngx_event_add_timer(ev, ngx_bench_timeout());
+    }
+
+    readd = ngx_bench_nsec() - start;
+
+    start = ngx_bench_nsec();
+
+    while (ngx_bench_expired < n) {
+        ngx_current_msec++;
+
+        (void) ngx_event_find_timer();
+        ngx_event_expire_timers();
+    }
+
+    expire = ngx_bench_nsec() - start;
+
+    printf("%-8lu %8s %12.1f %12.1f %12.1f\n",
+           (unsigned long) n, wheel ? "wheel" : "rbtree",
+           (double) add / n, (double) readd / n, (double) expire / n);
+}
+
+
+static void
+ngx_bench_handler(ngx_event_t *ev)
+{
+    ngx_bench_expired++;
+}
+
+
+static ngx_msec_t
+ngx_bench_timeout(void)
+{
+    ngx_bench_seed = ngx_bench_seed * 1103515245 + 12345;
+
+    return 1 + (ngx_bench_seed >> 8) % NGX_BENCH_TIMEOUT;
+}
+
+
+static uint64_t
+ngx_bench_nsec(void)
+{
+    struct timespec  ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+void
+ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+    const char *fmt, ...)
+{
+}
@@ -0,0 +1,309 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+/*
+ * The UDP session lookup microbenchmark times 2M random lookups among
+ * 1k to 100k sessions of one listening socket: in the rbtree keyed by
+ * crc32 as before, and with ngx_lookup_udp_connection() in the chained
+ * hash table filled by ngx_insert_udp_connection().  The event module
+ * is included to reach its static functions, unused parts of it are
+ * left out when linking.
+ *
+ * End-to-end runs with many concurrent flows use ngx_udp_flows.c.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+#include <ngx_event_udp.c>
+
+
+#define NGX_BENCH_LOOKUPS  2000000
+
+
+typedef struct {
+    ngx_rbtree_node_t   node;
+    ngx_connection_t   *connection;
+} ngx_bench_udp_node_t;
+
+
+static void ngx_bench_run(ngx_uint_t n);
+static void ngx_bench_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static ngx_connection_t *ngx_bench_rbtree_lookup(ngx_rbtree_t *rbtree,
+    struct sockaddr *sockaddr, socklen_t socklen);
+static uint64_t ngx_bench_nsec(void);
+
+
+volatile ngx_cycle_t  *ngx_cycle;
+
+/* used to detach connected sessions only */
+ngx_event_actions_t    ngx_event_actions;
+ngx_queue_t            ngx_posted_events;
+
+static ngx_log_t       ngx_bench_log;
+static ngx_cycle_t     ngx_bench_cycle;
+static uint32_t        ngx_bench_seed = 1;
+
+
+int ngx_cdecl
+main(int argc, char *const *argv)
+{
+    ngx_uint_t  i;
+
+    static ngx_uint_t  sessions[] = { 1000, 10000, 100000 };
+
+    ngx_bench_cycle.log = &ngx_bench_log;
+    ngx_cycle = &ngx_bench_cycle;
+
+    printf("%-8s %12s %12s %8s\n", "sessions", "rbtree ns", "hash ns",
+           "buckets");
+
+    for (i = 0; i < sizeof(sessions) / sizeof(sessions[0]); i++) {
+        ngx_bench_run(sessions[i]);
+    }
+
+    return 0;
+}
+
+
+static void
+ngx_bench_run(ngx_uint_t n)
+{
+    uint32_t               hash;
+    uint64_t               start, rbtree_time, hash_time;
+    ngx_uint_t             i, k, *order;
+    ngx_pool_t            *pool;
+    ngx_rbtree_t           rbtree;
+    ngx_listening_t        ls;
+    ngx_connection_t      *c, *conns;
+    ngx_rbtree_node_t      sentinel;
+    struct sockaddr_in    *sin, local;
+    ngx_bench_udp_node_t  *nodes;
+
+    pool = ngx_create_pool(16384, &ngx_bench_log);
+    conns = calloc(n, sizeof(ngx_connection_t));
+    sin = calloc(n, sizeof(struct sockaddr_in));
+    nodes = calloc(n, sizeof(ngx_bench_udp_node_t));
+    order = malloc(NGX_BENCH_LOOKUPS * sizeof(ngx_uint_t));
+
+    if (pool == NULL || conns == NULL || sin == NULL || nodes == NULL
+        || order == NULL)
+    {
+        printf("allocation failed\n");
+        exit(1);
+    }
+
+    ngx_memzero(&ls, sizeof(ngx_listening_t));
+    ngx_str_set(&ls.addr_text, "127.0.0.1:53");
+
+    ngx_memzero(&local, sizeof(struct sockaddr_in));
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    local.sin_port = htons(53);
+
+    ngx_rbtree_init(&rbtree, &sentinel, ngx_bench_rbtree_insert_value);
+
+    /* clients on 127.0.0.0/8 use ephemeral ports 32768-59999 */
+
+    for (i = 0; i < n; i++) {
+        sin[i].sin_family = AF_INET;
+        sin[i].sin_addr.s_addr = htonl(0x7f000001 + i / 28000);
+        sin[i].sin_port = htons(32768 + i % 28000);
+
+        c = &conns[i];
+
+        c->pool = pool;
+        c->log = &ngx_bench_log;
+        c->listening = &ls;
+        c->sockaddr = (struct sockaddr *) &sin[i];
+        c->socklen = sizeof(struct sockaddr_in);
+        c->local_sockaddr = (struct sockaddr *) &local;
+        c->local_socklen = sizeof(struct sockaddr_in);
+
+        ngx_crc32_init(hash);
+        ngx_crc32_update(&hash, (u_char *) c->sockaddr, c->socklen);
+        ngx_crc32_final(hash);
+
+        nodes[i].node.key = hash;
+        nodes[i].connection = c;
+
+        ngx_rbtree_insert(&rbtree, &nodes[i].node);
+
+        if (ngx_insert_udp_connection(c) != NGX_OK) {
+            printf("ngx_insert_udp_connection() failed\n");
+            exit(1);
+        }
+    }
+
+    for (i = 0; i < NGX_BENCH_LOOKUPS; i++) {
+        ngx_bench_seed = ngx_bench_seed * 1103515245 + 12345;
+        order[i] = (ngx_bench_seed >> 8) % n;
+    }
+
+    start = ngx_bench_nsec();
+
+    for (i = 0; i < NGX_BENCH_LOOKUPS; i++) {
+        k = order[i];
+
+        c = ngx_bench_rbtree_lookup(&rbtree, (struct sockaddr *) &sin[k],
+                                    sizeof(struct sockaddr_in));
+        if (c != &conns[k]) {
+            printf("rbtree lookup failed\n");
+            exit(1);
+        }
+    }
+
+    rbtree_time = ngx_bench_nsec() - start;
+
+    start = ngx_bench_nsec();
+
+    for (i = 0; i < NGX_BENCH_LOOKUPS; i++) {
+        k = order[i];
+
+        c = ngx_lookup_udp_connection(&ls, (struct sockaddr *) &sin[k],
+                                      sizeof(struct sockaddr_in),
+                                      (struct sockaddr *) &local,
+                                      sizeof(struct sockaddr_in));
+        if (c != &conns[k]) {
+            printf("hash lookup failed\n");
+            exit(1);
+        }
+    }
+
+    hash_time = ngx_bench_nsec() - start;
+
+    printf("%-8lu %12.1f %12.1f %8lu\n", (unsigned long) n,
+           (double) rbtree_time / NGX_BENCH_LOOKUPS,
+           (double) hash_time / NGX_BENCH_LOOKUPS,
+           (unsigned long) ls.udp_hash_mask + 1);
+
+    /* the pool cleanups remove the sessions from the hash table */
+
+    ngx_destroy_pool(pool);
+
+    if (ls.udp_nsessions) {
+        printf("%lu sessions left\n", (unsigned long) ls.udp_nsessions);
+    }
+
+    ngx_free(ls.udp_hash);
+
+    free(conns);
+    free(sin);
+    free(nodes);
+    free(order);
+}
+
+
+/* the rbtree of sessions before the hash table */
+
+static void
+ngx_bench_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_int_t               rc;
+    ngx_connection_t       *c, *ct;
+    ngx_rbtree_node_t     **p;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            c = ((ngx_bench_udp_node_t *) node)->connection;
+            ct = ((ngx_bench_udp_node_t *) temp)->connection;
+
+            rc = ngx_cmp_sockaddr(c->sockaddr, c->socklen,
+                                  ct->sockaddr, ct->socklen, 1);
+
+            p = (rc < 0) ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static ngx_connection_t *
+ngx_bench_rbtree_lookup(ngx_rbtree_t *rbtree, struct sockaddr *sockaddr,
+    socklen_t socklen)
+{
+    uint32_t            hash;
+    ngx_int_t           rc;
+    ngx_connection_t   *c;
+    ngx_rbtree_node_t  *node, *sentinel;
+
+    node = rbtree->root;
+    sentinel = rbtree->sentinel;
+
+    ngx_crc32_init(hash);
+    ngx_crc32_update(&hash, (u_char *) sockaddr, socklen);
+    ngx_crc32_final(hash);
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        c = ((ngx_bench_udp_node_t *) node)->connection;
+
+        rc = ngx_cmp_sockaddr(sockaddr, socklen, c->sockaddr, c->socklen, 1);
+
+        if (rc == 0) {
+            return c;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+static uint64_t
+ngx_bench_nsec(void)
+{
+    struct timespec  ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+void
+ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+    const char *fmt, ...)
+{
+}
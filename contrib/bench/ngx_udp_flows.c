@@ -0,0 +1,264 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+/*
+ * The UDP flow generator opens one socket per client flow and sends
+ * 64-byte datagrams to a stream proxy on 127.0.0.1, counting what the
+ * proxy forwards to a sink on another port:
+ *
+ *     stream {
+ *         server {
+ *             listen 127.0.0.1:18200 udp rcvbuf=8m;
+ *             proxy_pass 127.0.0.1:18201;
+ *             proxy_timeout 60s;
+ *         }
+ *     }
+ *
+ *     ngx_udp_flows 18200 18201 10000 40 [worker pid]
+ *
+ * The first round opens the sessions, the other rounds are measured.
+ * Flows are spread over 127.0.0.1-127.0.0.4 to have enough ephemeral
+ * ports for 100k flows; the worker needs as many connections and open
+ * files.  With the pid of the worker, its CPU time per forwarded
+ * datagram is reported.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+
+#define NGX_FLOWS_PER_ADDR  25000
+#define NGX_FLOWS_BURST     256
+
+
+static int ngx_flows_sink(int port, int fd);
+static long ngx_flows_cpu(int pid);
+
+
+int
+main(int argc, char *const *argv)
+{
+    int                 i, r, n, rounds, pid, sink, *fd, p[2];
+    long                sent, forwarded, cpu;
+    char                buf[64];
+    struct rlimit       rlim;
+    struct sockaddr_in  sin, local;
+
+    if (argc < 5) {
+        fprintf(stderr, "usage: ngx_udp_flows port sink_port flows rounds "
+                "[worker_pid]\n");
+        return 1;
+    }
+
+    n = atoi(argv[3]);
+    rounds = atoi(argv[4]);
+    pid = (argc > 5) ? atoi(argv[5]) : 0;
+
+    if (n <= 0 || rounds < 2) {
+        fprintf(stderr, "at least 1 flow and 2 rounds are needed\n");
+        return 1;
+    }
+
+    rlim.rlim_cur = n + 64;
+    rlim.rlim_max = n + 64;
+
+    if (setrlimit(RLIMIT_NOFILE, &rlim) == -1) {
+        perror("setrlimit(RLIMIT_NOFILE)");
+        return 1;
+    }
+
+    if (pipe(p) == -1) {
+        perror("pipe()");
+        return 1;
+    }
+
+    sink = fork();
+
+    if (sink == -1) {
+        perror("fork()");
+        return 1;
+    }
+
+    if (sink == 0) {
+        close(p[0]);
+        return ngx_flows_sink(atoi(argv[2]), p[1]);
+    }
+
+    close(p[1]);
+
+    fd = malloc(n * sizeof(int));
+    if (fd == NULL) {
+        return 1;
+    }
+
+    memset(&sin, 0, sizeof(struct sockaddr_in));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(atoi(argv[1]));
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    memset(&local, 0, sizeof(struct sockaddr_in));
+    local.sin_family = AF_INET;
+
+    for (i = 0; i < n; i++) {
+        fd[i] = socket(AF_INET, SOCK_DGRAM, 0);
+
+        if (fd[i] == -1) {
+            perror("socket()");
+            return 1;
+        }
+
+        local.sin_addr.s_addr = htonl(INADDR_LOOPBACK
+                                      + i / NGX_FLOWS_PER_ADDR);
+
+        if (bind(fd[i], (struct sockaddr *) &local, sizeof(local)) == -1) {
+            perror("bind()");
+            return 1;
+        }
+    }
+
+    memset(buf, 'x', sizeof(buf));
+
+    cpu = 0;
+
+    /* the sessions are opened by the first round */
+
+    sleep(1);
+
+    for (r = 0; r < rounds; r++) {
+
+        if (r == 1) {
+            sleep(2);
+            cpu = pid ? ngx_flows_cpu(pid) : 0;
+        }
+
+        for (i = 0; i < n; i++) {
+            (void) sendto(fd[i], buf, sizeof(buf), 0,
+                          (struct sockaddr *) &sin, sizeof(sin));
+
+            if (i % NGX_FLOWS_BURST == NGX_FLOWS_BURST - 1) {
+                usleep(200);
+            }
+        }
+    }
+
+    if (read(p[0], &forwarded, sizeof(long)) != sizeof(long)) {
+        fprintf(stderr, "no result from the sink\n");
+        return 1;
+    }
+
+    (void) waitpid(sink, NULL, 0);
+
+    cpu = pid ? ngx_flows_cpu(pid) - cpu : 0;
+
+    /* the first round is not counted */
+
+    forwarded -= n;
+    sent = (long) n * (rounds - 1);
+
+    printf("flows %d: forwarded %ld of %ld", n, forwarded, sent);
+
+    if (pid && forwarded > 0) {
+        printf(", worker %.2f us/datagram", (double) cpu / forwarded);
+    }
+
+    printf("\n");
+
+    return 0;
+}
+
+
+/* counts datagrams until none arrive for 5 seconds */
+
+static int
+ngx_flows_sink(int port, int fd)
+{
+    int                 s, rcvbuf;
+    long                n;
+    char                buf[2048];
+    struct timeval      tv;
+    struct sockaddr_in  sin;
+
+    s = socket(AF_INET, SOCK_DGRAM, 0);
+    if (s == -1) {
+        perror("socket()");
+        return 1;
+    }
+
+    rcvbuf = 8 * 1024 * 1024;
+    (void) setsockopt(s, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(int));
+
+    memset(&sin, 0, sizeof(struct sockaddr_in));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(s, (struct sockaddr *) &sin, sizeof(sin)) == -1) {
+        perror("bind()");
+        return 1;
+    }
+
+    tv.tv_sec = 5;
+    tv.tv_usec = 0;
+    (void) setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    for (n = 0; recv(s, buf, sizeof(buf), 0) >= 0; n++) { /* void */ }
+
+    if (write(fd, &n, sizeof(long)) != sizeof(long)) {
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/* user and system time of a process, in microseconds */
+
+static long
+ngx_flows_cpu(int pid)
+{
+    char           *p, buf[1024];
+    long            utime, stime;
+    FILE           *f;
+    unsigned long   tck;
+
+    snprintf(buf, sizeof(buf), "/proc/%d/stat", pid);
+
+    f = fopen(buf, "r");
+    if (f == NULL) {
+        return 0;
+    }
+
+    p = fgets(buf, sizeof(buf), f);
+    fclose(f);
+
+    if (p == NULL) {
+        return 0;
+    }
+
+    /* fields 14 and 15, after the command in parentheses */
+
+    p = strrchr(buf, ')');
+
+    if (p == NULL
+        || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %ld %ld",
+                  &utime, &stime) != 2)
+    {
+        return 0;
+    }
+
+    tck = sysconf(_SC_CLK_TCK);
+
+    return (utime + stime) * (1000000 / tck);
+}
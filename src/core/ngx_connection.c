@@ -14,6 +14,13 @@ ngx_os_io_t  ngx_io;
 
 
 static void ngx_drain_connections(ngx_cycle_t *cycle);
+#if (NGX_HAVE_REUSEPORT_CBPF)
+static void ngx_reuseport_join(ngx_cycle_t *cycle, ngx_listening_t *ls);
+static ngx_uint_t ngx_reuseport_members(ngx_array_t *listening,
+    ngx_listening_t *ls, ngx_uint_t n, ngx_uint_t remain);
+static ngx_uint_t ngx_reuseport_member(ngx_listening_t *ls,
+    ngx_listening_t *member);
+#endif
 
 
 ngx_listening_t *
@@ -72,10 +79,6 @@ ngx_create_listening(ngx_conf_t *cf, struct sockaddr *sockaddr,
 
     ngx_memcpy(ls->addr_text.data, text, len);
 
-#if !(NGX_WIN32)
-    ngx_rbtree_init(&ls->rbtree, &ls->sentinel, ngx_udp_rbtree_insert_value);
-#endif
-
     ls->fd = (ngx_socket_t) -1;
     ls->type = SOCK_STREAM;
 
@@ -309,6 +312,14 @@ ngx_set_inherited_sockets(ngx_cycle_t *cycle)
         }
 #endif
 
+#if (NGX_HAVE_REUSEPORT_CBPF)
+
+        /* the group order is not known, the order of sockets is assumed */
+
+        ls[i].reuseport_index = ngx_reuseport_members(&cycle->listening,
+                                                      &ls[i], i, 1);
+#endif
+
 #endif
 
         if (ls[i].type != SOCK_STREAM) {
@@ -647,6 +658,9 @@ ngx_open_listening_sockets(ngx_cycle_t *cycle)
 #endif
 
             if (ls[i].type != SOCK_STREAM) {
+#if (NGX_HAVE_REUSEPORT_CBPF)
+                ngx_reuseport_join(cycle, &ls[i]);
+#endif
                 ls[i].fd = s;
                 continue;
             }
@@ -685,6 +699,10 @@ ngx_open_listening_sockets(ngx_cycle_t *cycle)
 
             ls[i].listen = 1;
 
+#if (NGX_HAVE_REUSEPORT_CBPF)
+            ngx_reuseport_join(cycle, &ls[i]);
+#endif
+
             ls[i].fd = s;
         }
 
@@ -709,6 +727,117 @@ ngx_open_listening_sockets(ngx_cycle_t *cycle)
 }
 
 
+#if (NGX_HAVE_REUSEPORT_CBPF)
+
+/*
+ * A reuseport group numbers its sockets in the order they are added
+ * to it, by bind() for UDP and by listen() for TCP, and when a socket
+ * is closed, the last socket of the group takes its place.  The positions
+ * are tracked, so that a steering program can map worker processes
+ * to them.  The sockets of the old cycle which are not reused are still
+ * open when new sockets are added, and are closed after that.
+ */
+
+static void
+ngx_reuseport_join(ngx_cycle_t *cycle, ngx_listening_t *ls)
+{
+    ngx_uint_t  n;
+
+    if (!ls->reuseport) {
+        return;
+    }
+
+    n = ngx_reuseport_members(&cycle->listening, ls,
+                              cycle->listening.nelts, 1);
+
+    if (cycle->old_cycle) {
+        n += ngx_reuseport_members(&cycle->old_cycle->listening, ls,
+                                   cycle->old_cycle->listening.nelts, 0);
+    }
+
+    ls->reuseport_index = n;
+}
+
+
+/* called for a socket of the old cycle before it is closed */
+
+void
+ngx_reuseport_leave(ngx_cycle_t *cycle, ngx_listening_t *ls)
+{
+    ngx_uint_t        i;
+    ngx_listening_t  *last, *nls;
+
+    if (!ls->reuseport) {
+        return;
+    }
+
+    last = NULL;
+
+    nls = cycle->listening.elts;
+    for (i = 0; i < cycle->listening.nelts; i++) {
+        if (ngx_reuseport_member(ls, &nls[i])
+            && (last == NULL
+                || nls[i].reuseport_index > last->reuseport_index))
+        {
+            last = &nls[i];
+        }
+    }
+
+    nls = cycle->old_cycle->listening.elts;
+    for (i = 0; i < cycle->old_cycle->listening.nelts; i++) {
+        if (!nls[i].remain
+            && ngx_reuseport_member(ls, &nls[i])
+            && (last == NULL
+                || nls[i].reuseport_index > last->reuseport_index))
+        {
+            last = &nls[i];
+        }
+    }
+
+    if (last && last->reuseport_index > ls->reuseport_index) {
+        last->reuseport_index = ls->reuseport_index;
+    }
+}
+
+
+static ngx_uint_t
+ngx_reuseport_members(ngx_array_t *listening, ngx_listening_t *ls,
+    ngx_uint_t n, ngx_uint_t remain)
+{
+    ngx_uint_t        i, count;
+    ngx_listening_t  *member;
+
+    count = 0;
+    member = listening->elts;
+
+    for (i = 0; i < n; i++) {
+        if ((remain || !member[i].remain)
+            && ngx_reuseport_member(ls, &member[i]))
+        {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+
+static ngx_uint_t
+ngx_reuseport_member(ngx_listening_t *ls, ngx_listening_t *member)
+{
+    return member != ls
+           && member->fd != (ngx_socket_t) -1
+           && member->reuseport
+           && !member->ignore
+           && member->type == ls->type
+           && ngx_cmp_sockaddr(member->sockaddr, member->socklen,
+                               ls->sockaddr, ls->socklen, 1)
+              == NGX_OK;
+}
+
+#endif
+
+
 void
 ngx_configure_listening_sockets(ngx_cycle_t *cycle)
 {
@@ -1053,6 +1182,10 @@ ngx_close_listening_sockets(ngx_cycle_t *cycle)
                 }
             }
 
+            if (c->read->posted) {
+                ngx_delete_posted_event(c->read);
+            }
+
             ngx_free_connection(c);
 
             c->fd = (ngx_socket_t) -1;
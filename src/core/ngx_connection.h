@@ -51,10 +51,15 @@ struct ngx_listening_s {
     ngx_listening_t    *previous;
     ngx_connection_t   *connection;
 
-    ngx_rbtree_t        rbtree;
-    ngx_rbtree_node_t   sentinel;
+    /* UDP sessions, a chained hash table of ngx_udp_connection_t */
+    ngx_udp_connection_t  **udp_hash;
+    ngx_uint_t          udp_hash_mask;
+    ngx_uint_t          udp_nsessions;
 
     ngx_uint_t          worker;
+#if (NGX_HAVE_REUSEPORT_CBPF || NGX_COMPAT)
+    ngx_uint_t          reuseport_index;  /* position in reuseport group */
+#endif
 
     unsigned            open:1;
     unsigned            remain:1;
@@ -68,11 +73,13 @@ struct ngx_listening_s {
     unsigned            shared:1;    /* shared between threads or processes */
     unsigned            addr_ntop:1;
     unsigned            wildcard:1;
+    unsigned            connected:1;   /* UDP sessions on own sockets */
 
 #if (NGX_HAVE_INET6)
     unsigned            ipv6only:1;
 #endif
     unsigned            reuseport:1;
+    unsigned            reuseport_cpu:1;
     unsigned            add_reuseport:1;
     unsigned            keepalive:2;
 
@@ -215,6 +222,9 @@ ngx_int_t ngx_set_inherited_sockets(ngx_cycle_t *cycle);
 ngx_int_t ngx_open_listening_sockets(ngx_cycle_t *cycle);
 void ngx_configure_listening_sockets(ngx_cycle_t *cycle);
 void ngx_close_listening_sockets(ngx_cycle_t *cycle);
+#if (NGX_HAVE_REUSEPORT_CBPF)
+void ngx_reuseport_leave(ngx_cycle_t *cycle, ngx_listening_t *ls);
+#endif
 void ngx_close_connection(ngx_connection_t *c);
 void ngx_close_idle_connections(ngx_cycle_t *cycle);
 ngx_int_t ngx_connection_local_sockaddr(ngx_connection_t *c, ngx_str_t *s,
@@ -569,6 +569,10 @@ ngx_init_cycle(ngx_cycle_t *old_cycle)
                     }
 #endif
 
+#if (NGX_HAVE_REUSEPORT_CBPF)
+                    nls[n].reuseport_index = ls[i].reuseport_index;
+#endif
+
                     break;
                 }
             }
@@ -701,12 +705,18 @@ old_shm_zone_done:
             continue;
         }
 
+#if (NGX_HAVE_REUSEPORT_CBPF)
+        ngx_reuseport_leave(cycle, &ls[i]);
+#endif
+
         if (ngx_close_socket(ls[i].fd) == -1) {
             ngx_log_error(NGX_LOG_EMERG, log, ngx_socket_errno,
                           ngx_close_socket_n " listening socket on %V failed",
                           &ls[i].addr_text);
         }
 
+        ls[i].fd = (ngx_socket_t) -1;
+
 #if (NGX_HAVE_UNIX_DOMAIN)
 
         if (ls[i].sockaddr->sa_family == AF_UNIX) {
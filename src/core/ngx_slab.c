@@ -158,6 +158,7 @@ ngx_slab_init(ngx_slab_pool_t *pool)
 
     pool->last = pool->pages + pages;
     pool->pfree = pages;
+    pool->pfails = 0;
 
     pool->log_nomem = 1;
     pool->log_ctx = &pool->zero;
@@ -200,6 +201,7 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
 
         } else {
             p = 0;
+            pool->pfails++;
         }
 
         goto done;
@@ -674,6 +676,41 @@ fail:
 }
 
 
+void
+ngx_slab_stats(ngx_slab_pool_t *pool, ngx_slab_stats_t *stats,
+    ngx_slab_stat_t *slots)
+{
+    ngx_slab_page_t  *page;
+
+    /* the "slots" array must have room for ngx_pagesize_shift entries */
+
+    ngx_shmtx_lock(&pool->mutex);
+
+    stats->min_size = pool->min_size;
+
+    stats->pages = pool->last - pool->pages;
+    stats->free = pool->pfree;
+    stats->fails = pool->pfails;
+
+    stats->runs = 0;
+    stats->largest = 0;
+
+    for (page = pool->free.next; page != &pool->free; page = page->next) {
+        stats->runs++;
+
+        if (page->slab > stats->largest) {
+            stats->largest = page->slab;
+        }
+    }
+
+    stats->nslots = ngx_pagesize_shift - pool->min_shift;
+
+    ngx_memcpy(slots, pool->stats, stats->nslots * sizeof(ngx_slab_stat_t));
+
+    ngx_shmtx_unlock(&pool->mutex);
+}
+
+
 static ngx_slab_page_t *
 ngx_slab_alloc_pages(ngx_slab_pool_t *pool, ngx_uint_t pages)
 {
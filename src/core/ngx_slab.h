@@ -43,6 +43,7 @@ typedef struct {
 
     ngx_slab_stat_t  *stats;
     ngx_uint_t        pfree;
+    ngx_uint_t        pfails;
 
     u_char           *start;
     u_char           *end;
@@ -59,6 +60,21 @@ typedef struct {
 } ngx_slab_pool_t;
 
 
+typedef struct {
+    size_t            min_size;
+
+    ngx_uint_t        pages;
+    ngx_uint_t        free;
+    ngx_uint_t        fails;
+
+    /* free page runs */
+    ngx_uint_t        runs;
+    ngx_uint_t        largest;
+
+    ngx_uint_t        nslots;
+} ngx_slab_stats_t;
+
+
 void ngx_slab_sizes_init(void);
 void ngx_slab_init(ngx_slab_pool_t *pool);
 void *ngx_slab_alloc(ngx_slab_pool_t *pool, size_t size);
@@ -67,6 +83,8 @@ void *ngx_slab_calloc(ngx_slab_pool_t *pool, size_t size);
 void *ngx_slab_calloc_locked(ngx_slab_pool_t *pool, size_t size);
 void ngx_slab_free(ngx_slab_pool_t *pool, void *p);
 void ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p);
+void ngx_slab_stats(ngx_slab_pool_t *pool, ngx_slab_stats_t *stats,
+    ngx_slab_stat_t *slots);
 
 
 #endif /* _NGX_SLAB_H_INCLUDED_ */
@@ -16,28 +16,64 @@ typedef struct {
 } ngx_thread_pool_conf_t;
 
 
+/*
+ * The task queue is a bounded lock-free ring, each cell has a sequence
+ * number which tells whether the cell is free for the position being
+ * enqueued or holds a task for the position being dequeued.  Threads
+ * only take the mutex to sleep on the condition variable when the queue
+ * is empty, and the worker only signals it when some threads sleep.
+ */
+
+typedef struct {
+    ngx_atomic_t              sequence;
+    ngx_thread_task_t        *task;
+} ngx_thread_pool_cell_t;
+
+
 typedef struct {
-    ngx_thread_task_t        *first;
-    ngx_thread_task_t       **last;
+    ngx_thread_pool_cell_t   *cells;
+    ngx_atomic_uint_t         mask;
+    ngx_atomic_t              head;
+    ngx_atomic_t              tail;
 } ngx_thread_pool_queue_t;
 
-#define ngx_thread_pool_queue_init(q)                                         \
-    (q)->first = NULL;                                                        \
-    (q)->last = &(q)->first
+
+/*
+ * the counters are kept in shared memory and summed up over all
+ * worker processes, times are in microseconds
+ */
+
+typedef struct {
+    ngx_atomic_t              active;
+    ngx_atomic_t              waiting;
+    ngx_atomic_t              max_waiting;
+    ngx_atomic_t              tasks;
+    ngx_atomic_t              completed;
+    ngx_atomic_t              overflows;
+    ngx_atomic_t              wait_time;
+    ngx_atomic_t              exec_time;
+    ngx_atomic_t              wait_histogram[NGX_THREAD_POOL_HISTOGRAM];
+    ngx_atomic_t              exec_histogram[NGX_THREAD_POOL_HISTOGRAM];
+} ngx_thread_pool_counters_t;
 
 
 struct ngx_thread_pool_s {
     ngx_thread_mutex_t        mtx;
     ngx_thread_pool_queue_t   queue;
-    ngx_int_t                 waiting;
+    ngx_atomic_t              waiting;
+    ngx_atomic_t              sleeping;
     ngx_thread_cond_t         cond;
 
+    ngx_thread_pool_counters_t  *counters;
+
     ngx_log_t                *log;
 
     ngx_str_t                 name;
     ngx_uint_t                threads;
     ngx_int_t                 max_queue;
 
+    ngx_uint_t                helper;  /* unsigned  helper:1; */
+
     u_char                   *file;
     ngx_uint_t                line;
 };
@@ -48,6 +84,15 @@ static ngx_int_t ngx_thread_pool_init(ngx_thread_pool_t *tp, ngx_log_t *log,
 static void ngx_thread_pool_destroy(ngx_thread_pool_t *tp);
 static void ngx_thread_pool_exit_handler(void *data, ngx_log_t *log);
 
+static ngx_int_t ngx_thread_pool_queue_init(ngx_thread_pool_queue_t *queue,
+    ngx_uint_t size, ngx_pool_t *pool);
+static ngx_int_t ngx_thread_pool_queue_push(ngx_thread_pool_queue_t *queue,
+    ngx_thread_task_t *task);
+static ngx_thread_task_t *ngx_thread_pool_queue_pop(
+    ngx_thread_pool_queue_t *queue);
+static ngx_uint_t ngx_thread_pool_time(void);
+static ngx_uint_t ngx_thread_pool_bucket(ngx_uint_t time);
+
 static void *ngx_thread_pool_cycle(void *data);
 static void ngx_thread_pool_handler(ngx_event_t *ev);
 
@@ -56,6 +101,8 @@ static char *ngx_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static void *ngx_thread_pool_create_conf(ngx_cycle_t *cycle);
 static char *ngx_thread_pool_init_conf(ngx_cycle_t *cycle, void *conf);
 
+static ngx_int_t ngx_thread_pool_init_module(ngx_cycle_t *cycle);
+static void ngx_thread_pool_free_counters(void *data);
 static ngx_int_t ngx_thread_pool_init_worker(ngx_cycle_t *cycle);
 static void ngx_thread_pool_exit_worker(ngx_cycle_t *cycle);
 
@@ -86,7 +133,7 @@ ngx_module_t  ngx_thread_pool_module = {
     ngx_thread_pool_commands,              /* module directives */
     NGX_CORE_MODULE,                       /* module type */
     NULL,                                  /* init master */
-    NULL,                                  /* init module */
+    ngx_thread_pool_init_module,           /* init module */
     ngx_thread_pool_init_worker,           /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
@@ -99,8 +146,18 @@ ngx_module_t  ngx_thread_pool_module = {
 static ngx_str_t  ngx_thread_pool_default = ngx_string("default");
 
 static ngx_uint_t               ngx_thread_pool_task_id;
-static ngx_atomic_t             ngx_thread_pool_done_lock;
-static ngx_thread_pool_queue_t  ngx_thread_pool_done;
+
+ngx_uint_t  ngx_thread_pool_histogram[NGX_THREAD_POOL_HISTOGRAM - 1] = {
+    10, 50, 100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000
+};
+
+/*
+ * completed tasks are pushed by threads to the lock-free list in
+ * the reverse order, only the thread which finds the list empty
+ * notifies the worker, so completions are processed in batches
+ */
+
+static ngx_atomic_t             ngx_thread_pool_done;
 
 
 static ngx_int_t
@@ -117,7 +174,14 @@ ngx_thread_pool_init(ngx_thread_pool_t *tp, ngx_log_t *log, ngx_pool_t *pool)
         return NGX_ERROR;
     }
 
-    ngx_thread_pool_queue_init(&tp->queue);
+    if (ngx_thread_pool_queue_init(&tp->queue, tp->max_queue, pool)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    tp->waiting = 0;
+    tp->sleeping = 0;
 
     if (ngx_thread_mutex_create(&tp->mtx, log) != NGX_OK) {
         return NGX_ERROR;
@@ -230,58 +294,284 @@ ngx_thread_task_alloc(ngx_pool_t *pool, size_t size)
 ngx_int_t
 ngx_thread_task_post(ngx_thread_pool_t *tp, ngx_thread_task_t *task)
 {
+    ngx_atomic_uint_t            waiting, max;
+    ngx_thread_pool_counters_t  *counters;
+
     if (task->event.active) {
         ngx_log_error(NGX_LOG_ALERT, tp->log, 0,
                       "task #%ui already active", task->id);
         return NGX_ERROR;
     }
 
+    if ((ngx_int_t) tp->waiting >= tp->max_queue) {
+        goto overflow;
+    }
+
+    task->id = ngx_thread_pool_task_id++;
+    task->next = NULL;
+    task->time = ngx_thread_pool_time();
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, tp->log, 0,
+                   "task #%ui added to thread pool \"%V\"",
+                   task->id, &tp->name);
+
+    task->event.active = 1;
+
+    waiting = ngx_atomic_fetch_add(&tp->waiting, 1) + 1;
+
+    if (ngx_thread_pool_queue_push(&tp->queue, task) != NGX_OK) {
+        (void) ngx_atomic_fetch_add(&tp->waiting, -1);
+        task->event.active = 0;
+        goto overflow;
+    }
+
+    /* the exit tasks of a destroyed pool are not accounted */
+
+    if (task->handler != ngx_thread_pool_exit_handler) {
+        counters = tp->counters;
+
+        (void) ngx_atomic_fetch_add(&counters->waiting, 1);
+        (void) ngx_atomic_fetch_add(&counters->tasks, 1);
+
+        do {
+            max = counters->max_waiting;
+
+        } while (waiting > max
+                 && !ngx_atomic_cmp_set(&counters->max_waiting, max, waiting));
+    }
+
+    /* pairs with the barrier in ngx_thread_pool_cycle() */
+
+    ngx_memory_barrier();
+
+    if (tp->sleeping == 0) {
+        return NGX_OK;
+    }
+
     if (ngx_thread_mutex_lock(&tp->mtx, tp->log) != NGX_OK) {
         return NGX_ERROR;
     }
 
-    if (tp->waiting >= tp->max_queue) {
+    if (ngx_thread_cond_signal(&tp->cond, tp->log) != NGX_OK) {
         (void) ngx_thread_mutex_unlock(&tp->mtx, tp->log);
-
-        ngx_log_error(NGX_LOG_ERR, tp->log, 0,
-                      "thread pool \"%V\" queue overflow: %i tasks waiting",
-                      &tp->name, tp->waiting);
         return NGX_ERROR;
     }
 
-    task->event.active = 1;
+    (void) ngx_thread_mutex_unlock(&tp->mtx, tp->log);
 
-    task->id = ngx_thread_pool_task_id++;
-    task->next = NULL;
+    return NGX_OK;
 
-    if (ngx_thread_cond_signal(&tp->cond, tp->log) != NGX_OK) {
-        (void) ngx_thread_mutex_unlock(&tp->mtx, tp->log);
+overflow:
+
+    (void) ngx_atomic_fetch_add(&tp->counters->overflows, 1);
+
+    ngx_log_error(NGX_LOG_ERR, tp->log, 0,
+                  "thread pool \"%V\" queue overflow: %i tasks waiting",
+                  &tp->name, (ngx_int_t) tp->waiting);
+
+    return NGX_ERROR;
+}
+
+
+ngx_int_t
+ngx_thread_pool_stats(ngx_cycle_t *cycle, ngx_uint_t n,
+    ngx_thread_pool_stats_t *stats)
+{
+    ngx_uint_t                   i;
+    ngx_thread_pool_t          **tpp, *tp;
+    ngx_thread_pool_conf_t      *tcf;
+    ngx_thread_pool_counters_t  *counters;
+
+    tcf = (ngx_thread_pool_conf_t *) ngx_get_conf(cycle->conf_ctx,
+                                                  ngx_thread_pool_module);
+
+    if (tcf == NULL || n >= tcf->pools.nelts) {
+        return NGX_DECLINED;
+    }
+
+    tpp = tcf->pools.elts;
+    tp = tpp[n];
+
+    counters = tp->counters;
+
+    stats->name = tp->name;
+    stats->threads = tp->threads;
+    stats->max_queue = tp->max_queue;
+
+    stats->active = counters->active;
+    stats->waiting = counters->waiting;
+    stats->max_waiting = counters->max_waiting;
+    stats->tasks = counters->tasks;
+    stats->completed = counters->completed;
+    stats->overflows = counters->overflows;
+    stats->wait_time = counters->wait_time;
+    stats->exec_time = counters->exec_time;
+
+    for (i = 0; i < NGX_THREAD_POOL_HISTOGRAM; i++) {
+        stats->wait_histogram[i] = counters->wait_histogram[i];
+        stats->exec_histogram[i] = counters->exec_histogram[i];
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_thread_pool_queue_init(ngx_thread_pool_queue_t *queue, ngx_uint_t size,
+    ngx_pool_t *pool)
+{
+    ngx_uint_t  i, n;
+
+    for (n = 1; n < size; n <<= 1) { /* void */ }
+
+    queue->cells = ngx_palloc(pool, n * sizeof(ngx_thread_pool_cell_t));
+    if (queue->cells == NULL) {
         return NGX_ERROR;
     }
 
-    *tp->queue.last = task;
-    tp->queue.last = &task->next;
+    for (i = 0; i < n; i++) {
+        queue->cells[i].sequence = i;
+        queue->cells[i].task = NULL;
+    }
+
+    queue->mask = n - 1;
+    queue->head = 0;
+    queue->tail = 0;
 
-    tp->waiting++;
+    return NGX_OK;
+}
 
-    (void) ngx_thread_mutex_unlock(&tp->mtx, tp->log);
 
-    ngx_log_debug2(NGX_LOG_DEBUG_CORE, tp->log, 0,
-                   "task #%ui added to thread pool \"%V\"",
-                   task->id, &tp->name);
+static ngx_int_t
+ngx_thread_pool_queue_push(ngx_thread_pool_queue_t *queue,
+    ngx_thread_task_t *task)
+{
+    ngx_atomic_int_t         diff;
+    ngx_atomic_uint_t        pos;
+    ngx_thread_pool_cell_t  *cell;
+
+    pos = queue->tail;
+
+    for ( ;; ) {
+        cell = &queue->cells[pos & queue->mask];
+
+        diff = (ngx_atomic_int_t) (cell->sequence - pos);
+
+        if (diff == 0) {
+            if (ngx_atomic_cmp_set(&queue->tail, pos, pos + 1)) {
+                break;
+            }
+
+        } else if (diff < 0) {
+
+            /* the queue is full */
+
+            return NGX_ERROR;
+        }
+
+        pos = queue->tail;
+    }
+
+    cell->task = task;
+
+    ngx_memory_barrier();
+
+    cell->sequence = pos + 1;
 
     return NGX_OK;
 }
 
 
+static ngx_thread_task_t *
+ngx_thread_pool_queue_pop(ngx_thread_pool_queue_t *queue)
+{
+    ngx_atomic_int_t         diff;
+    ngx_atomic_uint_t        pos;
+    ngx_thread_task_t       *task;
+    ngx_thread_pool_cell_t  *cell;
+
+    pos = queue->head;
+
+    for ( ;; ) {
+        cell = &queue->cells[pos & queue->mask];
+
+        diff = (ngx_atomic_int_t) (cell->sequence - (pos + 1));
+
+        if (diff == 0) {
+            if (ngx_atomic_cmp_set(&queue->head, pos, pos + 1)) {
+                break;
+            }
+
+        } else if (diff < 0) {
+
+            /* the queue is empty */
+
+            return NULL;
+        }
+
+        pos = queue->head;
+    }
+
+    task = cell->task;
+
+    ngx_memory_barrier();
+
+    cell->sequence = pos + queue->mask + 1;
+
+    return task;
+}
+
+
+static ngx_uint_t
+ngx_thread_pool_time(void)
+{
+#if (NGX_HAVE_CLOCK_MONOTONIC)
+    struct timespec  ts;
+
+#if defined(CLOCK_MONOTONIC_FAST)
+    clock_gettime(CLOCK_MONOTONIC_FAST, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+
+    return (ngx_uint_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+#else
+    struct timeval   tv;
+
+    ngx_gettimeofday(&tv);
+
+    return (ngx_uint_t) tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+
+static ngx_uint_t
+ngx_thread_pool_bucket(ngx_uint_t time)
+{
+    ngx_uint_t  n;
+
+    for (n = 0; n < NGX_THREAD_POOL_HISTOGRAM - 1; n++) {
+        if (time <= ngx_thread_pool_histogram[n]) {
+            break;
+        }
+    }
+
+    return n;
+}
+
+
 static void *
 ngx_thread_pool_cycle(void *data)
 {
     ngx_thread_pool_t *tp = data;
 
-    int                 err;
-    sigset_t            set;
-    ngx_thread_task_t  *task;
+    int                          err;
+    sigset_t                     set;
+    ngx_uint_t                   start, time;
+    ngx_atomic_uint_t            head;
+    ngx_thread_task_t           *task;
+    ngx_thread_pool_counters_t  *counters;
 
 #if 0
     ngx_time_update();
@@ -303,33 +593,61 @@ ngx_thread_pool_cycle(void *data)
         return NULL;
     }
 
+    counters = tp->counters;
+
     for ( ;; ) {
-        if (ngx_thread_mutex_lock(&tp->mtx, tp->log) != NGX_OK) {
-            return NULL;
-        }
+        task = ngx_thread_pool_queue_pop(&tp->queue);
 
-        /* the number may become negative */
-        tp->waiting--;
+        if (task == NULL) {
+            if (ngx_thread_mutex_lock(&tp->mtx, tp->log) != NGX_OK) {
+                return NULL;
+            }
+
+            /*
+             * the increment is a full barrier, so either the queue is
+             * seen non-empty here, or the worker sees a sleeping thread
+             * after adding a task
+             */
+
+            (void) ngx_atomic_fetch_add(&tp->sleeping, 1);
+
+            for ( ;; ) {
+                task = ngx_thread_pool_queue_pop(&tp->queue);
+
+                if (task) {
+                    break;
+                }
+
+                if (ngx_thread_cond_wait(&tp->cond, &tp->mtx, tp->log)
+                    != NGX_OK)
+                {
+                    (void) ngx_thread_mutex_unlock(&tp->mtx, tp->log);
+                    return NULL;
+                }
+            }
 
-        while (tp->queue.first == NULL) {
-            if (ngx_thread_cond_wait(&tp->cond, &tp->mtx, tp->log)
-                != NGX_OK)
-            {
-                (void) ngx_thread_mutex_unlock(&tp->mtx, tp->log);
+            (void) ngx_atomic_fetch_add(&tp->sleeping, -1);
+
+            if (ngx_thread_mutex_unlock(&tp->mtx, tp->log) != NGX_OK) {
                 return NULL;
             }
         }
 
-        task = tp->queue.first;
-        tp->queue.first = task->next;
+        (void) ngx_atomic_fetch_add(&tp->waiting, -1);
 
-        if (tp->queue.first == NULL) {
-            tp->queue.last = &tp->queue.first;
+        if (task->handler == ngx_thread_pool_exit_handler) {
+            task->handler(task->ctx, tp->log);
         }
 
-        if (ngx_thread_mutex_unlock(&tp->mtx, tp->log) != NGX_OK) {
-            return NULL;
-        }
+        start = ngx_thread_pool_time();
+        time = start - task->time;
+
+        (void) ngx_atomic_fetch_add(&counters->waiting, -1);
+        (void) ngx_atomic_fetch_add(&counters->active, 1);
+        (void) ngx_atomic_fetch_add(&counters->wait_time, time);
+        (void) ngx_atomic_fetch_add(
+                        &counters->wait_histogram[ngx_thread_pool_bucket(time)],
+                        1);
 
 #if 0
         ngx_time_update();
@@ -345,18 +663,25 @@ ngx_thread_pool_cycle(void *data)
                        "complete task #%ui in thread pool \"%V\"",
                        task->id, &tp->name);
 
-        task->next = NULL;
+        time = ngx_thread_pool_time() - start;
 
-        ngx_spinlock(&ngx_thread_pool_done_lock, 1, 2048);
+        (void) ngx_atomic_fetch_add(&counters->active, -1);
+        (void) ngx_atomic_fetch_add(&counters->completed, 1);
+        (void) ngx_atomic_fetch_add(&counters->exec_time, time);
+        (void) ngx_atomic_fetch_add(
+                        &counters->exec_histogram[ngx_thread_pool_bucket(time)],
+                        1);
 
-        *ngx_thread_pool_done.last = task;
-        ngx_thread_pool_done.last = &task->next;
+        do {
+            head = ngx_thread_pool_done;
+            task->next = (ngx_thread_task_t *) head;
 
-        ngx_memory_barrier();
+        } while (!ngx_atomic_cmp_set(&ngx_thread_pool_done, head,
+                                     (ngx_atomic_uint_t) task));
 
-        ngx_unlock(&ngx_thread_pool_done_lock);
-
-        (void) ngx_notify(ngx_thread_pool_handler);
+        if (head == 0) {
+            (void) ngx_notify(ngx_thread_pool_handler);
+        }
     }
 }
 
@@ -365,19 +690,27 @@ static void
 ngx_thread_pool_handler(ngx_event_t *ev)
 {
     ngx_event_t        *event;
-    ngx_thread_task_t  *task;
+    ngx_atomic_uint_t   head;
+    ngx_thread_task_t  *task, *next;
 
     ngx_log_debug0(NGX_LOG_DEBUG_CORE, ev->log, 0, "thread pool handler");
 
-    ngx_spinlock(&ngx_thread_pool_done_lock, 1, 2048);
+    do {
+        head = ngx_thread_pool_done;
 
-    task = ngx_thread_pool_done.first;
-    ngx_thread_pool_done.first = NULL;
-    ngx_thread_pool_done.last = &ngx_thread_pool_done.first;
+    } while (!ngx_atomic_cmp_set(&ngx_thread_pool_done, head, 0));
 
-    ngx_memory_barrier();
+    /* restore the completion order */
+
+    task = NULL;
 
-    ngx_unlock(&ngx_thread_pool_done_lock);
+    while (head) {
+        next = (ngx_thread_task_t *) head;
+        head = (ngx_atomic_uint_t) next->next;
+
+        next->next = task;
+        task = next;
+    }
 
     while (task) {
         ngx_log_debug1(NGX_LOG_DEBUG_CORE, ev->log, 0,
@@ -554,6 +887,13 @@ ngx_thread_pool_add(ngx_conf_t *cf, ngx_str_t *name)
 }
 
 
+void
+ngx_thread_pool_helper(ngx_thread_pool_t *tp)
+{
+    tp->helper = 1;
+}
+
+
 ngx_thread_pool_t *
 ngx_thread_pool_get(ngx_cycle_t *cycle, ngx_str_t *name)
 {
@@ -579,6 +919,68 @@ ngx_thread_pool_get(ngx_cycle_t *cycle, ngx_str_t *name)
 }
 
 
+static ngx_int_t
+ngx_thread_pool_init_module(ngx_cycle_t *cycle)
+{
+    u_char                   *shared;
+    size_t                    size;
+    ngx_uint_t                i;
+    ngx_shm_t                *shm;
+    ngx_thread_pool_t       **tpp;
+    ngx_pool_cleanup_t       *cln;
+    ngx_thread_pool_conf_t   *tcf;
+
+    tcf = (ngx_thread_pool_conf_t *) ngx_get_conf(cycle->conf_ctx,
+                                                  ngx_thread_pool_module);
+
+    if (tcf == NULL || tcf->pools.nelts == 0) {
+        return NGX_OK;
+    }
+
+    /* keep the counters of different pools in different cache lines */
+
+    size = ngx_align(sizeof(ngx_thread_pool_counters_t), 128);
+
+    cln = ngx_pool_cleanup_add(cycle->pool, sizeof(ngx_shm_t));
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    shm = cln->data;
+
+    shm->size = size * tcf->pools.nelts;
+    ngx_str_set(&shm->name, "nginx_thread_pools");
+    shm->log = cycle->log;
+
+    if (ngx_shm_alloc(shm) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_thread_pool_free_counters;
+
+    shared = shm->addr;
+
+    ngx_memzero(shared, shm->size);
+
+    tpp = tcf->pools.elts;
+
+    for (i = 0; i < tcf->pools.nelts; i++) {
+        tpp[i]->counters = (ngx_thread_pool_counters_t *) (shared + i * size);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_thread_pool_free_counters(void *data)
+{
+    ngx_shm_t  *shm = data;
+
+    ngx_shm_free(shm);
+}
+
+
 static ngx_int_t
 ngx_thread_pool_init_worker(ngx_cycle_t *cycle)
 {
@@ -587,7 +989,8 @@ ngx_thread_pool_init_worker(ngx_cycle_t *cycle)
     ngx_thread_pool_conf_t   *tcf;
 
     if (ngx_process != NGX_PROCESS_WORKER
-        && ngx_process != NGX_PROCESS_SINGLE)
+        && ngx_process != NGX_PROCESS_SINGLE
+        && ngx_process != NGX_PROCESS_HELPER)
     {
         return NGX_OK;
     }
@@ -599,11 +1002,18 @@ ngx_thread_pool_init_worker(ngx_cycle_t *cycle)
         return NGX_OK;
     }
 
-    ngx_thread_pool_queue_init(&ngx_thread_pool_done);
+    ngx_thread_pool_done = 0;
 
     tpp = tcf->pools.elts;
 
     for (i = 0; i < tcf->pools.nelts; i++) {
+
+        /* helper processes only start the pools they use */
+
+        if (ngx_process == NGX_PROCESS_HELPER && !tpp[i]->helper) {
+            continue;
+        }
+
         if (ngx_thread_pool_init(tpp[i], cycle->log, cycle->pool) != NGX_OK) {
             return NGX_ERROR;
         }
@@ -621,7 +1031,8 @@ ngx_thread_pool_exit_worker(ngx_cycle_t *cycle)
     ngx_thread_pool_conf_t   *tcf;
 
     if (ngx_process != NGX_PROCESS_WORKER
-        && ngx_process != NGX_PROCESS_SINGLE)
+        && ngx_process != NGX_PROCESS_SINGLE
+        && ngx_process != NGX_PROCESS_HELPER)
     {
         return;
     }
@@ -636,6 +1047,11 @@ ngx_thread_pool_exit_worker(ngx_cycle_t *cycle)
     tpp = tcf->pools.elts;
 
     for (i = 0; i < tcf->pools.nelts; i++) {
+
+        if (ngx_process == NGX_PROCESS_HELPER && !tpp[i]->helper) {
+            continue;
+        }
+
         ngx_thread_pool_destroy(tpp[i]);
     }
 }
@@ -17,6 +17,7 @@
 struct ngx_thread_task_s {
     ngx_thread_task_t   *next;
     ngx_uint_t           id;
+    ngx_uint_t           time;
     void                *ctx;
     void               (*handler)(void *data, ngx_log_t *log);
     ngx_event_t          event;
@@ -26,11 +27,40 @@ struct ngx_thread_task_s {
 typedef struct ngx_thread_pool_s  ngx_thread_pool_t;
 
 
+#define NGX_THREAD_POOL_HISTOGRAM  12
+
+
+typedef struct {
+    ngx_str_t            name;
+    ngx_uint_t           threads;
+    ngx_uint_t           max_queue;
+
+    ngx_uint_t           active;
+    ngx_uint_t           waiting;
+    ngx_uint_t           max_waiting;
+    ngx_uint_t           tasks;
+    ngx_uint_t           completed;
+    ngx_uint_t           overflows;
+
+    /* microseconds */
+    ngx_uint_t           wait_time;
+    ngx_uint_t           exec_time;
+    ngx_uint_t           wait_histogram[NGX_THREAD_POOL_HISTOGRAM];
+    ngx_uint_t           exec_histogram[NGX_THREAD_POOL_HISTOGRAM];
+} ngx_thread_pool_stats_t;
+
+
 ngx_thread_pool_t *ngx_thread_pool_add(ngx_conf_t *cf, ngx_str_t *name);
+void ngx_thread_pool_helper(ngx_thread_pool_t *tp);
 ngx_thread_pool_t *ngx_thread_pool_get(ngx_cycle_t *cycle, ngx_str_t *name);
 
 ngx_thread_task_t *ngx_thread_task_alloc(ngx_pool_t *pool, size_t size);
 ngx_int_t ngx_thread_task_post(ngx_thread_pool_t *tp, ngx_thread_task_t *task);
+ngx_int_t ngx_thread_pool_stats(ngx_cycle_t *cycle, ngx_uint_t n,
+    ngx_thread_pool_stats_t *stats);
+
+
+extern ngx_uint_t  ngx_thread_pool_histogram[];
 
 
 #endif /* _NGX_THREAD_POOL_H_INCLUDED_ */
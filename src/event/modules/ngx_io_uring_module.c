@@ -0,0 +1,1086 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+
+/*
+ * The module uses io_uring as a readiness notification mechanism:
+ * every connection has a single multishot IORING_OP_POLL_ADD request
+ * that behaves like an edge-triggered epoll registration, so the rest
+ * of nginx keeps using ngx_os_io for the actual socket I/O.  Level-triggered
+ * registrations, e.g., of listening sockets, use one-shot poll requests
+ * that are rearmed after each completion.  Additions,
+ * modifications and removals are only queued to the submission ring and
+ * are passed to a kernel in one io_uring_enter() call together with
+ * waiting for completions.  File AIO reads are submitted to the same ring.
+ *
+ * Multishot IORING_OP_ACCEPT is not used for listening sockets.  It would
+ * hand accepted sockets over as completions and bypass ngx_event_accept(),
+ * where the accept mutex, the worker_connections limit, the EMFILE back-off
+ * and the multi_accept batches are handled, and it needs Linux 5.19.
+ * Accepting stays in one place for all event modules instead.
+ *
+ * The user_data of a connection poll request is the connection pointer
+ * with the instance bit in bit 0 and the poll generation in bit 1.
+ * The user_data of event requests (AIO and notify) is the event pointer
+ * with bit 2 set.  Zero user_data is used for requests whose completions
+ * are not interesting, e.g., poll removals.
+ */
+
+#define NGX_IO_URING_INSTANCE  0x1
+#define NGX_IO_URING_GEN       0x2
+#define NGX_IO_URING_EVENT     0x4
+#define NGX_IO_URING_MASK      0x7
+
+/*
+ * the events of the armed poll request and its generation
+ * are kept in c->read->index
+ */
+#define NGX_IO_URING_INDEX_GEN 0x40000000
+
+
+typedef struct {
+    ngx_uint_t  entries;
+} ngx_io_uring_conf_t;
+
+
+static int ngx_io_uring_setup(u_int entries, struct io_uring_params *p);
+static int ngx_io_uring_enter(u_int to_submit, u_int min_complete, u_int flags,
+    void *arg, size_t argsz);
+static ngx_int_t ngx_io_uring_init(ngx_cycle_t *cycle, ngx_msec_t timer);
+static ngx_int_t ngx_io_uring_ring_init(ngx_cycle_t *cycle,
+    ngx_io_uring_conf_t *urcf);
+#if (NGX_HAVE_EVENTFD)
+static ngx_int_t ngx_io_uring_notify_init(ngx_log_t *log);
+static void ngx_io_uring_notify_handler(ngx_event_t *ev);
+#endif
+static void ngx_io_uring_done(ngx_cycle_t *cycle);
+static struct io_uring_sqe *ngx_io_uring_get_sqe(ngx_log_t *log);
+static ngx_int_t ngx_io_uring_poll_add(ngx_log_t *log, int fd,
+    uint32_t events, uint64_t data);
+static ngx_int_t ngx_io_uring_poll_remove(ngx_log_t *log, uint64_t data);
+static ngx_int_t ngx_io_uring_arm(ngx_connection_t *c, uint32_t events);
+static ngx_int_t ngx_io_uring_disarm(ngx_connection_t *c);
+static ngx_int_t ngx_io_uring_add_event(ngx_event_t *ev, ngx_int_t event,
+    ngx_uint_t flags);
+static ngx_int_t ngx_io_uring_del_event(ngx_event_t *ev, ngx_int_t event,
+    ngx_uint_t flags);
+static ngx_int_t ngx_io_uring_add_connection(ngx_connection_t *c);
+static ngx_int_t ngx_io_uring_del_connection(ngx_connection_t *c,
+    ngx_uint_t flags);
+#if (NGX_HAVE_EVENTFD)
+static ngx_int_t ngx_io_uring_notify(ngx_event_handler_pt handler);
+#endif
+static ngx_int_t ngx_io_uring_process_events(ngx_cycle_t *cycle,
+    ngx_msec_t timer, ngx_uint_t flags);
+static void ngx_io_uring_process_event(ngx_cycle_t *cycle, uint64_t data,
+    int32_t res, uint32_t cflags, ngx_uint_t flags);
+
+static void *ngx_io_uring_create_conf(ngx_cycle_t *cycle);
+static char *ngx_io_uring_init_conf(ngx_cycle_t *cycle, void *conf);
+
+
+static int                   ring_fd = -1;
+
+static u_char               *sq_ring;
+static size_t                sq_ring_size;
+static uint32_t             *sq_khead;
+static uint32_t             *sq_ktail;
+static uint32_t              sq_mask;
+static uint32_t              sq_entries;
+static uint32_t             *sq_array;
+static uint32_t              sq_tail;
+static struct io_uring_sqe  *sqes;
+static size_t                sqes_size;
+
+static uint32_t             *cq_khead;
+static uint32_t             *cq_ktail;
+static uint32_t              cq_mask;
+static struct io_uring_cqe  *cqes;
+
+#if (NGX_HAVE_EVENTFD)
+static int                   notify_fd = -1;
+static ngx_event_t           notify_event;
+#endif
+
+#if (NGX_HAVE_FILE_AIO)
+ngx_uint_t                   ngx_io_uring_aio;
+#endif
+
+
+static ngx_str_t      io_uring_name = ngx_string("io_uring");
+
+static ngx_command_t  ngx_io_uring_commands[] = {
+
+    { ngx_string("io_uring_entries"),
+      NGX_EVENT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      0,
+      offsetof(ngx_io_uring_conf_t, entries),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_event_module_t  ngx_io_uring_module_ctx = {
+    &io_uring_name,
+    ngx_io_uring_create_conf,            /* create configuration */
+    ngx_io_uring_init_conf,              /* init configuration */
+
+    {
+        ngx_io_uring_add_event,          /* add an event */
+        ngx_io_uring_del_event,          /* delete an event */
+        ngx_io_uring_add_event,          /* enable an event */
+        ngx_io_uring_del_event,          /* disable an event */
+        ngx_io_uring_add_connection,     /* add an connection */
+        ngx_io_uring_del_connection,     /* delete an connection */
+#if (NGX_HAVE_EVENTFD)
+        ngx_io_uring_notify,             /* trigger a notify */
+#else
+        NULL,                            /* trigger a notify */
+#endif
+        ngx_io_uring_process_events,     /* process the events */
+        ngx_io_uring_init,               /* init the events */
+        ngx_io_uring_done,               /* done the events */
+    }
+};
+
+ngx_module_t  ngx_io_uring_module = {
+    NGX_MODULE_V1,
+    &ngx_io_uring_module_ctx,            /* module context */
+    ngx_io_uring_commands,               /* module directives */
+    NGX_EVENT_MODULE,                    /* module type */
+    NULL,                                /* init master */
+    NULL,                                /* init module */
+    NULL,                                /* init process */
+    NULL,                                /* init thread */
+    NULL,                                /* exit thread */
+    NULL,                                /* exit process */
+    NULL,                                /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+/*
+ * We call io_uring_setup() and io_uring_enter() directly as syscalls
+ * instead of liburing usage to avoid an additional library dependency.
+ */
+
+static int
+ngx_io_uring_setup(u_int entries, struct io_uring_params *p)
+{
+    return syscall(SYS_io_uring_setup, entries, p);
+}
+
+
+static int
+ngx_io_uring_enter(u_int to_submit, u_int min_complete, u_int flags,
+    void *arg, size_t argsz)
+{
+    return syscall(SYS_io_uring_enter, ring_fd, to_submit, min_complete,
+                   flags, arg, argsz);
+}
+
+
+static ngx_int_t
+ngx_io_uring_init(ngx_cycle_t *cycle, ngx_msec_t timer)
+{
+    ngx_io_uring_conf_t  *urcf;
+
+    urcf = ngx_event_get_conf(cycle->conf_ctx, ngx_io_uring_module);
+
+    if (ring_fd == -1) {
+        if (ngx_io_uring_ring_init(cycle, urcf) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+#if (NGX_HAVE_EVENTFD)
+        if (ngx_io_uring_notify_init(cycle->log) != NGX_OK) {
+            ngx_io_uring_module_ctx.actions.notify = NULL;
+        }
+#endif
+
+#if (NGX_HAVE_FILE_AIO)
+        ngx_io_uring_aio = 1;
+#endif
+
+#if (NGX_HAVE_EPOLLRDHUP)
+        /* poll requests report POLLRDHUP the same way epoll does */
+        ngx_use_epoll_rdhup = 1;
+#endif
+    }
+
+    ngx_io = ngx_os_io;
+
+    ngx_event_actions = ngx_io_uring_module_ctx.actions;
+
+    ngx_event_flags = NGX_USE_CLEAR_EVENT
+                      |NGX_USE_GREEDY_EVENT
+                      |NGX_USE_EPOLL_EVENT;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_io_uring_ring_init(ngx_cycle_t *cycle, ngx_io_uring_conf_t *urcf)
+{
+    struct io_uring_params  p;
+
+    ngx_memzero(&p, sizeof(struct io_uring_params));
+
+    ring_fd = ngx_io_uring_setup(urcf->entries, &p);
+
+    if (ring_fd == -1) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "io_uring_setup() failed");
+        return NGX_ERROR;
+    }
+
+    /*
+     * multishot poll requests appeared in Linux 5.13
+     * together with IORING_FEAT_RSRC_TAGS
+     */
+
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) == 0
+        || (p.features & IORING_FEAT_NODROP) == 0
+        || (p.features & IORING_FEAT_EXT_ARG) == 0
+        || (p.features & IORING_FEAT_RSRC_TAGS) == 0)
+    {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                      "io_uring features 0x%xd are not sufficient, "
+                      "Linux 5.13 or newer is required", p.features);
+        goto failed;
+    }
+
+    sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+
+    if (sq_ring_size < p.cq_off.cqes
+                       + p.cq_entries * sizeof(struct io_uring_cqe))
+    {
+        sq_ring_size = p.cq_off.cqes
+                       + p.cq_entries * sizeof(struct io_uring_cqe);
+    }
+
+    sq_ring = mmap(NULL, sq_ring_size, PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+
+    if (sq_ring == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "mmap(IORING_OFF_SQ_RING) failed");
+        sq_ring = NULL;
+        goto failed;
+    }
+
+    sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    sqes = mmap(NULL, sqes_size, PROT_READ|PROT_WRITE,
+                MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+
+    if (sqes == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "mmap(IORING_OFF_SQES) failed");
+        sqes = NULL;
+        goto failed;
+    }
+
+    sq_khead = (uint32_t *) (sq_ring + p.sq_off.head);
+    sq_ktail = (uint32_t *) (sq_ring + p.sq_off.tail);
+    sq_mask = *(uint32_t *) (sq_ring + p.sq_off.ring_mask);
+    sq_entries = *(uint32_t *) (sq_ring + p.sq_off.ring_entries);
+    sq_array = (uint32_t *) (sq_ring + p.sq_off.array);
+    sq_tail = *sq_ktail;
+
+    cq_khead = (uint32_t *) (sq_ring + p.cq_off.head);
+    cq_ktail = (uint32_t *) (sq_ring + p.cq_off.tail);
+    cq_mask = *(uint32_t *) (sq_ring + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *) (sq_ring + p.cq_off.cqes);
+
+    ngx_log_debug4(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring: fd:%d sq:%uD cq:%uD features:%xD",
+                   ring_fd, p.sq_entries, p.cq_entries, p.features);
+
+    return NGX_OK;
+
+failed:
+
+    ngx_io_uring_done(cycle);
+
+    return NGX_ERROR;
+}
+
+
+#if (NGX_HAVE_EVENTFD)
+
+static ngx_int_t
+ngx_io_uring_notify_init(ngx_log_t *log)
+{
+#if (NGX_HAVE_SYS_EVENTFD_H)
+    notify_fd = eventfd(0, 0);
+#else
+    notify_fd = syscall(SYS_eventfd, 0);
+#endif
+
+    if (notify_fd == -1) {
+        ngx_log_error(NGX_LOG_EMERG, log, ngx_errno, "eventfd() failed");
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "notify eventfd: %d", notify_fd);
+
+    notify_event.handler = ngx_io_uring_notify_handler;
+    notify_event.log = log;
+    notify_event.active = 1;
+
+    if (ngx_io_uring_poll_add(log, notify_fd, EPOLLIN|EPOLLET,
+                              (uintptr_t) &notify_event | NGX_IO_URING_EVENT)
+        != NGX_OK)
+    {
+        if (close(notify_fd) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                          "eventfd close() failed");
+        }
+
+        notify_fd = -1;
+
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_io_uring_notify_handler(ngx_event_t *ev)
+{
+    ssize_t               n;
+    uint64_t              count;
+    ngx_err_t             err;
+    ngx_event_handler_pt  handler;
+
+    if (++ev->index == NGX_MAX_UINT32_VALUE) {
+        ev->index = 0;
+
+        n = read(notify_fd, &count, sizeof(uint64_t));
+
+        err = ngx_errno;
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                       "read() eventfd %d: %z count:%uL", notify_fd, n, count);
+
+        if ((size_t) n != sizeof(uint64_t)) {
+            ngx_log_error(NGX_LOG_ALERT, ev->log, err,
+                          "read() eventfd %d failed", notify_fd);
+        }
+    }
+
+    handler = ev->data;
+    handler(ev);
+}
+
+#endif
+
+
+static void
+ngx_io_uring_done(ngx_cycle_t *cycle)
+{
+    if (sqes && munmap(sqes, sqes_size) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "munmap(IORING_OFF_SQES) failed");
+    }
+
+    if (sq_ring && munmap(sq_ring, sq_ring_size) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "munmap(IORING_OFF_SQ_RING) failed");
+    }
+
+    sqes = NULL;
+    sq_ring = NULL;
+
+    if (ring_fd != -1 && close(ring_fd) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "io_uring close() failed");
+    }
+
+    ring_fd = -1;
+
+#if (NGX_HAVE_EVENTFD)
+
+    if (notify_fd != -1 && close(notify_fd) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "eventfd close() failed");
+    }
+
+    notify_fd = -1;
+
+#endif
+
+#if (NGX_HAVE_FILE_AIO)
+    ngx_io_uring_aio = 0;
+#endif
+}
+
+
+static struct io_uring_sqe *
+ngx_io_uring_get_sqe(ngx_log_t *log)
+{
+    int                   n;
+    uint32_t              head;
+    struct io_uring_sqe  *sqe;
+
+    head = *(volatile uint32_t *) sq_khead;
+
+    if (sq_tail - head >= sq_entries) {
+
+        /* the submission ring is full, pass the queued requests to a kernel */
+
+        ngx_memory_barrier();
+
+        *sq_ktail = sq_tail;
+
+        n = ngx_io_uring_enter(sq_tail - head, 0, 0, NULL, 0);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, log, 0,
+                       "io_uring flush: %d", n);
+
+        if (n == -1) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                          "io_uring_enter() failed");
+            return NULL;
+        }
+
+        head = *(volatile uint32_t *) sq_khead;
+
+        if (sq_tail - head >= sq_entries) {
+            ngx_log_error(NGX_LOG_ALERT, log, 0,
+                          "io_uring submission queue is full");
+            return NULL;
+        }
+    }
+
+    sqe = &sqes[sq_tail & sq_mask];
+
+    ngx_memzero(sqe, sizeof(struct io_uring_sqe));
+
+    sq_array[sq_tail & sq_mask] = sq_tail & sq_mask;
+    sq_tail++;
+
+    return sqe;
+}
+
+
+static ngx_int_t
+ngx_io_uring_poll_add(ngx_log_t *log, int fd, uint32_t events, uint64_t data)
+{
+    struct io_uring_sqe  *sqe;
+
+    sqe = ngx_io_uring_get_sqe(log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+
+    if (events & EPOLLET) {
+        events &= ~EPOLLET;
+        sqe->len = IORING_POLL_ADD_MULTI;
+    }
+
+#if !(NGX_HAVE_LITTLE_ENDIAN)
+    events = (events << 16) | (events >> 16);
+#endif
+
+    sqe->poll32_events = events;
+    sqe->user_data = data;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_io_uring_poll_remove(ngx_log_t *log, uint64_t data)
+{
+    struct io_uring_sqe  *sqe;
+
+    sqe = ngx_io_uring_get_sqe(log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = data;
+    sqe->user_data = 0;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_io_uring_arm(ngx_connection_t *c, uint32_t events)
+{
+    uint64_t      data;
+    ngx_uint_t    gen;
+    ngx_event_t  *rev;
+
+    rev = c->read;
+    data = (uintptr_t) c | rev->instance;
+
+    if (rev->index == NGX_INVALID_INDEX) {
+        gen = 0;
+
+    } else {
+        gen = rev->index & NGX_IO_URING_INDEX_GEN;
+
+        if (gen) {
+            data |= NGX_IO_URING_GEN;
+        }
+
+        if (ngx_io_uring_poll_remove(c->log, data) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        gen ^= NGX_IO_URING_INDEX_GEN;
+    }
+
+    data = (uintptr_t) c | rev->instance | (gen ? NGX_IO_URING_GEN : 0);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "io_uring poll add: fd:%d ev:%08XD d:%XL",
+                   c->fd, events, data);
+
+    if (ngx_io_uring_poll_add(c->log, c->fd, events, data) != NGX_OK) {
+        rev->index = NGX_INVALID_INDEX;
+        return NGX_ERROR;
+    }
+
+    rev->index = events | gen;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_io_uring_disarm(ngx_connection_t *c)
+{
+    uint64_t      data;
+    ngx_event_t  *rev;
+
+    rev = c->read;
+
+    if (rev->index == NGX_INVALID_INDEX) {
+        return NGX_OK;
+    }
+
+    data = (uintptr_t) c | rev->instance;
+
+    if (rev->index & NGX_IO_URING_INDEX_GEN) {
+        data |= NGX_IO_URING_GEN;
+    }
+
+    rev->index = NGX_INVALID_INDEX;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "io_uring poll remove: fd:%d d:%XL", c->fd, data);
+
+    return ngx_io_uring_poll_remove(c->log, data);
+}
+
+
+static ngx_int_t
+ngx_io_uring_add_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags)
+{
+    uint32_t           events, prev;
+    ngx_event_t       *e;
+    ngx_connection_t  *c;
+
+    c = ev->data;
+
+    if (event == NGX_READ_EVENT) {
+        e = c->write;
+        prev = EPOLLOUT;
+        events = EPOLLIN|EPOLLRDHUP;
+
+    } else {
+        e = c->read;
+        prev = EPOLLIN|EPOLLRDHUP;
+        events = EPOLLOUT;
+    }
+
+    if (e->active) {
+        events |= prev;
+    }
+
+    if (flags & NGX_CLEAR_EVENT) {
+        events |= EPOLLET;
+    }
+
+#if (NGX_HAVE_EPOLLEXCLUSIVE)
+
+    /*
+     * listening sockets shared by worker processes, the one-shot poll
+     * requests are woken up exclusively since Linux 5.13, older kernels
+     * ignore the flag; as with epoll, EPOLLRDHUP cannot be combined with it
+     */
+
+    if (flags & NGX_EXCLUSIVE_EVENT) {
+        events &= ~EPOLLRDHUP;
+        events |= EPOLLEXCLUSIVE;
+    }
+
+#endif
+
+    if (ngx_io_uring_arm(c, events) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ev->active = 1;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_io_uring_del_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags)
+{
+    uint32_t           prev;
+    ngx_event_t       *e;
+    ngx_connection_t  *c;
+
+    /*
+     * unlike epoll, a poll request holds a reference to the file,
+     * so it has to be removed explicitly even before the closing
+     * the file descriptor
+     */
+
+    c = ev->data;
+
+    if (event == NGX_READ_EVENT) {
+        e = c->write;
+        prev = EPOLLOUT;
+
+    } else {
+        e = c->read;
+        prev = EPOLLIN|EPOLLRDHUP;
+    }
+
+    if (e->active && !(flags & NGX_CLOSE_EVENT)) {
+
+        if (c->read->index != NGX_INVALID_INDEX) {
+            prev |= c->read->index & EPOLLET;
+        }
+
+        if (ngx_io_uring_arm(c, prev) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+    } else {
+        if (ngx_io_uring_disarm(c) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    ev->active = 0;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_io_uring_add_connection(ngx_connection_t *c)
+{
+    if (ngx_io_uring_arm(c, EPOLLIN|EPOLLOUT|EPOLLRDHUP|EPOLLET) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    c->read->active = 1;
+    c->write->active = 1;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_io_uring_del_connection(ngx_connection_t *c, ngx_uint_t flags)
+{
+    if (ngx_io_uring_disarm(c) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    c->read->active = 0;
+    c->write->active = 0;
+
+    return NGX_OK;
+}
+
+
+#if (NGX_HAVE_EVENTFD)
+
+static ngx_int_t
+ngx_io_uring_notify(ngx_event_handler_pt handler)
+{
+    static uint64_t inc = 1;
+
+    notify_event.data = handler;
+
+    if ((size_t) write(notify_fd, &inc, sizeof(uint64_t)) != sizeof(uint64_t)) {
+        ngx_log_error(NGX_LOG_ALERT, notify_event.log, ngx_errno,
+                      "write() to eventfd %d failed", notify_fd);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_io_uring_process_events(ngx_cycle_t *cycle, ngx_msec_t timer,
+    ngx_uint_t flags)
+{
+    int                              n;
+    int32_t                          res;
+    uint32_t                         head, tail, cflags;
+    uint64_t                         data;
+    ngx_err_t                        err;
+    ngx_uint_t                       level;
+    struct timespec                  ts;
+    struct io_uring_getevents_arg    arg;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring timer: %M, submit: %uD",
+                   timer, sq_tail - *(volatile uint32_t *) sq_khead);
+
+    ngx_memzero(&arg, sizeof(struct io_uring_getevents_arg));
+
+    arg.sigmask_sz = _NSIG / 8;
+
+    if (timer != NGX_TIMER_INFINITE) {
+        ts.tv_sec = timer / 1000;
+        ts.tv_nsec = (timer % 1000) * 1000000;
+        arg.ts = (uint64_t) (uintptr_t) &ts;
+    }
+
+    ngx_memory_barrier();
+
+    *sq_ktail = sq_tail;
+
+    n = ngx_io_uring_enter(sq_tail - *(volatile uint32_t *) sq_khead, 1,
+                           IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG,
+                           &arg, sizeof(struct io_uring_getevents_arg));
+
+    err = (n == -1) ? ngx_errno : 0;
+
+    if (flags & NGX_UPDATE_TIME || ngx_event_timer_alarm) {
+        ngx_time_update();
+    }
+
+    if (err) {
+        if (err == NGX_EINTR) {
+
+            if (ngx_event_timer_alarm) {
+                ngx_event_timer_alarm = 0;
+                return NGX_OK;
+            }
+
+            level = NGX_LOG_INFO;
+
+        } else if (err == ETIME || err == NGX_EBUSY) {
+
+            /* the timeout has expired or the completion queue is full */
+
+            level = 0;
+
+        } else {
+            level = NGX_LOG_ALERT;
+        }
+
+        if (level) {
+            ngx_log_error(level, cycle->log, err, "io_uring_enter() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    head = *cq_khead;
+    tail = *(volatile uint32_t *) cq_ktail;
+
+    ngx_memory_barrier();
+
+    if (head == tail) {
+        if (timer != NGX_TIMER_INFINITE) {
+            return NGX_OK;
+        }
+
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, 0,
+                      "io_uring_enter() returned no events without timeout");
+        return NGX_ERROR;
+    }
+
+    while (head != tail) {
+        data = cqes[head & cq_mask].user_data;
+        res = cqes[head & cq_mask].res;
+        cflags = cqes[head & cq_mask].flags;
+
+        /*
+         * the completion entry is released before calling a handler
+         * as the handler may process the completion queue again
+         */
+
+        head++;
+
+        ngx_memory_barrier();
+
+        *cq_khead = head;
+
+        if (data) {
+            ngx_io_uring_process_event(cycle, data, res, cflags, flags);
+        }
+
+        if (head == tail) {
+            tail = *(volatile uint32_t *) cq_ktail;
+            ngx_memory_barrier();
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_io_uring_process_event(ngx_cycle_t *cycle, uint64_t data, int32_t res,
+    uint32_t cflags, ngx_uint_t flags)
+{
+    uint32_t           events, revents;
+    ngx_uint_t         instance, gen;
+    ngx_event_t       *e, *rev, *wev;
+    ngx_queue_t       *queue;
+    ngx_connection_t  *c;
+#if (NGX_HAVE_FILE_AIO)
+    ngx_event_aio_t   *aio;
+#endif
+
+    if (data & NGX_IO_URING_EVENT) {
+        e = (ngx_event_t *) (uintptr_t) (data & ~(uint64_t) NGX_IO_URING_MASK);
+
+#if (NGX_HAVE_EVENTFD)
+
+        if (e == &notify_event) {
+
+            if (!(cflags & IORING_CQE_F_MORE) && res >= 0) {
+                (void) ngx_io_uring_poll_add(cycle->log, notify_fd,
+                                             EPOLLIN|EPOLLET, data);
+            }
+
+            e->handler(e);
+            return;
+        }
+
+#endif
+
+#if (NGX_HAVE_FILE_AIO)
+
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                       "io_uring aio: %p res:%D", e, res);
+
+        e->complete = 1;
+        e->active = 0;
+        e->ready = 1;
+
+        aio = e->data;
+        aio->res = res;
+
+        ngx_post_event(e, &ngx_posted_events);
+
+#endif
+
+        return;
+    }
+
+    instance = data & NGX_IO_URING_INSTANCE;
+    gen = data & NGX_IO_URING_GEN;
+
+    c = (ngx_connection_t *) (uintptr_t) (data & ~(uint64_t) NGX_IO_URING_MASK);
+
+    rev = c->read;
+
+    if (c->fd == -1 || rev->instance != instance || res == -NGX_ECANCELED) {
+
+        /*
+         * the stale event from a file descriptor
+         * that was just closed in this iteration,
+         * or the completion of a removed poll request
+         */
+
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                       "io_uring: stale event %p", c);
+        return;
+    }
+
+    if (rev->index == NGX_INVALID_INDEX
+        || ((rev->index & NGX_IO_URING_INDEX_GEN) != 0) != (gen != 0))
+    {
+        /* the event from a poll request which has been replaced */
+
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                       "io_uring: stale poll %p", c);
+        return;
+    }
+
+    ngx_log_debug4(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring: fd:%d res:%D fl:%xD d:%XL",
+                   c->fd, res, cflags, data);
+
+    if (!(cflags & IORING_CQE_F_MORE)) {
+
+        /*
+         * a one-shot poll request has been completed, or
+         * a multishot poll request has been terminated by a kernel
+         */
+
+        events = rev->index & ~NGX_IO_URING_INDEX_GEN;
+
+        rev->index = NGX_INVALID_INDEX;
+
+        if (res >= 0 && ngx_io_uring_arm(c, events) != NGX_OK) {
+            res = -NGX_EINVAL;
+        }
+    }
+
+    if (res < 0) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, -res,
+                      "io_uring poll on fd:%d failed", c->fd);
+        revents = EPOLLERR;
+
+    } else {
+        revents = (uint32_t) res;
+    }
+
+    if (revents & (EPOLLERR|EPOLLHUP)) {
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                       "io_uring error on fd:%d ev:%04XD",
+                       c->fd, revents);
+
+        /*
+         * if the error events were returned, add EPOLLIN and EPOLLOUT
+         * to handle the events at least in one active handler
+         */
+
+        revents |= EPOLLIN|EPOLLOUT;
+    }
+
+    if ((revents & EPOLLIN) && rev->active) {
+
+#if (NGX_HAVE_EPOLLRDHUP)
+        if (revents & EPOLLRDHUP) {
+            rev->pending_eof = 1;
+        }
+
+        rev->available = 1;
+#endif
+
+        rev->ready = 1;
+
+        if (flags & NGX_POST_EVENTS) {
+            queue = rev->accept ? &ngx_posted_accept_events
+                                : &ngx_posted_events;
+
+            ngx_post_event(rev, queue);
+
+        } else {
+            rev->handler(rev);
+        }
+    }
+
+    wev = c->write;
+
+    if ((revents & EPOLLOUT) && wev->active) {
+
+        if (c->fd == -1 || wev->instance != instance) {
+
+            /*
+             * the stale event from a file descriptor
+             * that was just closed in this iteration
+             */
+
+            ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                           "io_uring: stale event %p", c);
+            return;
+        }
+
+        wev->ready = 1;
+#if (NGX_THREADS)
+        wev->complete = 1;
+#endif
+
+        if (flags & NGX_POST_EVENTS) {
+            ngx_post_event(wev, &ngx_posted_events);
+
+        } else {
+            wev->handler(wev);
+        }
+    }
+}
+
+
+#if (NGX_HAVE_FILE_AIO)
+
+ngx_int_t
+ngx_io_uring_aio_read(ngx_event_aio_t *aio, u_char *buf, size_t size,
+    off_t offset)
+{
+    struct io_uring_sqe  *sqe;
+
+    sqe = ngx_io_uring_get_sqe(aio->event.log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = aio->fd;
+    sqe->addr = (uint64_t) (uintptr_t) buf;
+    sqe->len = size;
+    sqe->off = offset;
+    sqe->user_data = (uintptr_t) &aio->event | NGX_IO_URING_EVENT;
+
+    return NGX_OK;
+}
+
+#endif
+
+
+static void *
+ngx_io_uring_create_conf(ngx_cycle_t *cycle)
+{
+    ngx_io_uring_conf_t  *urcf;
+
+    urcf = ngx_palloc(cycle->pool, sizeof(ngx_io_uring_conf_t));
+    if (urcf == NULL) {
+        return NULL;
+    }
+
+    urcf->entries = NGX_CONF_UNSET;
+
+    return urcf;
+}
+
+
+static char *
+ngx_io_uring_init_conf(ngx_cycle_t *cycle, void *conf)
+{
+    ngx_io_uring_conf_t *urcf = conf;
+
+    ngx_conf_init_uint_value(urcf->entries, 1024);
+
+    return NGX_CONF_OK;
+}
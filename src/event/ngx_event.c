@@ -23,11 +23,16 @@ extern ngx_module_t ngx_select_module;
 static char *ngx_event_init_conf(ngx_cycle_t *cycle, void *conf);
 static ngx_int_t ngx_event_module_init(ngx_cycle_t *cycle);
 static ngx_int_t ngx_event_process_init(ngx_cycle_t *cycle);
+#if (NGX_HAVE_REUSEPORT_CBPF)
+static void ngx_event_reuseport_cpu(ngx_cycle_t *cycle, ngx_listening_t *ls);
+#endif
 static char *ngx_events_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 
 static char *ngx_event_connections(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static char *ngx_event_use(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_event_multi_accept(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 static char *ngx_event_debug_connection(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 
@@ -73,6 +78,14 @@ static ngx_atomic_t   ngx_stat_writing0;
 ngx_atomic_t         *ngx_stat_writing = &ngx_stat_writing0;
 static ngx_atomic_t   ngx_stat_waiting0;
 ngx_atomic_t         *ngx_stat_waiting = &ngx_stat_waiting0;
+static ngx_atomic_t   ngx_stat_udp_recv_calls0;
+ngx_atomic_t         *ngx_stat_udp_recv_calls = &ngx_stat_udp_recv_calls0;
+static ngx_atomic_t   ngx_stat_udp_received0;
+ngx_atomic_t         *ngx_stat_udp_received = &ngx_stat_udp_received0;
+static ngx_atomic_t   ngx_stat_udp_send_calls0;
+ngx_atomic_t         *ngx_stat_udp_send_calls = &ngx_stat_udp_send_calls0;
+static ngx_atomic_t   ngx_stat_udp_sent0;
+ngx_atomic_t         *ngx_stat_udp_sent = &ngx_stat_udp_sent0;
 
 #endif
 
@@ -134,10 +147,10 @@ static ngx_command_t  ngx_event_core_commands[] = {
       NULL },
 
     { ngx_string("multi_accept"),
-      NGX_EVENT_CONF|NGX_CONF_FLAG,
-      ngx_conf_set_flag_slot,
+      NGX_EVENT_CONF|NGX_CONF_TAKE1,
+      ngx_event_multi_accept,
+      0,
       0,
-      offsetof(ngx_event_conf_t, multi_accept),
       NULL },
 
     { ngx_string("accept_mutex"),
@@ -154,6 +167,13 @@ static ngx_command_t  ngx_event_core_commands[] = {
       offsetof(ngx_event_conf_t, accept_mutex_delay),
       NULL },
 
+    { ngx_string("timer_wheel"),
+      NGX_EVENT_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      0,
+      offsetof(ngx_event_conf_t, timer_wheel),
+      NULL },
+
     { ngx_string("debug_connection"),
       NGX_EVENT_CONF|NGX_CONF_TAKE1,
       ngx_event_debug_connection,
@@ -215,6 +235,11 @@ ngx_process_events_and_timers(ngx_cycle_t *cycle)
 #endif
     }
 
+    if (!ngx_queue_empty(&ngx_posted_next_events)) {
+        ngx_event_move_posted_next(cycle);
+        timer = 0;
+    }
+
     if (ngx_use_accept_mutex) {
         if (ngx_accept_disabled > 0) {
             ngx_accept_disabled--;
@@ -535,7 +560,11 @@ ngx_event_module_init(ngx_cycle_t *cycle)
            + cl          /* ngx_stat_active */
            + cl          /* ngx_stat_reading */
            + cl          /* ngx_stat_writing */
-           + cl;         /* ngx_stat_waiting */
+           + cl          /* ngx_stat_waiting */
+           + cl          /* ngx_stat_udp_recv_calls */
+           + cl          /* ngx_stat_udp_received */
+           + cl          /* ngx_stat_udp_send_calls */
+           + cl;         /* ngx_stat_udp_sent */
 
 #endif
 
@@ -582,6 +611,10 @@ ngx_event_module_init(ngx_cycle_t *cycle)
     ngx_stat_reading = (ngx_atomic_t *) (shared + 7 * cl);
     ngx_stat_writing = (ngx_atomic_t *) (shared + 8 * cl);
     ngx_stat_waiting = (ngx_atomic_t *) (shared + 9 * cl);
+    ngx_stat_udp_recv_calls = (ngx_atomic_t *) (shared + 10 * cl);
+    ngx_stat_udp_received = (ngx_atomic_t *) (shared + 11 * cl);
+    ngx_stat_udp_send_calls = (ngx_atomic_t *) (shared + 12 * cl);
+    ngx_stat_udp_sent = (ngx_atomic_t *) (shared + 13 * cl);
 
 #endif
 
@@ -640,6 +673,9 @@ ngx_event_process_init(ngx_cycle_t *cycle)
 
     ngx_queue_init(&ngx_posted_accept_events);
     ngx_queue_init(&ngx_posted_events);
+    ngx_queue_init(&ngx_posted_next_events);
+
+    ngx_event_timer_wheel = ecf->timer_wheel;
 
     if (ngx_event_timer_init(cycle->log) == NGX_ERROR) {
         return NGX_ERROR;
@@ -779,6 +815,12 @@ ngx_event_process_init(ngx_cycle_t *cycle)
         }
 #endif
 
+#if (NGX_HAVE_REUSEPORT_CBPF)
+        if (ls[i].reuseport_cpu && ngx_worker == 0) {
+            ngx_event_reuseport_cpu(cycle, &ls[i]);
+        }
+#endif
+
         c = ngx_get_connection(ls[i].fd, cycle->log);
 
         if (c == NULL) {
@@ -1018,6 +1060,149 @@ ngx_events_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 }
 
 
+#if (NGX_HAVE_REUSEPORT_CBPF)
+
+/*
+ * The reuseport group program returns the position of a socket in the
+ * group.  The positions are not the worker numbers: they follow the order
+ * the sockets were added to the group, including the sockets reused
+ * from previous configurations, so the program maps workers to them
+ * explicitly, as tracked by ngx_reuseport_join() and ngx_reuseport_leave().
+ * A connection is steered to the worker bound to the CPU which received
+ * the packet, or the CPU number modulo the number of workers is used
+ * if no worker is bound to the CPU.
+ */
+
+static void
+ngx_event_reuseport_cpu(ngx_cycle_t *cycle, ngx_listening_t *ls)
+{
+    ngx_uint_t           i, n, worker, *index;
+    ngx_listening_t     *wls;
+    ngx_core_conf_t     *ccf;
+    struct sock_fprog    prog;
+    struct sock_filter  *code, *op;
+#if (NGX_HAVE_CPU_AFFINITY)
+    ngx_uint_t           cpu;
+    ngx_cpuset_t        *mask, *masks;
+#endif
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+
+    n = ccf->worker_processes;
+
+    index = ngx_alloc(n * sizeof(ngx_uint_t), cycle->log);
+    if (index == NULL) {
+        return;
+    }
+
+    for (worker = 0; worker < n; worker++) {
+        index[worker] = worker;
+    }
+
+    wls = cycle->listening.elts;
+    for (i = 0; i < cycle->listening.nelts; i++) {
+
+        if (wls[i].reuseport
+            && wls[i].worker < n
+            && wls[i].type == ls->type
+            && ngx_cmp_sockaddr(wls[i].sockaddr, wls[i].socklen,
+                                ls->sockaddr, ls->socklen, 1)
+               == NGX_OK)
+        {
+            index[wls[i].worker] = wls[i].reuseport_index;
+
+            ngx_log_debug3(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                           "reuseport %V worker %ui at %ui",
+                           &ls->addr_text, wls[i].worker,
+                           wls[i].reuseport_index);
+        }
+    }
+
+    code = ngx_alloc((2 * CPU_SETSIZE + 2 * n + 3) * sizeof(struct sock_filter),
+                     cycle->log);
+    if (code == NULL) {
+        ngx_free(index);
+        return;
+    }
+
+    op = code;
+
+    *op++ = (struct sock_filter)
+            BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+
+#if (NGX_HAVE_CPU_AFFINITY)
+
+    masks = ngx_alloc(n * sizeof(ngx_cpuset_t), cycle->log);
+    if (masks == NULL) {
+        ngx_free(index);
+        ngx_free(code);
+        return;
+    }
+
+    for (worker = 0; worker < n; worker++) {
+        mask = ngx_get_cpu_affinity(worker);
+
+        if (mask == NULL) {
+            break;
+        }
+
+        masks[worker] = *mask;
+    }
+
+    if (worker == n) {
+
+        for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            for (worker = 0; worker < n; worker++) {
+
+                if (CPU_ISSET(cpu, &masks[worker])) {
+                    *op++ = (struct sock_filter)
+                            BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, cpu, 0, 1);
+                    *op++ = (struct sock_filter)
+                            BPF_STMT(BPF_RET|BPF_K, index[worker]);
+                    break;
+                }
+            }
+        }
+    }
+
+    ngx_free(masks);
+
+#endif
+
+    *op++ = (struct sock_filter) BPF_STMT(BPF_ALU|BPF_MOD|BPF_K, n);
+
+    for (worker = 0; worker < n; worker++) {
+        *op++ = (struct sock_filter)
+                BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, worker, 0, 1);
+        *op++ = (struct sock_filter) BPF_STMT(BPF_RET|BPF_K, index[worker]);
+    }
+
+    *op++ = (struct sock_filter) BPF_STMT(BPF_RET|BPF_K, 0);
+
+    ngx_free(index);
+
+    prog.len = op - code;
+    prog.filter = code;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "reuseport cpu program for %V: %ui instructions",
+                   &ls->addr_text, (ngx_uint_t) prog.len);
+
+    if (setsockopt(ls->fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                   (const void *) &prog, sizeof(struct sock_fprog))
+        == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                      "setsockopt(SO_ATTACH_REUSEPORT_CBPF) %V failed, "
+                      "ignored", &ls->addr_text);
+    }
+
+    ngx_free(code);
+}
+
+#endif
+
+
 static char *
 ngx_event_connections(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
@@ -1107,6 +1292,48 @@ ngx_event_use(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 }
 
 
+static char *
+ngx_event_multi_accept(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_event_conf_t  *ecf = conf;
+
+    ngx_int_t   n;
+    ngx_str_t  *value;
+
+    if (ecf->multi_accept != NGX_CONF_UNSET) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        ecf->multi_accept = 0;
+        ecf->multi_accept_max = 0;
+        return NGX_CONF_OK;
+    }
+
+    ecf->multi_accept = 1;
+
+    if (ngx_strcmp(value[1].data, "on") == 0) {
+        ecf->multi_accept_max = 0;
+        return NGX_CONF_OK;
+    }
+
+    n = ngx_atoi(value[1].data, value[1].len);
+    if (n == NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid value \"%V\" in \"%V\" directive, "
+                           "it must be \"on\", \"off\", or a number",
+                           &value[1], &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    ecf->multi_accept_max = n;
+
+    return NGX_CONF_OK;
+}
+
+
 static char *
 ngx_event_debug_connection(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
@@ -1224,8 +1451,10 @@ ngx_event_core_create_conf(ngx_cycle_t *cycle)
     ecf->connections = NGX_CONF_UNSET_UINT;
     ecf->use = NGX_CONF_UNSET_UINT;
     ecf->multi_accept = NGX_CONF_UNSET;
+    ecf->multi_accept_max = NGX_CONF_UNSET_UINT;
     ecf->accept_mutex = NGX_CONF_UNSET;
     ecf->accept_mutex_delay = NGX_CONF_UNSET_MSEC;
+    ecf->timer_wheel = NGX_CONF_UNSET;
     ecf->name = (void *) NGX_CONF_UNSET;
 
 #if (NGX_DEBUG)
@@ -1323,8 +1552,10 @@ ngx_event_core_init_conf(ngx_cycle_t *cycle, void *conf)
     ngx_conf_init_ptr_value(ecf->name, event_module->name->data);
 
     ngx_conf_init_value(ecf->multi_accept, 0);
+    ngx_conf_init_uint_value(ecf->multi_accept_max, 0);
     ngx_conf_init_value(ecf->accept_mutex, 0);
     ngx_conf_init_msec_value(ecf->accept_mutex_delay, 500);
+    ngx_conf_init_value(ecf->timer_wheel, 0);
 
     return NGX_CONF_OK;
 }
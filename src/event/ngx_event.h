@@ -442,10 +442,13 @@ typedef struct {
     ngx_uint_t    use;
 
     ngx_flag_t    multi_accept;
+    ngx_uint_t    multi_accept_max;
     ngx_flag_t    accept_mutex;
 
     ngx_msec_t    accept_mutex_delay;
 
+    ngx_flag_t    timer_wheel;
+
     u_char       *name;
 
 #if (NGX_DEBUG)
@@ -484,6 +487,10 @@ extern ngx_atomic_t  *ngx_stat_active;
 extern ngx_atomic_t  *ngx_stat_reading;
 extern ngx_atomic_t  *ngx_stat_writing;
 extern ngx_atomic_t  *ngx_stat_waiting;
+extern ngx_atomic_t  *ngx_stat_udp_recv_calls;
+extern ngx_atomic_t  *ngx_stat_udp_received;
+extern ngx_atomic_t  *ngx_stat_udp_send_calls;
+extern ngx_atomic_t  *ngx_stat_udp_sent;
 
 #endif
 
@@ -506,10 +513,9 @@ extern ngx_module_t           ngx_event_core_module;
 void ngx_event_accept(ngx_event_t *ev);
 #if !(NGX_WIN32)
 void ngx_event_recvmsg(ngx_event_t *ev);
-void ngx_udp_rbtree_insert_value(ngx_rbtree_node_t *temp,
-    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
 #endif
 void ngx_delete_udp_connection(void *data);
+ngx_uint_t ngx_udp_connection_pending(ngx_connection_t *c);
 ngx_int_t ngx_trylock_accept_mutex(ngx_cycle_t *cycle);
 ngx_int_t ngx_enable_accept_events(ngx_cycle_t *cycle);
 u_char *ngx_accept_log_error(ngx_log_t *log, u_char *buf, size_t len);
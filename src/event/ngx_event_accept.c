@@ -21,6 +21,7 @@ ngx_event_accept(ngx_event_t *ev)
     ngx_err_t          err;
     ngx_log_t         *log;
     ngx_uint_t         level;
+    ngx_uint_t         accepted;
     ngx_socket_t       s;
     ngx_event_t       *rev, *wev;
     ngx_sockaddr_t     sa;
@@ -49,9 +50,16 @@ ngx_event_accept(ngx_event_t *ev)
     ls = lc->listening;
     ev->ready = 0;
 
+    if (ev->posted) {
+        /* the socket was reported again before the posted batch */
+        ngx_delete_posted_event(ev);
+    }
+
     ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
                    "accept on %V, ready: %d", &ls->addr_text, ev->available);
 
+    accepted = 0;
+
     do {
         socklen = sizeof(ngx_sockaddr_t);
 
@@ -311,6 +319,24 @@ ngx_event_accept(ngx_event_t *ev)
             ev->available--;
         }
 
+        if (ecf->multi_accept_max && ++accepted == ecf->multi_accept_max) {
+
+            /*
+             * the rest of the backlog is drained in the next iteration
+             * of the event loop, after the events already reported;
+             * with the accept mutex it is left to the next mutex holder
+             */
+
+            ngx_log_debug1(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                           "accept batch of %ui reached", accepted);
+
+            if (!ngx_use_accept_mutex) {
+                ngx_post_event(ev, &ngx_posted_next_events);
+            }
+
+            break;
+        }
+
     } while (ev->available);
 }
 
@@ -10,9 +10,56 @@
 #include <ngx_event.h>
 
 
+/*
+ * The hierarchical timer wheel has NGX_TIMER_WHEEL_LEVELS levels
+ * of 64 slots, a slot of level N covers 64^N milliseconds.  A timer is
+ * placed at the level of the highest 6-bit digit in which its key differs
+ * from the current wheel time, so timers are moved to lower levels when
+ * the wheel time reaches the slot, and level 0 slots contain timers
+ * with the exact key.  Timers more than 2^30 milliseconds ahead are kept
+ * in the overflow list which is rescanned when the top level wraps.
+ *
+ * A slot is a circular list of timer nodes with a sentinel node, node's
+ * left and right point to the previous and next nodes, and parent points
+ * to the slot sentinel.
+ */
+
+#define NGX_TIMER_WHEEL_BITS      6
+#define NGX_TIMER_WHEEL_SLOTS     (1 << NGX_TIMER_WHEEL_BITS)
+#define NGX_TIMER_WHEEL_MASK      (NGX_TIMER_WHEEL_SLOTS - 1)
+#define NGX_TIMER_WHEEL_LEVELS    5
+#define NGX_TIMER_WHEEL_RANGE                                                 \
+    ((ngx_msec_t) 1 << (NGX_TIMER_WHEEL_BITS * NGX_TIMER_WHEEL_LEVELS))
+
+#define ngx_timer_wheel_shift(level)  ((level) * NGX_TIMER_WHEEL_BITS)
+#define ngx_timer_wheel_index(key, level)                                     \
+    (((key) >> ngx_timer_wheel_shift(level)) & NGX_TIMER_WHEEL_MASK)
+
+
+typedef struct {
+    ngx_msec_t          time;
+    ngx_uint_t          count;
+    uint64_t            bitmap[NGX_TIMER_WHEEL_LEVELS];
+    ngx_rbtree_node_t   slots[NGX_TIMER_WHEEL_LEVELS * NGX_TIMER_WHEEL_SLOTS];
+    ngx_rbtree_node_t   overflow;
+} ngx_event_timer_wheel_t;
+
+
+static void ngx_event_timer_wheel_init(void);
+static ngx_msec_t ngx_event_timer_wheel_find(void);
+static void ngx_event_timer_wheel_expire(void);
+static ngx_int_t ngx_event_timer_wheel_no_timers_left(void);
+static void ngx_event_timer_wheel_cascade(ngx_rbtree_node_t *head);
+static void ngx_event_timer_wheel_advance(ngx_msec_t time);
+static ngx_int_t ngx_event_timer_wheel_next(uint64_t bitmap);
+
+
 ngx_rbtree_t              ngx_event_timer_rbtree;
 static ngx_rbtree_node_t  ngx_event_timer_sentinel;
 
+ngx_uint_t                ngx_event_timer_wheel;
+static ngx_event_timer_wheel_t  ngx_timer_wheel;
+
 /*
  * the event timer rbtree may contain the duplicate keys, however,
  * it should not be a problem, because we use the rbtree to find
@@ -25,6 +72,10 @@ ngx_event_timer_init(ngx_log_t *log)
     ngx_rbtree_init(&ngx_event_timer_rbtree, &ngx_event_timer_sentinel,
                     ngx_rbtree_insert_timer_value);
 
+    if (ngx_event_timer_wheel) {
+        ngx_event_timer_wheel_init();
+    }
+
     return NGX_OK;
 }
 
@@ -35,6 +86,10 @@ ngx_event_find_timer(void)
     ngx_msec_int_t      timer;
     ngx_rbtree_node_t  *node, *root, *sentinel;
 
+    if (ngx_event_timer_wheel) {
+        return ngx_event_timer_wheel_find();
+    }
+
     if (ngx_event_timer_rbtree.root == &ngx_event_timer_sentinel) {
         return NGX_TIMER_INFINITE;
     }
@@ -56,6 +111,11 @@ ngx_event_expire_timers(void)
     ngx_event_t        *ev;
     ngx_rbtree_node_t  *node, *root, *sentinel;
 
+    if (ngx_event_timer_wheel) {
+        ngx_event_timer_wheel_expire();
+        return;
+    }
+
     sentinel = ngx_event_timer_rbtree.sentinel;
 
     for ( ;; ) {
@@ -102,6 +162,10 @@ ngx_event_no_timers_left(void)
     ngx_event_t        *ev;
     ngx_rbtree_node_t  *node, *root, *sentinel;
 
+    if (ngx_event_timer_wheel) {
+        return ngx_event_timer_wheel_no_timers_left();
+    }
+
     sentinel = ngx_event_timer_rbtree.sentinel;
     root = ngx_event_timer_rbtree.root;
 
@@ -124,3 +188,367 @@ ngx_event_no_timers_left(void)
 
     return NGX_OK;
 }
+
+
+static void
+ngx_event_timer_wheel_init(void)
+{
+    ngx_uint_t          i;
+    ngx_rbtree_node_t  *head;
+
+    ngx_timer_wheel.time = ngx_current_msec;
+    ngx_timer_wheel.count = 0;
+
+    for (i = 0; i < NGX_TIMER_WHEEL_LEVELS; i++) {
+        ngx_timer_wheel.bitmap[i] = 0;
+    }
+
+    for (i = 0; i < NGX_TIMER_WHEEL_LEVELS * NGX_TIMER_WHEEL_SLOTS; i++) {
+        head = &ngx_timer_wheel.slots[i];
+        head->left = head;
+        head->right = head;
+    }
+
+    head = &ngx_timer_wheel.overflow;
+    head->left = head;
+    head->right = head;
+}
+
+
+void
+ngx_event_timer_wheel_insert(ngx_rbtree_node_t *node)
+{
+    ngx_msec_t          key, diff;
+    ngx_uint_t          level, index;
+    ngx_rbtree_node_t  *head;
+
+    key = node->key;
+
+    if ((ngx_msec_int_t) (key - ngx_timer_wheel.time) <= 0) {
+
+        /* the timer has already expired */
+
+        key = ngx_timer_wheel.time;
+    }
+
+    if (key - ngx_timer_wheel.time >= NGX_TIMER_WHEEL_RANGE) {
+        head = &ngx_timer_wheel.overflow;
+        goto insert;
+    }
+
+    diff = key ^ ngx_timer_wheel.time;
+
+    if (diff >= NGX_TIMER_WHEEL_RANGE) {
+
+        /* the key is in the next round of the top level */
+
+        level = NGX_TIMER_WHEEL_LEVELS - 1;
+
+    } else {
+        for (level = 0;
+             diff >> ngx_timer_wheel_shift(level + 1);
+             level++)
+        {
+            /* void */
+        }
+    }
+
+    index = ngx_timer_wheel_index(key, level);
+
+    head = &ngx_timer_wheel.slots[level * NGX_TIMER_WHEEL_SLOTS + index];
+
+    ngx_timer_wheel.bitmap[level] |= (uint64_t) 1 << index;
+
+insert:
+
+    node->parent = head;
+    node->left = head->left;
+    node->right = head;
+    head->left->right = node;
+    head->left = node;
+
+    ngx_timer_wheel.count++;
+}
+
+
+void
+ngx_event_timer_wheel_delete(ngx_rbtree_node_t *node)
+{
+    ngx_uint_t          n;
+    ngx_rbtree_node_t  *head;
+
+    head = node->parent;
+
+    node->left->right = node->right;
+    node->right->left = node->left;
+
+    ngx_timer_wheel.count--;
+
+    if (head->right == head && head != &ngx_timer_wheel.overflow) {
+        n = head - ngx_timer_wheel.slots;
+
+        ngx_timer_wheel.bitmap[n / NGX_TIMER_WHEEL_SLOTS] &=
+                                 ~((uint64_t) 1 << (n % NGX_TIMER_WHEEL_SLOTS));
+    }
+}
+
+
+static ngx_msec_t
+ngx_event_timer_wheel_find(void)
+{
+    ngx_int_t       next;
+    ngx_uint_t      level, index, shift;
+    ngx_msec_t      time, start;
+    ngx_msec_int_t  timer;
+    uint64_t        bitmap;
+
+    if (ngx_timer_wheel.count == 0) {
+        return NGX_TIMER_INFINITE;
+    }
+
+    time = ngx_timer_wheel.time;
+
+    /* level 0 slots contain exact keys, and expired timers in current slot */
+
+    index = ngx_timer_wheel_index(time, 0);
+    bitmap = ngx_timer_wheel.bitmap[0] >> index;
+
+    if (bitmap) {
+        start = time + ngx_event_timer_wheel_next(bitmap);
+        goto found;
+    }
+
+    /*
+     * a slot at an upper level contains timers not earlier than the slot
+     * start, and all of them are later than timers at lower levels
+     */
+
+    for (level = 1; level < NGX_TIMER_WHEEL_LEVELS; level++) {
+
+        bitmap = ngx_timer_wheel.bitmap[level];
+
+        if (bitmap == 0) {
+            continue;
+        }
+
+        shift = ngx_timer_wheel_shift(level);
+        index = ngx_timer_wheel_index(time, level);
+
+        /* the lowest slot after the current one, possibly in the next round */
+
+        bitmap = (bitmap >> index >> 1)
+                 | (bitmap << (NGX_TIMER_WHEEL_SLOTS - 1 - index));
+
+        next = ngx_event_timer_wheel_next(bitmap) + 1;
+
+        start = (time & ~(((ngx_msec_t) 1 << shift) - 1))
+                + ((ngx_msec_t) next << shift);
+
+        goto found;
+    }
+
+    /* the overflow list only */
+
+    start = (time & ~(NGX_TIMER_WHEEL_RANGE - 1)) + NGX_TIMER_WHEEL_RANGE;
+
+found:
+
+    timer = (ngx_msec_int_t) (start - ngx_current_msec);
+
+    return (ngx_msec_t) (timer > 0 ? timer : 0);
+}
+
+
+static void
+ngx_event_timer_wheel_expire(void)
+{
+    ngx_int_t           next;
+    ngx_uint_t          index;
+    ngx_msec_t          time;
+    uint64_t            bitmap;
+    ngx_event_t        *ev;
+    ngx_rbtree_node_t  *head, *node;
+
+    for ( ;; ) {
+
+        if (ngx_timer_wheel.count == 0) {
+            ngx_timer_wheel.time = ngx_current_msec;
+            return;
+        }
+
+        time = ngx_timer_wheel.time;
+        index = ngx_timer_wheel_index(time, 0);
+        head = &ngx_timer_wheel.slots[index];
+
+        while (head->right != head) {
+            node = head->right;
+
+            ev = (ngx_event_t *) ((char *) node - offsetof(ngx_event_t, timer));
+
+            ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                           "event timer del: %d: %M",
+                           ngx_event_ident(ev->data), ev->timer.key);
+
+            ngx_event_timer_wheel_delete(node);
+
+#if (NGX_DEBUG)
+            ev->timer.left = NULL;
+            ev->timer.right = NULL;
+            ev->timer.parent = NULL;
+#endif
+
+            ev->timer_set = 0;
+
+            ev->timedout = 1;
+
+            ev->handler(ev);
+        }
+
+        if (time == ngx_current_msec) {
+            return;
+        }
+
+        /* skip to the next non-empty level 0 slot or to the next round */
+
+        bitmap = ngx_timer_wheel.bitmap[0] >> index >> 1;
+
+        if (bitmap) {
+            next = ngx_event_timer_wheel_next(bitmap) + 1;
+
+        } else {
+            next = NGX_TIMER_WHEEL_SLOTS - index;
+        }
+
+        if ((ngx_msec_int_t) (time + next - ngx_current_msec) > 0) {
+            next = ngx_current_msec - time;
+        }
+
+        ngx_event_timer_wheel_advance(time + next);
+    }
+}
+
+
+static void
+ngx_event_timer_wheel_advance(ngx_msec_t time)
+{
+    ngx_uint_t          level;
+    ngx_rbtree_node_t  *head;
+
+    ngx_timer_wheel.time = time;
+
+    if (ngx_timer_wheel_index(time, 0) != 0) {
+        return;
+    }
+
+    if ((time & (NGX_TIMER_WHEEL_RANGE - 1)) == 0) {
+        ngx_event_timer_wheel_cascade(&ngx_timer_wheel.overflow);
+    }
+
+    /* move timers of the reached slots down starting from the top level */
+
+    for (level = NGX_TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+
+        if (time & (((ngx_msec_t) 1 << ngx_timer_wheel_shift(level)) - 1)) {
+            continue;
+        }
+
+        head = &ngx_timer_wheel.slots[level * NGX_TIMER_WHEEL_SLOTS
+                                      + ngx_timer_wheel_index(time, level)];
+
+        ngx_event_timer_wheel_cascade(head);
+    }
+}
+
+
+static void
+ngx_event_timer_wheel_cascade(ngx_rbtree_node_t *head)
+{
+    ngx_uint_t          n;
+    ngx_rbtree_node_t   list, *node;
+
+    if (head->right == head) {
+        return;
+    }
+
+    /*
+     * the timers are moved to a local list first, as some of them
+     * may be inserted back into the same list, e.g., the overflow one
+     */
+
+    list.left = head->left;
+    list.right = head->right;
+    list.left->right = &list;
+    list.right->left = &list;
+
+    head->left = head;
+    head->right = head;
+
+    if (head != &ngx_timer_wheel.overflow) {
+        n = head - ngx_timer_wheel.slots;
+
+        ngx_timer_wheel.bitmap[n / NGX_TIMER_WHEEL_SLOTS] &=
+                                 ~((uint64_t) 1 << (n % NGX_TIMER_WHEEL_SLOTS));
+    }
+
+    while (list.right != &list) {
+        node = list.right;
+
+        list.right = node->right;
+        node->right->left = &list;
+
+        ngx_timer_wheel.count--;
+
+        ngx_event_timer_wheel_insert(node);
+    }
+}
+
+
+static ngx_int_t
+ngx_event_timer_wheel_no_timers_left(void)
+{
+    ngx_uint_t          i;
+    ngx_event_t        *ev;
+    ngx_rbtree_node_t  *head, *node;
+
+    for (i = 0; i <= NGX_TIMER_WHEEL_LEVELS * NGX_TIMER_WHEEL_SLOTS; i++) {
+
+        head = &ngx_timer_wheel.slots[i];
+
+        if (i == NGX_TIMER_WHEEL_LEVELS * NGX_TIMER_WHEEL_SLOTS) {
+            head = &ngx_timer_wheel.overflow;
+        }
+
+        for (node = head->right; node != head; node = node->right) {
+            ev = (ngx_event_t *) ((char *) node - offsetof(ngx_event_t, timer));
+
+            if (!ev->cancelable) {
+                return NGX_AGAIN;
+            }
+        }
+    }
+
+    /* only cancelable timers left */
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_event_timer_wheel_next(uint64_t bitmap)
+{
+#if (__GNUC__ >= 4)
+
+    return __builtin_ctzll(bitmap);
+
+#else
+
+    ngx_int_t  n;
+
+    for (n = 0; (bitmap & 1) == 0; n++) {
+        bitmap >>= 1;
+    }
+
+    return n;
+
+#endif
+}
@@ -12,50 +12,88 @@
 
 #if !(NGX_WIN32)
 
+#define NGX_UDP_HASH_SIZE  64
+
+
 struct ngx_udp_connection_s {
-    ngx_rbtree_node_t   node;
-    ngx_connection_t   *connection;
-    ngx_buf_t          *buffer;
+    ngx_udp_connection_t  *next;
+    ngx_connection_t      *connection;
+    ngx_buf_t             *buffer;
+    uint32_t               hash;
+    unsigned               connected:1;
 };
 
 
+#if !(NGX_HAVE_MMSG)
+
+typedef struct {
+    struct msghdr       msg_hdr;
+    unsigned int        msg_len;
+} ngx_udp_mmsghdr_t;
+
+#else
+
+typedef struct mmsghdr  ngx_udp_mmsghdr_t;
+
+#endif
+
+
 static void ngx_close_accepted_udp_connection(ngx_connection_t *c);
 static ssize_t ngx_udp_shared_recv(ngx_connection_t *c, u_char *buf,
     size_t size);
+static void ngx_udp_connect_socket(ngx_connection_t *c);
+static void ngx_udp_detach_socket(ngx_connection_t *c);
+static ssize_t ngx_udp_connected_recv(ngx_connection_t *c, u_char *buf,
+    size_t size);
 static ngx_int_t ngx_insert_udp_connection(ngx_connection_t *c);
+static ngx_int_t ngx_udp_hash_grow(ngx_listening_t *ls, ngx_log_t *log);
 static ngx_connection_t *ngx_lookup_udp_connection(ngx_listening_t *ls,
     struct sockaddr *sockaddr, socklen_t socklen,
     struct sockaddr *local_sockaddr, socklen_t local_socklen);
 
 
+/*
+ * The datagrams are received with recvmmsg() in batches of up to
+ * NGX_UDP_BATCH, and the whole batch is dispatched before the next call.
+ */
+
 void
 ngx_event_recvmsg(ngx_event_t *ev)
 {
-    ssize_t            n;
-    ngx_buf_t          buf;
-    ngx_log_t         *log;
-    ngx_err_t          err;
-    socklen_t          socklen, local_socklen;
-    ngx_event_t       *rev, *wev;
-    struct iovec       iov[1];
-    struct msghdr      msg;
-    ngx_sockaddr_t     sa, lsa;
-    struct sockaddr   *sockaddr, *local_sockaddr;
-    ngx_listening_t   *ls;
-    ngx_event_conf_t  *ecf;
-    ngx_connection_t  *c, *lc;
-    static u_char      buffer[65535];
+    int                 rc;
+    ssize_t             n;
+    u_char             *buffer;
+    ngx_buf_t           buf;
+    ngx_log_t          *log;
+    ngx_err_t           err;
+    ngx_uint_t          i, k, nmsg, vlen, received, stop, ready;
+    socklen_t           socklen, local_socklen;
+    ngx_event_t        *rev, *wev;
+    struct msghdr      *msg;
+    ngx_sockaddr_t     *sa, lsa;
+    struct sockaddr    *sockaddr, *local_sockaddr;
+    ngx_listening_t    *ls;
+    ngx_event_conf_t   *ecf;
+    ngx_connection_t   *c, *lc;
+
+    static u_char             buffers[NGX_UDP_BATCH][65535];
+    static struct iovec       iov[NGX_UDP_BATCH];
+    static ngx_sockaddr_t     sas[NGX_UDP_BATCH];
+    static ngx_udp_mmsghdr_t  msgs[NGX_UDP_BATCH];
 
 #if (NGX_HAVE_MSGHDR_MSG_CONTROL)
 
 #if (NGX_HAVE_IP_RECVDSTADDR)
-    u_char             msg_control[CMSG_SPACE(sizeof(struct in_addr))];
+    static u_char  msg_control[NGX_UDP_BATCH]
+                              [CMSG_SPACE(sizeof(struct in_addr))];
 #elif (NGX_HAVE_IP_PKTINFO)
-    u_char             msg_control[CMSG_SPACE(sizeof(struct in_pktinfo))];
+    static u_char  msg_control[NGX_UDP_BATCH]
+                              [CMSG_SPACE(sizeof(struct in_pktinfo))];
 #endif
 
 #if (NGX_HAVE_INET6 && NGX_HAVE_IPV6_RECVPKTINFO)
-    u_char             msg_control6[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+    static u_char  msg_control6[NGX_UDP_BATCH]
+                               [CMSG_SPACE(sizeof(struct in6_pktinfo))];
 #endif
 
 #endif
@@ -78,67 +116,123 @@ ngx_event_recvmsg(ngx_event_t *ev)
     ls = lc->listening;
     ev->ready = 0;
 
+    if (ev->posted) {
+        ngx_delete_posted_event(ev);
+    }
+
     ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
                    "recvmsg on %V, ready: %d", &ls->addr_text, ev->available);
 
+    received = 0;
+    stop = 0;
+    nmsg = 0;
+    vlen = 0;
+    i = 0;
+
     do {
-        ngx_memzero(&msg, sizeof(struct msghdr));
 
-        iov[0].iov_base = (void *) buffer;
-        iov[0].iov_len = sizeof(buffer);
+        if (i == nmsg) {
+
+            vlen = NGX_UDP_BATCH;
+
+            if (ecf->multi_accept_max
+                && vlen > ecf->multi_accept_max - received)
+            {
+                vlen = ecf->multi_accept_max - received;
+            }
+
+            for (k = 0; k < vlen; k++) {
+                msg = &msgs[k].msg_hdr;
 
-        msg.msg_name = &sa;
-        msg.msg_namelen = sizeof(ngx_sockaddr_t);
-        msg.msg_iov = iov;
-        msg.msg_iovlen = 1;
+                ngx_memzero(msg, sizeof(struct msghdr));
+
+                iov[k].iov_base = (void *) buffers[k];
+                iov[k].iov_len = sizeof(buffers[k]);
+
+                msg->msg_name = &sas[k];
+                msg->msg_namelen = sizeof(ngx_sockaddr_t);
+                msg->msg_iov = &iov[k];
+                msg->msg_iovlen = 1;
 
 #if (NGX_HAVE_MSGHDR_MSG_CONTROL)
 
-        if (ls->wildcard) {
+                if (ls->wildcard) {
 
 #if (NGX_HAVE_IP_RECVDSTADDR || NGX_HAVE_IP_PKTINFO)
-            if (ls->sockaddr->sa_family == AF_INET) {
-                msg.msg_control = &msg_control;
-                msg.msg_controllen = sizeof(msg_control);
-            }
+                    if (ls->sockaddr->sa_family == AF_INET) {
+                        msg->msg_control = msg_control[k];
+                        msg->msg_controllen = sizeof(msg_control[k]);
+                    }
 #endif
 
 #if (NGX_HAVE_INET6 && NGX_HAVE_IPV6_RECVPKTINFO)
-            if (ls->sockaddr->sa_family == AF_INET6) {
-                msg.msg_control = &msg_control6;
-                msg.msg_controllen = sizeof(msg_control6);
-            }
+                    if (ls->sockaddr->sa_family == AF_INET6) {
+                        msg->msg_control = msg_control6[k];
+                        msg->msg_controllen = sizeof(msg_control6[k]);
+                    }
 #endif
-        }
+                }
 
 #endif
+            }
+
+#if (NGX_HAVE_MMSG)
+
+            rc = recvmmsg(lc->fd, msgs, vlen, 0, NULL);
+
+#else
+
+            n = recvmsg(lc->fd, &msgs[0].msg_hdr, 0);
 
-        n = recvmsg(lc->fd, &msg, 0);
+            rc = (n == -1) ? -1 : 1;
+            msgs[0].msg_len = n;
+
+#endif
 
-        if (n == -1) {
-            err = ngx_socket_errno;
+            if (rc == -1) {
+                err = ngx_socket_errno;
+
+                if (err == NGX_EAGAIN) {
+                    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, ev->log, err,
+                                   "recvmsg() not ready");
+                    return;
+                }
+
+                ngx_log_error(NGX_LOG_ALERT, ev->log, err,
+                              "recvmsg() failed");
 
-            if (err == NGX_EAGAIN) {
-                ngx_log_debug0(NGX_LOG_DEBUG_EVENT, ev->log, err,
-                               "recvmsg() not ready");
                 return;
             }
 
-            ngx_log_error(NGX_LOG_ALERT, ev->log, err, "recvmsg() failed");
+            ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                           "recvmsg batch: %d of %ui", rc, vlen);
 
-            return;
+#if (NGX_STAT_STUB)
+            (void) ngx_atomic_fetch_add(ngx_stat_udp_recv_calls, 1);
+            (void) ngx_atomic_fetch_add(ngx_stat_udp_received, rc);
+#endif
+
+            nmsg = rc;
+            i = 0;
         }
 
+        msg = &msgs[i].msg_hdr;
+        n = msgs[i].msg_len;
+        buffer = buffers[i];
+        sa = &sas[i];
+
+        i++;
+
 #if (NGX_HAVE_MSGHDR_MSG_CONTROL)
-        if (msg.msg_flags & (MSG_TRUNC|MSG_CTRUNC)) {
+        if (msg->msg_flags & (MSG_TRUNC|MSG_CTRUNC)) {
             ngx_log_error(NGX_LOG_ALERT, ev->log, 0,
                           "recvmsg() truncated data");
             continue;
         }
 #endif
 
-        sockaddr = msg.msg_name;
-        socklen = msg.msg_namelen;
+        sockaddr = msg->msg_name;
+        socklen = msg->msg_namelen;
 
         if (socklen > (socklen_t) sizeof(ngx_sockaddr_t)) {
             socklen = sizeof(ngx_sockaddr_t);
@@ -152,8 +246,8 @@ ngx_event_recvmsg(ngx_event_t *ev)
              */
 
             socklen = sizeof(struct sockaddr);
-            ngx_memzero(&sa, sizeof(struct sockaddr));
-            sa.sockaddr.sa_family = ls->sockaddr->sa_family;
+            ngx_memzero(sa, sizeof(struct sockaddr));
+            sa->sockaddr.sa_family = ls->sockaddr->sa_family;
         }
 
         local_sockaddr = ls->sockaddr;
@@ -167,9 +261,9 @@ ngx_event_recvmsg(ngx_event_t *ev)
             ngx_memcpy(&lsa, local_sockaddr, local_socklen);
             local_sockaddr = &lsa.sockaddr;
 
-            for (cmsg = CMSG_FIRSTHDR(&msg);
+            for (cmsg = CMSG_FIRSTHDR(msg);
                  cmsg != NULL;
-                 cmsg = CMSG_NXTHDR(&msg, cmsg))
+                 cmsg = CMSG_NXTHDR(msg, cmsg))
             {
 
 #if (NGX_HAVE_IP_RECVDSTADDR)
@@ -257,6 +351,27 @@ ngx_event_recvmsg(ngx_event_t *ev)
 
             c->udp->buffer = &buf;
 
+            if (!c->shared) {
+
+                /*
+                 * a datagram queued on the listening socket before
+                 * the session socket was connected, it is passed alone
+                 * to keep the order of the flow
+                 */
+
+                ready = rev->ready;
+                rev->ready = 1;
+
+                rev->handler(rev);
+
+                if (c->udp) {
+                    c->udp->buffer = NULL;
+                    rev->ready = ready;
+                }
+
+                goto next;
+            }
+
             rev->ready = 1;
             rev->active = 0;
 
@@ -281,7 +396,7 @@ ngx_event_recvmsg(ngx_event_t *ev)
 
         c = ngx_get_connection(lc->fd, ev->log);
         if (c == NULL) {
-            return;
+            goto failed;
         }
 
         c->shared = 1;
@@ -295,13 +410,13 @@ ngx_event_recvmsg(ngx_event_t *ev)
         c->pool = ngx_create_pool(ls->pool_size, ev->log);
         if (c->pool == NULL) {
             ngx_close_accepted_udp_connection(c);
-            return;
+            goto failed;
         }
 
         c->sockaddr = ngx_palloc(c->pool, socklen);
         if (c->sockaddr == NULL) {
             ngx_close_accepted_udp_connection(c);
-            return;
+            goto failed;
         }
 
         ngx_memcpy(c->sockaddr, sockaddr, socklen);
@@ -309,7 +424,7 @@ ngx_event_recvmsg(ngx_event_t *ev)
         log = ngx_palloc(c->pool, sizeof(ngx_log_t));
         if (log == NULL) {
             ngx_close_accepted_udp_connection(c);
-            return;
+            goto failed;
         }
 
         *log = ls->log;
@@ -326,7 +441,7 @@ ngx_event_recvmsg(ngx_event_t *ev)
             local_sockaddr = ngx_palloc(c->pool, local_socklen);
             if (local_sockaddr == NULL) {
                 ngx_close_accepted_udp_connection(c);
-                return;
+                goto failed;
             }
 
             ngx_memcpy(local_sockaddr, &lsa, local_socklen);
@@ -338,7 +453,7 @@ ngx_event_recvmsg(ngx_event_t *ev)
         c->buffer = ngx_create_temp_buf(c->pool, n);
         if (c->buffer == NULL) {
             ngx_close_accepted_udp_connection(c);
-            return;
+            goto failed;
         }
 
         c->buffer->last = ngx_cpymem(c->buffer->last, buffer, n);
@@ -371,7 +486,7 @@ ngx_event_recvmsg(ngx_event_t *ev)
             c->addr_text.data = ngx_pnalloc(c->pool, ls->addr_text_max_len);
             if (c->addr_text.data == NULL) {
                 ngx_close_accepted_udp_connection(c);
-                return;
+                goto failed;
             }
 
             c->addr_text.len = ngx_sock_ntop(c->sockaddr, c->socklen,
@@ -379,7 +494,7 @@ ngx_event_recvmsg(ngx_event_t *ev)
                                              ls->addr_text_max_len, 0);
             if (c->addr_text.len == 0) {
                 ngx_close_accepted_udp_connection(c);
-                return;
+                goto failed;
             }
         }
 
@@ -405,7 +520,11 @@ ngx_event_recvmsg(ngx_event_t *ev)
 
         if (ngx_insert_udp_connection(c) != NGX_OK) {
             ngx_close_accepted_udp_connection(c);
-            return;
+            goto failed;
+        }
+
+        if (ls->connected) {
+            ngx_udp_connect_socket(c);
         }
 
         log->data = NULL;
@@ -413,13 +532,32 @@ ngx_event_recvmsg(ngx_event_t *ev)
 
         ls->handler(c);
 
+        goto next;
+
+    failed:
+
+        /* the rest of the batch is still dispatched */
+
+        stop = 1;
+
     next:
 
         if (ngx_event_flags & NGX_USE_KQUEUE_EVENT) {
             ev->available -= n;
         }
 
-    } while (ev->available);
+        if (ecf->multi_accept_max && ++received == ecf->multi_accept_max) {
+
+            /* the rest is drained in the next iteration of the event loop */
+
+            if (!ngx_use_accept_mutex) {
+                ngx_post_event(ev, &ngx_posted_next_events);
+            }
+
+            break;
+        }
+
+    } while (i < nmsg || (!stop && nmsg == vlen && ev->available));
 }
 
 
@@ -465,70 +603,251 @@ ngx_udp_shared_recv(ngx_connection_t *c, u_char *buf, size_t size)
 }
 
 
-void
-ngx_udp_rbtree_insert_value(ngx_rbtree_node_t *temp,
-    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+/*
+ * The session gets its own socket bound to the local address and connected
+ * to the client, so the kernel delivers further datagrams of the flow
+ * directly to it.  The listening socket is used if this is not possible.
+ */
+
+static void
+ngx_udp_connect_socket(ngx_connection_t *c)
 {
-    ngx_int_t               rc;
-    ngx_connection_t       *c, *ct;
-    ngx_rbtree_node_t     **p;
-    ngx_udp_connection_t   *udp, *udpt;
+    int            reuseaddr;
+    ngx_socket_t   s;
 
-    for ( ;; ) {
+    switch (c->sockaddr->sa_family) {
+
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+#endif
+    case AF_INET:
+        break;
+
+    default:
+        return;
+    }
 
-        if (node->key < temp->key) {
+    s = ngx_socket(c->sockaddr->sa_family, SOCK_DGRAM, 0);
 
-            p = &temp->left;
+    if (s == (ngx_socket_t) -1) {
+        ngx_log_error(NGX_LOG_ALERT, c->log, ngx_socket_errno,
+                      ngx_socket_n " failed");
+        return;
+    }
 
-        } else if (node->key > temp->key) {
+    if (ngx_cycle->files && (ngx_uint_t) s >= ngx_cycle->files_n) {
+        ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                      "the new socket has number %d, "
+                      "but only %ui files are available",
+                      s, ngx_cycle->files_n);
+        goto failed;
+    }
 
-            p = &temp->right;
+    reuseaddr = 1;
 
-        } else { /* node->key == temp->key */
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR,
+                   (const void *) &reuseaddr, sizeof(int))
+        == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, c->log, ngx_socket_errno,
+                      "setsockopt(SO_REUSEADDR) failed");
+        goto failed;
+    }
 
-            udp = (ngx_udp_connection_t *) node;
-            c = udp->connection;
+    if (ngx_nonblocking(s) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, c->log, ngx_socket_errno,
+                      ngx_nonblocking_n " failed");
+        goto failed;
+    }
 
-            udpt = (ngx_udp_connection_t *) temp;
-            ct = udpt->connection;
+    if (bind(s, c->local_sockaddr, c->local_socklen) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, c->log, ngx_socket_errno,
+                      "bind() failed");
+        goto failed;
+    }
 
-            rc = ngx_cmp_sockaddr(c->sockaddr, c->socklen,
-                                  ct->sockaddr, ct->socklen, 1);
+    if (connect(s, c->sockaddr, c->socklen) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, c->log, ngx_socket_errno,
+                      "connect() failed");
+        goto failed;
+    }
 
-            if (rc == 0 && c->listening->wildcard) {
-                rc = ngx_cmp_sockaddr(c->local_sockaddr, c->local_socklen,
-                                      ct->local_sockaddr, ct->local_socklen, 1);
-            }
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "udp connected socket: fd:%d listening:%d", s, c->fd);
+
+    if (ngx_cycle->files) {
+        ngx_cycle->files[s] = c;
+    }
+
+    c->fd = s;
+    c->shared = 0;
+    c->recv = ngx_udp_connected_recv;
+
+    c->udp->connected = 1;
+
+    c->read->active = 0;
+
+    return;
+
+failed:
+
+    if (ngx_close_socket(s) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, c->log, ngx_socket_errno,
+                      ngx_close_socket_n " failed");
+    }
+}
+
+
+/*
+ * The session stops accepting datagrams: its socket is closed, so that
+ * the next datagram of the flow starts a new session on the listening
+ * socket.  Datagrams already queued on the closed socket are lost.
+ */
+
+static void
+ngx_udp_detach_socket(ngx_connection_t *c)
+{
+    ngx_event_t  *wev;
+
+    wev = c->write;
+
+    if (c->read->posted) {
+        ngx_delete_posted_event(c->read);
+    }
 
-            p = (rc < 0) ? &temp->left : &temp->right;
+    if (ngx_del_conn) {
+        ngx_del_conn(c, NGX_CLOSE_EVENT);
+
+    } else {
+        if (c->read->active || c->read->disabled) {
+            ngx_del_event(c->read, NGX_READ_EVENT, NGX_CLOSE_EVENT);
         }
 
-        if (*p == sentinel) {
-            break;
+        if (wev->active || wev->disabled) {
+            ngx_del_event(wev, NGX_WRITE_EVENT, NGX_CLOSE_EVENT);
         }
+    }
+
+    if (ngx_cycle->files && ngx_cycle->files[c->fd] == c) {
+        ngx_cycle->files[c->fd] = NULL;
+    }
 
-        temp = *p;
+    if (ngx_close_socket(c->fd) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, c->log, ngx_socket_errno,
+                      ngx_close_socket_n " failed");
     }
 
-    *p = node;
-    node->parent = temp;
-    node->left = sentinel;
-    node->right = sentinel;
-    ngx_rbt_red(node);
+    c->fd = c->listening->connection->fd;
+    c->shared = 1;
+    c->recv = ngx_udp_shared_recv;
+
+    c->read->ready = 0;
+    c->read->active = 1;
+
+    /* output blocked on the closed socket is retried on the listening one */
+
+    if (!wev->ready) {
+        wev->ready = 1;
+        ngx_post_event(wev, &ngx_posted_events);
+    }
+}
+
+
+static ssize_t
+ngx_udp_connected_recv(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    ssize_t          n;
+    ngx_buf_t       *b;
+    ngx_err_t        err;
+    socklen_t        socklen;
+    ngx_sockaddr_t   sa;
+
+    if (c->udp && c->udp->buffer) {
+        b = c->udp->buffer;
+
+        /* the datagram is consumed, the socket is read after the call */
+
+        if (b->pos == NULL) {
+            return NGX_AGAIN;
+        }
+
+        n = ngx_min(b->last - b->pos, (ssize_t) size);
+
+        ngx_memcpy(buf, b->pos, n);
+
+        b->pos = NULL;
+
+        return n;
+    }
+
+    for ( ;; ) {
+        socklen = sizeof(ngx_sockaddr_t);
+
+        n = recvfrom(c->fd, buf, size, 0, &sa.sockaddr, &socklen);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "recvfrom: fd:%d %z of %uz", c->fd, n, size);
+
+        if (n >= 0) {
+
+            /*
+             * the socket is bound before it is connected,
+             * and may receive datagrams of other flows in between
+             */
+
+            if (ngx_cmp_sockaddr(&sa.sockaddr, socklen,
+                                 c->sockaddr, c->socklen, 1)
+                != NGX_OK)
+            {
+                ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                               "recvfrom: datagram of another flow dropped");
+                continue;
+            }
+
+            return n;
+        }
+
+        err = ngx_socket_errno;
+
+        if (err == NGX_EINTR) {
+            continue;
+        }
+
+        if (err == NGX_EAGAIN) {
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
+                           "recvfrom() not ready");
+            c->read->ready = 0;
+            return NGX_AGAIN;
+        }
+
+        c->read->ready = 0;
+        c->read->error = 1;
+
+        return ngx_connection_error(c, err, "recvfrom() failed");
+    }
 }
 
 
 static ngx_int_t
 ngx_insert_udp_connection(ngx_connection_t *c)
 {
-    uint32_t               hash;
-    ngx_pool_cleanup_t    *cln;
-    ngx_udp_connection_t  *udp;
+    uint32_t                hash;
+    ngx_listening_t        *ls;
+    ngx_pool_cleanup_t     *cln;
+    ngx_udp_connection_t   *udp, **bucket;
 
     if (c->udp) {
         return NGX_OK;
     }
 
+    ls = c->listening;
+
+    if ((ls->udp_hash == NULL || ls->udp_nsessions > ls->udp_hash_mask)
+        && ngx_udp_hash_grow(ls, c->log) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
     udp = ngx_pcalloc(c->pool, sizeof(ngx_udp_connection_t));
     if (udp == NULL) {
         return NGX_ERROR;
@@ -539,13 +858,13 @@ ngx_insert_udp_connection(ngx_connection_t *c)
     ngx_crc32_init(hash);
     ngx_crc32_update(&hash, (u_char *) c->sockaddr, c->socklen);
 
-    if (c->listening->wildcard) {
+    if (ls->wildcard) {
         ngx_crc32_update(&hash, (u_char *) c->local_sockaddr, c->local_socklen);
     }
 
     ngx_crc32_final(hash);
 
-    udp->node.key = hash;
+    udp->hash = hash;
 
     cln = ngx_pool_cleanup_add(c->pool, 0);
     if (cln == NULL) {
@@ -555,7 +874,12 @@ ngx_insert_udp_connection(ngx_connection_t *c)
     cln->data = c;
     cln->handler = ngx_delete_udp_connection;
 
-    ngx_rbtree_insert(&c->listening->rbtree, &udp->node);
+    bucket = &ls->udp_hash[hash & ls->udp_hash_mask];
+
+    udp->next = *bucket;
+    *bucket = udp;
+
+    ls->udp_nsessions++;
 
     c->udp = udp;
 
@@ -563,18 +887,103 @@ ngx_insert_udp_connection(ngx_connection_t *c)
 }
 
 
+/*
+ * The table is allocated in a worker on the first session and doubled
+ * whenever the number of sessions reaches the number of buckets.
+ */
+
+static ngx_int_t
+ngx_udp_hash_grow(ngx_listening_t *ls, ngx_log_t *log)
+{
+    ngx_uint_t              i, size;
+    ngx_udp_connection_t   *udp, *next, **hash;
+
+    size = ls->udp_hash ? 2 * (ls->udp_hash_mask + 1) : NGX_UDP_HASH_SIZE;
+
+    hash = ngx_calloc(size * sizeof(ngx_udp_connection_t *), log);
+    if (hash == NULL) {
+
+        /* longer chains still work */
+
+        return ls->udp_hash ? NGX_OK : NGX_ERROR;
+    }
+
+    if (ls->udp_hash) {
+
+        for (i = 0; i <= ls->udp_hash_mask; i++) {
+
+            for (udp = ls->udp_hash[i]; udp; udp = next) {
+                next = udp->next;
+
+                udp->next = hash[udp->hash & (size - 1)];
+                hash[udp->hash & (size - 1)] = udp;
+            }
+        }
+
+        ngx_free(ls->udp_hash);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "udp hash on %V: %ui buckets", &ls->addr_text, size);
+
+    ls->udp_hash = hash;
+    ls->udp_hash_mask = size - 1;
+
+    return NGX_OK;
+}
+
+
 void
 ngx_delete_udp_connection(void *data)
 {
     ngx_connection_t  *c = data;
 
-    if (c->udp == NULL) {
+    ngx_listening_t        *ls;
+    ngx_udp_connection_t   *udp, **up;
+
+    udp = c->udp;
+
+    if (udp == NULL) {
         return;
     }
 
-    ngx_rbtree_delete(&c->listening->rbtree, &c->udp->node);
+    ls = c->listening;
+
+    for (up = &ls->udp_hash[udp->hash & ls->udp_hash_mask];
+         *up != udp;
+         up = &(*up)->next)
+    {
+        /* void */
+    }
+
+    *up = udp->next;
+
+    ls->udp_nsessions--;
 
     c->udp = NULL;
+
+    if (udp->connected && c->fd != (ngx_socket_t) -1) {
+        ngx_udp_detach_socket(c);
+    }
+}
+
+
+/*
+ * datagrams queued on the socket of a connected session would be lost
+ * if the session is finalized, while on the listening socket they start
+ * a new session
+ */
+
+ngx_uint_t
+ngx_udp_connection_pending(ngx_connection_t *c)
+{
+    u_char  ch;
+
+    if (c->udp == NULL || !c->udp->connected) {
+        return 0;
+    }
+
+    return recv(c->fd, &ch, 1, MSG_PEEK) != -1;
 }
 
 
@@ -583,9 +992,7 @@ ngx_lookup_udp_connection(ngx_listening_t *ls, struct sockaddr *sockaddr,
     socklen_t socklen, struct sockaddr *local_sockaddr, socklen_t local_socklen)
 {
     uint32_t               hash;
-    ngx_int_t              rc;
     ngx_connection_t      *c;
-    ngx_rbtree_node_t     *node, *sentinel;
     ngx_udp_connection_t  *udp;
 
 #if (NGX_HAVE_UNIX_DOMAIN)
@@ -604,8 +1011,9 @@ ngx_lookup_udp_connection(ngx_listening_t *ls, struct sockaddr *sockaddr,
 
 #endif
 
-    node = ls->rbtree.root;
-    sentinel = ls->rbtree.sentinel;
+    if (ls->udp_hash == NULL) {
+        return NULL;
+    }
 
     ngx_crc32_init(hash);
     ngx_crc32_update(&hash, (u_char *) sockaddr, socklen);
@@ -616,37 +1024,30 @@ ngx_lookup_udp_connection(ngx_listening_t *ls, struct sockaddr *sockaddr,
 
     ngx_crc32_final(hash);
 
-    while (node != sentinel) {
+    for (udp = ls->udp_hash[hash & ls->udp_hash_mask]; udp; udp = udp->next) {
 
-        if (hash < node->key) {
-            node = node->left;
+        if (udp->hash != hash) {
             continue;
         }
 
-        if (hash > node->key) {
-            node = node->right;
-            continue;
-        }
-
-        /* hash == node->key */
-
-        udp = (ngx_udp_connection_t *) node;
-
         c = udp->connection;
 
-        rc = ngx_cmp_sockaddr(sockaddr, socklen,
-                              c->sockaddr, c->socklen, 1);
-
-        if (rc == 0 && ls->wildcard) {
-            rc = ngx_cmp_sockaddr(local_sockaddr, local_socklen,
-                                  c->local_sockaddr, c->local_socklen, 1);
+        if (ngx_cmp_sockaddr(sockaddr, socklen,
+                             c->sockaddr, c->socklen, 1)
+            != NGX_OK)
+        {
+            continue;
         }
 
-        if (rc == 0) {
-            return c;
+        if (ls->wildcard
+            && ngx_cmp_sockaddr(local_sockaddr, local_socklen,
+                                c->local_sockaddr, c->local_socklen, 1)
+               != NGX_OK)
+        {
+            continue;
         }
 
-        node = (rc < 0) ? node->left : node->right;
+        return c;
     }
 
     return NULL;
@@ -660,4 +1061,11 @@ ngx_delete_udp_connection(void *data)
     return;
 }
 
+
+ngx_uint_t
+ngx_udp_connection_pending(ngx_connection_t *c)
+{
+    return 0;
+}
+
 #endif
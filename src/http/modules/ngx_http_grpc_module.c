@@ -4579,6 +4579,10 @@ ngx_http_grpc_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    if (glcf->upstream.upstream->conf == NULL) {
+        glcf->upstream.upstream->conf = &glcf->upstream;
+    }
+
     if (u.family != AF_UNIX) {
 
         if (u.no_port) {
@@ -30,6 +30,27 @@ typedef struct {
 } ngx_http_limit_req_shctx_t;
 
 
+#define NGX_HTTP_LIMIT_REQ_SHARDS    1024
+#define NGX_HTTP_LIMIT_REQ_SHARD_KEY 64
+
+
+/*
+ * a per-worker shard holds a part of the burst leased from the shared node,
+ * requests are accounted against the lease without taking the zone mutex
+ */
+
+typedef struct {
+    uint32_t                     hash;
+    u_short                      len;
+    ngx_msec_t                   sync;
+    ngx_msec_t                   last;
+    /* integer values, 1 corresponds to 0.001 r/s */
+    ngx_uint_t                   excess;
+    ngx_uint_t                   credit;
+    u_char                       data[NGX_HTTP_LIMIT_REQ_SHARD_KEY];
+} ngx_http_limit_req_shard_t;
+
+
 typedef struct {
     ngx_http_limit_req_shctx_t  *sh;
     ngx_slab_pool_t             *shpool;
@@ -37,6 +58,9 @@ typedef struct {
     ngx_uint_t                   rate;
     ngx_http_complex_value_t     key;
     ngx_http_limit_req_node_t   *node;
+    ngx_msec_t                   sync;
+    ngx_http_limit_req_shard_t  *shards;
+    ngx_http_limit_req_shard_t  *shard;
 } ngx_http_limit_req_ctx_t;
 
 
@@ -60,6 +84,11 @@ typedef struct {
 static void ngx_http_limit_req_delay(ngx_http_request_t *r);
 static ngx_int_t ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit,
     ngx_uint_t hash, ngx_str_t *key, ngx_uint_t *ep, ngx_uint_t account);
+static ngx_http_limit_req_node_t *ngx_http_limit_req_find(
+    ngx_http_limit_req_ctx_t *ctx, ngx_uint_t hash, u_char *data,
+    size_t len);
+static ngx_int_t ngx_http_limit_req_shard(ngx_http_limit_req_limit_t *limit,
+    ngx_uint_t hash, ngx_str_t *key, ngx_uint_t *ep, ngx_uint_t account);
 static ngx_msec_t ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits,
     ngx_uint_t n, ngx_uint_t *ep, ngx_http_limit_req_limit_t **limit);
 static void ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx,
@@ -92,7 +121,7 @@ static ngx_conf_num_bounds_t  ngx_http_limit_req_status_bounds = {
 static ngx_command_t  ngx_http_limit_req_commands[] = {
 
     { ngx_string("limit_req_zone"),
-      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE3,
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE3|NGX_CONF_TAKE4,
       ngx_http_limit_req_zone,
       0,
       0,
@@ -212,12 +241,18 @@ ngx_http_limit_req_handler(ngx_http_request_t *r)
 
         hash = ngx_crc32_short(key.data, key.len);
 
-        ngx_shmtx_lock(&ctx->shpool->mutex);
+        if (ctx->shards && key.len <= NGX_HTTP_LIMIT_REQ_SHARD_KEY) {
+            rc = ngx_http_limit_req_shard(limit, hash, &key, &excess,
+                                          (n == lrcf->limits.nelts - 1));
 
-        rc = ngx_http_limit_req_lookup(limit, hash, &key, &excess,
-                                       (n == lrcf->limits.nelts - 1));
+        } else {
+            ngx_shmtx_lock(&ctx->shpool->mutex);
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+            rc = ngx_http_limit_req_lookup(limit, hash, &key, &excess,
+                                           (n == lrcf->limits.nelts - 1));
+
+            ngx_shmtx_unlock(&ctx->shpool->mutex);
+        }
 
         ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                        "limit_req[%ui]: %i %ui.%03ui",
@@ -247,6 +282,8 @@ ngx_http_limit_req_handler(ngx_http_request_t *r)
         while (n--) {
             ctx = limits[n].shm_zone->data;
 
+            ctx->shard = NULL;
+
             if (ctx->node == NULL) {
                 continue;
             }
@@ -379,10 +416,10 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
     ngx_str_t *key, ngx_uint_t *ep, ngx_uint_t account)
 {
     size_t                      size;
-    ngx_int_t                   rc, excess;
+    ngx_int_t                   excess;
     ngx_msec_t                  now;
     ngx_msec_int_t              ms;
-    ngx_rbtree_node_t          *node, *sentinel;
+    ngx_rbtree_node_t          *node;
     ngx_http_limit_req_ctx_t   *ctx;
     ngx_http_limit_req_node_t  *lr;
 
@@ -390,70 +427,48 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
 
     ctx = limit->shm_zone->data;
 
-    node = ctx->sh->rbtree.root;
-    sentinel = ctx->sh->rbtree.sentinel;
-
-    while (node != sentinel) {
+    lr = ngx_http_limit_req_find(ctx, hash, key->data, key->len);
 
-        if (hash < node->key) {
-            node = node->left;
-            continue;
-        }
+    if (lr) {
+        ngx_queue_remove(&lr->queue);
+        ngx_queue_insert_head(&ctx->sh->queue, &lr->queue);
 
-        if (hash > node->key) {
-            node = node->right;
-            continue;
-        }
-
-        /* hash == node->key */
-
-        lr = (ngx_http_limit_req_node_t *) &node->color;
-
-        rc = ngx_memn2cmp(key->data, lr->data, key->len, (size_t) lr->len);
-
-        if (rc == 0) {
-            ngx_queue_remove(&lr->queue);
-            ngx_queue_insert_head(&ctx->sh->queue, &lr->queue);
-
-            ms = (ngx_msec_int_t) (now - lr->last);
-
-            if (ms < -60000) {
-                ms = 1;
+        ms = (ngx_msec_int_t) (now - lr->last);
 
-            } else if (ms < 0) {
-                ms = 0;
-            }
+        if (ms < -60000) {
+            ms = 1;
 
-            excess = lr->excess - ctx->rate * ms / 1000 + 1000;
+        } else if (ms < 0) {
+            ms = 0;
+        }
 
-            if (excess < 0) {
-                excess = 0;
-            }
+        excess = lr->excess - ctx->rate * ms / 1000 + 1000;
 
-            *ep = excess;
+        if (excess < 0) {
+            excess = 0;
+        }
 
-            if ((ngx_uint_t) excess > limit->burst) {
-                return NGX_BUSY;
-            }
+        *ep = excess;
 
-            if (account) {
-                lr->excess = excess;
+        if ((ngx_uint_t) excess > limit->burst) {
+            return NGX_BUSY;
+        }
 
-                if (ms) {
-                    lr->last = now;
-                }
+        if (account) {
+            lr->excess = excess;
 
-                return NGX_OK;
+            if (ms) {
+                lr->last = now;
             }
 
-            lr->count++;
+            return NGX_OK;
+        }
 
-            ctx->node = lr;
+        lr->count++;
 
-            return NGX_AGAIN;
-        }
+        ctx->node = lr;
 
-        node = (rc < 0) ? node->left : node->right;
+        return NGX_AGAIN;
     }
 
     *ep = 0;
@@ -505,15 +520,185 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
 }
 
 
+static ngx_http_limit_req_node_t *
+ngx_http_limit_req_find(ngx_http_limit_req_ctx_t *ctx, ngx_uint_t hash,
+    u_char *data, size_t len)
+{
+    ngx_int_t                   rc;
+    ngx_rbtree_node_t          *node, *sentinel;
+    ngx_http_limit_req_node_t  *lr;
+
+    node = ctx->sh->rbtree.root;
+    sentinel = ctx->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        lr = (ngx_http_limit_req_node_t *) &node->color;
+
+        rc = ngx_memn2cmp(data, lr->data, len, (size_t) lr->len);
+
+        if (rc == 0) {
+            return lr;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+static ngx_int_t
+ngx_http_limit_req_shard(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
+    ngx_str_t *key, ngx_uint_t *ep, ngx_uint_t account)
+{
+    ngx_int_t                    rc, excess;
+    ngx_uint_t                   lease, want;
+    ngx_msec_t                   now;
+    ngx_msec_int_t               ms;
+    ngx_http_limit_req_ctx_t    *ctx;
+    ngx_http_limit_req_node_t   *lr;
+    ngx_http_limit_req_shard_t  *shard;
+
+    now = ngx_current_msec;
+
+    ctx = limit->shm_zone->data;
+
+    shard = &ctx->shards[hash & (NGX_HTTP_LIMIT_REQ_SHARDS - 1)];
+
+    if (shard->credit >= 1000
+        && shard->hash == hash
+        && (ngx_msec_t) (now - shard->sync) < ctx->sync
+        && ngx_memn2cmp(key->data, shard->data, key->len, shard->len) == 0)
+    {
+        ms = (ngx_msec_int_t) (now - shard->last);
+
+        if (ms < 0) {
+            ms = 0;
+        }
+
+        /* the estimate does not include requests of other workers */
+
+        excess = shard->excess - ctx->rate * ms / 1000 + 1000;
+
+        if (excess < 0) {
+            excess = 0;
+        }
+
+        *ep = excess;
+
+        if (account) {
+            shard->credit -= 1000;
+            shard->excess = excess;
+
+            if (ms) {
+                shard->last = now;
+            }
+
+            return NGX_OK;
+        }
+
+        ctx->shard = shard;
+
+        return NGX_AGAIN;
+    }
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    if (shard->credit) {
+
+        /*
+         * return the unused part of the lease, less what has leaked out
+         * of the node since it was taken: that part may already be gone
+         * from the excess
+         */
+
+        ms = (ngx_msec_int_t) (now - shard->sync);
+
+        if (ms < 0) {
+            ms = 0;
+        }
+
+        lease = ctx->rate * ms / 1000;
+
+        if (shard->credit > lease) {
+            lease = shard->credit - lease;
+
+            lr = ngx_http_limit_req_find(ctx, shard->hash, shard->data,
+                                         shard->len);
+
+            if (lr) {
+                lr->excess = (lr->excess > lease) ? lr->excess - lease : 0;
+            }
+        }
+
+        shard->credit = 0;
+    }
+
+    shard->len = 0;
+
+    rc = ngx_http_limit_req_lookup(limit, hash, key, ep, account);
+
+    if (rc == NGX_OK) {
+        lr = ngx_http_limit_req_find(ctx, hash, key->data, key->len);
+
+        /*
+         * lease what leaks out in the sync interval, but no more than
+         * a half of the burst left; requests over the delay threshold
+         * are delayed by the caller as usual
+         */
+
+        want = ctx->rate * ctx->sync / 1000;
+
+        lease = (limit->burst > lr->excess)
+                ? (limit->burst - lr->excess) / 2 : 0;
+        lease = ngx_min(lease, want);
+        lease -= lease % 1000;
+
+        lr->excess += lease;
+
+        shard->hash = hash;
+        shard->len = (u_short) key->len;
+        shard->sync = now;
+        shard->last = now;
+        shard->excess = *ep;
+        shard->credit = lease;
+
+        ngx_memcpy(shard->data, key->data, key->len);
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "limit_req lease: %ui.%03ui",
+                       lease / 1000, lease % 1000);
+    }
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    return rc;
+}
+
+
 static ngx_msec_t
 ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits, ngx_uint_t n,
     ngx_uint_t *ep, ngx_http_limit_req_limit_t **limit)
 {
-    ngx_int_t                   excess;
-    ngx_msec_t                  now, delay, max_delay;
-    ngx_msec_int_t              ms;
-    ngx_http_limit_req_ctx_t   *ctx;
-    ngx_http_limit_req_node_t  *lr;
+    ngx_int_t                    excess;
+    ngx_msec_t                   now, delay, max_delay;
+    ngx_msec_int_t               ms;
+    ngx_http_limit_req_ctx_t    *ctx;
+    ngx_http_limit_req_node_t   *lr;
+    ngx_http_limit_req_shard_t  *shard;
 
     excess = *ep;
 
@@ -527,40 +712,67 @@ ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits, ngx_uint_t n,
 
     while (n--) {
         ctx = limits[n].shm_zone->data;
-        lr = ctx->node;
+        shard = ctx->shard;
 
-        if (lr == NULL) {
-            continue;
-        }
+        if (shard) {
+            now = ngx_current_msec;
+            ms = (ngx_msec_int_t) (now - shard->last);
+
+            if (ms < 0) {
+                ms = 0;
+            }
 
-        ngx_shmtx_lock(&ctx->shpool->mutex);
+            excess = shard->excess - ctx->rate * ms / 1000 + 1000;
 
-        now = ngx_current_msec;
-        ms = (ngx_msec_int_t) (now - lr->last);
+            if (excess < 0) {
+                excess = 0;
+            }
 
-        if (ms < -60000) {
-            ms = 1;
+            if (ms) {
+                shard->last = now;
+            }
 
-        } else if (ms < 0) {
-            ms = 0;
-        }
+            shard->excess = excess;
+            shard->credit -= 1000;
 
-        excess = lr->excess - ctx->rate * ms / 1000 + 1000;
+            ctx->shard = NULL;
 
-        if (excess < 0) {
-            excess = 0;
-        }
+        } else {
+            lr = ctx->node;
 
-        if (ms) {
-            lr->last = now;
-        }
+            if (lr == NULL) {
+                continue;
+            }
+
+            ngx_shmtx_lock(&ctx->shpool->mutex);
+
+            now = ngx_current_msec;
+            ms = (ngx_msec_int_t) (now - lr->last);
+
+            if (ms < -60000) {
+                ms = 1;
+
+            } else if (ms < 0) {
+                ms = 0;
+            }
+
+            excess = lr->excess - ctx->rate * ms / 1000 + 1000;
+
+            if (excess < 0) {
+                excess = 0;
+            }
 
-        lr->excess = excess;
-        lr->count--;
+            if (ms) {
+                lr->last = now;
+            }
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+            lr->excess = excess;
+            lr->count--;
 
-        ctx->node = NULL;
+            ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+            ctx->node = NULL;
+        }
 
         if ((ngx_uint_t) excess <= limits[n].delay) {
             continue;
@@ -769,6 +981,7 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_str_t                         *value, name, s;
     ngx_int_t                          rate, scale;
     ngx_uint_t                         i;
+    ngx_msec_t                         sync;
     ngx_shm_zone_t                    *shm_zone;
     ngx_http_limit_req_ctx_t          *ctx;
     ngx_http_compile_complex_value_t   ccv;
@@ -793,6 +1006,7 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     size = 0;
     rate = 1;
     scale = 1;
+    sync = 0;
     name.len = 0;
 
     for (i = 2; i < cf->args->nelts; i++) {
@@ -855,6 +1069,21 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "sync=", 5) == 0) {
+
+            s.len = value[i].len - 5;
+            s.data = value[i].data + 5;
+
+            sync = ngx_parse_time(&s, 0);
+            if (sync == (ngx_msec_t) NGX_ERROR || sync == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid sync value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid parameter \"%V\"", &value[i]);
         return NGX_CONF_ERROR;
@@ -869,6 +1098,17 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     ctx->rate = rate * 1000 / scale;
 
+    if (sync) {
+        ctx->sync = sync;
+
+        ctx->shards = ngx_pcalloc(cf->pool,
+                                  NGX_HTTP_LIMIT_REQ_SHARDS
+                                  * sizeof(ngx_http_limit_req_shard_t));
+        if (ctx->shards == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
     shm_zone = ngx_shared_memory_add(cf, &name, size,
                                      &ngx_http_limit_req_module);
     if (shm_zone == NULL) {
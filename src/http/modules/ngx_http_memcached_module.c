@@ -714,6 +714,10 @@ ngx_http_memcached_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    if (mlcf->upstream.upstream->conf == NULL) {
+        mlcf->upstream.upstream->conf = &mlcf->upstream;
+    }
+
     clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
 
     clcf->handler = ngx_http_memcached_handler;
@@ -245,6 +245,9 @@ static ngx_conf_bitmask_t  ngx_http_proxy_ssl_protocols[] = {
 static ngx_conf_enum_t  ngx_http_proxy_http_version[] = {
     { ngx_string("1.0"), NGX_HTTP_VERSION_10 },
     { ngx_string("1.1"), NGX_HTTP_VERSION_11 },
+#if (NGX_HTTP_UPSTREAM_MULTIPLEX)
+    { ngx_string("2"), NGX_HTTP_VERSION_20 },
+#endif
     { ngx_null_string, 0 }
 };
 
@@ -543,6 +546,13 @@ static ngx_command_t  ngx_http_proxy_commands[] = {
       offsetof(ngx_http_proxy_loc_conf_t, upstream.cache_lock_age),
       NULL },
 
+    { ngx_string("proxy_cache_lock_stream"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_proxy_loc_conf_t, upstream.cache_lock_stream),
+      NULL },
+
     { ngx_string("proxy_cache_revalidate"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
       ngx_conf_set_flag_slot,
@@ -925,11 +935,12 @@ ngx_http_proxy_handler(ngx_http_request_t *r)
     u->input_filter_ctx = r;
 
     u->accel = 1;
+    u->http2 = (plcf->http_version == NGX_HTTP_VERSION_20);
 
     if (!plcf->upstream.request_buffering
         && plcf->body_values == NULL && plcf->upstream.pass_request_body
         && (!r->headers_in.chunked
-            || plcf->http_version == NGX_HTTP_VERSION_11))
+            || plcf->http_version >= NGX_HTTP_VERSION_11))
     {
         r->request_body_no_buffering = 1;
     }
@@ -1358,7 +1369,7 @@ ngx_http_proxy_create_request(ngx_http_request_t *r)
 
     u->uri.len = b->last - u->uri.data;
 
-    if (plcf->http_version == NGX_HTTP_VERSION_11) {
+    if (plcf->http_version >= NGX_HTTP_VERSION_11) {
         b->last = ngx_cpymem(b->last, ngx_http_proxy_version_11,
                              sizeof(ngx_http_proxy_version_11) - 1);
 
@@ -1767,15 +1778,19 @@ ngx_http_proxy_process_status_line(ngx_http_request_t *r)
 
     u->headers_in.status_n = ctx->status.code;
 
-    len = ctx->status.end - ctx->status.start;
-    u->headers_in.status_line.len = len;
+    /* HTTP/2 has no reason phrase, the status line is generated */
 
-    u->headers_in.status_line.data = ngx_pnalloc(r->pool, len);
-    if (u->headers_in.status_line.data == NULL) {
-        return NGX_ERROR;
-    }
+    if (!u->http2) {
+        len = ctx->status.end - ctx->status.start;
+        u->headers_in.status_line.len = len;
 
-    ngx_memcpy(u->headers_in.status_line.data, ctx->status.start, len);
+        u->headers_in.status_line.data = ngx_pnalloc(r->pool, len);
+        if (u->headers_in.status_line.data == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(u->headers_in.status_line.data, ctx->status.start, len);
+    }
 
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http proxy status %ui \"%V\"",
@@ -2868,6 +2883,7 @@ ngx_http_proxy_create_loc_conf(ngx_conf_t *cf)
     conf->upstream.cache_lock = NGX_CONF_UNSET;
     conf->upstream.cache_lock_timeout = NGX_CONF_UNSET_MSEC;
     conf->upstream.cache_lock_age = NGX_CONF_UNSET_MSEC;
+    conf->upstream.cache_lock_stream = NGX_CONF_UNSET;
     conf->upstream.cache_revalidate = NGX_CONF_UNSET;
     conf->upstream.cache_convert_head = NGX_CONF_UNSET;
     conf->upstream.cache_background_update = NGX_CONF_UNSET;
@@ -3173,6 +3189,9 @@ ngx_http_proxy_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_msec_value(conf->upstream.cache_lock_age,
                               prev->upstream.cache_lock_age, 5000);
 
+    ngx_conf_merge_value(conf->upstream.cache_lock_stream,
+                              prev->upstream.cache_lock_stream, 0);
+
     ngx_conf_merge_value(conf->upstream.cache_revalidate,
                               prev->upstream.cache_revalidate, 0);
 
@@ -3196,6 +3215,9 @@ ngx_http_proxy_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_value(conf->upstream.intercept_errors,
                               prev->upstream.intercept_errors, 0);
 
+    ngx_conf_merge_uint_value(conf->http_version, prev->http_version,
+                              NGX_HTTP_VERSION_10);
+
 #if (NGX_HTTP_SSL)
 
     ngx_conf_merge_value(conf->upstream.ssl_session_reuse,
@@ -3289,9 +3311,6 @@ ngx_http_proxy_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 
     ngx_conf_merge_ptr_value(conf->cookie_paths, prev->cookie_paths, NULL);
 
-    ngx_conf_merge_uint_value(conf->http_version, prev->http_version,
-                              NGX_HTTP_VERSION_10);
-
     ngx_conf_merge_uint_value(conf->headers_hash_max_size,
                               prev->headers_hash_max_size, 512);
 
@@ -3335,6 +3354,18 @@ ngx_http_proxy_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
         clcf->handler = ngx_http_proxy_handler;
     }
 
+    if (conf->http_version == NGX_HTTP_VERSION_20
+        && (conf->proxy_lengths
+            || (conf->upstream.upstream
+                && !(conf->upstream.upstream->flags
+                     & NGX_HTTP_UPSTREAM_HTTP2))))
+    {
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "\"proxy_http_version 2\" requires "
+                      "\"proxy_pass\" to an upstream with \"multiplex\"");
+        return NGX_CONF_ERROR;
+    }
+
     if (conf->body_source.data == NULL) {
         conf->body_flushes = prev->body_flushes;
         conf->body_source = prev->body_source;
@@ -3659,6 +3690,10 @@ ngx_http_proxy_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    if (plcf->upstream.upstream->conf == NULL) {
+        plcf->upstream.upstream->conf = &plcf->upstream;
+    }
+
     plcf->vars.schema.len = add;
     plcf->vars.schema.data = url->data;
     plcf->vars.key_start = plcf->vars.schema;
@@ -4327,6 +4362,20 @@ ngx_http_proxy_set_ssl(ngx_conf_t *cf, ngx_http_proxy_loc_conf_t *plcf)
         return NGX_ERROR;
     }
 
+#ifdef TLSEXT_TYPE_application_layer_protocol_negotiation
+
+    if (plcf->http_version == NGX_HTTP_VERSION_20
+        && SSL_CTX_set_alpn_protos(plcf->upstream.ssl->ctx,
+                                   (u_char *) "\x02h2", 3)
+           != 0)
+    {
+        ngx_ssl_error(NGX_LOG_EMERG, cf->log, 0,
+                      "SSL_CTX_set_alpn_protos() failed");
+        return NGX_ERROR;
+    }
+
+#endif
+
     return NGX_OK;
 }
 
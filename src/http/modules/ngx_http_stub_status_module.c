@@ -10,10 +10,34 @@
 #include <ngx_http.h>
 
 
+typedef struct {
+    ngx_flag_t    json;
+} ngx_http_stub_status_loc_conf_t;
+
+
+typedef struct {
+    ngx_str_t                     name;
+    size_t                        size;
+    ngx_slab_stats_t              stats;
+    ngx_slab_stat_t              *slots;
+#if (NGX_HTTP_CACHE)
+    ngx_http_file_cache_stats_t   cache;
+#endif
+} ngx_http_stub_status_zone_t;
+
+
 static ngx_int_t ngx_http_stub_status_handler(ngx_http_request_t *r);
+static ngx_buf_t *ngx_http_stub_status_json(ngx_http_request_t *r);
+static ngx_array_t *ngx_http_stub_status_zones(ngx_http_request_t *r);
+#if (NGX_THREADS)
+static u_char *ngx_http_stub_status_histogram(u_char *p, ngx_uint_t *counts);
+#endif
 static ngx_int_t ngx_http_stub_status_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_stub_status_add_variables(ngx_conf_t *cf);
+static void *ngx_http_stub_status_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_stub_status_merge_loc_conf(ngx_conf_t *cf, void *parent,
+    void *child);
 static char *ngx_http_set_stub_status(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 
@@ -23,7 +47,7 @@ static ngx_command_t  ngx_http_status_commands[] = {
     { ngx_string("stub_status"),
       NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
       ngx_http_set_stub_status,
-      0,
+      NGX_HTTP_LOC_CONF_OFFSET,
       0,
       NULL },
 
@@ -41,8 +65,8 @@ static ngx_http_module_t  ngx_http_stub_status_module_ctx = {
     NULL,                                  /* create server configuration */
     NULL,                                  /* merge server configuration */
 
-    NULL,                                  /* create location configuration */
-    NULL                                   /* merge location configuration */
+    ngx_http_stub_status_create_loc_conf,  /* create location configuration */
+    ngx_http_stub_status_merge_loc_conf    /* merge location configuration */
 };
 
 
@@ -83,11 +107,12 @@ static ngx_http_variable_t  ngx_http_stub_status_vars[] = {
 static ngx_int_t
 ngx_http_stub_status_handler(ngx_http_request_t *r)
 {
-    size_t             size;
-    ngx_int_t          rc;
-    ngx_buf_t         *b;
-    ngx_chain_t        out;
-    ngx_atomic_int_t   ap, hn, ac, rq, rd, wr, wa;
+    size_t                            size;
+    ngx_int_t                         rc;
+    ngx_buf_t                        *b;
+    ngx_chain_t                       out;
+    ngx_atomic_int_t                  ap, hn, ac, rq, rd, wr, wa;
+    ngx_http_stub_status_loc_conf_t  *sscf;
 
     if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
         return NGX_HTTP_NOT_ALLOWED;
@@ -99,8 +124,17 @@ ngx_http_stub_status_handler(ngx_http_request_t *r)
         return rc;
     }
 
-    r->headers_out.content_type_len = sizeof("text/plain") - 1;
-    ngx_str_set(&r->headers_out.content_type, "text/plain");
+    sscf = ngx_http_get_module_loc_conf(r, ngx_http_stub_status_module);
+
+    if (sscf->json) {
+        r->headers_out.content_type_len = sizeof("application/json") - 1;
+        ngx_str_set(&r->headers_out.content_type, "application/json");
+
+    } else {
+        r->headers_out.content_type_len = sizeof("text/plain") - 1;
+        ngx_str_set(&r->headers_out.content_type, "text/plain");
+    }
+
     r->headers_out.content_type_lowcase = NULL;
 
     if (r->method == NGX_HTTP_HEAD) {
@@ -113,6 +147,15 @@ ngx_http_stub_status_handler(ngx_http_request_t *r)
         }
     }
 
+    if (sscf->json) {
+        b = ngx_http_stub_status_json(r);
+        if (b == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        goto send;
+    }
+
     size = sizeof("Active connections:  \n") + NGX_ATOMIC_T_LEN
            + sizeof("server accepts handled requests\n") - 1
            + 6 + 3 * NGX_ATOMIC_T_LEN
@@ -123,9 +166,6 @@ ngx_http_stub_status_handler(ngx_http_request_t *r)
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    out.buf = b;
-    out.next = NULL;
-
     ap = *ngx_stat_accepted;
     hn = *ngx_stat_handled;
     ac = *ngx_stat_active;
@@ -144,6 +184,11 @@ ngx_http_stub_status_handler(ngx_http_request_t *r)
     b->last = ngx_sprintf(b->last, "Reading: %uA Writing: %uA Waiting: %uA \n",
                           rd, wr, wa);
 
+send:
+
+    out.buf = b;
+    out.next = NULL;
+
     r->headers_out.status = NGX_HTTP_OK;
     r->headers_out.content_length_n = b->last - b->pos;
 
@@ -160,6 +205,427 @@ ngx_http_stub_status_handler(ngx_http_request_t *r)
 }
 
 
+static ngx_buf_t *
+ngx_http_stub_status_json(ngx_http_request_t *r)
+{
+    size_t                        size;
+    ngx_buf_t                    *b;
+    ngx_uint_t                    i, j;
+    ngx_array_t                  *zones;
+    ngx_slab_stat_t              *slot;
+    ngx_http_stub_status_zone_t  *zone;
+#if (NGX_HTTP_CACHE)
+    ngx_uint_t                    k;
+    ngx_http_file_cache_shard_stats_t  *shard;
+#endif
+#if (NGX_THREADS)
+    ngx_uint_t                    n;
+    ngx_array_t                  *pools;
+    ngx_thread_pool_stats_t       st, *stats;
+#endif
+#if (NGX_HTTP_UPSTREAM_KEEPALIVE)
+    ngx_uint_t                    nk;
+    ngx_array_t                  *upstreams;
+    ngx_http_upstream_keepalive_stats_t  kst, *kstats;
+#endif
+
+    size = sizeof("{\"connections\":{\"active\":,\"reading\":,\"writing\":,"
+                  "\"waiting\":,\"accepted\":,\"handled\":},"
+                  "\"requests\":{\"total\":},"
+                  "\"udp\":{\"recv_calls\":,\"received\":,"
+                  "\"send_calls\":,\"sent\":}}") - 1
+           + 11 * NGX_ATOMIC_T_LEN;
+
+    zones = ngx_http_stub_status_zones(r);
+    if (zones == NULL) {
+        return NULL;
+    }
+
+    zone = zones->elts;
+
+    size += sizeof(",\"slabs\":{}") - 1;
+
+    for (i = 0; i < zones->nelts; i++) {
+        size += sizeof(",\"\":{\"size\":,\"pages\":{\"total\":,\"used\":,"
+                       "\"free\":,\"free_runs\":,\"largest_free_run\":,"
+                       "\"fails\":},\"slots\":{}}") - 1
+                + zone[i].name.len
+                + ngx_escape_json(NULL, zone[i].name.data, zone[i].name.len)
+                + 7 * NGX_INT_T_LEN
+                + zone[i].stats.nslots
+                  * (sizeof(",\"\":{\"used\":,\"free\":,\"reqs\":,"
+                            "\"fails\":}") - 1
+                     + 5 * NGX_INT_T_LEN);
+    }
+
+#if (NGX_HTTP_CACHE)
+
+    size += sizeof(",\"caches\":{}") - 1;
+
+    for (i = 0; i < zones->nelts; i++) {
+        if (zone[i].cache.shards == NULL) {
+            continue;
+        }
+
+        size += sizeof(",\"\":{\"size\":,\"entries\":,\"max_size\":,"
+                       "\"evicted\":,\"evicted_size\":,\"lag\":,"
+                       "\"shards\":[]}") - 1
+                + zone[i].name.len
+                + ngx_escape_json(NULL, zone[i].name.data, zone[i].name.len)
+                + 3 * NGX_OFF_T_LEN + 3 * NGX_INT_T_LEN
+                + zone[i].cache.nshards
+                  * (sizeof(",{\"nodes\":,\"locks\":,\"contended\":}") - 1
+                     + 3 * NGX_INT_T_LEN);
+    }
+
+#endif
+
+#if (NGX_THREADS)
+
+    pools = ngx_array_create(r->pool, 4, sizeof(ngx_thread_pool_stats_t));
+    if (pools == NULL) {
+        return NULL;
+    }
+
+    for (n = 0;
+         ngx_thread_pool_stats((ngx_cycle_t *) ngx_cycle, n, &st) == NGX_OK;
+         n++)
+    {
+        stats = ngx_array_push(pools);
+        if (stats == NULL) {
+            return NULL;
+        }
+
+        *stats = st;
+    }
+
+    stats = pools->elts;
+
+    size += sizeof(",\"thread_pools\":{}") - 1;
+
+    for (i = 0; i < n; i++) {
+        size += sizeof(",\"\":{\"threads\":,\"max_queue\":,\"active\":,"
+                       "\"waiting\":,\"max_waiting\":,\"tasks\":,"
+                       "\"completed\":,\"overflows\":,\"wait_time\":,"
+                       "\"exec_time\":,\"wait_histogram\":,"
+                       "\"exec_histogram\":}") - 1
+                + stats[i].name.len
+                + ngx_escape_json(NULL, stats[i].name.data, stats[i].name.len)
+                + 10 * NGX_INT_T_LEN
+                + 2 * (sizeof("{}") - 1
+                       + NGX_THREAD_POOL_HISTOGRAM
+                         * (sizeof(",\"\":") - 1 + 2 * NGX_INT_T_LEN)
+                       + sizeof("inf") - 1);
+    }
+
+#endif
+
+#if (NGX_HTTP_UPSTREAM_KEEPALIVE)
+
+    upstreams = ngx_array_create(r->pool, 4,
+                                 sizeof(ngx_http_upstream_keepalive_stats_t));
+    if (upstreams == NULL) {
+        return NULL;
+    }
+
+    for (nk = 0;
+         ngx_http_upstream_keepalive_stats((ngx_cycle_t *) ngx_cycle, nk, &kst)
+         == NGX_OK;
+         nk++)
+    {
+        kstats = ngx_array_push(upstreams);
+        if (kstats == NULL) {
+            return NULL;
+        }
+
+        *kstats = kst;
+    }
+
+    kstats = upstreams->elts;
+
+    size += sizeof(",\"keepalive\":{}") - 1;
+
+    for (i = 0; i < nk; i++) {
+        size += sizeof(",\"\":{\"idle\":,\"hits\":,\"misses\":,"
+                       "\"evicted\":,\"prewarmed\":}") - 1
+                + kstats[i].name.len
+                + ngx_escape_json(NULL, kstats[i].name.data,
+                                  kstats[i].name.len)
+                + 5 * NGX_INT_T_LEN;
+    }
+
+#endif
+
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    b->last = ngx_sprintf(b->last,
+                          "{\"connections\":{\"active\":%uA,\"reading\":%uA,"
+                          "\"writing\":%uA,\"waiting\":%uA,"
+                          "\"accepted\":%uA,\"handled\":%uA},"
+                          "\"requests\":{\"total\":%uA},"
+                          "\"udp\":{\"recv_calls\":%uA,\"received\":%uA,"
+                          "\"send_calls\":%uA,\"sent\":%uA}",
+                          *ngx_stat_active, *ngx_stat_reading,
+                          *ngx_stat_writing, *ngx_stat_waiting,
+                          *ngx_stat_accepted, *ngx_stat_handled,
+                          *ngx_stat_requests,
+                          *ngx_stat_udp_recv_calls, *ngx_stat_udp_received,
+                          *ngx_stat_udp_send_calls, *ngx_stat_udp_sent);
+
+    b->last = ngx_cpymem(b->last, ",\"slabs\":{", sizeof(",\"slabs\":{") - 1);
+
+    for (i = 0; i < zones->nelts; i++) {
+        if (i) {
+            *b->last++ = ',';
+        }
+
+        *b->last++ = '"';
+        b->last = (u_char *) ngx_escape_json(b->last, zone[i].name.data,
+                                             zone[i].name.len);
+        *b->last++ = '"';
+
+        b->last = ngx_sprintf(b->last,
+                              ":{\"size\":%uz,\"pages\":{\"total\":%ui,"
+                              "\"used\":%ui,\"free\":%ui,\"free_runs\":%ui,"
+                              "\"largest_free_run\":%ui,\"fails\":%ui},"
+                              "\"slots\":{",
+                              zone[i].size, zone[i].stats.pages,
+                              zone[i].stats.pages - zone[i].stats.free,
+                              zone[i].stats.free, zone[i].stats.runs,
+                              zone[i].stats.largest, zone[i].stats.fails);
+
+        slot = zone[i].slots;
+
+        for (j = 0; j < zone[i].stats.nslots; j++) {
+            b->last = ngx_sprintf(b->last,
+                                  "%s\"%uz\":{\"used\":%ui,\"free\":%ui,"
+                                  "\"reqs\":%ui,\"fails\":%ui}",
+                                  j ? "," : "", zone[i].stats.min_size << j,
+                                  slot[j].used, slot[j].total - slot[j].used,
+                                  slot[j].reqs, slot[j].fails);
+        }
+
+        *b->last++ = '}';
+        *b->last++ = '}';
+    }
+
+    *b->last++ = '}';
+
+#if (NGX_HTTP_CACHE)
+
+    b->last = ngx_cpymem(b->last, ",\"caches\":{", sizeof(",\"caches\":{") - 1);
+
+    for (i = 0, k = 0; i < zones->nelts; i++) {
+        if (zone[i].cache.shards == NULL) {
+            continue;
+        }
+
+        if (k++) {
+            *b->last++ = ',';
+        }
+
+        *b->last++ = '"';
+        b->last = (u_char *) ngx_escape_json(b->last, zone[i].name.data,
+                                             zone[i].name.len);
+        *b->last++ = '"';
+
+        b->last = ngx_sprintf(b->last,
+                              ":{\"size\":%O,\"entries\":%ui,"
+                              "\"max_size\":%O,\"evicted\":%ui,"
+                              "\"evicted_size\":%O,\"lag\":%M,\"shards\":[",
+                              zone[i].cache.size, zone[i].cache.count,
+                              zone[i].cache.max_size, zone[i].cache.evicted,
+                              zone[i].cache.evicted_size,
+                              zone[i].cache.lag);
+
+        shard = zone[i].cache.shards;
+
+        for (j = 0; j < zone[i].cache.nshards; j++) {
+            b->last = ngx_sprintf(b->last,
+                                  "%s{\"nodes\":%ui,\"locks\":%ui,"
+                                  "\"contended\":%ui}",
+                                  j ? "," : "", shard[j].nodes,
+                                  shard[j].locks, shard[j].contended);
+        }
+
+        *b->last++ = ']';
+        *b->last++ = '}';
+    }
+
+    *b->last++ = '}';
+
+#endif
+
+#if (NGX_THREADS)
+
+    b->last = ngx_cpymem(b->last, ",\"thread_pools\":{",
+                         sizeof(",\"thread_pools\":{") - 1);
+
+    for (i = 0; i < n; i++) {
+        if (i) {
+            *b->last++ = ',';
+        }
+
+        *b->last++ = '"';
+        b->last = (u_char *) ngx_escape_json(b->last, stats[i].name.data,
+                                             stats[i].name.len);
+        *b->last++ = '"';
+
+        b->last = ngx_sprintf(b->last,
+                              ":{\"threads\":%ui,\"max_queue\":%ui,"
+                              "\"active\":%ui,\"waiting\":%ui,"
+                              "\"max_waiting\":%ui,\"tasks\":%ui,"
+                              "\"completed\":%ui,\"overflows\":%ui,"
+                              "\"wait_time\":%ui,\"exec_time\":%ui,"
+                              "\"wait_histogram\":",
+                              stats[i].threads, stats[i].max_queue,
+                              stats[i].active, stats[i].waiting,
+                              stats[i].max_waiting, stats[i].tasks,
+                              stats[i].completed, stats[i].overflows,
+                              stats[i].wait_time, stats[i].exec_time);
+
+        b->last = ngx_http_stub_status_histogram(b->last,
+                                                 stats[i].wait_histogram);
+
+        b->last = ngx_cpymem(b->last, ",\"exec_histogram\":",
+                             sizeof(",\"exec_histogram\":") - 1);
+
+        b->last = ngx_http_stub_status_histogram(b->last,
+                                                 stats[i].exec_histogram);
+
+        *b->last++ = '}';
+    }
+
+    *b->last++ = '}';
+
+#endif
+
+#if (NGX_HTTP_UPSTREAM_KEEPALIVE)
+
+    b->last = ngx_cpymem(b->last, ",\"keepalive\":{",
+                         sizeof(",\"keepalive\":{") - 1);
+
+    for (i = 0; i < nk; i++) {
+        if (i) {
+            *b->last++ = ',';
+        }
+
+        *b->last++ = '"';
+        b->last = (u_char *) ngx_escape_json(b->last, kstats[i].name.data,
+                                             kstats[i].name.len);
+        *b->last++ = '"';
+
+        b->last = ngx_sprintf(b->last,
+                              ":{\"idle\":%ui,\"hits\":%ui,\"misses\":%ui,"
+                              "\"evicted\":%ui,\"prewarmed\":%ui}",
+                              kstats[i].idle, kstats[i].hits,
+                              kstats[i].misses, kstats[i].evicted,
+                              kstats[i].prewarmed);
+    }
+
+    *b->last++ = '}';
+
+#endif
+
+    *b->last++ = '}';
+
+    return b;
+}
+
+
+static ngx_array_t *
+ngx_http_stub_status_zones(ngx_http_request_t *r)
+{
+    ngx_uint_t                    i;
+#if (NGX_HTTP_CACHE)
+    ngx_int_t                     rc;
+#endif
+    ngx_array_t                  *zones;
+    ngx_shm_zone_t               *shm_zone;
+    ngx_list_part_t              *part;
+    ngx_http_stub_status_zone_t  *zone;
+
+    zones = ngx_array_create(r->pool, 4, sizeof(ngx_http_stub_status_zone_t));
+    if (zones == NULL) {
+        return NULL;
+    }
+
+    part = &((ngx_cycle_t *) ngx_cycle)->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        zone = ngx_array_push(zones);
+        if (zone == NULL) {
+            return NULL;
+        }
+
+        zone->name = shm_zone[i].shm.name;
+        zone->size = shm_zone[i].shm.size;
+
+        zone->slots = ngx_palloc(r->pool,
+                                 ngx_pagesize_shift * sizeof(ngx_slab_stat_t));
+        if (zone->slots == NULL) {
+            return NULL;
+        }
+
+        ngx_slab_stats((ngx_slab_pool_t *) shm_zone[i].shm.addr, &zone->stats,
+                       zone->slots);
+
+#if (NGX_HTTP_CACHE)
+
+        rc = ngx_http_file_cache_stats(&shm_zone[i], &zone->cache, r->pool);
+
+        if (rc == NGX_ERROR) {
+            return NULL;
+        }
+
+        if (rc == NGX_DECLINED) {
+            zone->cache.shards = NULL;
+        }
+
+#endif
+    }
+
+    return zones;
+}
+
+
+#if (NGX_THREADS)
+
+static u_char *
+ngx_http_stub_status_histogram(u_char *p, ngx_uint_t *counts)
+{
+    ngx_uint_t  i;
+
+    *p++ = '{';
+
+    for (i = 0; i < NGX_THREAD_POOL_HISTOGRAM - 1; i++) {
+        p = ngx_sprintf(p, "\"%ui\":%ui,", ngx_thread_pool_histogram[i],
+                        counts[i]);
+    }
+
+    p = ngx_sprintf(p, "\"inf\":%ui}", counts[i]);
+
+    return p;
+}
+
+#endif
+
+
 static ngx_int_t
 ngx_http_stub_status_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data)
@@ -224,13 +690,52 @@ ngx_http_stub_status_add_variables(ngx_conf_t *cf)
 }
 
 
+static void *
+ngx_http_stub_status_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_stub_status_loc_conf_t  *conf;
+
+    conf = ngx_palloc(cf->pool, sizeof(ngx_http_stub_status_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    conf->json = NGX_CONF_UNSET;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_stub_status_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_stub_status_loc_conf_t *prev = parent;
+    ngx_http_stub_status_loc_conf_t *conf = child;
+
+    ngx_conf_merge_value(conf->json, prev->json, 0);
+
+    return NGX_CONF_OK;
+}
+
+
 static char *
 ngx_http_set_stub_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
+    ngx_http_stub_status_loc_conf_t *sscf = conf;
+
+    ngx_str_t                 *value;
     ngx_http_core_loc_conf_t  *clcf;
 
     clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
     clcf->handler = ngx_http_stub_status_handler;
 
+    value = cf->args->elts;
+
+    /* any other parameter is ignored for compatibility */
+
+    if (cf->args->nelts == 2 && ngx_strcmp(value[1].data, "json") == 0) {
+        sscf->json = 1;
+    }
+
     return NGX_CONF_OK;
 }
@@ -0,0 +1,467 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+typedef struct {
+    ngx_msec_t                            decay;
+    ngx_uint_t                            number;
+    ngx_http_upstream_rr_peer_t         **peers;
+} ngx_http_upstream_ewma_srv_conf_t;
+
+
+typedef struct {
+    /* the round robin data must be first */
+    ngx_http_upstream_rr_peer_data_t      rrp;
+
+    ngx_http_upstream_ewma_srv_conf_t    *conf;
+    ngx_http_request_t                   *request;
+    ngx_msec_t                            start;
+    u_char                                tries;
+} ngx_http_upstream_ewma_peer_data_t;
+
+
+static ngx_int_t ngx_http_upstream_init_ewma(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_update_ewma(ngx_pool_t *pool,
+    ngx_http_upstream_srv_conf_t *us);
+
+static ngx_int_t ngx_http_upstream_init_ewma_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_get_ewma_peer(ngx_peer_connection_t *pc,
+    void *data);
+static void ngx_http_upstream_free_ewma_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+static void *ngx_http_upstream_ewma_create_conf(ngx_conf_t *cf);
+static char *ngx_http_upstream_ewma(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_http_upstream_ewma_commands[] = {
+
+    { ngx_string("peak_ewma"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
+      ngx_http_upstream_ewma,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_upstream_ewma_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_upstream_ewma_create_conf,    /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_upstream_ewma_module = {
+    NGX_MODULE_V1,
+    &ngx_http_upstream_ewma_module_ctx,    /* module context */
+    ngx_http_upstream_ewma_commands,       /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_http_upstream_init_ewma(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cf->log, 0, "init peak ewma");
+
+    if (ngx_http_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_http_upstream_init_ewma_peer;
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    if (us->shm_zone) {
+        return NGX_OK;
+    }
+#endif
+
+    return ngx_http_upstream_update_ewma(cf->pool, us);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_update_ewma(ngx_pool_t *pool,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    size_t                              size;
+    ngx_uint_t                          i;
+    ngx_http_upstream_rr_peer_t        *peer, **list;
+    ngx_http_upstream_rr_peers_t       *peers;
+    ngx_http_upstream_ewma_srv_conf_t  *ecf;
+
+    ecf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_ewma_module);
+
+    peers = us->peer.data;
+
+    size = peers->number * sizeof(ngx_http_upstream_rr_peer_t *);
+
+    list = pool ? ngx_palloc(pool, size) : ngx_alloc(size, ngx_cycle->log);
+    if (list == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+        list[i] = peer;
+    }
+
+    ecf->number = i;
+    ecf->peers = list;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_init_ewma_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_upstream_ewma_srv_conf_t   *ecf;
+    ngx_http_upstream_ewma_peer_data_t  *ep;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "init peak ewma peer");
+
+    ecf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_ewma_module);
+
+    ep = ngx_palloc(r->pool, sizeof(ngx_http_upstream_ewma_peer_data_t));
+    if (ep == NULL) {
+        return NGX_ERROR;
+    }
+
+    r->upstream->peer.data = &ep->rrp;
+
+    if (ngx_http_upstream_init_round_robin_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    r->upstream->peer.get = ngx_http_upstream_get_ewma_peer;
+    r->upstream->peer.free = ngx_http_upstream_free_ewma_peer;
+
+    ep->conf = ecf;
+    ep->request = r;
+    ep->start = ngx_current_msec;
+    ep->tries = 0;
+
+    ngx_http_upstream_rr_peers_rlock(ep->rrp.peers);
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    if (ep->rrp.peers->shpool && ecf->peers == NULL) {
+        if (ngx_http_upstream_update_ewma(NULL, us) != NGX_OK) {
+            ngx_http_upstream_rr_peers_unlock(ep->rrp.peers);
+            return NGX_ERROR;
+        }
+    }
+#endif
+
+    ngx_http_upstream_rr_peers_unlock(ep->rrp.peers);
+
+    return NGX_OK;
+}
+
+
+/*
+ * Two random peers are compared by their load, that is, the number of
+ * active connections times the peak EWMA of the response time, divided
+ * by the weight, and the less loaded one is selected.
+ */
+
+static ngx_int_t
+ngx_http_upstream_get_ewma_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_ewma_peer_data_t  *ep = data;
+
+    time_t                             now;
+    uint64_t                           load, prev_load;
+    uintptr_t                          m;
+    ngx_uint_t                         i, n, p;
+    ngx_http_upstream_rr_peer_t       *peer, *prev;
+    ngx_http_upstream_rr_peers_t      *peers;
+    ngx_http_upstream_rr_peer_data_t  *rrp;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get peak ewma peer, try: %ui", pc->tries);
+
+    rrp = &ep->rrp;
+    peers = rrp->peers;
+
+    ep->start = ngx_current_msec;
+
+    ngx_http_upstream_rr_peers_wlock(peers);
+
+    if (ep->tries > 20 || peers->single) {
+        ngx_http_upstream_rr_peers_unlock(peers);
+        return ngx_http_upstream_get_round_robin_peer(pc, rrp);
+    }
+
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    now = ngx_time();
+
+    prev = NULL;
+
+#if (NGX_SUPPRESS_WARN)
+    p = 0;
+#endif
+
+    for ( ;; ) {
+
+        i = ngx_random() % ep->conf->number;
+
+        peer = ep->conf->peers[i];
+
+        if (peer == prev) {
+            goto next;
+        }
+
+        n = i / (8 * sizeof(uintptr_t));
+        m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+
+        if (rrp->tried[n] & m) {
+            goto next;
+        }
+
+        if (peer->down) {
+            goto next;
+        }
+
+        if (peer->max_fails
+            && peer->fails >= peer->max_fails
+            && now - peer->checked <= peer->fail_timeout)
+        {
+            goto next;
+        }
+
+        if (peer->max_conns && peer->conns >= peer->max_conns) {
+            goto next;
+        }
+
+        if (prev) {
+            /* compare (ewma + 1) * (conns + 1) / weight */
+
+            load = (uint64_t) (peer->ewma + 1) * (peer->conns + 1)
+                   * prev->weight;
+            prev_load = (uint64_t) (prev->ewma + 1) * (prev->conns + 1)
+                        * peer->weight;
+
+            if (load > prev_load) {
+                peer = prev;
+                n = p / (8 * sizeof(uintptr_t));
+                m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
+            }
+
+            break;
+        }
+
+        prev = peer;
+        p = i;
+
+    next:
+
+        if (++ep->tries > 20) {
+            ngx_http_upstream_rr_peers_unlock(peers);
+            return ngx_http_upstream_get_round_robin_peer(pc, rrp);
+        }
+    }
+
+    rrp->current = peer;
+
+    if (now - peer->checked > peer->fail_timeout) {
+        peer->checked = now;
+    }
+
+    pc->sockaddr = peer->sockaddr;
+    pc->socklen = peer->socklen;
+    pc->name = &peer->name;
+
+    peer->conns++;
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    rrp->tried[n] |= m;
+
+    return NGX_OK;
+}
+
+
+/*
+ * The response time is the upstream header time if it is known, or
+ * the time since the peer was selected.  A failed attempt counts as
+ * at least the decay time.  The average follows any higher value at
+ * once, and decays towards lower ones with a weight of
+ * decay / (decay + elapsed), an approximation of exp(-elapsed / decay).
+ */
+
+static void
+ngx_http_upstream_free_ewma_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_http_upstream_ewma_peer_data_t  *ep = data;
+
+    uint64_t                       rtt, elapsed, decay;
+    ngx_http_upstream_state_t     *us;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    peer = ep->rrp.current;
+    peers = ep->rrp.peers;
+
+    if (peer == NULL) {
+        goto done;
+    }
+
+    us = ep->request->upstream->state;
+
+    if (us && us->header_time != (ngx_msec_t) -1) {
+        rtt = us->header_time;
+
+    } else {
+        rtt = ngx_current_msec - ep->start;
+    }
+
+    decay = ep->conf->decay;
+
+    if ((state & NGX_PEER_FAILED) && rtt < decay) {
+        rtt = decay;
+    }
+
+    /* microseconds */
+    rtt *= 1000;
+
+    ngx_http_upstream_rr_peers_rlock(peers);
+    ngx_http_upstream_rr_peer_lock(peers, peer);
+
+    elapsed = (ngx_msec_t) (ngx_current_msec - peer->ewma_stamp);
+
+    if (rtt >= peer->ewma || peer->ewma_stamp == 0) {
+        peer->ewma = rtt;
+
+    } else {
+        peer->ewma = (peer->ewma * decay + rtt * elapsed) / (decay + elapsed);
+    }
+
+    peer->ewma_stamp = ngx_current_msec;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "peak ewma peer %V rtt:%uL ewma:%ui",
+                   &peer->name, rtt, peer->ewma);
+
+    ngx_http_upstream_rr_peer_unlock(peers, peer);
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+done:
+
+    ngx_http_upstream_free_round_robin_peer(pc, &ep->rrp, state);
+}
+
+
+static void *
+ngx_http_upstream_ewma_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_ewma_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_ewma_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->number = 0;
+     *     conf->peers = NULL;
+     */
+
+    conf->decay = NGX_CONF_UNSET_MSEC;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_upstream_ewma(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_ewma_srv_conf_t  *ecf = conf;
+
+    ngx_str_t                     *value, s;
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    if (ecf->decay != NGX_CONF_UNSET_MSEC) {
+        return "is duplicate";
+    }
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    if (uscf->peer.init_upstream) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "load balancing method redefined");
+    }
+
+    uscf->peer.init_upstream = ngx_http_upstream_init_ewma;
+
+    uscf->flags = NGX_HTTP_UPSTREAM_CREATE
+                  |NGX_HTTP_UPSTREAM_WEIGHT
+                  |NGX_HTTP_UPSTREAM_MAX_CONNS
+                  |NGX_HTTP_UPSTREAM_MAX_FAILS
+                  |NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
+                  |NGX_HTTP_UPSTREAM_DOWN;
+
+    ecf->decay = 10000;
+
+    if (cf->args->nelts == 1) {
+        return NGX_CONF_OK;
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strncmp(value[1].data, "decay=", 6) != 0) {
+        goto invalid;
+    }
+
+    s.len = value[1].len - 6;
+    s.data = &value[1].data[6];
+
+    ecf->decay = ngx_parse_time(&s, 0);
+
+    if (ecf->decay == (ngx_msec_t) NGX_ERROR || ecf->decay == 0) {
+        goto invalid;
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[1]);
+
+    return NGX_CONF_ERROR;
+}
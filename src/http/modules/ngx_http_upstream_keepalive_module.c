@@ -10,20 +10,65 @@
 #include <ngx_http.h>
 
 
+/* the counters are kept in shared memory and summed up over all workers */
+
+typedef struct {
+    ngx_atomic_t                       idle;
+    ngx_atomic_t                       hits;
+    ngx_atomic_t                       misses;
+    ngx_atomic_t                       evicted;
+    ngx_atomic_t                       prewarmed;
+} ngx_http_upstream_keepalive_counters_t;
+
+
+typedef struct ngx_http_upstream_keepalive_warm_s
+    ngx_http_upstream_keepalive_warm_t;
+
+
 typedef struct {
-    ngx_uint_t                         max_cached;
-    ngx_uint_t                         requests;
-    ngx_msec_t                         timeout;
+    ngx_uint_t                               max_cached;
+    ngx_uint_t                               requests;
+    ngx_msec_t                               timeout;
+    ngx_uint_t                               prewarm;
 
-    ngx_queue_t                        cache;
-    ngx_queue_t                        free;
+    ngx_queue_t                              cache;
+    ngx_queue_t                              free;
 
-    ngx_http_upstream_init_pt          original_init_upstream;
-    ngx_http_upstream_init_peer_pt     original_init_peer;
+    ngx_http_upstream_init_pt                original_init_upstream;
+    ngx_http_upstream_init_peer_pt           original_init_peer;
+
+    ngx_http_upstream_srv_conf_t            *upstream;
+    ngx_http_upstream_keepalive_counters_t  *counters;
+
+    /* per worker */
+    ngx_uint_t                               idle;
+    ngx_uint_t                               pending;
+    ngx_uint_t                               nwarm;
+    ngx_http_upstream_keepalive_warm_t      *warm;
+    ngx_queue_t                              connects;
+    ngx_event_t                              prewarm_event;
 
 } ngx_http_upstream_keepalive_srv_conf_t;
 
 
+struct ngx_http_upstream_keepalive_warm_s {
+    ngx_http_upstream_keepalive_srv_conf_t  *conf;
+
+    ngx_http_upstream_rr_peers_t      *peers;
+    ngx_http_upstream_rr_peer_t       *peer;
+    ngx_uint_t                         pending;
+};
+
+
+typedef struct {
+    ngx_http_upstream_keepalive_warm_t  *warm;
+
+    ngx_queue_t                        queue;
+    ngx_connection_t                  *connection;
+
+} ngx_http_upstream_keepalive_connect_t;
+
+
 typedef struct {
     ngx_http_upstream_keepalive_srv_conf_t  *conf;
 
@@ -61,10 +106,27 @@ static ngx_int_t ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc,
 static void ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc,
     void *data, ngx_uint_t state);
 
+static void ngx_http_upstream_keepalive_save(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf, ngx_connection_t *c,
+    struct sockaddr *sockaddr, socklen_t socklen);
 static void ngx_http_upstream_keepalive_dummy_handler(ngx_event_t *ev);
 static void ngx_http_upstream_keepalive_close_handler(ngx_event_t *ev);
 static void ngx_http_upstream_keepalive_close(ngx_connection_t *c);
 
+static void ngx_http_upstream_keepalive_prewarm(ngx_event_t *ev);
+static ngx_int_t ngx_http_upstream_keepalive_prewarm_connect(
+    ngx_http_upstream_keepalive_warm_t *warm);
+static void ngx_http_upstream_keepalive_prewarm_handler(ngx_event_t *ev);
+static void ngx_http_upstream_keepalive_prewarm_done(ngx_connection_t *c,
+    ngx_uint_t ok);
+#if (NGX_HTTP_SSL)
+static void ngx_http_upstream_keepalive_prewarm_ssl(ngx_connection_t *c);
+static void ngx_http_upstream_keepalive_prewarm_ssl_handler(
+    ngx_connection_t *c);
+static ngx_int_t ngx_http_upstream_keepalive_ssl_name(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf, ngx_str_t *name);
+#endif
+
 #if (NGX_HTTP_SSL)
 static ngx_int_t ngx_http_upstream_keepalive_set_session(
     ngx_peer_connection_t *pc, void *data);
@@ -75,6 +137,10 @@ static void ngx_http_upstream_keepalive_save_session(ngx_peer_connection_t *pc,
 static void *ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf);
 static char *ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static ngx_int_t ngx_http_upstream_keepalive_init_module(ngx_cycle_t *cycle);
+static void ngx_http_upstream_keepalive_free_counters(void *data);
+static ngx_int_t ngx_http_upstream_keepalive_init_process(ngx_cycle_t *cycle);
+static void ngx_http_upstream_keepalive_exit_process(ngx_cycle_t *cycle);
 
 
 static ngx_command_t  ngx_http_upstream_keepalive_commands[] = {
@@ -100,6 +166,13 @@ static ngx_command_t  ngx_http_upstream_keepalive_commands[] = {
       offsetof(ngx_http_upstream_keepalive_srv_conf_t, requests),
       NULL },
 
+    { ngx_string("keepalive_prewarm"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_upstream_keepalive_srv_conf_t, prewarm),
+      NULL },
+
       ngx_null_command
 };
 
@@ -125,11 +198,11 @@ ngx_module_t  ngx_http_upstream_keepalive_module = {
     ngx_http_upstream_keepalive_commands,    /* module directives */
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
-    NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_upstream_keepalive_init_module, /* init module */
+    ngx_http_upstream_keepalive_init_process, /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
-    NULL,                                  /* exit process */
+    ngx_http_upstream_keepalive_exit_process, /* exit process */
     NULL,                                  /* exit master */
     NGX_MODULE_V1_PADDING
 };
@@ -151,6 +224,9 @@ ngx_http_upstream_init_keepalive(ngx_conf_t *cf,
 
     ngx_conf_init_msec_value(kcf->timeout, 60000);
     ngx_conf_init_uint_value(kcf->requests, 100);
+    ngx_conf_init_uint_value(kcf->prewarm, 0);
+
+    kcf->upstream = us;
 
     if (kcf->original_init_upstream(cf, us) != NGX_OK) {
         return NGX_ERROR;
@@ -266,10 +342,20 @@ ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
         }
     }
 
+    (void) ngx_atomic_fetch_add(&kp->conf->counters->misses, 1);
+
     return NGX_OK;
 
 found:
 
+    kp->conf->idle--;
+    (void) ngx_atomic_fetch_add(&kp->conf->counters->idle, -1);
+    (void) ngx_atomic_fetch_add(&kp->conf->counters->hits, 1);
+
+    if (kp->conf->nwarm) {
+        ngx_post_event(&kp->conf->prewarm_event, &ngx_posted_events);
+    }
+
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "get keepalive peer: using connection %p", c);
 
@@ -296,9 +382,7 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
     ngx_uint_t state)
 {
     ngx_http_upstream_keepalive_peer_data_t  *kp = data;
-    ngx_http_upstream_keepalive_cache_t      *item;
 
-    ngx_queue_t          *q;
     ngx_connection_t     *c;
     ngx_http_upstream_t  *u;
 
@@ -344,30 +428,50 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "free keepalive peer: saving connection %p", c);
 
-    if (ngx_queue_empty(&kp->conf->free)) {
+    pc->connection = NULL;
+
+    ngx_http_upstream_keepalive_save(kp->conf, c, pc->sockaddr, pc->socklen);
 
-        q = ngx_queue_last(&kp->conf->cache);
+invalid:
+
+    kp->original_free_peer(pc, kp->data, state);
+}
+
+
+static void
+ngx_http_upstream_keepalive_save(ngx_http_upstream_keepalive_srv_conf_t *kcf,
+    ngx_connection_t *c, struct sockaddr *sockaddr, socklen_t socklen)
+{
+    ngx_queue_t                          *q;
+    ngx_http_upstream_keepalive_cache_t  *item;
+
+    if (ngx_queue_empty(&kcf->free)) {
+
+        q = ngx_queue_last(&kcf->cache);
         ngx_queue_remove(q);
 
         item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
 
         ngx_http_upstream_keepalive_close(item->connection);
 
+        (void) ngx_atomic_fetch_add(&kcf->counters->evicted, 1);
+
     } else {
-        q = ngx_queue_head(&kp->conf->free);
+        q = ngx_queue_head(&kcf->free);
         ngx_queue_remove(q);
 
         item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
+
+        kcf->idle++;
+        (void) ngx_atomic_fetch_add(&kcf->counters->idle, 1);
     }
 
-    ngx_queue_insert_head(&kp->conf->cache, q);
+    ngx_queue_insert_head(&kcf->cache, q);
 
     item->connection = c;
 
-    pc->connection = NULL;
-
     c->read->delayed = 0;
-    ngx_add_timer(c->read, kp->conf->timeout);
+    ngx_add_timer(c->read, kcf->timeout);
 
     if (c->write->timer_set) {
         ngx_del_timer(c->write);
@@ -383,16 +487,12 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
     c->write->log = ngx_cycle->log;
     c->pool->log = ngx_cycle->log;
 
-    item->socklen = pc->socklen;
-    ngx_memcpy(&item->sockaddr, pc->sockaddr, pc->socklen);
+    item->socklen = socklen;
+    ngx_memcpy(&item->sockaddr, sockaddr, socklen);
 
     if (c->read->ready) {
         ngx_http_upstream_keepalive_close_handler(c->read);
     }
-
-invalid:
-
-    kp->original_free_peer(pc, kp->data, state);
 }
 
 
@@ -444,6 +544,13 @@ close:
 
     ngx_queue_remove(&item->queue);
     ngx_queue_insert_head(&conf->free, &item->queue);
+
+    conf->idle--;
+    (void) ngx_atomic_fetch_add(&conf->counters->idle, -1);
+
+    if (conf->nwarm) {
+        ngx_post_event(&conf->prewarm_event, &ngx_posted_events);
+    }
 }
 
 
@@ -470,6 +577,417 @@ ngx_http_upstream_keepalive_close(ngx_connection_t *c)
 }
 
 
+/*
+ * Prewarming keeps up to "keepalive_prewarm" idle connections per server
+ * in the cache of each worker.  The connections are opened on start and
+ * whenever a cached one is taken or closed.  The settings to connect,
+ * including SSL, are those of the first location passing to the upstream.
+ */
+
+static void
+ngx_http_upstream_keepalive_prewarm(ngx_event_t *ev)
+{
+    ngx_uint_t                               i, n, down;
+    ngx_queue_t                             *q;
+    ngx_http_upstream_rr_peer_t             *peer;
+    ngx_http_upstream_keepalive_warm_t      *warm;
+    ngx_http_upstream_keepalive_cache_t     *item;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
+
+    kcf = ev->data;
+
+    if (ngx_exiting || ngx_terminate) {
+        return;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "keepalive prewarm, idle: %ui, pending: %ui",
+                   kcf->idle, kcf->pending);
+
+    for (i = 0; i < kcf->nwarm; i++) {
+        warm = &kcf->warm[i];
+        peer = warm->peer;
+
+        ngx_http_upstream_rr_peers_rlock(warm->peers);
+        ngx_http_upstream_rr_peer_lock(warm->peers, peer);
+
+        down = peer->down;
+
+        ngx_http_upstream_rr_peer_unlock(warm->peers, peer);
+        ngx_http_upstream_rr_peers_unlock(warm->peers);
+
+        if (down) {
+            continue;
+        }
+
+        n = warm->pending;
+
+        for (q = ngx_queue_head(&kcf->cache);
+             q != ngx_queue_sentinel(&kcf->cache);
+             q = ngx_queue_next(q))
+        {
+            item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t,
+                                  queue);
+
+            if (ngx_memn2cmp((u_char *) &item->sockaddr,
+                             (u_char *) peer->sockaddr,
+                             item->socklen, peer->socklen)
+                == 0)
+            {
+                n++;
+            }
+        }
+
+        while (n < kcf->prewarm
+               && kcf->idle + kcf->pending < kcf->max_cached)
+        {
+            if (ngx_http_upstream_keepalive_prewarm_connect(warm) != NGX_OK) {
+                break;
+            }
+
+            n++;
+        }
+    }
+}
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_prewarm_connect(
+    ngx_http_upstream_keepalive_warm_t *warm)
+{
+    ngx_int_t                                rc;
+    ngx_connection_t                        *c;
+    ngx_peer_connection_t                    pc;
+    ngx_http_upstream_conf_t                *conf;
+    ngx_http_upstream_keepalive_connect_t   *kc;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
+
+    kcf = warm->conf;
+    conf = kcf->upstream->conf;
+
+    ngx_memzero(&pc, sizeof(ngx_peer_connection_t));
+
+    pc.sockaddr = warm->peer->sockaddr;
+    pc.socklen = warm->peer->socklen;
+    pc.name = &warm->peer->name;
+    pc.get = ngx_event_get_peer;
+    pc.log = ngx_cycle->log;
+    pc.log_error = NGX_ERROR_ERR;
+
+    if (conf->local && conf->local->value == NULL) {
+        pc.local = conf->local->addr;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc.log, 0,
+                   "keepalive prewarm connect to %V", pc.name);
+
+    rc = ngx_event_connect_peer(&pc);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        goto failed;
+    }
+
+    c = pc.connection;
+
+    c->pool = ngx_create_pool(128, ngx_cycle->log);
+    if (c->pool == NULL) {
+        ngx_close_connection(c);
+        goto failed;
+    }
+
+    kc = ngx_palloc(c->pool, sizeof(ngx_http_upstream_keepalive_connect_t));
+    if (kc == NULL) {
+        ngx_destroy_pool(c->pool);
+        ngx_close_connection(c);
+        goto failed;
+    }
+
+    kc->warm = warm;
+    kc->connection = c;
+
+    ngx_queue_insert_head(&kcf->connects, &kc->queue);
+
+    c->data = kc;
+    c->read->handler = ngx_http_upstream_keepalive_prewarm_handler;
+    c->write->handler = ngx_http_upstream_keepalive_prewarm_handler;
+
+    warm->pending++;
+    kcf->pending++;
+
+    /* pending connections are closed on exit */
+    c->write->cancelable = 1;
+
+    ngx_add_timer(c->write, conf->connect_timeout);
+
+    if (rc == NGX_OK) {
+        ngx_http_upstream_keepalive_prewarm_handler(c->write);
+    }
+
+    return NGX_OK;
+
+failed:
+
+    /* retry later */
+
+    if (!kcf->prewarm_event.timer_set) {
+        ngx_add_timer(&kcf->prewarm_event, 1000);
+    }
+
+    return NGX_ERROR;
+}
+
+
+static void
+ngx_http_upstream_keepalive_prewarm_handler(ngx_event_t *ev)
+{
+    int                                      err;
+    socklen_t                                len;
+    ngx_connection_t                        *c;
+#if (NGX_HTTP_SSL)
+    ngx_str_t                                name;
+    ngx_http_upstream_keepalive_connect_t   *kc;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
+#endif
+
+    c = ev->data;
+
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "upstream timed out while prewarming connection");
+        ngx_http_upstream_keepalive_prewarm_done(c, 0);
+        return;
+    }
+
+    if (ev->write == 0) {
+        return;
+    }
+
+#if (NGX_HAVE_KQUEUE)
+
+    if (ngx_event_flags & NGX_USE_KQUEUE_EVENT) {
+        err = c->write->pending_eof ? c->write->kq_errno : 0;
+
+    } else
+#endif
+    {
+        err = 0;
+        len = sizeof(int);
+
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len)
+            == -1)
+        {
+            err = ngx_socket_errno;
+        }
+    }
+
+    if (err) {
+        (void) ngx_connection_error(c, err, "connect() failed");
+        ngx_http_upstream_keepalive_prewarm_done(c, 0);
+        return;
+    }
+
+#if (NGX_HTTP_SSL)
+
+    kc = c->data;
+    kcf = kc->warm->conf;
+
+    /*
+     * if the name cannot be known, the connection is cached without SSL,
+     * and the handshake is done when it is used
+     */
+
+    if (kcf->upstream->conf->ssl
+        && ngx_http_upstream_keepalive_ssl_name(kcf, &name) == NGX_OK)
+    {
+        ngx_http_upstream_keepalive_prewarm_ssl(c);
+        return;
+    }
+
+#endif
+
+    ngx_http_upstream_keepalive_prewarm_done(c, 1);
+}
+
+
+static void
+ngx_http_upstream_keepalive_prewarm_done(ngx_connection_t *c, ngx_uint_t ok)
+{
+    ngx_http_upstream_rr_peer_t             *peer;
+    ngx_http_upstream_keepalive_warm_t      *warm;
+    ngx_http_upstream_keepalive_connect_t   *kc;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
+
+    kc = c->data;
+    warm = kc->warm;
+    kcf = warm->conf;
+    peer = warm->peer;
+
+    ngx_queue_remove(&kc->queue);
+
+    warm->pending--;
+    kcf->pending--;
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    if (ok && !ngx_exiting && !ngx_terminate
+        && ngx_handle_read_event(c->read, 0) == NGX_OK)
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "keepalive prewarm: saving connection %p", c);
+
+        (void) ngx_atomic_fetch_add(&kcf->counters->prewarmed, 1);
+
+        ngx_http_upstream_keepalive_save(kcf, c, peer->sockaddr,
+                                         peer->socklen);
+        return;
+    }
+
+    ngx_http_upstream_keepalive_close(c);
+
+    if (!ok && !kcf->prewarm_event.timer_set) {
+        ngx_add_timer(&kcf->prewarm_event, 1000);
+    }
+}
+
+
+#if (NGX_HTTP_SSL)
+
+static void
+ngx_http_upstream_keepalive_prewarm_ssl(ngx_connection_t *c)
+{
+    u_char                                  *p;
+    ngx_int_t                                rc;
+    ngx_str_t                                name;
+    ngx_http_upstream_conf_t                *conf;
+    ngx_http_upstream_keepalive_connect_t   *kc;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
+
+    kc = c->data;
+    kcf = kc->warm->conf;
+    conf = kcf->upstream->conf;
+
+    if (ngx_ssl_create_connection(conf->ssl, c,
+                                  NGX_SSL_BUFFER|NGX_SSL_CLIENT)
+        != NGX_OK)
+    {
+        ngx_http_upstream_keepalive_prewarm_done(c, 0);
+        return;
+    }
+
+    c->sendfile = 0;
+
+#ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
+
+    if (conf->ssl_server_name
+        && ngx_http_upstream_keepalive_ssl_name(kcf, &name) == NGX_OK
+        && name.len
+        && *name.data != '['
+        && ngx_inet_addr(name.data, name.len) == INADDR_NONE)
+    {
+        p = ngx_pnalloc(c->pool, name.len + 1);
+        if (p == NULL) {
+            ngx_http_upstream_keepalive_prewarm_done(c, 0);
+            return;
+        }
+
+        (void) ngx_cpystrn(p, name.data, name.len + 1);
+
+        if (SSL_set_tlsext_host_name(c->ssl->connection, (char *) p) == 0) {
+            ngx_ssl_error(NGX_LOG_ERR, c->log, 0,
+                          "SSL_set_tlsext_host_name(\"%s\") failed", p);
+            ngx_http_upstream_keepalive_prewarm_done(c, 0);
+            return;
+        }
+    }
+
+#endif
+
+    rc = ngx_ssl_handshake(c);
+
+    if (rc == NGX_AGAIN) {
+        c->ssl->handler = ngx_http_upstream_keepalive_prewarm_ssl_handler;
+        return;
+    }
+
+    ngx_http_upstream_keepalive_prewarm_ssl_handler(c);
+}
+
+
+static void
+ngx_http_upstream_keepalive_prewarm_ssl_handler(ngx_connection_t *c)
+{
+    long                                     rc;
+    ngx_str_t                                name;
+    ngx_http_upstream_keepalive_connect_t   *kc;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
+
+    kc = c->data;
+    kcf = kc->warm->conf;
+
+    if (!c->ssl->handshaked) {
+        ngx_http_upstream_keepalive_prewarm_done(c, 0);
+        return;
+    }
+
+    if (kcf->upstream->conf->ssl_verify) {
+        rc = SSL_get_verify_result(c->ssl->connection);
+
+        if (rc != X509_V_OK) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "upstream SSL certificate verify error: (%l:%s)",
+                          rc, X509_verify_cert_error_string(rc));
+            ngx_http_upstream_keepalive_prewarm_done(c, 0);
+            return;
+        }
+
+        if (ngx_http_upstream_keepalive_ssl_name(kcf, &name) != NGX_OK
+            || ngx_ssl_check_host(c, &name) != NGX_OK)
+        {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "upstream SSL certificate does not match \"%V\"",
+                          &name);
+            ngx_http_upstream_keepalive_prewarm_done(c, 0);
+            return;
+        }
+    }
+
+    ngx_http_upstream_keepalive_prewarm_done(c, 1);
+}
+
+
+/*
+ * the name is known without a request only if proxy_ssl_name and
+ * similar directives are not set or contain no variables
+ */
+
+static ngx_int_t
+ngx_http_upstream_keepalive_ssl_name(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf, ngx_str_t *name)
+{
+    ngx_http_upstream_conf_t  *conf;
+
+    conf = kcf->upstream->conf;
+
+    if (conf->ssl_name == NULL) {
+        *name = kcf->upstream->host;
+        return NGX_OK;
+    }
+
+    if (conf->ssl_name->lengths == NULL) {
+        *name = conf->ssl_name->value;
+        return NGX_OK;
+    }
+
+    ngx_str_null(name);
+
+    return NGX_DECLINED;
+}
+
+#endif
+
+
 #if (NGX_HTTP_SSL)
 
 static ngx_int_t
@@ -514,6 +1032,7 @@ ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf)
 
     conf->timeout = NGX_CONF_UNSET_MSEC;
     conf->requests = NGX_CONF_UNSET_UINT;
+    conf->prewarm = NGX_CONF_UNSET_UINT;
 
     return conf;
 }
@@ -559,3 +1078,258 @@ ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     return NGX_CONF_OK;
 }
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_init_module(ngx_cycle_t *cycle)
+{
+    u_char                                   *shared;
+    size_t                                    size;
+    ngx_shm_t                                *shm;
+    ngx_uint_t                                i, n;
+    ngx_pool_cleanup_t                       *cln;
+    ngx_http_upstream_srv_conf_t            **uscfp;
+    ngx_http_upstream_main_conf_t            *umcf;
+    ngx_http_upstream_keepalive_srv_conf_t   *kcf;
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+    n = 0;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        kcf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                          ngx_http_upstream_keepalive_module);
+
+        if (kcf->max_cached) {
+            n++;
+        }
+    }
+
+    if (n == 0) {
+        return NGX_OK;
+    }
+
+    /* keep the counters of different upstreams in different cache lines */
+
+    size = ngx_align(sizeof(ngx_http_upstream_keepalive_counters_t), 128);
+
+    cln = ngx_pool_cleanup_add(cycle->pool, sizeof(ngx_shm_t));
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    shm = cln->data;
+
+    shm->size = size * n;
+    ngx_str_set(&shm->name, "nginx_upstream_keepalive");
+    shm->log = cycle->log;
+
+    if (ngx_shm_alloc(shm) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_http_upstream_keepalive_free_counters;
+
+    shared = shm->addr;
+
+    ngx_memzero(shared, shm->size);
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        kcf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                          ngx_http_upstream_keepalive_module);
+
+        if (kcf->max_cached) {
+            kcf->counters = (ngx_http_upstream_keepalive_counters_t *) shared;
+            shared += size;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_keepalive_free_counters(void *data)
+{
+    ngx_shm_t  *shm = data;
+
+    ngx_shm_free(shm);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                                i, n;
+    ngx_event_t                              *ev;
+    ngx_http_upstream_rr_peer_t              *peer;
+    ngx_http_upstream_rr_peers_t             *peers;
+    ngx_http_upstream_srv_conf_t            **uscfp;
+    ngx_http_upstream_main_conf_t            *umcf;
+    ngx_http_upstream_keepalive_srv_conf_t   *kcf;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        kcf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                          ngx_http_upstream_keepalive_module);
+
+        if (kcf->max_cached == 0 || kcf->prewarm == 0
+            || uscfp[i]->conf == NULL)
+        {
+            continue;
+        }
+
+        /* backup servers are not prewarmed */
+
+        peers = uscfp[i]->peer.data;
+
+        kcf->warm = ngx_pcalloc(cycle->pool, peers->number
+                                * sizeof(ngx_http_upstream_keepalive_warm_t));
+        if (kcf->warm == NULL) {
+            return NGX_ERROR;
+        }
+
+        for (peer = peers->peer, n = 0; peer; peer = peer->next, n++) {
+            kcf->warm[n].conf = kcf;
+            kcf->warm[n].peers = peers;
+            kcf->warm[n].peer = peer;
+        }
+
+        kcf->nwarm = n;
+
+        ngx_queue_init(&kcf->connects);
+
+        ev = &kcf->prewarm_event;
+
+        ev->handler = ngx_http_upstream_keepalive_prewarm;
+        ev->data = kcf;
+        ev->log = cycle->log;
+        ev->cancelable = 1;
+
+        ngx_add_timer(ev, 1);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_keepalive_exit_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                                i;
+    ngx_queue_t                              *q;
+    ngx_http_upstream_srv_conf_t            **uscfp;
+    ngx_http_upstream_main_conf_t            *umcf;
+    ngx_http_upstream_keepalive_connect_t    *kc;
+    ngx_http_upstream_keepalive_srv_conf_t   *kcf;
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+    if (umcf == NULL) {
+        return;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        kcf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                          ngx_http_upstream_keepalive_module);
+
+        if (kcf->warm == NULL) {
+            continue;
+        }
+
+        /* connections still connecting or in SSL handshake */
+
+        while (!ngx_queue_empty(&kcf->connects)) {
+            q = ngx_queue_head(&kcf->connects);
+            kc = ngx_queue_data(q, ngx_http_upstream_keepalive_connect_t,
+                                queue);
+
+            ngx_queue_remove(q);
+
+            ngx_http_upstream_keepalive_close(kc->connection);
+        }
+    }
+}
+
+
+ngx_int_t
+ngx_http_upstream_keepalive_stats(ngx_cycle_t *cycle, ngx_uint_t n,
+    ngx_http_upstream_keepalive_stats_t *stats)
+{
+    ngx_uint_t                                i;
+    ngx_http_upstream_srv_conf_t            **uscfp;
+    ngx_http_upstream_main_conf_t            *umcf;
+    ngx_http_upstream_keepalive_counters_t   *counters;
+    ngx_http_upstream_keepalive_srv_conf_t   *kcf;
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+    if (umcf == NULL) {
+        return NGX_DECLINED;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        kcf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                          ngx_http_upstream_keepalive_module);
+
+        if (kcf->max_cached == 0) {
+            continue;
+        }
+
+        if (n) {
+            n--;
+            continue;
+        }
+
+        counters = kcf->counters;
+
+        stats->name = uscfp[i]->host;
+        stats->idle = counters->idle;
+        stats->hits = counters->hits;
+        stats->misses = counters->misses;
+        stats->evicted = counters->evicted;
+        stats->prewarmed = counters->prewarmed;
+
+        return NGX_OK;
+    }
+
+    return NGX_DECLINED;
+}
@@ -0,0 +1,3987 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+/*
+ * Requests to an upstream with "multiplex" share HTTP/2 connections
+ * opened by each worker.  A request gets a virtual connection: frames
+ * written to it by a protocol module are checked against the flow control
+ * windows and queued to the shared connection with a stream identifier
+ * of its own, and frames received for the stream are passed back with
+ * the identifier the module used.  The connection preface, SETTINGS,
+ * PING and connection WINDOW_UPDATE frames are handled here, so
+ * the module works as if it had a connection of its own.
+ *
+ * A module writing HTTP/1.1 instead, as the proxy module with
+ * "proxy_http_version 2", sets u->http2.  The request head is converted
+ * to a HEADERS frame, and the body, as sent with Content-Length or chunked,
+ * to DATA frames.  The response header block is converted back to a status
+ * line and header lines, and the body is passed chunked if the server sent
+ * no Content-Length.
+ */
+
+
+#define NGX_HTTP_UPSTREAM_MULTIPLEX_BUFFER_SIZE                              \
+    (NGX_HTTP_V2_FRAME_HEADER_SIZE + NGX_HTTP_V2_DEFAULT_FRAME_SIZE)
+
+/* output queued on a connection before streams are blocked */
+#define NGX_HTTP_UPSTREAM_MULTIPLEX_BUSY_SIZE                                \
+    (4 * NGX_HTTP_UPSTREAM_MULTIPLEX_BUFFER_SIZE)
+
+#define NGX_HTTP_UPSTREAM_MULTIPLEX_MAX_STREAM_ID  0x7fffffff
+
+/* streams given to a connection until the server's limit is known */
+#define NGX_HTTP_UPSTREAM_MULTIPLEX_DEFAULT_STREAMS  100
+
+#define NGX_HTTP_UPSTREAM_MULTIPLEX_HEADER_TABLE_SIZE_SETTING  0x1
+#define NGX_HTTP_UPSTREAM_MULTIPLEX_ENABLE_PUSH_SETTING        0x2
+#define NGX_HTTP_UPSTREAM_MULTIPLEX_MAX_STREAMS_SETTING        0x3
+#define NGX_HTTP_UPSTREAM_MULTIPLEX_INIT_WINDOW_SETTING        0x4
+
+#define NGX_HTTP_UPSTREAM_MULTIPLEX_SETTINGS_PARAM_SIZE  6
+
+#define NGX_HTTP_UPSTREAM_MULTIPLEX_REFUSED_STREAM  0x7
+#define NGX_HTTP_UPSTREAM_MULTIPLEX_CANCEL          0x8
+
+
+typedef struct ngx_http_upstream_multiplex_conn_s
+    ngx_http_upstream_multiplex_conn_t;
+typedef struct ngx_http_upstream_multiplex_stream_s
+    ngx_http_upstream_multiplex_stream_t;
+
+
+typedef struct {
+    ngx_uint_t                         max_streams;
+    ngx_uint_t                         requests;
+    size_t                             window;
+    ngx_msec_t                         timeout;
+
+    /* per worker */
+    ngx_queue_t                        connections;
+
+    ngx_http_upstream_init_pt          original_init_upstream;
+    ngx_http_upstream_init_peer_pt     original_init_peer;
+
+} ngx_http_upstream_multiplex_srv_conf_t;
+
+
+struct ngx_http_upstream_multiplex_conn_s {
+    ngx_http_upstream_multiplex_srv_conf_t  *conf;
+
+    ngx_queue_t                        queue;
+    ngx_connection_t                  *connection;
+
+    ngx_queue_t                        streams;
+    ngx_uint_t                         nstreams;
+    ngx_uint_t                         max_streams;
+
+    /* streams started and not closed, as counted by the server */
+    ngx_uint_t                         active;
+    ngx_uint_t                         requests;
+    ngx_uint_t                         next_stream_id;
+    ngx_uint_t                         last_stream_id;
+
+    socklen_t                          socklen;
+    ngx_sockaddr_t                     sockaddr;
+    ngx_str_t                          name;
+
+#if (NGX_HTTP_SSL)
+    ngx_ssl_t                         *ssl;
+    ngx_str_t                          ssl_name;
+#endif
+
+    ngx_chain_t                       *out;
+    ngx_chain_t                      **last;
+    ngx_chain_t                       *free;
+    size_t                             busy;
+
+    ngx_buf_t                         *buffer;
+
+    /* the frame being received */
+    u_char                             header[NGX_HTTP_V2_FRAME_HEADER_SIZE];
+    size_t                             header_len;
+    size_t                             rest;
+    ngx_uint_t                         type;
+    ngx_uint_t                         flags;
+    ngx_uint_t                         stream_id;
+    size_t                             length;
+    ngx_http_upstream_multiplex_stream_t  *stream;
+    u_char                             payload[8];
+    size_t                             payload_len;
+
+    ssize_t                            send_window;
+    size_t                             recv_window;
+    size_t                             init_window;
+
+    unsigned                           connected:1;
+    unsigned                           settings:1;
+    unsigned                           tcp_nodelay:1;
+    unsigned                           ssl_verify:1;
+    unsigned                           draining:1;
+    unsigned                           error:1;
+};
+
+
+struct ngx_http_upstream_multiplex_stream_s {
+    ngx_http_upstream_multiplex_conn_t  *mc;
+    ngx_queue_t                        queue;
+
+    ngx_connection_t                   connection;
+    ngx_event_t                        read;
+    ngx_event_t                        write;
+
+    ngx_uint_t                         id;
+    ngx_uint_t                         local_id;
+
+    ssize_t                            send_window;
+    size_t                             recv_window;
+
+    /* sent on the connection window, not yet returned to the module */
+    size_t                             consumed;
+
+    /* frames received, with the identifier used by the module */
+    size_t                             buffered;
+    ngx_chain_t                       *in;
+    ngx_chain_t                       *in_last;
+    ngx_chain_t                       *in_free;
+
+    /* complete frames written by the module, not yet queued */
+    ngx_chain_t                       *out;
+    ngx_chain_t                      **last;
+
+    /* the frame being written */
+    ngx_chain_t                       *frame;
+    u_char                             header[NGX_HTTP_V2_FRAME_HEADER_SIZE];
+    size_t                             header_len;
+    size_t                             rest;
+    size_t                             preface;
+
+    /* HTTP/1.1 written and read by the module */
+    ngx_http_request_t                *request;
+    ngx_buf_t                         *head;
+    ngx_buf_t                         *block;
+    off_t                              length;
+    ngx_http_chunked_t                 chunked;
+    size_t                             padding;
+
+    unsigned                           headers:1;
+    unsigned                           received:1;
+    unsigned                           active:1;
+    unsigned                           local_closed:1;
+    unsigned                           remote_closed:1;
+    unsigned                           blocked:1;
+    unsigned                           error:1;
+
+    unsigned                           http1:1;
+    unsigned                           request_head:1;
+    unsigned                           request_done:1;
+    unsigned                           head_request:1;
+    unsigned                           response:1;
+    unsigned                           response_chunked:1;
+    unsigned                           end_stream:1;
+};
+
+
+typedef struct {
+    ngx_http_upstream_multiplex_srv_conf_t  *conf;
+
+    ngx_http_request_t                *request;
+    ngx_http_upstream_multiplex_stream_t  *stream;
+
+    void                              *data;
+
+    ngx_event_get_peer_pt              original_get_peer;
+    ngx_event_free_peer_pt             original_free_peer;
+
+#if (NGX_HTTP_SSL)
+    ngx_event_set_peer_session_pt      original_set_session;
+    ngx_event_save_peer_session_pt     original_save_session;
+
+    ngx_str_t                          ssl_name;
+#endif
+
+} ngx_http_upstream_multiplex_peer_data_t;
+
+
+#define ngx_http_upstream_multiplex_get_stream(c)                            \
+    ((ngx_http_upstream_multiplex_stream_t *)                                \
+        ((u_char *) (c)                                                      \
+         - offsetof(ngx_http_upstream_multiplex_stream_t, connection)))
+
+
+static ngx_int_t ngx_http_upstream_init_multiplex_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_get_multiplex_peer(
+    ngx_peer_connection_t *pc, void *data);
+static void ngx_http_upstream_free_multiplex_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+
+static ngx_int_t ngx_http_upstream_multiplex_connect(
+    ngx_http_upstream_multiplex_peer_data_t *mp, ngx_peer_connection_t *pc,
+    ngx_http_upstream_multiplex_conn_t **mcp);
+static void ngx_http_upstream_multiplex_connect_handler(
+    ngx_http_upstream_multiplex_conn_t *mc);
+#if (NGX_HTTP_SSL)
+static ngx_int_t ngx_http_upstream_multiplex_ssl_name(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_str_t *name);
+static ngx_int_t ngx_http_upstream_multiplex_ssl_init(
+    ngx_http_upstream_multiplex_conn_t *mc, ngx_http_upstream_t *u,
+    ngx_str_t *name);
+static void ngx_http_upstream_multiplex_ssl_handshake_handler(
+    ngx_connection_t *c);
+#endif
+static void ngx_http_upstream_multiplex_connected(
+    ngx_http_upstream_multiplex_conn_t *mc);
+static void ngx_http_upstream_multiplex_read_handler(ngx_event_t *rev);
+static void ngx_http_upstream_multiplex_write_handler(ngx_event_t *wev);
+static void ngx_http_upstream_multiplex_dummy_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_upstream_multiplex_flush(
+    ngx_http_upstream_multiplex_conn_t *mc);
+static ngx_int_t ngx_http_upstream_multiplex_process(
+    ngx_http_upstream_multiplex_conn_t *mc, u_char *p, u_char *last);
+static ngx_int_t ngx_http_upstream_multiplex_frame_start(
+    ngx_http_upstream_multiplex_conn_t *mc);
+static ngx_int_t ngx_http_upstream_multiplex_frame_end(
+    ngx_http_upstream_multiplex_conn_t *mc);
+static ngx_int_t ngx_http_upstream_multiplex_setting(
+    ngx_http_upstream_multiplex_conn_t *mc);
+static void ngx_http_upstream_multiplex_goaway(
+    ngx_http_upstream_multiplex_conn_t *mc, ngx_uint_t last_id,
+    ngx_uint_t error);
+static ngx_int_t ngx_http_upstream_multiplex_queue_frame(
+    ngx_http_upstream_multiplex_conn_t *mc, ngx_uint_t type, ngx_uint_t flags,
+    ngx_uint_t sid, u_char *payload, size_t len);
+static ngx_chain_t *ngx_http_upstream_multiplex_get_buf(
+    ngx_http_upstream_multiplex_conn_t *mc);
+static void ngx_http_upstream_multiplex_post_flush(
+    ngx_http_upstream_multiplex_conn_t *mc);
+static void ngx_http_upstream_multiplex_wake(
+    ngx_http_upstream_multiplex_conn_t *mc);
+static void ngx_http_upstream_multiplex_fail(
+    ngx_http_upstream_multiplex_conn_t *mc);
+static void ngx_http_upstream_multiplex_drain(
+    ngx_http_upstream_multiplex_conn_t *mc);
+static void ngx_http_upstream_multiplex_close(
+    ngx_http_upstream_multiplex_conn_t *mc);
+
+static ngx_http_upstream_multiplex_stream_t *
+    ngx_http_upstream_multiplex_create_stream(
+    ngx_http_upstream_multiplex_conn_t *mc, ngx_peer_connection_t *pc,
+    ngx_http_request_t *r);
+static void ngx_http_upstream_multiplex_close_stream(
+    ngx_http_upstream_multiplex_stream_t *s);
+static void ngx_http_upstream_multiplex_stream_closed(
+    ngx_http_upstream_multiplex_stream_t *s);
+static void ngx_http_upstream_multiplex_stream_error(
+    ngx_http_upstream_multiplex_stream_t *s);
+static ngx_int_t ngx_http_upstream_multiplex_deliver(
+    ngx_http_upstream_multiplex_stream_t *s, u_char *p, size_t len);
+static ngx_int_t ngx_http_upstream_multiplex_deliver_frame(
+    ngx_http_upstream_multiplex_stream_t *s, ngx_uint_t type,
+    ngx_uint_t flags, ngx_uint_t sid, u_char *payload, size_t len);
+static ngx_int_t ngx_http_upstream_multiplex_update_window(
+    ngx_http_upstream_multiplex_stream_t *s);
+static ssize_t ngx_http_upstream_multiplex_parse_output(
+    ngx_http_upstream_multiplex_stream_t *s, u_char *p, u_char *last);
+static ngx_int_t ngx_http_upstream_multiplex_queue_output(
+    ngx_http_upstream_multiplex_stream_t *s);
+
+static ssize_t ngx_http_upstream_multiplex_recv(ngx_connection_t *c,
+    u_char *buf, size_t size);
+static ssize_t ngx_http_upstream_multiplex_recv_chain(ngx_connection_t *c,
+    ngx_chain_t *cl, off_t limit);
+static ssize_t ngx_http_upstream_multiplex_send(ngx_connection_t *c,
+    u_char *buf, size_t size);
+static ngx_chain_t *ngx_http_upstream_multiplex_send_chain(
+    ngx_connection_t *c, ngx_chain_t *in, off_t limit);
+
+static ssize_t ngx_http_upstream_multiplex_http1_output(
+    ngx_http_upstream_multiplex_stream_t *s, u_char *p, u_char *last);
+static ngx_int_t ngx_http_upstream_multiplex_http1_request(
+    ngx_http_upstream_multiplex_stream_t *s);
+static ngx_int_t ngx_http_upstream_multiplex_http1_line(u_char **pos,
+    u_char *last, ngx_str_t *name, ngx_str_t *value);
+static ssize_t ngx_http_upstream_multiplex_http1_body(
+    ngx_http_upstream_multiplex_stream_t *s, u_char *p, u_char *last);
+static ngx_int_t ngx_http_upstream_multiplex_http1_frame(
+    ngx_http_upstream_multiplex_stream_t *s, ngx_uint_t type,
+    ngx_uint_t flags, u_char *payload, size_t len);
+static ngx_int_t ngx_http_upstream_multiplex_http1_input(
+    ngx_http_upstream_multiplex_stream_t *s, u_char *p, size_t len);
+static ngx_int_t ngx_http_upstream_multiplex_http1_frame_end(
+    ngx_http_upstream_multiplex_stream_t *s);
+static ngx_int_t ngx_http_upstream_multiplex_http1_response(
+    ngx_http_upstream_multiplex_stream_t *s);
+static ngx_int_t ngx_http_upstream_multiplex_http1_header(
+    ngx_http_upstream_multiplex_stream_t *s, ngx_str_t *name,
+    ngx_str_t *value);
+static ngx_uint_t ngx_http_upstream_multiplex_hop_header(ngx_str_t *name);
+static u_char *ngx_http_upstream_multiplex_parse_int(u_char *p, u_char *end,
+    ngx_uint_t prefix, ngx_uint_t *value);
+static u_char *ngx_http_upstream_multiplex_parse_string(u_char *p,
+    u_char *end, ngx_str_t *str, u_char **tmp, ngx_log_t *log);
+
+static u_char *ngx_http_upstream_multiplex_write_header(u_char *p, size_t len,
+    ngx_uint_t type, ngx_uint_t flags, ngx_uint_t sid);
+static u_char *ngx_http_upstream_multiplex_write_setting(u_char *p,
+    ngx_uint_t id, ngx_uint_t value);
+
+#if (NGX_HTTP_SSL)
+static ngx_int_t ngx_http_upstream_multiplex_set_session(
+    ngx_peer_connection_t *pc, void *data);
+static void ngx_http_upstream_multiplex_save_session(
+    ngx_peer_connection_t *pc, void *data);
+#endif
+
+static void *ngx_http_upstream_multiplex_create_conf(ngx_conf_t *cf);
+static char *ngx_http_upstream_multiplex(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_upstream_multiplex_window(ngx_conf_t *cf, void *post,
+    void *data);
+
+
+static ngx_conf_post_handler_pt  ngx_http_upstream_multiplex_window_post =
+    ngx_http_upstream_multiplex_window;
+
+
+static ngx_command_t  ngx_http_upstream_multiplex_commands[] = {
+
+    { ngx_string("multiplex"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_http_upstream_multiplex,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("multiplex_requests"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_upstream_multiplex_srv_conf_t, requests),
+      NULL },
+
+    { ngx_string("multiplex_window"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_upstream_multiplex_srv_conf_t, window),
+      &ngx_http_upstream_multiplex_window_post },
+
+    { ngx_string("multiplex_timeout"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_upstream_multiplex_srv_conf_t, timeout),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_upstream_multiplex_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_upstream_multiplex_create_conf, /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_upstream_multiplex_module = {
+    NGX_MODULE_V1,
+    &ngx_http_upstream_multiplex_module_ctx, /* module context */
+    ngx_http_upstream_multiplex_commands,    /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static u_char  ngx_http_upstream_multiplex_preface[] =
+    "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+
+/* connection-specific headers, not allowed in HTTP/2 */
+
+static ngx_str_t  ngx_http_upstream_multiplex_hop_headers[] = {
+    ngx_string("connection"),
+    ngx_string("keep-alive"),
+    ngx_string("proxy-connection"),
+    ngx_string("transfer-encoding"),
+    ngx_string("upgrade"),
+    ngx_null_string
+};
+
+
+static ngx_int_t
+ngx_http_upstream_init_multiplex(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_upstream_multiplex_srv_conf_t  *mcf;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cf->log, 0,
+                   "init multiplex");
+
+    mcf = ngx_http_conf_upstream_srv_conf(us,
+                                          ngx_http_upstream_multiplex_module);
+
+    if (us->peer.init_upstream != ngx_http_upstream_init_multiplex) {
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "\"keepalive\" cannot be used after \"multiplex\" "
+                      "in upstream \"%V\"", &us->host);
+        return NGX_ERROR;
+    }
+
+    ngx_conf_init_uint_value(mcf->requests, 1000);
+    ngx_conf_init_size_value(mcf->window, 256 * 1024);
+    ngx_conf_init_msec_value(mcf->timeout, 60000);
+
+    if (mcf->original_init_upstream(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    mcf->original_init_peer = us->peer.init;
+
+    us->peer.init = ngx_http_upstream_init_multiplex_peer;
+
+    ngx_queue_init(&mcf->connections);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_init_multiplex_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_upstream_multiplex_peer_data_t  *mp;
+    ngx_http_upstream_multiplex_srv_conf_t   *mcf;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "init multiplex peer");
+
+    mcf = ngx_http_conf_upstream_srv_conf(us,
+                                          ngx_http_upstream_multiplex_module);
+
+    mp = ngx_palloc(r->pool, sizeof(ngx_http_upstream_multiplex_peer_data_t));
+    if (mp == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (mcf->original_init_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    mp->conf = mcf;
+    mp->request = r;
+    mp->stream = NULL;
+    mp->data = r->upstream->peer.data;
+    mp->original_get_peer = r->upstream->peer.get;
+    mp->original_free_peer = r->upstream->peer.free;
+
+    r->upstream->peer.data = mp;
+    r->upstream->peer.get = ngx_http_upstream_get_multiplex_peer;
+    r->upstream->peer.free = ngx_http_upstream_free_multiplex_peer;
+
+#if (NGX_HTTP_SSL)
+    mp->original_set_session = r->upstream->peer.set_session;
+    mp->original_save_session = r->upstream->peer.save_session;
+    r->upstream->peer.set_session = ngx_http_upstream_multiplex_set_session;
+    r->upstream->peer.save_session = ngx_http_upstream_multiplex_save_session;
+#endif
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_get_multiplex_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_multiplex_peer_data_t  *mp = data;
+
+    ngx_int_t                              rc;
+    ngx_queue_t                           *q;
+    ngx_http_upstream_multiplex_conn_t    *mc;
+    ngx_http_upstream_multiplex_stream_t  *s;
+#if (NGX_HTTP_SSL)
+    ngx_http_upstream_t                   *u;
+#endif
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get multiplex peer");
+
+    /* ask balancer */
+
+    rc = mp->original_get_peer(pc, mp->data);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+#if (NGX_HTTP_SSL)
+
+    u = mp->request->upstream;
+
+    ngx_str_null(&mp->ssl_name);
+
+    if (u->ssl
+        && ngx_http_upstream_multiplex_ssl_name(mp->request, u, &mp->ssl_name)
+           != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+#endif
+
+    /* search for a connection with a free stream */
+
+    for (q = ngx_queue_head(&mp->conf->connections);
+         q != ngx_queue_sentinel(&mp->conf->connections);
+         q = ngx_queue_next(q))
+    {
+        mc = ngx_queue_data(q, ngx_http_upstream_multiplex_conn_t, queue);
+
+        if (mc->nstreams >= mc->max_streams) {
+            continue;
+        }
+
+        if (ngx_memn2cmp((u_char *) &mc->sockaddr, (u_char *) pc->sockaddr,
+                         mc->socklen, pc->socklen)
+            != 0)
+        {
+            continue;
+        }
+
+#if (NGX_HTTP_SSL)
+
+        if (mc->ssl != (u->ssl ? u->conf->ssl : NULL)) {
+            continue;
+        }
+
+        if (mc->ssl
+            && ngx_memn2cmp(mc->ssl_name.data, mp->ssl_name.data,
+                            mc->ssl_name.len, mp->ssl_name.len)
+               != 0)
+        {
+            continue;
+        }
+
+#endif
+
+        goto found;
+    }
+
+    rc = ngx_http_upstream_multiplex_connect(mp, pc, &mc);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+found:
+
+    s = ngx_http_upstream_multiplex_create_stream(mc, pc, mp->request);
+    if (s == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get multiplex peer: using connection %p, streams: %ui",
+                   mc->connection, mc->nstreams);
+
+    /*
+     * a connection is no longer used for new requests after the number
+     * of requests servers usually limit it to, like "http2_max_requests"
+     */
+
+    if (++mc->requests >= mp->conf->requests) {
+        ngx_http_upstream_multiplex_drain(mc);
+    }
+
+    mp->stream = s;
+
+    pc->connection = &s->connection;
+    pc->cached = 0;
+
+    return NGX_DONE;
+}
+
+
+static void
+ngx_http_upstream_free_multiplex_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_http_upstream_multiplex_peer_data_t  *mp = data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "free multiplex peer");
+
+    if (mp->stream) {
+        ngx_http_upstream_multiplex_close_stream(mp->stream);
+
+        mp->stream = NULL;
+        pc->connection = NULL;
+    }
+
+    mp->original_free_peer(pc, mp->data, state);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_multiplex_connect(ngx_http_upstream_multiplex_peer_data_t *mp,
+    ngx_peer_connection_t *pc, ngx_http_upstream_multiplex_conn_t **mcp)
+{
+    u_char                              *p;
+    ngx_int_t                            rc;
+    ngx_pool_t                          *pool;
+    ngx_chain_t                         *cl;
+    ngx_connection_t                    *c;
+    ngx_http_upstream_t                 *u;
+    ngx_peer_connection_t                peer;
+    ngx_http_core_loc_conf_t            *clcf;
+    ngx_http_upstream_multiplex_conn_t  *mc;
+
+    u = mp->request->upstream;
+
+    pool = ngx_create_pool(1024, ngx_cycle->log);
+    if (pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    mc = ngx_pcalloc(pool, sizeof(ngx_http_upstream_multiplex_conn_t));
+    if (mc == NULL) {
+        goto failed;
+    }
+
+    mc->buffer = ngx_create_temp_buf(pool,
+                                     NGX_HTTP_UPSTREAM_MULTIPLEX_BUFFER_SIZE);
+    if (mc->buffer == NULL) {
+        goto failed;
+    }
+
+    mc->name.data = ngx_pstrdup(pool, pc->name);
+    if (mc->name.data == NULL) {
+        goto failed;
+    }
+
+    mc->name.len = pc->name->len;
+
+    ngx_memcpy(&mc->sockaddr, pc->sockaddr, pc->socklen);
+    mc->socklen = pc->socklen;
+
+    ngx_memzero(&peer, sizeof(ngx_peer_connection_t));
+
+    peer.sockaddr = &mc->sockaddr.sockaddr;
+    peer.socklen = mc->socklen;
+    peer.name = &mc->name;
+    peer.get = ngx_event_get_peer;
+    peer.local = pc->local;
+    peer.rcvbuf = pc->rcvbuf;
+    peer.log = ngx_cycle->log;
+    peer.log_error = NGX_ERROR_ERR;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "multiplex connect to %V", &mc->name);
+
+    rc = ngx_event_connect_peer(&peer);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        ngx_destroy_pool(pool);
+        return (rc == NGX_ERROR) ? NGX_ERROR : NGX_DECLINED;
+    }
+
+    c = peer.connection;
+
+    c->pool = pool;
+    c->data = mc;
+    c->read->handler = ngx_http_upstream_multiplex_read_handler;
+    c->write->handler = ngx_http_upstream_multiplex_write_handler;
+
+    mc->conf = mp->conf;
+    mc->connection = c;
+
+    ngx_queue_init(&mc->streams);
+
+    mc->last = &mc->out;
+    mc->next_stream_id = 1;
+    mc->last_stream_id = NGX_HTTP_UPSTREAM_MULTIPLEX_MAX_STREAM_ID;
+
+    mc->max_streams = ngx_min(mp->conf->max_streams,
+                              NGX_HTTP_UPSTREAM_MULTIPLEX_DEFAULT_STREAMS);
+
+    mc->send_window = NGX_HTTP_V2_DEFAULT_WINDOW;
+    mc->recv_window = NGX_HTTP_V2_MAX_WINDOW;
+    mc->init_window = NGX_HTTP_V2_DEFAULT_WINDOW;
+
+    clcf = ngx_http_get_module_loc_conf(mp->request, ngx_http_core_module);
+    mc->tcp_nodelay = clcf->tcp_nodelay;
+
+#if (NGX_HTTP_SSL)
+
+    if (u->ssl
+        && ngx_http_upstream_multiplex_ssl_init(mc, u, &mp->ssl_name)
+           != NGX_OK)
+    {
+        goto close;
+    }
+
+#endif
+
+    cl = ngx_http_upstream_multiplex_get_buf(mc);
+    if (cl == NULL) {
+        goto close;
+    }
+
+    /*
+     * the stream windows are limited to bound the data buffered
+     * for slow clients, the connection window is not
+     */
+
+    p = ngx_cpymem(cl->buf->last, ngx_http_upstream_multiplex_preface,
+                   sizeof(ngx_http_upstream_multiplex_preface) - 1);
+
+    p = ngx_http_upstream_multiplex_write_header(p,
+                            3 * NGX_HTTP_UPSTREAM_MULTIPLEX_SETTINGS_PARAM_SIZE,
+                            NGX_HTTP_V2_SETTINGS_FRAME, 0, 0);
+
+    p = ngx_http_upstream_multiplex_write_setting(p,
+                      NGX_HTTP_UPSTREAM_MULTIPLEX_HEADER_TABLE_SIZE_SETTING, 0);
+    p = ngx_http_upstream_multiplex_write_setting(p,
+                      NGX_HTTP_UPSTREAM_MULTIPLEX_ENABLE_PUSH_SETTING, 0);
+    p = ngx_http_upstream_multiplex_write_setting(p,
+                      NGX_HTTP_UPSTREAM_MULTIPLEX_INIT_WINDOW_SETTING,
+                      mc->conf->window);
+
+    p = ngx_http_upstream_multiplex_write_header(p, 4,
+                            NGX_HTTP_V2_WINDOW_UPDATE_FRAME, 0, 0);
+    p = ngx_http_v2_write_uint32(p, NGX_HTTP_V2_MAX_WINDOW
+                                    - NGX_HTTP_V2_DEFAULT_WINDOW);
+
+    cl->buf->last = p;
+
+    *mc->last = cl;
+    mc->last = &cl->next;
+
+    ngx_queue_insert_head(&mc->conf->connections, &mc->queue);
+
+    ngx_add_timer(c->write, u->conf->connect_timeout);
+
+    if (rc == NGX_OK) {
+        ngx_post_event(c->write, &ngx_posted_events);
+    }
+
+    *mcp = mc;
+
+    return NGX_OK;
+
+close:
+
+#if (NGX_HTTP_SSL)
+
+    if (c->ssl) {
+        c->ssl->no_wait_shutdown = 1;
+        c->ssl->no_send_shutdown = 1;
+
+        (void) ngx_ssl_shutdown(c);
+    }
+
+#endif
+
+    ngx_close_connection(c);
+
+failed:
+
+    ngx_destroy_pool(pool);
+
+    return NGX_ERROR;
+}
+
+
+static void
+ngx_http_upstream_multiplex_connect_handler(
+    ngx_http_upstream_multiplex_conn_t *mc)
+{
+    int                err;
+    socklen_t          len;
+    ngx_connection_t  *c;
+
+    c = mc->connection;
+
+    if (c->write->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "upstream %V timed out while connecting", &mc->name);
+        ngx_http_upstream_multiplex_fail(mc);
+        return;
+    }
+
+#if (NGX_HAVE_KQUEUE)
+
+    if (ngx_event_flags & NGX_USE_KQUEUE_EVENT) {
+        err = c->write->pending_eof ? c->write->kq_errno : 0;
+
+    } else
+#endif
+    {
+        err = 0;
+        len = sizeof(int);
+
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len)
+            == -1)
+        {
+            err = ngx_socket_errno;
+        }
+    }
+
+    if (err) {
+        ngx_log_error(NGX_LOG_ERR, c->log, err,
+                      "connect() to upstream %V failed", &mc->name);
+        ngx_http_upstream_multiplex_fail(mc);
+        return;
+    }
+
+#if (NGX_HTTP_SSL)
+
+    if (c->ssl) {
+        if (ngx_ssl_handshake(c) == NGX_AGAIN) {
+            c->ssl->handler = ngx_http_upstream_multiplex_ssl_handshake_handler;
+            return;
+        }
+
+        ngx_http_upstream_multiplex_ssl_handshake_handler(c);
+        return;
+    }
+
+#endif
+
+    ngx_http_upstream_multiplex_connected(mc);
+}
+
+
+#if (NGX_HTTP_SSL)
+
+static ngx_int_t
+ngx_http_upstream_multiplex_ssl_name(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_str_t *name)
+{
+    u_char  *p, *last;
+
+    if (u->conf->ssl_name) {
+        if (ngx_http_complex_value(r, u->conf->ssl_name, name) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+    } else {
+        *name = u->ssl_name;
+    }
+
+    if (name->len == 0) {
+        return NGX_OK;
+    }
+
+    /* strip port, as ngx_http_upstream_ssl_name() does */
+
+    p = name->data;
+    last = name->data + name->len;
+
+    if (*p == '[') {
+        p = ngx_strlchr(p, last, ']');
+
+        if (p == NULL) {
+            p = name->data;
+        }
+    }
+
+    p = ngx_strlchr(p, last, ':');
+
+    if (p != NULL) {
+        name->len = p - name->data;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_multiplex_ssl_init(ngx_http_upstream_multiplex_conn_t *mc,
+    ngx_http_upstream_t *u, ngx_str_t *name)
+{
+    u_char            *p;
+    ngx_connection_t  *c;
+
+    c = mc->connection;
+
+    if (ngx_ssl_create_connection(u->conf->ssl, c,
+                                  NGX_SSL_BUFFER|NGX_SSL_CLIENT)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    c->sendfile = 0;
+
+    mc->ssl = u->conf->ssl;
+    mc->ssl_verify = u->conf->ssl_verify;
+
+    /* null-terminated for SSL_set_tlsext_host_name() */
+
+    p = ngx_pnalloc(c->pool, name->len + 1);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    (void) ngx_cpystrn(p, name->data, name->len + 1);
+
+    mc->ssl_name.len = name->len;
+    mc->ssl_name.data = p;
+
+#ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
+
+    /* as per RFC 6066, literal IPv4 and IPv6 addresses are not permitted */
+
+    if (u->conf->ssl_server_name
+        && name->len
+        && *name->data != '['
+        && ngx_inet_addr(name->data, name->len) == INADDR_NONE)
+    {
+        if (SSL_set_tlsext_host_name(c->ssl->connection, (char *) p) == 0) {
+            ngx_ssl_error(NGX_LOG_ERR, c->log, 0,
+                          "SSL_set_tlsext_host_name(\"%s\") failed", p);
+            return NGX_ERROR;
+        }
+    }
+
+#endif
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_multiplex_ssl_handshake_handler(ngx_connection_t *c)
+{
+    long                                 rc;
+    ngx_http_upstream_multiplex_conn_t  *mc;
+
+    mc = c->data;
+
+    if (!c->ssl->handshaked) {
+        ngx_http_upstream_multiplex_fail(mc);
+        return;
+    }
+
+    if (mc->ssl_verify) {
+        rc = SSL_get_verify_result(c->ssl->connection);
+
+        if (rc != X509_V_OK) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "upstream SSL certificate verify error: (%l:%s)",
+                          rc, X509_verify_cert_error_string(rc));
+            ngx_http_upstream_multiplex_fail(mc);
+            return;
+        }
+
+        if (ngx_ssl_check_host(c, &mc->ssl_name) != NGX_OK) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "upstream SSL certificate does not match \"%V\"",
+                          &mc->ssl_name);
+            ngx_http_upstream_multiplex_fail(mc);
+            return;
+        }
+    }
+
+    c->read->handler = ngx_http_upstream_multiplex_read_handler;
+    c->write->handler = ngx_http_upstream_multiplex_write_handler;
+
+    ngx_http_upstream_multiplex_connected(mc);
+}
+
+#endif
+
+
+static void
+ngx_http_upstream_multiplex_connected(ngx_http_upstream_multiplex_conn_t *mc)
+{
+    ngx_connection_t  *c;
+
+    c = mc->connection;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "multiplex connected to %V", &mc->name);
+
+    mc->connected = 1;
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    if (mc->tcp_nodelay && ngx_tcp_nodelay(c) != NGX_OK) {
+        ngx_http_upstream_multiplex_fail(mc);
+        return;
+    }
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_http_upstream_multiplex_fail(mc);
+        return;
+    }
+
+    /* the handshake may have left data in the SSL buffer */
+
+    ngx_post_event(c->read, &ngx_posted_events);
+
+    if (ngx_http_upstream_multiplex_flush(mc) != NGX_OK) {
+        ngx_http_upstream_multiplex_fail(mc);
+    }
+}
+
+
+static void
+ngx_http_upstream_multiplex_read_handler(ngx_event_t *rev)
+{
+    ssize_t                              n;
+    ngx_buf_t                           *b;
+    ngx_connection_t                    *c;
+    ngx_http_upstream_multiplex_conn_t  *mc;
+
+    c = rev->data;
+    mc = c->data;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "multiplex read handler, streams: %ui", mc->nstreams);
+
+    if (c->close || rev->timedout) {
+        if (mc->nstreams == 0) {
+            ngx_http_upstream_multiplex_close(mc);
+            return;
+        }
+
+        c->close = 0;
+        rev->timedout = 0;
+    }
+
+    if (!mc->connected) {
+        return;
+    }
+
+    b = mc->buffer;
+
+    do {
+        n = c->recv(c, b->start, b->end - b->start);
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == 0 || n == NGX_ERROR) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                           "multiplex connection to %V closed", &mc->name);
+
+            ngx_http_upstream_multiplex_fail(mc);
+            return;
+        }
+
+        if (ngx_http_upstream_multiplex_process(mc, b->start, b->start + n)
+            != NGX_OK)
+        {
+            ngx_http_upstream_multiplex_fail(mc);
+            return;
+        }
+
+    } while (rev->ready);
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_http_upstream_multiplex_fail(mc);
+        return;
+    }
+
+    if (mc->draining && mc->nstreams == 0) {
+        ngx_http_upstream_multiplex_close(mc);
+        return;
+    }
+
+    if (ngx_http_upstream_multiplex_flush(mc) != NGX_OK) {
+        ngx_http_upstream_multiplex_fail(mc);
+    }
+}
+
+
+static void
+ngx_http_upstream_multiplex_write_handler(ngx_event_t *wev)
+{
+    ngx_connection_t                    *c;
+    ngx_http_upstream_multiplex_conn_t  *mc;
+
+    c = wev->data;
+    mc = c->data;
+
+    if (!mc->connected) {
+        ngx_http_upstream_multiplex_connect_handler(mc);
+        return;
+    }
+
+    if (ngx_http_upstream_multiplex_flush(mc) != NGX_OK) {
+        ngx_http_upstream_multiplex_fail(mc);
+    }
+}
+
+
+static void
+ngx_http_upstream_multiplex_dummy_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "multiplex dummy handler");
+}
+
+
+static ngx_int_t
+ngx_http_upstream_multiplex_flush(ngx_http_upstream_multiplex_conn_t *mc)
+{
+    size_t             busy;
+    ngx_chain_t       *cl, *ln;
+    ngx_connection_t  *c;
+
+    c = mc->connection;
+
+    if (!mc->connected || mc->error) {
+        return NGX_OK;
+    }
+
+    if (mc->out == NULL && !c->buffered) {
+        return NGX_OK;
+    }
+
+    /* the SSL buffer is sent once all the frames are copied */
+
+    for (cl = mc->out; cl && cl->next; cl = cl->next) { /* void */ }
+
+    if (cl) {
+        cl->buf->flush = 1;
+    }
+
+    cl = c->send_chain(c, mc->out, 0);
+
+    if (cl == NGX_CHAIN_ERROR) {
+        return NGX_ERROR;
+    }
+
+    while (mc->out != cl) {
+        ln = mc->out;
+        mc->out = ln->next;
+
+        ln->next = mc->free;
+        mc->free = ln;
+    }
+
+    busy = 0;
+
+    for (ln = mc->out; ln; ln = ln->next) {
+        busy += ln->buf->last - ln->buf->pos;
+    }
+
+    if (mc->out == NULL) {
+        mc->last = &mc->out;
+    }
+
+    mc->busy = busy;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "multiplex flush, busy: %uz", busy);
+
+    if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (busy < NGX_HTTP_UPSTREAM_MULTIPLEX_BUSY_SIZE) {
+        ngx_http_upstream_multiplex_wake(mc);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_multiplex_process(ngx_http_upstream_multiplex_conn_t *mc,
+    u_char *p, u_char *last)
+{
+    size_t  n;
+
+    while (p < last) {
+
+        if (mc->header_len < NGX_HTTP_V2_FRAME_HEADER_SIZE) {
+            n = ngx_min((size_t) (last - p),
+                        NGX_HTTP_V2_FRAME_HEADER_SIZE - mc->header_len);
+
+            ngx_memcpy(mc->header + mc->header_len, p, n);
+            mc->header_len += n;
+            p += n;
+
+            if (mc->header_len < NGX_HTTP_V2_FRAME_HEADER_SIZE) {
+                break;
+            }
+
+            if (ngx_http_upstream_multiplex_frame_start(mc) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            if (mc->rest == 0
+                && ngx_http_upstream_multiplex_frame_end(mc) != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            continue;
+        }
+
+        n = ngx_min((size_t) (last - p), mc->rest);
+
+        if (mc->stream
+            && mc->type != NGX_HTTP_V2_RST_STREAM_FRAME
+            && (mc->stream->http1
+                ? ngx_http_upstream_multiplex_http1_input(mc->stream, p, n)
+                : ngx_http_upstream_multiplex_deliver(mc->stream, p, n))
+               != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        mc->rest -= n;
+
+        if (mc->type == NGX_HTTP_V2_SETTINGS_FRAME) {
+
+            /* settings are applied one by one */
+
+            while (n--) {
+                mc->payload[mc->payload_len++] = *p++;
+
+                if (mc->payload_len == 6) {
+                    if (ngx_http_upstream_multiplex_setting(mc) != NGX_OK) {
+                        return NGX_ERROR;
+                    }
+
+                    mc->payload_len = 0;
+                }
+            }
+
+        } else {
+            while (n--) {
+                if (mc->payload_len < sizeof(mc->payload)) {
+                    mc->payload[mc->payload_len++] = *p;
+                }
+
+                p++;
+            }
+        }
+
+        if (mc->rest == 0
+            && ngx_http_upstream_multiplex_frame_end(mc) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_multiplex_frame_start(ngx_http_upstream_multiplex_conn_t *mc)
+{
+    size_t                                 window;
+    uint32_t                               head;
+    ngx_queue_t                           *q;
+    ngx_connection_t                      *c;
+    ngx_http_upstream_multiplex_stream_t  *s;
+
+    c = mc->connection;
+
+    head = ngx_http_v2_parse_uint32(mc->header);
+
+    mc->rest = ngx_http_v2_parse_length(head);
+    mc->length = mc->rest;
+    mc->type = ngx_http_v2_parse_type(head);
+    mc->flags = mc->header[4];
+    mc->stream_id = ngx_http_v2_parse_sid(&mc->header[5]);
+
+    mc->stream = NULL;
+    mc->payload_len = 0;
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "multiplex frame type:%ui f:%Xi l:%uz sid:%ui",
+                   mc->type, mc->flags, mc->rest, mc->stream_id);
+
+    if (mc->rest > NGX_HTTP_V2_DEFAULT_FRAME_SIZE) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "upstream %V sent frame with too long length: %uz",
+                      &mc->name, mc->rest);
+        return NGX_ERROR;
+    }
+
+    switch (mc->type) {
+
+    case NGX_HTTP_V2_DATA_FRAME:
+
+        if (mc->rest > mc->recv_window) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "upstream %V violated connection flow control, "
+                          "received %uz data frame with window %uz",
+                          &mc->name, mc->rest, mc->recv_window);
+            return NGX_ERROR;
+        }
+
+        mc->recv_window -= mc->rest;
+
+        if (mc->recv_window < NGX_HTTP_V2_MAX_WINDOW / 4) {
+            window = NGX_HTTP_V2_MAX_WINDOW - mc->recv_window;
+            mc->recv_window = NGX_HTTP_V2_MAX_WINDOW;
+
+            (void) ngx_http_v2_write_uint32(mc->payload, window);
+
+            if (ngx_http_upstream_multiplex_queue_frame(mc,
+                                        NGX_HTTP_V2_WINDOW_UPDATE_FRAME, 0, 0,
+                                        mc->payload, 4)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+        }
+
+        /* fall through */
+
+    case NGX_HTTP_V2_HEADERS_FRAME:
+    case NGX_HTTP_V2_PRIORITY_FRAME:
+    case NGX_HTTP_V2_CONTINUATION_FRAME:
+
+        if (mc->stream_id == 0) {
+            goto invalid;
+        }
+
+        break;
+
+    case NGX_HTTP_V2_RST_STREAM_FRAME:
+
+        if (mc->stream_id == 0 || mc->rest != 4) {
+            goto invalid;
+        }
+
+        break;
+
+    case NGX_HTTP_V2_SETTINGS_FRAME:
+
+        if (mc->stream_id
+            || mc->rest % NGX_HTTP_UPSTREAM_MULTIPLEX_SETTINGS_PARAM_SIZE
+            || ((mc->flags & NGX_HTTP_V2_ACK_FLAG) && mc->rest))
+        {
+            goto invalid;
+        }
+
+        if (!mc->settings && !(mc->flags & NGX_HTTP_V2_ACK_FLAG)) {
+
+            /* the limit is now known, if not sent it is unlimited */
+
+            mc->settings = 1;
+            mc->max_streams = mc->conf->max_streams;
+        }
+
+        break;
+
+    case NGX_HTTP_V2_PING_FRAME:
+
+        if (mc->stream_id || mc->rest != 8) {
+            goto invalid;
+        }
+
+        break;
+
+    case NGX_HTTP_V2_GOAWAY_FRAME:
+
+        if (mc->stream_id || mc->rest < 8) {
+            goto invalid;
+        }
+
+        break;
+
+    case NGX_HTTP_V2_WINDOW_UPDATE_FRAME:
+
+        if (mc->rest != 4) {
+            goto invalid;
+        }
+
+        break;
+    }
+
+    if (mc->stream_id == 0) {
+        return NGX_OK;
+    }
+
+    /* frames of streams closed already are ignored */
+
+    for (q = ngx_queue_head(&mc->streams);
+         q != ngx_queue_sentinel(&mc->streams);
+         q = ngx_queue_next(q))
+    {
+        s = ngx_queue_data(q, ngx_http_upstream_multiplex_stream_t, queue);
+
+        if (s->id == mc->stream_id) {
+            goto found;
+        }
+    }
+
+    return NGX_OK;
+
+found:
+
+    mc->stream = s;
+
+    switch (mc->type) {
+
+    case NGX_HTTP_V2_DATA_FRAME:
+
+        if (mc->rest > s->recv_window) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "upstream %V violated stream flow control, "
+                          "received %uz data frame with window %uz",
+                          &mc->name, mc->rest, s->recv_window);
+            return NGX_ERROR;
+        }
+
+        s->recv_window -= mc->rest;
+
+        /* fall through */
+
+    case NGX_HTTP_V2_HEADERS_FRAME:
+        s->received = 1;
+        break;
+
+    case NGX_HTTP_V2_RST_STREAM_FRAME:
+
+        /* passed once the error code is known */
+
+        return NGX_OK;
+    }
+
+    if (s->http1) {
+        s->padding = 0;
+
+        if (mc->type != NGX_HTTP_V2_HEADERS_FRAME) {
+            return NGX_OK;
+        }
+
+        if (s->block == NULL) {
+            s->block = ngx_create_temp_buf(s->connection.pool,
+                                     s->request->upstream->conf->buffer_size);
+            if (s->block == NULL) {
+                return NGX_ERROR;
+            }
+        }
+
+        s->block->last = s->block->pos;
+        s->end_stream = (mc->flags & NGX_HTTP_V2_END_STREAM_FLAG) ? 1 : 0;
+
+        return NGX_OK;
+    }
+
+    (void) ngx_http_v2_write_sid(&mc->header[5], s->local_id);
+
+    return ngx_http_upstream_multiplex_deliver(s, mc->header,
+                                               NGX_HTTP_V2_FRAME_HEADER_SIZE);
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                  "upstream %V sent invalid frame type:%ui l:%uz sid:%ui",
+                  &mc->name, mc->type, mc->rest, mc->stream_id);
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_multiplex_frame_end(ngx_http_upstream_multiplex_conn_t *mc)
+{
+    size_t                                 window;
+    ngx_http_upstream_multiplex_stream_t  *s;
+
+    s = mc->stream;
+
+    mc->header_len = 0;
+    mc->stream = NULL;
+
+    if (mc->stream_id) {
+
+        if (s == NULL) {
+            return NGX_OK;
+        }
+
+        if (s->http1
+            && ngx_http_upstream_multiplex_http1_frame_end(s) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        switch (mc->type) {
+
+        case NGX_HTTP_V2_HEADERS_FRAME:
+
+            if (s->http1) {
+
+                /* closed once the header block is converted */
+
+                break;
+            }
+
+            /* fall through */
+
+        case NGX_HTTP_V2_DATA_FRAME:
+
+            if (mc->flags & NGX_HTTP_V2_END_STREAM_FLAG) {
+                s->remote_closed = 1;
+            }
+
+            break;
+
+        case NGX_HTTP_V2_RST_STREAM_FRAME:
+
+            if (s->http1 && !s->remote_closed && s->received) {
+                ngx_log_error(NGX_LOG_ERR, s->connection.log, 0,
+                              "upstream %V reset stream %ui with error %ui",
+                              &mc->name, s->id,
+                              ngx_http_v2_parse_uint32(mc->payload));
+            }
+
+            s->local_closed = 1;
+            s->remote_closed = 1;
+
+            /*
+             * a stream refused by the server was not processed,
+             * and is passed to the next server
+             */
+
+            if (ngx_http_v2_parse_uint32(mc->payload)
+                == NGX_HTTP_UPSTREAM_MULTIPLEX_REFUSED_STREAM
+                && !s->received)
+            {
+                ngx_log_error(NGX_LOG_INFO, mc->connection->log, 0,
+                              "upstream %V refused stream %ui",
+                              &mc->name, s->id);
+
+                ngx_http_upstream_multiplex_stream_closed(s);
+                ngx_http_upstream_multiplex_stream_error(s);
+                return NGX_OK;
+            }
+
+            /* the response converted ends, complete or not */
+
+            if (s->http1) {
+                break;
+            }
+
+            if (ngx_http_upstream_multiplex_deliver_frame(s,
+                                        NGX_HTTP_V2_RST_STREAM_FRAME,
+                                        mc->flags, s->local_id,
+                                        mc->payload, 4)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            break;
+
+        case NGX_HTTP_V2_WINDOW_UPDATE_FRAME:
+
+            window = ngx_http_v2_parse_window(mc->payload);
+
+            if (window > (size_t) (NGX_HTTP_V2_MAX_WINDOW - s->send_window)) {
+
+                /* passed on, the module resets the stream */
+                break;
+            }
+
+            s->send_window += window;
+
+            if (s->blocked) {
+                s->blocked = 0;
+                s->write.ready = 1;
+                ngx_post_event(&s->write, &ngx_posted_events);
+            }
+
+            break;
+        }
+
+        ngx_http_upstream_multiplex_stream_closed(s);
+
+        s->read.ready = 1;
+        ngx_post_event(&s->read, &ngx_posted_events);
+
+        return NGX_OK;
+    }
+
+    switch (mc->type) {
+
+    case NGX_HTTP_V2_SETTINGS_FRAME:
+
+        if (mc->flags & NGX_HTTP_V2_ACK_FLAG) {
+            break;
+        }
+
+        ngx_http_upstream_multiplex_wake(mc);
+
+        return ngx_http_upstream_multiplex_queue_frame(mc,
+                                        NGX_HTTP_V2_SETTINGS_FRAME,
+                                        NGX_HTTP_V2_ACK_FLAG, 0, NULL, 0);
+
+    case NGX_HTTP_V2_PING_FRAME:
+
+        if (mc->flags & NGX_HTTP_V2_ACK_FLAG) {
+            break;
+        }
+
+        return ngx_http_upstream_multiplex_queue_frame(mc,
+                                        NGX_HTTP_V2_PING_FRAME,
+                                        NGX_HTTP_V2_ACK_FLAG, 0,
+                                        mc->payload, 8);
+
+    case NGX_HTTP_V2_WINDOW_UPDATE_FRAME:
+
+        window = ngx_http_v2_parse_window(mc->payload);
+
+        if (window == 0
+            || window > (size_t) (NGX_HTTP_V2_MAX_WINDOW - mc->send_window))
+        {
+            ngx_log_error(NGX_LOG_ERR, mc->connection->log, 0,
+                          "upstream %V sent invalid window update: %uz",
+                          &mc->name, window);
+            return NGX_ERROR;
+        }
+
+        mc->send_window += window;
+
+        ngx_http_upstream_multiplex_wake(mc);
+
+        break;
+
+    case NGX_HTTP_V2_GOAWAY_FRAME:
+
+        ngx_http_upstream_multiplex_goaway(mc,
+                                ngx_http_v2_parse_sid(mc->payload),
+                                ngx_http_v2_parse_uint32(&mc->payload[4]));
+        break;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_multiplex_setting(ngx_http_upstream_multiplex_conn_t *mc)
+{
+    u_char                                 frame[6];
+    ssize_t                                delta;
+    ngx_uint_t                             id, value;
+    ngx_queue_t                           *q;
+    ngx_http_upstream_multiplex_stream_t  *s;
+
+    id = ngx_http_v2_parse_uint16(mc->payload);
+    value = ngx_http_v2_parse_uint32(&mc->payload[2]);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mc->connection->log, 0,
+                   "multiplex setting %ui:%ui", id, value);
+
+    if (id == NGX_HTTP_UPSTREAM_MULTIPLEX_MAX_STREAMS_SETTING) {
+
+        /* streams over the limit are not closed, new ones are not opened */
+
+        mc->max_streams = ngx_min(value, mc->conf->max_streams);
+        return NGX_OK;
+    }
+
+    if (id != NGX_HTTP_UPSTREAM_MULTIPLEX_INIT_WINDOW_SETTING) {
+        return NGX_OK;
+    }
+
+    if (value > NGX_HTTP_V2_MAX_WINDOW) {
+        ngx_log_error(NGX_LOG_ERR, mc->connection->log, 0,
+                      "upstream %V sent settings frame "
+                      "with too large initial window size: %ui",
+                      &mc->name, value);
+        return NGX_ERROR;
+    }
+
+    delta = value - mc->init_window;
+    mc->init_window = value;
+
+    ngx_memcpy(frame, mc->payload, 6);
+
+    /* the modules adjust their own windows as well */
+
+    for (q = ngx_queue_head(&mc->streams);
+         q != ngx_queue_sentinel(&mc->streams);
+         q = ngx_queue_next(q))
+    {
+        s = ngx_queue_data(q, ngx_http_upstream_multiplex_stream_t, queue);
+
+        s->send_window += delta;
+
+        if (s->http1) {
+            continue;
+        }
+
+        if (ngx_http_upstream_multiplex_deliver_frame(s,
+                                        NGX_HTTP_V2_SETTINGS_FRAME, 0, 0,
+                                        frame, 6)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        s->read.ready = 1;
+        ngx_post_event(&s->read, &ngx_posted_events);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_multiplex_goaway(ngx_http_upstream_multiplex_conn_t *mc,
+    ngx_uint_t last_id, ngx_uint_t error)
+{
+    ngx_uint_t                             level;
+    ngx_queue_t                           *q;
+    ngx_http_upstream_multiplex_stream_t  *s;
+
+    level = error ? NGX_LOG_ERR : NGX_LOG_INFO;
+
+    ngx_log_error(level, mc->connection->log, 0,
+                  "upstream %V sent goaway with error %ui, last stream %ui",
+                  &mc->name, error, last_id);
+
+    ngx_http_upstream_multiplex_drain(mc);
+
+    if (last_id < mc->last_stream_id) {
+        mc->last_stream_id = last_id;
+    }
+
+    /*
+     * streams not processed by the server can be retried, streams
+     * not started yet are started if identifiers up to the last are left
+     */
+
+    for (q = ngx_queue_head(&mc->streams);
+         q != ngx_queue_sentinel(&mc->streams);
+         q = ngx_queue_next(q))
+    {
+        s = ngx_queue_data(q, ngx_http_upstream_multiplex_stream_t, queue);
+
+        if (s->id > last_id
+            || (s->id == 0 && mc->next_stream_id > last_id))
+        {
+            ngx_http_upstream_multiplex_stream_error(s);
+        }
+    }
+}
+
+
+static ngx_int_t
+ngx_http_upstream_multiplex_queue_frame(ngx_http_upstream_multiplex_conn_t *mc,
+    ngx_uint_t type, ngx_uint_t flags, ngx_uint_t sid, u_char *payload,
+    size_t len)
+{
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, mc->connection->log, 0,
+                   "multiplex send frame type:%ui f:%Xi sid:%ui",
+                   type, flags, sid);
+
+    cl = ngx_http_upstream_multiplex_get_buf(mc);
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    b = cl->buf;
+
+    b->last = ngx_http_upstream_multiplex_write_header(b->last, len, type,
+                                                       flags, sid);
+    b->last = ngx_cpymem(b->last, payload, len);
+
+    *mc->last = cl;
+    mc->last = &cl->next;
+
+    mc->busy += b->last - b->pos;
+
+    return NGX_OK;
+}
+
+
+static ngx_chain_t *
+ngx_http_upstream_multiplex_get_buf(ngx_http_upstream_multiplex_conn_t *mc)
+{
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl;
+
+    cl = mc->free;
+
+    if (cl) {
+        mc->free = cl->next;
+        cl->next = NULL;
+
+        b = cl->buf;
+        b->pos = b->start;
+        b->last = b->start;
+        b->flush = 0;
+
+        return cl;
+    }
+
+    cl = ngx_alloc_chain_link(mc->connection->pool);
+    if (cl == NULL) {
+        return NULL;
+    }
+
+    cl->buf = ngx_create_temp_buf(mc->connection->pool,
+                                  NGX_HTTP_UPSTREAM_MULTIPLEX_BUFFER_SIZE);
+    if (cl->buf == NULL) {
+        return NULL;
+    }
+
+    cl->next = NULL;
+
+    return cl;
+}
+
+
+static void
+ngx_http_upstream_multiplex_post_flush(ngx_http_upstream_multiplex_conn_t *mc)
+{
+    if (mc->connected && !mc->error) {
+        ngx_post_event(mc->connection->write, &ngx_posted_events);
+    }
+}
+
+
+static void
+ngx_http_upstream_multiplex_wake(ngx_http_upstream_multiplex_conn_t *mc)
+{
+    ngx_queue_t                           *q;
+    ngx_http_upstream_multiplex_stream_t  *s;
+
+    for (q = ngx_queue_head(&mc->streams);
+         q != ngx_queue_sentinel(&mc->streams);
+         q = ngx_queue_next(q))
+    {
+        s = ngx_queue_data(q, ngx_http_upstream_multiplex_stream_t, queue);
+
+        if (s->blocked) {
+            s->blocked = 0;
+            s->write.ready = 1;
+            ngx_post_event(&s->write, &ngx_posted_events);
+        }
+    }
+}
+
+
+static void
+ngx_http_upstream_multiplex_fail(ngx_http_upstream_multiplex_conn_t *mc)
+{
+    ngx_queue_t                           *q;
+    ngx_connection_t                      *c;
+    ngx_http_upstream_multiplex_stream_t  *s;
+
+    c = mc->connection;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "multiplex connection failed, streams: %ui", mc->nstreams);
+
+    ngx_http_upstream_multiplex_drain(mc);
+
+    mc->error = 1;
+
+    if (mc->nstreams == 0) {
+        ngx_http_upstream_multiplex_close(mc);
+        return;
+    }
+
+    /*
+     * the socket is kept open while streams use it,
+     * as their connections have its descriptor
+     */
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    c->read->handler = ngx_http_upstream_multiplex_dummy_handler;
+    c->write->handler = ngx_http_upstream_multiplex_dummy_handler;
+
+    /* responses received completely are not affected */
+
+    for (q = ngx_queue_head(&mc->streams);
+         q != ngx_queue_sentinel(&mc->streams);
+         q = ngx_queue_next(q))
+    {
+        s = ngx_queue_data(q, ngx_http_upstream_multiplex_stream_t, queue);
+
+        if (!s->remote_closed) {
+            ngx_http_upstream_multiplex_stream_error(s);
+        }
+    }
+}
+
+
+static void
+ngx_http_upstream_multiplex_drain(ngx_http_upstream_multiplex_conn_t *mc)
+{
+    if (mc->draining) {
+        return;
+    }
+
+    mc->draining = 1;
+
+    ngx_queue_remove(&mc->queue);
+}
+
+
+static void
+ngx_http_upstream_multiplex_close(ngx_http_upstream_multiplex_conn_t *mc)
+{
+    ngx_pool_t        *pool;
+    ngx_connection_t  *c;
+
+    c = mc->connection;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "multiplex close connection to %V", &mc->name);
+
+    ngx_http_upstream_multiplex_drain(mc);
+
+#if (NGX_HTTP_SSL)
+
+    if (c->ssl) {
+        c->ssl->no_wait_shutdown = 1;
+        c->ssl->no_send_shutdown = 1;
+
+        (void) ngx_ssl_shutdown(c);
+    }
+
+#endif
+
+    pool = c->pool;
+
+    ngx_close_connection(c);
+    ngx_destroy_pool(pool);
+}
+
+
+static ngx_http_upstream_multiplex_stream_t *
+ngx_http_upstream_multiplex_create_stream(
+    ngx_http_upstream_multiplex_conn_t *mc, ngx_peer_connection_t *pc,
+    ngx_http_request_t *r)
+{
+    u_char                                 payload[6];
+    ngx_pool_t                            *pool;
+    ngx_connection_t                      *c;
+    ngx_http_upstream_multiplex_stream_t  *s;
+
+    pool = ngx_create_pool(1024, pc->log);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    s = ngx_pcalloc(pool, sizeof(ngx_http_upstream_multiplex_stream_t));
+    if (s == NULL) {
+        ngx_destroy_pool(pool);
+        return NULL;
+    }
+
+    c = &s->connection;
+
+    c->pool = pool;
+    c->read = &s->read;
+    c->write = &s->write;
+    c->fd = mc->connection->fd;
+
+    c->recv = ngx_http_upstream_multiplex_recv;
+    c->send = ngx_http_upstream_multiplex_send;
+    c->recv_chain = ngx_http_upstream_multiplex_recv_chain;
+    c->send_chain = ngx_http_upstream_multiplex_send_chain;
+
+    c->log = pc->log;
+    c->sockaddr = pc->sockaddr;
+    c->socklen = pc->socklen;
+    c->type = SOCK_STREAM;
+    c->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
+
+#if (NGX_HTTP_SSL)
+    c->ssl = mc->connection->ssl;
+#endif
+
+    c->sendfile = 0;
+    c->tcp_nodelay = NGX_TCP_NODELAY_DISABLED;
+    c->tcp_nopush = NGX_TCP_NOPUSH_DISABLED;
+
+    /* the events are posted by the connection and never added */
+
+    s->read.data = c;
+    s->read.log = c->log;
+    s->read.active = 1;
+
+    s->write.data = c;
+    s->write.log = c->log;
+    s->write.write = 1;
+    s->write.active = 1;
+    s->write.ready = 1;
+
+    s->mc = mc;
+    s->send_window = mc->init_window;
+    s->recv_window = mc->conf->window;
+    s->last = &s->out;
+    s->preface = sizeof(ngx_http_upstream_multiplex_preface) - 1;
+
+    s->request = r;
+    s->http1 = r->upstream->http2;
+
+    if (s->http1) {
+
+        /* the windows are used by the conversion itself */
+
+        goto done;
+    }
+
+    /*
+     * the module is told the current initial window, and its
+     * connection window is opened: the connection window is
+     * accounted here
+     */
+
+    if (mc->init_window != NGX_HTTP_V2_DEFAULT_WINDOW) {
+        (void) ngx_http_v2_write_uint16(payload,
+                               NGX_HTTP_UPSTREAM_MULTIPLEX_INIT_WINDOW_SETTING);
+        (void) ngx_http_v2_write_uint32(&payload[2], mc->init_window);
+
+        if (ngx_http_upstream_multiplex_deliver_frame(s,
+                                        NGX_HTTP_V2_SETTINGS_FRAME, 0, 0,
+                                        payload, 6)
+            != NGX_OK)
+        {
+            ngx_destroy_pool(c->pool);
+            return NULL;
+        }
+    }
+
+    (void) ngx_http_v2_write_uint32(payload, NGX_HTTP_V2_MAX_WINDOW
+                                             - NGX_HTTP_V2_DEFAULT_WINDOW);
+
+    if (ngx_http_upstream_multiplex_deliver_frame(s,
+                                        NGX_HTTP_V2_WINDOW_UPDATE_FRAME, 0, 0,
+                                        payload, 4)
+        != NGX_OK)
+    {
+        ngx_destroy_pool(c->pool);
+        return NULL;
+    }
+
+    s->read.ready = 1;
+    ngx_post_event(&s->read, &ngx_posted_events);
+
+done:
+
+    ngx_queue_insert_tail(&mc->streams, &s->queue);
+    mc->nstreams++;
+
+    if (mc->connection->idle) {
+        mc->connection->idle = 0;
+
+        if (mc->connection->read->timer_set) {
+            ngx_del_timer(mc->connection->read);
+        }
+    }
+
+    return s;
+}
+
+
+static void
+ngx_http_upstream_multiplex_close_stream(
+    ngx_http_upstream_multiplex_stream_t *s)
+{
+    u_char                               payload[4];
+    ngx_chain_t                         *cl;
+    ngx_connection_t                    *c;
+    ngx_http_upstream_multiplex_conn_t  *mc;
+
+    c = &s->connection;
+    mc = s->mc;
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "multiplex close stream %ui, closed: %d:%d, streams: %ui",
+                   s->id, s->local_closed, s->remote_closed, mc->nstreams);
+
+    if (s->read.timer_set) {
+        ngx_del_timer(&s->read);
+    }
+
+    if (s->write.timer_set) {
+        ngx_del_timer(&s->write);
+    }
+
+    if (s->read.posted) {
+        ngx_delete_posted_event(&s->read);
+    }
+
+    if (s->write.posted) {
+        ngx_delete_posted_event(&s->write);
+    }
+
+    /* frames not queued are dropped, the buffers belong to the connection */
+
+    if (s->frame) {
+        s->frame->next = s->out;
+        s->out = s->frame;
+    }
+
+    while (s->out) {
+        cl = s->out;
+        s->out = cl->next;
+
+        cl->next = mc->free;
+        mc->free = cl;
+    }
+
+    if (s->id
+        && !mc->error
+        && !(s->local_closed && s->remote_closed))
+    {
+        (void) ngx_http_v2_write_uint32(payload,
+                                        NGX_HTTP_UPSTREAM_MULTIPLEX_CANCEL);
+
+        if (ngx_http_upstream_multiplex_queue_frame(mc,
+                                        NGX_HTTP_V2_RST_STREAM_FRAME, 0,
+                                        s->id, payload, 4)
+            == NGX_OK)
+        {
+            ngx_http_upstream_multiplex_post_flush(mc);
+
+        } else {
+            ngx_http_upstream_multiplex_drain(mc);
+        }
+    }
+
+    /* the rest of a frame being received for the stream is skipped */
+
+    if (mc->stream == s) {
+        mc->stream = NULL;
+    }
+
+    ngx_queue_remove(&s->queue);
+    mc->nstreams--;
+
+    if (s->active) {
+        mc->active--;
+        ngx_http_upstream_multiplex_wake(mc);
+    }
+
+    ngx_destroy_pool(c->pool);
+
+    if (mc->nstreams) {
+        return;
+    }
+
+    if (mc->draining || ngx_exiting || ngx_terminate) {
+        ngx_http_upstream_multiplex_close(mc);
+        return;
+    }
+
+    mc->connection->idle = 1;
+    ngx_add_timer(mc->connection->read, mc->conf->timeout);
+}
+
+
+static void
+ngx_http_upstream_multiplex_stream_closed(
+    ngx_http_upstream_multiplex_stream_t *s)
+{
+    if (!s->active || !s->local_closed || !s->remote_closed) {
+        return;
+    }
+
+    s->active = 0;
+    s->mc->active--;
+
+    ngx_http_upstream_multiplex_wake(s->mc);
+}
+
+
+static void
+ngx_http_upstream_multiplex_stream_error(
+    ngx_http_upstream_multiplex_stream_t *s)
+{
+    s->error = 1;
+
+    s->read.ready = 1;
+    ngx_post_event(&s->read, &ngx_posted_events);
+
+    s->write.ready = 1;
+    ngx_post_event(&s->write, &ngx_posted_events);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_multiplex_deliver(ngx_http_upstream_multiplex_stream_t *s,
+    u_char *p, size_t len)
+{
+    size_t        n;
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl;
+
+    while (len) {
+        cl = s->in_last;
+
+        if (cl == NULL || cl->buf->last == cl->buf->end) {
+            cl = s->in_free;
+
+            if (cl) {
+                s->in_free = cl->next;
+
+            } else {
+                cl = ngx_alloc_chain_link(s->connection.pool);
+                if (cl == NULL) {
+                    return NGX_ERROR;
+                }
+
+                cl->buf = ngx_create_temp_buf(s->connection.pool,
+                                              ngx_pagesize);
+                if (cl->buf == NULL) {
+                    return NGX_ERROR;
+                }
+            }
+
+            cl->next = NULL;
+
+            if (s->in_last) {
+                s->in_last->next = cl;
+
+            } else {
+                s->in = cl;
+            }
+
+            s->in_last = cl;
+        }
+
+        b = cl->buf;
+
+        n = ngx_min(len, (size_t) (b->end - b->last));
+
+        b->last = ngx_cpymem(b->last, p, n);
+
+        p += n;
+        len -= n;
+
+        s->buffered += n;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_multiplex_deliver_frame(
+    ngx_http_upstream_multiplex_stream_t *s, ngx_uint_t type, ngx_uint_t flags,
+    ngx_uint_t sid, u_char *payload, size_t len)
+{
+    u_char  header[NGX_HTTP_V2_FRAME_HEADER_SIZE];
+
+    (void) ngx_http_upstream_multiplex_write_header(header, len, type, flags,
+                                                    sid);
+
+    if (ngx_http_upstream_multiplex_deliver(s, header,
+                                            NGX_HTTP_V2_FRAME_HEADER_SIZE)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    return ngx_http_upstream_multiplex_deliver(s, payload, len);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_multiplex_update_window(
+    ngx_http_upstream_multiplex_stream_t *s)
+{
+    u_char                               payload[4];
+    size_t                               window;
+    ngx_http_upstream_multiplex_conn_t  *mc;
+
+    mc = s->mc;
+
+    if (s->id == 0 || s->remote_closed || mc->error) {
+        return NGX_OK;
+    }
+
+    /* data sent by the server and not read yet are limited by the window */
+
+    window = mc->conf->window - s->recv_window;
+
+    if (window < s->buffered) {
+        return NGX_OK;
+    }
+
+    window -= s->buffered;
+
+    if (window < mc->conf->window / 2) {
+        return NGX_OK;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, s->connection.log, 0,
+                   "multiplex stream %ui window update: %uz", s->id, window);
+
+    s->recv_window += window;
+
+    (void) ngx_http_v2_write_uint32(payload, window);
+
+    if (ngx_http_upstream_multiplex_queue_frame(mc,
+                                        NGX_HTTP_V2_WINDOW_UPDATE_FRAME, 0,
+                                        s->id, payload, 4)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_http_upstream_multiplex_post_flush(mc);
+
+    return NGX_OK;
+}
+
+
+static ssize_t
+ngx_http_upstream_multiplex_parse_output(
+    ngx_http_upstream_multiplex_stream_t *s, u_char *p, u_char *last)
+{
+    u_char                              *start;
+    size_t                               n, len;
+    uint32_t                             head;
+    ngx_uint_t                           type, flags, sid;
+    ngx_http_upstream_multiplex_conn_t  *mc;
+
+    mc = s->mc;
+    start = p;
+
+    while (p < last) {
+
+        if (s->preface) {
+            n = ngx_min((size_t) (last - p), s->preface);
+
+            if (ngx_memcmp(p, ngx_http_upstream_multiplex_preface
+                              + sizeof(ngx_http_upstream_multiplex_preface)
+                              - 1 - s->preface, n)
+                != 0)
+            {
+                ngx_log_error(NGX_LOG_ERR, s->connection.log, 0,
+                              "upstream \"multiplex\" requires "
+                              "the HTTP/2 protocol");
+                return NGX_ERROR;
+            }
+
+            s->preface -= n;
+            p += n;
+
+            continue;
+        }
+
+        if (s->header_len < NGX_HTTP_V2_FRAME_HEADER_SIZE) {
+            n = ngx_min((size_t) (last - p),
+                        NGX_HTTP_V2_FRAME_HEADER_SIZE - s->header_len);
+
+            ngx_memcpy(s->header + s->header_len, p, n);
+            s->header_len += n;
+            p += n;
+
+            if (s->header_len < NGX_HTTP_V2_FRAME_HEADER_SIZE) {
+                break;
+            }
+
+            head = ngx_http_v2_parse_uint32(s->header);
+
+            len = ngx_http_v2_parse_length(head);
+            type = ngx_http_v2_parse_type(head);
+            sid = ngx_http_v2_parse_sid(&s->header[5]);
+
+            if (len > NGX_HTTP_V2_DEFAULT_FRAME_SIZE) {
+                ngx_log_error(NGX_LOG_ALERT, s->connection.log, 0,
+                              "multiplexed frame too long: %uz", len);
+                return NGX_ERROR;
+            }
+
+            s->rest = len;
+
+            /*
+             * connection frames are not passed: the connection has
+             * its own settings and windows; stream windows are
+             * updated as the data are read from the stream
+             */
+
+            if (sid != 0
+                && type != NGX_HTTP_V2_WINDOW_UPDATE_FRAME
+                && !(type == NGX_HTTP_V2_RST_STREAM_FRAME && s->id == 0))
+            {
+                s->frame = ngx_http_upstream_multiplex_get_buf(mc);
+                if (s->frame == NULL) {
+                    return NGX_ERROR;
+                }
+
+                s->frame->buf->last = ngx_cpymem(s->frame->buf->last,
+                                                 s->header,
+                                                NGX_HTTP_V2_FRAME_HEADER_SIZE);
+            }
+
+        } else {
+            n = ngx_min((size_t) (last - p), s->rest);
+
+            if (s->frame) {
+                s->frame->buf->last = ngx_cpymem(s->frame->buf->last, p, n);
+            }
+
+            s->rest -= n;
+            p += n;
+        }
+
+        if (s->rest) {
+            continue;
+        }
+
+        /* the frame is complete */
+
+        s->header_len = 0;
+
+        if (s->frame == NULL) {
+            continue;
+        }
+
+        type = s->header[3];
+        flags = s->header[4];
+
+        if (type == NGX_HTTP_V2_HEADERS_FRAME
+            || type == NGX_HTTP_V2_CONTINUATION_FRAME)
+        {
+            s->headers = (flags & NGX_HTTP_V2_END_HEADERS_FLAG) ? 0 : 1;
+        }
+
+        *s->last = s->frame;
+        s->last = &s->frame->next;
+        s->frame = NULL;
+
+        break;
+    }
+
+    return p - start;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_multiplex_queue_output(
+    ngx_http_upstream_multiplex_stream_t *s)
+{
+    u_char                              *p, payload[4];
+    size_t                               len;
+    uint32_t                             head;
+    ngx_uint_t                           type, flags, sid, queued;
+    ngx_chain_t                         *cl;
+    ngx_http_upstream_multiplex_conn_t  *mc;
+
+    mc = s->mc;
+    queued = 0;
+
+    s->blocked = 0;
+
+    while (s->out) {
+        cl = s->out;
+        p = cl->buf->pos;
+
+        head = ngx_http_v2_parse_uint32(p);
+
+        len = ngx_http_v2_parse_length(head);
+        type = ngx_http_v2_parse_type(head);
+        flags = p[4];
+        sid = ngx_http_v2_parse_sid(&p[5]);
+
+        if (type != NGX_HTTP_V2_CONTINUATION_FRAME) {
+
+            /* a header block is queued as a whole */
+
+            if (type == NGX_HTTP_V2_HEADERS_FRAME
+                && !(flags & NGX_HTTP_V2_END_HEADERS_FLAG)
+                && s->headers)
+            {
+                break;
+            }
+
+            if (mc->busy >= NGX_HTTP_UPSTREAM_MULTIPLEX_BUSY_SIZE) {
+                goto blocked;
+            }
+
+            if (type == NGX_HTTP_V2_DATA_FRAME
+                && ((ssize_t) len > mc->send_window
+                    || (ssize_t) len > s->send_window))
+            {
+                goto blocked;
+            }
+
+            /*
+             * streams are started once the server's limit
+             * of concurrent streams is known and allows it
+             */
+
+            if (s->id == 0
+                && (!mc->settings || mc->active >= mc->max_streams))
+            {
+                goto blocked;
+            }
+        }
+
+        if (s->id == 0) {
+
+            if (type != NGX_HTTP_V2_HEADERS_FRAME) {
+                ngx_log_error(NGX_LOG_ALERT, s->connection.log, 0,
+                              "multiplexed stream started with "
+                              "frame type %ui", type);
+                return NGX_ERROR;
+            }
+
+            if (mc->next_stream_id > mc->last_stream_id) {
+                return NGX_ERROR;
+            }
+
+            s->id = mc->next_stream_id;
+            s->local_id = sid;
+            s->active = 1;
+
+            mc->next_stream_id += 2;
+            mc->active++;
+
+            if (mc->next_stream_id > NGX_HTTP_UPSTREAM_MULTIPLEX_MAX_STREAM_ID)
+            {
+                ngx_http_upstream_multiplex_drain(mc);
+            }
+
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, s->connection.log, 0,
+                           "multiplex stream %ui on connection %p",
+                           s->id, mc->connection);
+
+        } else if (sid != s->local_id) {
+            ngx_log_error(NGX_LOG_ALERT, s->connection.log, 0,
+                          "multiplexed frame for unknown stream %ui", sid);
+            return NGX_ERROR;
+        }
+
+        (void) ngx_http_v2_write_sid(&p[5], s->id);
+
+        switch (type) {
+
+        case NGX_HTTP_V2_DATA_FRAME:
+            mc->send_window -= len;
+            s->send_window -= len;
+
+            s->consumed += len;
+
+            if (s->consumed >= NGX_HTTP_V2_MAX_WINDOW / 4 && !s->http1) {
+                (void) ngx_http_v2_write_uint32(payload, s->consumed);
+                s->consumed = 0;
+
+                if (ngx_http_upstream_multiplex_deliver_frame(s,
+                                        NGX_HTTP_V2_WINDOW_UPDATE_FRAME, 0, 0,
+                                        payload, 4)
+                    != NGX_OK)
+                {
+                    return NGX_ERROR;
+                }
+
+                s->read.ready = 1;
+                ngx_post_event(&s->read, &ngx_posted_events);
+            }
+
+            /* fall through */
+
+        case NGX_HTTP_V2_HEADERS_FRAME:
+
+            if (flags & NGX_HTTP_V2_END_STREAM_FLAG) {
+                s->local_closed = 1;
+            }
+
+            break;
+
+        case NGX_HTTP_V2_RST_STREAM_FRAME:
+            s->local_closed = 1;
+            s->remote_closed = 1;
+            break;
+        }
+
+        ngx_http_upstream_multiplex_stream_closed(s);
+
+        s->out = cl->next;
+        cl->next = NULL;
+
+        *mc->last = cl;
+        mc->last = &cl->next;
+
+        mc->busy += cl->buf->last - cl->buf->pos;
+
+        queued = 1;
+    }
+
+    if (s->out == NULL) {
+        s->last = &s->out;
+    }
+
+    if (queued) {
+        ngx_http_upstream_multiplex_post_flush(mc);
+    }
+
+    return NGX_OK;
+
+blocked:
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, s->connection.log, 0,
+                   "multiplex stream %ui blocked, window: %z:%z",
+                   s->id, mc->send_window, s->send_window);
+
+    s->blocked = 1;
+
+    if (queued) {
+        ngx_http_upstream_multiplex_post_flush(mc);
+    }
+
+    return NGX_AGAIN;
+}
+
+
+static ssize_t
+ngx_http_upstream_multiplex_recv(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    size_t                                 n;
+    ssize_t                                total;
+    ngx_buf_t                             *b;
+    ngx_chain_t                           *cl;
+    ngx_http_upstream_multiplex_stream_t  *s;
+
+    s = ngx_http_upstream_multiplex_get_stream(c);
+
+    total = 0;
+
+    while (size && s->in) {
+        cl = s->in;
+        b = cl->buf;
+
+        n = ngx_min(size, (size_t) (b->last - b->pos));
+
+        buf = ngx_cpymem(buf, b->pos, n);
+        b->pos += n;
+
+        size -= n;
+        total += n;
+
+        if (b->pos == b->last) {
+            s->in = cl->next;
+
+            if (s->in == NULL) {
+                s->in_last = NULL;
+            }
+
+            b->pos = b->start;
+            b->last = b->start;
+
+            cl->next = s->in_free;
+            s->in_free = cl;
+        }
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "multiplex stream %ui recv: %z", s->id, total);
+
+    s->buffered -= total;
+
+    if (total && ngx_http_upstream_multiplex_update_window(s) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (total) {
+        if (s->in == NULL && !s->error) {
+            c->read->ready = 0;
+        }
+
+        return total;
+    }
+
+    if (s->error || (s->http1 && s->remote_closed)) {
+        c->read->eof = 1;
+        return 0;
+    }
+
+    c->read->ready = 0;
+
+    return NGX_AGAIN;
+}
+
+
+static ssize_t
+ngx_http_upstream_multiplex_recv_chain(ngx_connection_t *c, ngx_chain_t *cl,
+    off_t limit)
+{
+    size_t   size;
+    ssize_t  n, total;
+
+    total = 0;
+
+    for ( /* void */ ; cl; cl = cl->next) {
+
+        size = cl->buf->end - cl->buf->last;
+
+        if (limit && (off_t) (total + size) > limit) {
+            size = (size_t) (limit - total);
+        }
+
+        n = ngx_http_upstream_multiplex_recv(c, cl->buf->last, size);
+
+        if (n <= 0) {
+            return total ? total : n;
+        }
+
+        total += n;
+
+        if ((size_t) n < size || (limit && total >= limit)) {
+            break;
+        }
+    }
+
+    return total;
+}
+
+
+static ssize_t
+ngx_http_upstream_multiplex_send(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    ngx_buf_t     b;
+    ngx_chain_t   cl, *rc;
+
+    ngx_memzero(&b, sizeof(ngx_buf_t));
+
+    b.pos = buf;
+    b.last = buf + size;
+    b.temporary = 1;
+
+    cl.buf = &b;
+    cl.next = NULL;
+
+    rc = ngx_http_upstream_multiplex_send_chain(c, &cl, 0);
+
+    if (rc == NGX_CHAIN_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (b.pos == buf) {
+        return NGX_AGAIN;
+    }
+
+    return b.pos - buf;
+}
+
+
+static ngx_chain_t *
+ngx_http_upstream_multiplex_send_chain(ngx_connection_t *c, ngx_chain_t *in,
+    off_t limit)
+{
+    ssize_t                                n;
+    ngx_int_t                              rc;
+    ngx_buf_t                             *b;
+    ngx_http_upstream_multiplex_stream_t  *s;
+
+    s = ngx_http_upstream_multiplex_get_stream(c);
+
+    for ( ;; ) {
+
+        if (s->mc->error && s->local_closed && !s->error) {
+
+            /* the response is received, nothing is left to send */
+
+            c->buffered = 0;
+            return NULL;
+        }
+
+        if (s->error || s->mc->error) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "multiplexed upstream connection failed");
+            c->write->error = 1;
+            return NGX_CHAIN_ERROR;
+        }
+
+        rc = ngx_http_upstream_multiplex_queue_output(s);
+
+        if (rc == NGX_ERROR) {
+            c->write->error = 1;
+            return NGX_CHAIN_ERROR;
+        }
+
+        if (rc == NGX_AGAIN) {
+            break;
+        }
+
+        while (in && ngx_buf_size(in->buf) == 0) {
+            in = in->next;
+        }
+
+        if (in == NULL) {
+            break;
+        }
+
+        b = in->buf;
+
+        if (!ngx_buf_in_memory(b)) {
+            ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                          "file buffer in multiplexed stream");
+            return NGX_CHAIN_ERROR;
+        }
+
+        if (s->http1) {
+            n = ngx_http_upstream_multiplex_http1_output(s, b->pos, b->last);
+
+        } else {
+            n = ngx_http_upstream_multiplex_parse_output(s, b->pos, b->last);
+        }
+
+        if (n == NGX_ERROR) {
+            c->write->error = 1;
+            return NGX_CHAIN_ERROR;
+        }
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        b->pos += n;
+        c->sent += n;
+    }
+
+    while (in && ngx_buf_size(in->buf) == 0) {
+        in = in->next;
+    }
+
+    /* complete frames wait for the windows or the connection */
+
+    if (s->blocked) {
+        c->buffered = 1;
+        c->write->ready = 0;
+
+    } else {
+        c->buffered = 0;
+    }
+
+    return in;
+}
+
+
+static ssize_t
+ngx_http_upstream_multiplex_http1_output(
+    ngx_http_upstream_multiplex_stream_t *s, u_char *p, u_char *last)
+{
+    u_char     *pos;
+    size_t      size, len;
+    ngx_buf_t  *b;
+
+    if (s->request_done || s->local_closed) {
+
+        /* the rest is not needed by the server */
+
+        return last - p;
+    }
+
+    if (s->request_head) {
+        return ngx_http_upstream_multiplex_http1_body(s, p, last);
+    }
+
+    /* the request head is collected up to the empty line */
+
+    b = s->head;
+    size = last - p;
+
+    if (b == NULL || (size_t) (b->end - b->last) < size) {
+        len = b ? (size_t) (b->last - b->pos) : 0;
+
+        b = ngx_create_temp_buf(s->connection.pool,
+                                ngx_max(2 * len, len + size));
+        if (b == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (s->head) {
+            b->last = ngx_cpymem(b->last, s->head->pos, len);
+        }
+
+        s->head = b;
+    }
+
+    pos = (b->last - b->pos > 3) ? b->last - 3 : b->pos;
+
+    b->last = ngx_cpymem(b->last, p, size);
+
+    for ( /* void */ ; pos + 4 <= b->last; pos++) {
+
+        if (pos[0] == CR && pos[1] == LF && pos[2] == CR && pos[3] == LF) {
+            len = b->last - (pos + 4);
+            b->last = pos + 4;
+
+            if (ngx_http_upstream_multiplex_http1_request(s) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            s->request_head = 1;
+
+            return size - len;
+        }
+    }
+
+    return size;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_multiplex_http1_request(
+    ngx_http_upstream_multiplex_stream_t *s)
+{
+    u_char      *p, *last, *start, *pos, *block, *tmp;
+    size_t       len, size;
+    ngx_str_t    method, uri, host, name, value;
+    ngx_buf_t   *b;
+    ngx_uint_t   type, flags, chunked;
+
+    b = s->head;
+
+    p = b->pos;
+    last = b->last;
+
+    /* the request line, as written by the module */
+
+    method.data = p;
+
+    p = ngx_strlchr(p, last, ' ');
+    if (p == NULL) {
+        goto invalid;
+    }
+
+    method.len = p - method.data;
+    uri.data = ++p;
+
+    p = ngx_strlchr(p, last, ' ');
+    if (p == NULL) {
+        goto invalid;
+    }
+
+    uri.len = p - uri.data;
+
+    p = ngx_strlchr(p, last, LF);
+    if (p == NULL) {
+        goto invalid;
+    }
+
+    start = ++p;
+
+    /* the authority goes before the headers, the length tells the body */
+
+    ngx_str_null(&host);
+    chunked = 0;
+    s->length = 0;
+
+    while (ngx_http_upstream_multiplex_http1_line(&p, last, &name, &value)
+           == NGX_OK)
+    {
+        if (name.len == sizeof("host") - 1
+            && ngx_strncasecmp(name.data, (u_char *) "host", name.len) == 0)
+        {
+            host = value;
+
+        } else if (name.len == sizeof("content-length") - 1
+                   && ngx_strncasecmp(name.data, (u_char *) "content-length",
+                                      name.len)
+                      == 0)
+        {
+            s->length = ngx_atoof(value.data, value.len);
+
+            if (s->length == NGX_ERROR) {
+                goto invalid;
+            }
+
+        } else if (name.len == sizeof("transfer-encoding") - 1
+                   && ngx_strncasecmp(name.data,
+                                      (u_char *) "transfer-encoding",
+                                      name.len)
+                      == 0
+                   && value.len == sizeof("chunked") - 1
+                   && ngx_strncasecmp(value.data, (u_char *) "chunked",
+                                      value.len)
+                      == 0)
+        {
+            chunked = 1;
+        }
+    }
+
+    if (chunked) {
+        s->length = -1;
+    }
+
+    size = last - b->pos;
+
+    block = ngx_pnalloc(s->connection.pool, 3 * size + 64);
+    if (block == NULL) {
+        return NGX_ERROR;
+    }
+
+    tmp = ngx_pnalloc(s->connection.pool, size);
+    if (tmp == NULL) {
+        return NGX_ERROR;
+    }
+
+    pos = block;
+
+    if (method.len == 3 && ngx_strncmp(method.data, "GET", 3) == 0) {
+        *pos++ = ngx_http_v2_indexed(NGX_HTTP_V2_METHOD_GET_INDEX);
+
+    } else if (method.len == 4 && ngx_strncmp(method.data, "POST", 4) == 0) {
+        *pos++ = ngx_http_v2_indexed(NGX_HTTP_V2_METHOD_POST_INDEX);
+
+    } else {
+        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_METHOD_INDEX);
+        pos = ngx_http_v2_write_value(pos, method.data, method.len, tmp);
+    }
+
+    s->head_request = (method.len == 4
+                       && ngx_strncmp(method.data, "HEAD", 4) == 0);
+
+#if (NGX_HTTP_SSL)
+    if (s->mc->connection->ssl) {
+        *pos++ = ngx_http_v2_indexed(NGX_HTTP_V2_SCHEME_HTTPS_INDEX);
+
+    } else
+#endif
+    {
+        *pos++ = ngx_http_v2_indexed(NGX_HTTP_V2_SCHEME_HTTP_INDEX);
+    }
+
+    if (uri.len == 1 && uri.data[0] == '/') {
+        *pos++ = ngx_http_v2_indexed(NGX_HTTP_V2_PATH_ROOT_INDEX);
+
+    } else {
+        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_PATH_INDEX);
+        pos = ngx_http_v2_write_value(pos, uri.data, uri.len, tmp);
+    }
+
+    if (host.len) {
+        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_AUTHORITY_INDEX);
+        pos = ngx_http_v2_write_value(pos, host.data, host.len, tmp);
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, s->connection.log, 0,
+                   "multiplex http1 request: \"%V %V\", authority: \"%V\"",
+                   &method, &uri, &host);
+
+    p = start;
+
+    while (ngx_http_upstream_multiplex_http1_line(&p, last, &name, &value)
+           == NGX_OK)
+    {
+        if (ngx_http_upstream_multiplex_hop_header(&name)
+            || (name.len == sizeof("host") - 1
+                && ngx_strncasecmp(name.data, (u_char *) "host", name.len)
+                   == 0))
+        {
+            continue;
+        }
+
+        if (name.len == sizeof("te") - 1
+            && ngx_strncasecmp(name.data, (u_char *) "te", name.len) == 0
+            && (value.len != sizeof("trailers") - 1
+                || ngx_strncasecmp(value.data, (u_char *) "trailers",
+                                   value.len)
+                   != 0))
+        {
+            continue;
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, s->connection.log, 0,
+                       "multiplex http1 header: \"%V: %V\"", &name, &value);
+
+        *pos++ = 0;
+        pos = ngx_http_v2_write_name(pos, name.data, name.len, tmp);
+        pos = ngx_http_v2_write_value(pos, value.data, value.len, tmp);
+    }
+
+    /* the header block, split if larger than a frame */
+
+    if (s->length == 0) {
+        s->request_done = 1;
+    }
+
+    type = NGX_HTTP_V2_HEADERS_FRAME;
+    flags = s->request_done ? NGX_HTTP_V2_END_STREAM_FLAG : 0;
+
+    p = block;
+    len = pos - block;
+
+    for ( ;; ) {
+        size = ngx_min(len, NGX_HTTP_V2_DEFAULT_FRAME_SIZE);
+
+        if (size == len) {
+            flags |= NGX_HTTP_V2_END_HEADERS_FLAG;
+        }
+
+        if (ngx_http_upstream_multiplex_http1_frame(s, type, flags, p, size)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        p += size;
+        len -= size;
+
+        if (len == 0) {
+            return NGX_OK;
+        }
+
+        type = NGX_HTTP_V2_CONTINUATION_FRAME;
+        flags = 0;
+    }
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ALERT, s->connection.log, 0,
+                  "invalid request head in multiplexed stream");
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_multiplex_http1_line(u_char **pos, u_char *last,
+    ngx_str_t *name, ngx_str_t *value)
+{
+    u_char  *p, *end;
+
+    for ( ;; ) {
+        p = *pos;
+
+        end = ngx_strlchr(p, last, LF);
+        if (end == NULL) {
+            return NGX_DONE;
+        }
+
+        *pos = end + 1;
+
+        if (end > p && end[-1] == CR) {
+            end--;
+        }
+
+        if (end == p) {
+
+            /* the empty line */
+
+            return NGX_DONE;
+        }
+
+        name->data = p;
+
+        p = ngx_strlchr(p, end, ':');
+        if (p == NULL) {
+            continue;
+        }
+
+        name->len = p - name->data;
+
+        for (p++; p < end && (*p == ' ' || *p == '\t'); p++) {
+            /* void */
+        }
+
+        while (end > p && (end[-1] == ' ' || end[-1] == '\t')) {
+            end--;
+        }
+
+        value->data = p;
+        value->len = end - p;
+
+        return NGX_OK;
+    }
+}
+
+
+static ssize_t
+ngx_http_upstream_multiplex_http1_body(
+    ngx_http_upstream_multiplex_stream_t *s, u_char *p, u_char *last)
+{
+    off_t                                size;
+    u_char                              *start;
+    ssize_t                              window;
+    ngx_int_t                            rc;
+    ngx_buf_t                            b;
+    ngx_uint_t                           flags;
+    ngx_http_upstream_multiplex_conn_t  *mc;
+
+    mc = s->mc;
+    start = p;
+
+    if (s->length == -1 && s->chunked.size == 0) {
+
+        ngx_memzero(&b, sizeof(ngx_buf_t));
+
+        b.pos = p;
+        b.last = last;
+
+        rc = ngx_http_parse_chunked(s->request, &b, &s->chunked);
+
+        p = b.pos;
+
+        if (rc == NGX_DONE) {
+            s->request_done = 1;
+
+            if (ngx_http_upstream_multiplex_http1_frame(s,
+                                        NGX_HTTP_V2_DATA_FRAME,
+                                        NGX_HTTP_V2_END_STREAM_FLAG, p, 0)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            return p - start;
+        }
+
+        if (rc == NGX_ERROR) {
+            ngx_log_error(NGX_LOG_ALERT, s->connection.log, 0,
+                          "invalid chunked body in multiplexed stream");
+            return NGX_ERROR;
+        }
+
+        if (rc == NGX_AGAIN || p == last) {
+            return p - start;
+        }
+    }
+
+    /* a DATA frame, as large as the windows allow */
+
+    window = ngx_min(s->send_window, mc->send_window);
+
+    if (window <= 0) {
+
+        if (p != start) {
+            return p - start;
+        }
+
+        s->blocked = 1;
+        return NGX_AGAIN;
+    }
+
+    size = (s->length == -1) ? s->chunked.size : s->length;
+    size = ngx_min(size, last - p);
+    size = ngx_min(size, (off_t) window);
+    size = ngx_min(size, NGX_HTTP_V2_DEFAULT_FRAME_SIZE);
+
+    flags = 0;
+
+    if (s->length == -1) {
+        s->chunked.size -= size;
+
+    } else {
+        s->length -= size;
+
+        if (s->length == 0) {
+            flags = NGX_HTTP_V2_END_STREAM_FLAG;
+            s->request_done = 1;
+        }
+    }
+
+    if (ngx_http_upstream_multiplex_http1_frame(s, NGX_HTTP_V2_DATA_FRAME,
+                                                flags, p, (size_t) size)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    return p + size - start;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_multiplex_http1_frame(
+    ngx_http_upstream_multiplex_stream_t *s, ngx_uint_t type,
+    ngx_uint_t flags, u_char *payload, size_t len)
+{
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, s->connection.log, 0,
+                   "multiplex http1 frame type:%ui f:%Xi l:%uz",
+                   type, flags, len);
+
+    cl = ngx_http_upstream_multiplex_get_buf(s->mc);
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    b = cl->buf;
+
+    b->last = ngx_http_upstream_multiplex_write_header(b->last, len, type,
+                                                       flags, 1);
+    b->last = ngx_cpymem(b->last, payload, len);
+
+    *s->last = cl;
+    s->last = &cl->next;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_multiplex_http1_input(
+    ngx_http_upstream_multiplex_stream_t *s, u_char *p, size_t len)
+{
+    u_char                              *last;
+    size_t                               n, rest, skip;
+    ngx_uint_t                           padded;
+    ngx_http_upstream_multiplex_conn_t  *mc;
+    u_char                               chunk[sizeof("ffffffffffffffff"
+                                                      CRLF) - 1];
+
+    mc = s->mc;
+
+    switch (mc->type) {
+
+    case NGX_HTTP_V2_DATA_FRAME:
+        skip = 0;
+        break;
+
+    case NGX_HTTP_V2_HEADERS_FRAME:
+        skip = (mc->flags & NGX_HTTP_V2_PRIORITY_FLAG) ? 5 : 0;
+        break;
+
+    case NGX_HTTP_V2_CONTINUATION_FRAME:
+        skip = 0;
+        break;
+
+    default:
+        return NGX_OK;
+    }
+
+    padded = (mc->type != NGX_HTTP_V2_CONTINUATION_FRAME
+              && (mc->flags & NGX_HTTP_V2_PADDED_FLAG));
+
+    if (padded) {
+        skip++;
+    }
+
+    rest = mc->rest;
+
+    while (len) {
+
+        /* the pad length and priority are skipped */
+
+        if (mc->length - rest < skip) {
+
+            if (padded && rest == mc->length) {
+                s->padding = *p;
+
+                if (skip > mc->length || s->padding > mc->length - skip) {
+                    ngx_log_error(NGX_LOG_ERR, mc->connection->log, 0,
+                                  "upstream %V sent padded frame "
+                                  "with incorrect length: %uz, padding: %uz",
+                                  &mc->name, mc->length, s->padding);
+                    return NGX_ERROR;
+                }
+            }
+
+            p++;
+            len--;
+            rest--;
+
+            continue;
+        }
+
+        if (rest <= s->padding) {
+            break;
+        }
+
+        n = ngx_min(len, rest - s->padding);
+
+        if (s->error) {
+            /* void */
+
+        } else if (mc->type != NGX_HTTP_V2_DATA_FRAME) {
+
+            if (s->block == NULL
+                || (size_t) (s->block->end - s->block->last) < n)
+            {
+                ngx_log_error(NGX_LOG_ERR, s->connection.log, 0,
+                              "upstream %V sent too big header", &mc->name);
+                ngx_http_upstream_multiplex_stream_error(s);
+
+            } else {
+                s->block->last = ngx_cpymem(s->block->last, p, n);
+            }
+
+        } else if (!s->response) {
+            ngx_log_error(NGX_LOG_ERR, s->connection.log, 0,
+                          "upstream %V sent data before headers", &mc->name);
+            ngx_http_upstream_multiplex_stream_error(s);
+
+        } else if (s->response_chunked) {
+            last = ngx_sprintf(chunk, "%xz" CRLF, n);
+
+            if (ngx_http_upstream_multiplex_deliver(s, chunk, last - chunk)
+                != NGX_OK
+                || ngx_http_upstream_multiplex_deliver(s, p, n) != NGX_OK
+                || ngx_http_upstream_multiplex_deliver(s, (u_char *) CRLF,
+                                                       sizeof(CRLF) - 1)
+                   != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+        } else if (ngx_http_upstream_multiplex_deliver(s, p, n) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        p += n;
+        len -= n;
+        rest -= n;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_multiplex_http1_frame_end(
+    ngx_http_upstream_multiplex_stream_t *s)
+{
+    ngx_http_upstream_multiplex_conn_t  *mc;
+
+    mc = s->mc;
+
+    switch (mc->type) {
+
+    case NGX_HTTP_V2_DATA_FRAME:
+
+        if ((mc->flags & NGX_HTTP_V2_END_STREAM_FLAG)
+            && s->response_chunked && !s->error)
+        {
+            return ngx_http_upstream_multiplex_deliver(s,
+                                          (u_char *) "0" CRLF CRLF,
+                                          sizeof("0" CRLF CRLF) - 1);
+        }
+
+        break;
+
+    case NGX_HTTP_V2_HEADERS_FRAME:
+    case NGX_HTTP_V2_CONTINUATION_FRAME:
+
+        if (!(mc->flags & NGX_HTTP_V2_END_HEADERS_FLAG)) {
+            break;
+        }
+
+        if (!s->error
+            && ngx_http_upstream_multiplex_http1_response(s) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        if (s->end_stream) {
+            s->remote_closed = 1;
+        }
+
+        break;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_multiplex_http1_response(
+    ngx_http_upstream_multiplex_stream_t *s)
+{
+    u_char      ch, *p, *end, *tmp, *last;
+    size_t      i;
+    ngx_int_t   status;
+    ngx_str_t   name, value;
+    ngx_uint_t  index, size_update, prefix, literal, length;
+    u_char      line[sizeof("HTTP/1.1 000" CRLF) - 1];
+
+    p = s->block->pos;
+    end = s->block->last;
+
+    if (s->response) {
+
+        /* trailers are not passed */
+
+        if (!s->end_stream) {
+            goto invalid;
+        }
+
+        if (s->response_chunked) {
+            return ngx_http_upstream_multiplex_deliver(s,
+                                          (u_char *) "0" CRLF CRLF,
+                                          sizeof("0" CRLF CRLF) - 1);
+        }
+
+        return NGX_OK;
+    }
+
+    /* strings are decoded in place, or here if Huffman encoded */
+
+    tmp = ngx_pnalloc(s->connection.pool, (end - p) * 8 / 5 + 1);
+    if (tmp == NULL) {
+        return NGX_ERROR;
+    }
+
+    status = 0;
+    length = 0;
+
+    while (p < end) {
+        last = tmp;
+        ch = *p;
+
+        if (ch & 0x80) {
+            /* indexed header field */
+            prefix = 0x7f;
+            literal = 0;
+
+        } else if (ch & 0x40) {
+            /* literal header field with incremental indexing */
+            prefix = 0x3f;
+            literal = 1;
+
+        } else if ((ch & 0xe0) == 0x20) {
+
+            /* dynamic table size update, the table size is 0 */
+
+            p = ngx_http_upstream_multiplex_parse_int(p, end, 0x1f,
+                                                      &size_update);
+            if (p == NULL || size_update) {
+                goto invalid;
+            }
+
+            continue;
+
+        } else {
+            /* literal header field without indexing or never indexed */
+            prefix = 0x0f;
+            literal = 1;
+        }
+
+        p = ngx_http_upstream_multiplex_parse_int(p, end, prefix, &index);
+
+        if (p == NULL || index > 61 || (index == 0 && !literal)) {
+            goto invalid;
+        }
+
+        if (index) {
+            name = *ngx_http_v2_get_static_name(index);
+
+        } else {
+            p = ngx_http_upstream_multiplex_parse_string(p, end, &name, &last,
+                                                         s->connection.log);
+            if (p == NULL) {
+                goto invalid;
+            }
+        }
+
+        if (literal) {
+            p = ngx_http_upstream_multiplex_parse_string(p, end, &value,
+                                                         &last,
+                                                         s->connection.log);
+            if (p == NULL) {
+                goto invalid;
+            }
+
+        } else {
+            value = *ngx_http_v2_get_static_value(index);
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, s->connection.log, 0,
+                       "multiplex http1 response header: \"%V: %V\"",
+                       &name, &value);
+
+        if (name.len && name.data[0] == ':') {
+
+            if (status
+                || name.len != sizeof(":status") - 1
+                || ngx_strncmp(name.data, ":status", name.len) != 0
+                || value.len != 3)
+            {
+                goto invalid;
+            }
+
+            status = ngx_atoi(value.data, value.len);
+
+            if (status < 100) {
+                goto invalid;
+            }
+
+            /* informational responses are not passed */
+
+            if (status < 200) {
+                continue;
+            }
+
+            last = ngx_sprintf(line, "HTTP/1.1 %V" CRLF, &value);
+
+            if (ngx_http_upstream_multiplex_deliver(s, line, last - line)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            continue;
+        }
+
+        if (status == 0 || name.len == 0) {
+            goto invalid;
+        }
+
+        for (i = 0; i < name.len; i++) {
+            ch = name.data[i];
+
+            if (ch <= 0x20 || ch == 0x7f || ch == ':'
+                || (ch >= 'A' && ch <= 'Z'))
+            {
+                goto invalid;
+            }
+        }
+
+        for (i = 0; i < value.len; i++) {
+            ch = value.data[i];
+
+            if (ch == '\0' || ch == CR || ch == LF) {
+                goto invalid;
+            }
+        }
+
+        if (status < 200 || ngx_http_upstream_multiplex_hop_header(&name)) {
+            continue;
+        }
+
+        if (name.len == sizeof("content-length") - 1
+            && ngx_strncmp(name.data, "content-length", name.len) == 0)
+        {
+            length = 1;
+        }
+
+        if (ngx_http_upstream_multiplex_http1_header(s, &name, &value)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    if (status == 0) {
+        goto invalid;
+    }
+
+    if (status < 200) {
+
+        if (s->end_stream) {
+            goto invalid;
+        }
+
+        return NGX_OK;
+    }
+
+    s->response = 1;
+
+    /* the body is chunked if its length is not known */
+
+    if (!length && status != 204 && status != 304 && !s->head_request) {
+
+        if (s->end_stream) {
+            ngx_str_set(&name, "content-length");
+            ngx_str_set(&value, "0");
+
+        } else {
+            ngx_str_set(&name, "transfer-encoding");
+            ngx_str_set(&value, "chunked");
+
+            s->response_chunked = 1;
+        }
+
+        if (ngx_http_upstream_multiplex_http1_header(s, &name, &value)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    return ngx_http_upstream_multiplex_deliver(s, (u_char *) CRLF,
+                                               sizeof(CRLF) - 1);
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, s->connection.log, 0,
+                  "upstream %V sent invalid header block", &s->mc->name);
+
+    ngx_http_upstream_multiplex_stream_error(s);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_multiplex_http1_header(
+    ngx_http_upstream_multiplex_stream_t *s, ngx_str_t *name,
+    ngx_str_t *value)
+{
+    if (ngx_http_upstream_multiplex_deliver(s, name->data, name->len)
+        != NGX_OK
+        || ngx_http_upstream_multiplex_deliver(s, (u_char *) ": ", 2)
+           != NGX_OK
+        || ngx_http_upstream_multiplex_deliver(s, value->data, value->len)
+           != NGX_OK
+        || ngx_http_upstream_multiplex_deliver(s, (u_char *) CRLF,
+                                               sizeof(CRLF) - 1)
+           != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_multiplex_hop_header(ngx_str_t *name)
+{
+    ngx_str_t  *h;
+
+    for (h = ngx_http_upstream_multiplex_hop_headers; h->len; h++) {
+
+        if (name->len == h->len
+            && ngx_strncasecmp(name->data, h->data, h->len) == 0)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+static u_char *
+ngx_http_upstream_multiplex_parse_int(u_char *p, u_char *end,
+    ngx_uint_t prefix, ngx_uint_t *value)
+{
+    ngx_uint_t  ch, shift;
+
+    if (p == end) {
+        return NULL;
+    }
+
+    *value = *p++ & prefix;
+
+    if (*value < prefix) {
+        return p;
+    }
+
+    for (shift = 0; shift < 28 && p < end; shift += 7) {
+        ch = *p++;
+
+        *value += (ch & 0x7f) << shift;
+
+        if (ch < 0x80) {
+            return p;
+        }
+    }
+
+    return NULL;
+}
+
+
+static u_char *
+ngx_http_upstream_multiplex_parse_string(u_char *p, u_char *end,
+    ngx_str_t *str, u_char **tmp, ngx_log_t *log)
+{
+    u_char      state;
+    ngx_uint_t  huff, len;
+
+    if (p == end) {
+        return NULL;
+    }
+
+    huff = *p & 0x80;
+
+    p = ngx_http_upstream_multiplex_parse_int(p, end, 0x7f, &len);
+
+    if (p == NULL || len > (size_t) (end - p)) {
+        return NULL;
+    }
+
+    if (!huff) {
+        str->data = p;
+        str->len = len;
+
+        return p + len;
+    }
+
+    state = 0;
+    str->data = *tmp;
+
+    if (ngx_http_v2_huff_decode(&state, p, len, tmp, 1, log) != NGX_OK) {
+        return NULL;
+    }
+
+    str->len = *tmp - str->data;
+
+    return p + len;
+}
+
+
+static u_char *
+ngx_http_upstream_multiplex_write_header(u_char *p, size_t len,
+    ngx_uint_t type, ngx_uint_t flags, ngx_uint_t sid)
+{
+    p = ngx_http_v2_write_len_and_type(p, len, type);
+    *p++ = (u_char) flags;
+    p = ngx_http_v2_write_sid(p, sid);
+
+    return p;
+}
+
+
+static u_char *
+ngx_http_upstream_multiplex_write_setting(u_char *p, ngx_uint_t id,
+    ngx_uint_t value)
+{
+    p = ngx_http_v2_write_uint16(p, id);
+    p = ngx_http_v2_write_uint32(p, value);
+
+    return p;
+}
+
+
+#if (NGX_HTTP_SSL)
+
+static ngx_int_t
+ngx_http_upstream_multiplex_set_session(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_multiplex_peer_data_t  *mp = data;
+
+    return mp->original_set_session(pc, mp->data);
+}
+
+
+static void
+ngx_http_upstream_multiplex_save_session(ngx_peer_connection_t *pc,
+    void *data)
+{
+    ngx_http_upstream_multiplex_peer_data_t  *mp = data;
+
+    mp->original_save_session(pc, mp->data);
+    return;
+}
+
+#endif
+
+
+static void *
+ngx_http_upstream_multiplex_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_multiplex_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool,
+                       sizeof(ngx_http_upstream_multiplex_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->original_init_upstream = NULL;
+     *     conf->original_init_peer = NULL;
+     *     conf->max_streams = 0;
+     */
+
+    conf->requests = NGX_CONF_UNSET_UINT;
+    conf->window = NGX_CONF_UNSET_SIZE;
+    conf->timeout = NGX_CONF_UNSET_MSEC;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_upstream_multiplex(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_srv_conf_t            *uscf;
+    ngx_http_upstream_multiplex_srv_conf_t  *mcf = conf;
+
+    ngx_int_t    n;
+    ngx_str_t   *value;
+
+    if (mcf->max_streams) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    n = ngx_atoi(value[1].data, value[1].len);
+
+    if (n == NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid value \"%V\" in \"%V\" directive",
+                           &value[1], &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    mcf->max_streams = n;
+
+    /* init upstream handler */
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    mcf->original_init_upstream = uscf->peer.init_upstream
+                                  ? uscf->peer.init_upstream
+                                  : ngx_http_upstream_init_round_robin;
+
+    uscf->peer.init_upstream = ngx_http_upstream_init_multiplex;
+    uscf->flags |= NGX_HTTP_UPSTREAM_HTTP2;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_upstream_multiplex_window(ngx_conf_t *cf, void *post, void *data)
+{
+    size_t *sp = data;
+
+    if (*sp < NGX_HTTP_V2_DEFAULT_FRAME_SIZE
+        || *sp > NGX_HTTP_V2_MAX_WINDOW)
+    {
+        return "value is out of range";
+    }
+
+    return NGX_CONF_OK;
+}
@@ -29,6 +29,13 @@
 
 #define NGX_HTTP_CACHE_VERSION       5
 
+#define NGX_HTTP_CACHE_SKETCH_DEPTH  4
+#define NGX_HTTP_CACHE_SKETCH_MAX    15
+
+#define NGX_HTTP_CACHE_MAX_SHARDS    256
+
+#define NGX_HTTP_CACHE_INDEX_MAGIC   0x58444e49  /* "INDX" */
+
 
 typedef struct {
     ngx_uint_t                       status;
@@ -36,6 +43,16 @@ typedef struct {
 } ngx_http_cache_valid_t;
 
 
+typedef struct {
+    off_t                            size;
+    size_t                           body_start;
+    ngx_uint_t                       refs;
+    unsigned                         done:1;
+    unsigned                         error:1;
+    u_char                           name[1];
+} ngx_http_file_cache_stream_t;
+
+
 typedef struct {
     ngx_rbtree_node_t                node;
     ngx_queue_t                      queue;
@@ -59,6 +76,7 @@ typedef struct {
     size_t                           body_start;
     off_t                            fs_size;
     ngx_msec_t                       lock_time;
+    ngx_http_file_cache_stream_t    *stream;
 } ngx_http_file_cache_node_t;
 
 
@@ -95,6 +113,9 @@ struct ngx_http_cache_s {
     ngx_http_file_cache_t           *file_cache;
     ngx_http_file_cache_node_t      *node;
 
+    ngx_http_file_cache_stream_t    *stream;
+    off_t                            stream_sent;
+
 #if (NGX_THREADS || NGX_COMPAT)
     ngx_thread_task_t               *thread_task;
 #endif
@@ -107,6 +128,7 @@ struct ngx_http_cache_s {
     ngx_event_t                      wait_event;
 
     unsigned                         lock:1;
+    unsigned                         lock_stream:1;
     unsigned                         waiting:1;
 
     unsigned                         updated:1;
@@ -120,6 +142,8 @@ struct ngx_http_cache_s {
 
     unsigned                         stale_updating:1;
     unsigned                         stale_error:1;
+    unsigned                         ram:1;
+    unsigned                         admitted:1;
 };
 
 
@@ -142,18 +166,82 @@ typedef struct {
 } ngx_http_file_cache_header_t;
 
 
+/* the layout up to the data must match ngx_http_file_cache_node_t */
+
+typedef struct {
+    ngx_rbtree_node_t                node;
+    ngx_queue_t                      queue;
+
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN
+                                         - sizeof(ngx_rbtree_key_t)];
+
+    size_t                           len;
+    u_char                           data[1];
+} ngx_http_file_cache_ram_node_t;
+
+
 typedef struct {
     ngx_rbtree_t                     rbtree;
     ngx_rbtree_node_t                sentinel;
     ngx_queue_t                      queue;
+    size_t                           size;
+    ngx_uint_t                       count;
+} ngx_http_file_cache_ram_t;
+
+
+typedef struct {
+    ngx_shmtx_sh_t                   lock;
+    ngx_shmtx_t                      mutex;
+    ngx_rbtree_t                     rbtree;
+    ngx_rbtree_node_t                sentinel;
+    ngx_queue_t                      queue;
+    ngx_uint_t                       count;
+    ngx_uint_t                       locks;
+    ngx_uint_t                       contended;
+    u_char                          *sketch;
+    ngx_uint_t                       sketch_samples;
+} ngx_http_file_cache_shard_t;
+
+
+typedef struct {
     ngx_atomic_t                     cold;
     ngx_atomic_t                     loading;
-    off_t                            size;
-    ngx_uint_t                       count;
+    ngx_atomic_t                     size;
+    ngx_atomic_t                     count;
+    ngx_atomic_t                     evicted;
+    ngx_atomic_t                     evicted_size;
+    ngx_msec_t                       over;
     ngx_uint_t                       watermark;
+    time_t                           index;
+    ngx_uint_t                       sketch_mask;
+    ngx_uint_t                       cursor;
+    ngx_uint_t                       nshards;
+    ngx_http_file_cache_shard_t      shards[1];
 } ngx_http_file_cache_sh_t;
 
 
+typedef struct {
+    ngx_uint_t                       nodes;
+    ngx_uint_t                       locks;
+    ngx_uint_t                       contended;
+} ngx_http_file_cache_shard_stats_t;
+
+
+typedef struct {
+    off_t                            size;
+    ngx_uint_t                       count;
+    off_t                            max_size;
+    ngx_uint_t                       evicted;
+    off_t                            evicted_size;
+    ngx_msec_t                       lag;
+    ngx_uint_t                       nshards;
+    ngx_http_file_cache_shard_stats_t  *shards;
+} ngx_http_file_cache_stats_t;
+
+
+typedef struct ngx_http_file_cache_batch_s  ngx_http_file_cache_batch_t;
+
+
 struct ngx_http_file_cache_s {
     ngx_http_file_cache_sh_t        *sh;
     ngx_slab_pool_t                 *shpool;
@@ -176,9 +264,28 @@ struct ngx_http_file_cache_s {
     ngx_uint_t                       manager_files;
     ngx_msec_t                       manager_sleep;
     ngx_msec_t                       manager_threshold;
+    ngx_uint_t                       manager_iops;
+    size_t                           manager_rate;
+    ngx_msec_t                       manager_next;
+    ngx_http_file_cache_batch_t     *manager_batch;
+#if (NGX_THREADS)
+    ngx_thread_pool_t               *manager_thread_pool;
+#endif
+
+    ngx_uint_t                       admission;
+    ngx_uint_t                       shards;
+
+    ngx_str_t                        index;
+    time_t                           index_interval;
+    time_t                           index_saved;
 
     ngx_shm_zone_t                  *shm_zone;
 
+    ngx_http_file_cache_ram_t       *ram;
+    ngx_slab_pool_t                 *ram_pool;
+    size_t                           ram_max_object;
+    ngx_shm_zone_t                  *ram_zone;
+
     ngx_uint_t                       use_temp_path;
                                      /* unsigned use_temp_path:1 */
 };
@@ -190,10 +297,14 @@ void ngx_http_file_cache_create_key(ngx_http_request_t *r);
 ngx_int_t ngx_http_file_cache_open(ngx_http_request_t *r);
 ngx_int_t ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf);
 void ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf);
+void ngx_http_file_cache_stream_update(ngx_http_request_t *r,
+    ngx_temp_file_t *tf);
 void ngx_http_file_cache_update_header(ngx_http_request_t *r);
 ngx_int_t ngx_http_cache_send(ngx_http_request_t *);
 void ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf);
 time_t ngx_http_file_cache_valid(ngx_array_t *cache_valid, ngx_uint_t status);
+ngx_int_t ngx_http_file_cache_stats(ngx_shm_zone_t *shm_zone,
+    ngx_http_file_cache_stats_t *stats, ngx_pool_t *pool);
 
 char *ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
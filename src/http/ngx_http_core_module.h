@@ -80,6 +80,7 @@ typedef struct {
 #endif
     unsigned                   deferred_accept:1;
     unsigned                   reuseport:1;
+    unsigned                   reuseport_cpu:1;
     unsigned                   so_keepalive:2;
     unsigned                   proxy_protocol:1;
 
@@ -11,11 +11,25 @@
 #include <ngx_md5.h>
 
 
+static ngx_int_t ngx_http_file_cache_ram_init(ngx_shm_zone_t *shm_zone,
+    void *data);
 static ngx_int_t ngx_http_file_cache_lock(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static void ngx_http_file_cache_lock_wait_handler(ngx_event_t *ev);
 static void ngx_http_file_cache_lock_wait(ngx_http_request_t *r,
     ngx_http_cache_t *c);
+static ngx_uint_t ngx_http_file_cache_stream_attach(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static ngx_int_t ngx_http_file_cache_stream_open(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_stream_handler(ngx_event_t *ev);
+static void ngx_http_file_cache_stream_writer(ngx_http_request_t *r);
+static void ngx_http_file_cache_stream(ngx_http_request_t *r);
+static ngx_int_t ngx_http_file_cache_stream_send(ngx_http_request_t *r);
+static void ngx_http_file_cache_stream_close(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c, ngx_uint_t error);
+static void ngx_http_file_cache_stream_release(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c);
 static ngx_int_t ngx_http_file_cache_read(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static ssize_t ngx_http_file_cache_aio_read(ngx_http_request_t *r,
@@ -33,9 +47,26 @@ static ngx_int_t ngx_http_file_cache_exists(ngx_http_file_cache_t *cache,
 static ngx_int_t ngx_http_file_cache_name(ngx_http_request_t *r,
     ngx_path_t *path);
 static ngx_http_file_cache_node_t *
-    ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key);
+    ngx_http_file_cache_lookup(ngx_http_file_cache_shard_t *shard, u_char *key);
+static ngx_http_file_cache_shard_t *
+    ngx_http_file_cache_shard(ngx_http_file_cache_t *cache, u_char *key);
+static void ngx_http_file_cache_shard_lock(ngx_http_file_cache_shard_t *shard);
 static void ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
     ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static ngx_int_t ngx_http_file_cache_ram_read(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_ram_add(ngx_http_request_t *r,
+    ngx_temp_file_t *tf);
+static void ngx_http_file_cache_ram_store(ngx_http_file_cache_t *cache,
+    u_char *key, u_char *data, size_t len);
+static void ngx_http_file_cache_ram_delete(ngx_http_file_cache_t *cache,
+    u_char *key);
+static void ngx_http_file_cache_ram_delete_node(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn);
+static void ngx_http_file_cache_ram_free(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_ram_node_t *rn);
+static ngx_http_file_cache_ram_node_t *
+    ngx_http_file_cache_ram_lookup(ngx_http_file_cache_t *cache, u_char *key);
 static void ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary,
     size_t len, u_char *hash);
 static void ngx_http_file_cache_vary_header(ngx_http_request_t *r,
@@ -45,10 +76,24 @@ static ngx_int_t ngx_http_file_cache_reopen(ngx_http_request_t *r,
 static ngx_int_t ngx_http_file_cache_update_variant(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static void ngx_http_file_cache_cleanup(void *data);
-static time_t ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache);
+static time_t ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_batch_t *batch);
 static time_t ngx_http_file_cache_expire(ngx_http_file_cache_t *cache);
+static ngx_int_t ngx_http_file_cache_batch_init(ngx_http_file_cache_t *cache);
+static ngx_queue_t *ngx_http_file_cache_evict_last(
+    ngx_http_file_cache_shard_t *shard);
+static void ngx_http_file_cache_evict(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, ngx_queue_t *q,
+    ngx_http_file_cache_batch_t *batch);
 static void ngx_http_file_cache_delete(ngx_http_file_cache_t *cache,
-    ngx_queue_t *q, u_char *name);
+    ngx_http_file_cache_shard_t *shard, ngx_http_file_cache_node_t *fcn);
+static void ngx_http_file_cache_evict_flush(ngx_http_file_cache_t *cache);
+static int ngx_libc_cdecl ngx_http_file_cache_evict_cmp(const void *one,
+    const void *two);
+static void ngx_http_file_cache_evict_batch(void *data, ngx_log_t *log);
+#if (NGX_THREADS)
+static void ngx_http_file_cache_evict_done(ngx_event_t *ev);
+#endif
 static void ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache);
 static ngx_int_t ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
@@ -63,6 +108,56 @@ static ngx_int_t ngx_http_file_cache_add(ngx_http_file_cache_t *cache,
 static ngx_int_t ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
 static void ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache);
+static ngx_int_t ngx_http_file_cache_sketch_init(ngx_http_file_cache_t *cache,
+    size_t size);
+static ngx_uint_t ngx_http_file_cache_sketch(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, u_char *key);
+static void ngx_http_file_cache_index_load(ngx_http_file_cache_t *cache,
+    ngx_log_t *log);
+static void ngx_http_file_cache_index_save(ngx_http_file_cache_t *cache);
+static ngx_rbtree_node_t *ngx_http_file_cache_index_next(
+    ngx_http_file_cache_shard_t *shard, u_char *key);
+
+
+#define NGX_HTTP_CACHE_INDEX_BATCH  1024
+#define NGX_HTTP_CACHE_STREAM_POLL  10
+
+
+typedef struct {
+    uint32_t                         magic;
+    uint32_t                         entry_size;
+    u_char                           level[NGX_MAX_PATH_LEVEL];
+    u_char                           reserved;
+    uint32_t                         bsize;
+    time_t                           time;
+    uint64_t                         count;
+} ngx_http_file_cache_index_header_t;
+
+
+typedef struct {
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN];
+    off_t                            fs_size;
+} ngx_http_file_cache_index_entry_t;
+
+
+typedef struct {
+    ngx_http_file_cache_node_t      *node;
+    ngx_http_file_cache_shard_t     *shard;
+    u_char                          *name;
+} ngx_http_file_cache_evict_t;
+
+
+struct ngx_http_file_cache_batch_s {
+    ngx_http_file_cache_t           *cache;
+    ngx_http_file_cache_evict_t     *evict;
+    ngx_uint_t                       nelts;
+    ngx_uint_t                       nalloc;
+    off_t                            size;
+#if (NGX_THREADS)
+    ngx_thread_task_t                task;
+#endif
+    ngx_uint_t                       busy;  /* unsigned  busy:1; */
+};
 
 
 ngx_str_t  ngx_http_cache_status[] = {
@@ -82,11 +177,13 @@ static u_char  ngx_http_file_cache_key[] = { LF, 'K', 'E', 'Y', ':', ' ' };
 static ngx_int_t
 ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 {
-    ngx_http_file_cache_t  *ocache = data;
+    ngx_http_file_cache_t        *ocache = data;
 
-    size_t                  len;
-    ngx_uint_t              n;
-    ngx_http_file_cache_t  *cache;
+    u_char                       *file;
+    size_t                        len;
+    ngx_uint_t                    n;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
 
     cache = shm_zone->data;
 
@@ -110,6 +207,13 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
             }
         }
 
+        if (cache->shards != ocache->sh->nshards) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "cache \"%V\" had previously different shards",
+                          &shm_zone->shm.name);
+            return NGX_ERROR;
+        }
+
         cache->sh = ocache->sh;
 
         cache->shpool = ocache->shpool;
@@ -121,7 +225,7 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
             cache->path->loader = NULL;
         }
 
-        return NGX_OK;
+        return ngx_http_file_cache_sketch_init(cache, shm_zone->shm.size);
     }
 
     cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
@@ -134,22 +238,62 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
         return NGX_OK;
     }
 
-    cache->sh = ngx_slab_alloc(cache->shpool, sizeof(ngx_http_file_cache_sh_t));
+    cache->sh = ngx_slab_alloc(cache->shpool,
+                               sizeof(ngx_http_file_cache_sh_t)
+                               + (cache->shards - 1)
+                                 * sizeof(ngx_http_file_cache_shard_t));
     if (cache->sh == NULL) {
         return NGX_ERROR;
     }
 
     cache->shpool->data = cache->sh;
 
-    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
-                    ngx_http_file_cache_rbtree_insert_value);
+    cache->sh->nshards = cache->shards;
+
+    for (n = 0; n < cache->shards; n++) {
+        shard = &cache->sh->shards[n];
+
+#if (NGX_HAVE_ATOMIC_OPS)
+
+        file = NULL;
+
+#else
+
+        file = ngx_slab_alloc(cache->shpool, ngx_cycle->lock_file.len
+                                             + shm_zone->shm.name.len
+                                             + sizeof(":shard")
+                                             + NGX_INT_T_LEN);
+        if (file == NULL) {
+            return NGX_ERROR;
+        }
+
+        (void) ngx_sprintf(file, "%V%V:shard%ui%Z", &ngx_cycle->lock_file,
+                           &shm_zone->shm.name, n);
+
+#endif
+
+        if (ngx_shmtx_create(&shard->mutex, &shard->lock, file) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        ngx_rbtree_init(&shard->rbtree, &shard->sentinel,
+                        ngx_http_file_cache_rbtree_insert_value);
 
-    ngx_queue_init(&cache->sh->queue);
+        ngx_queue_init(&shard->queue);
+
+        shard->count = 0;
+        shard->locks = 0;
+        shard->contended = 0;
+        shard->sketch = NULL;
+    }
 
     cache->sh->cold = 1;
     cache->sh->loading = 0;
     cache->sh->size = 0;
     cache->sh->count = 0;
+    cache->sh->evicted = 0;
+    cache->sh->evicted_size = 0;
+    cache->sh->over = 0;
     cache->sh->watermark = (ngx_uint_t) -1;
 
     cache->bsize = ngx_fs_bsize(cache->path->name.data);
@@ -168,6 +312,76 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 
     cache->shpool->log_nomem = 0;
 
+    cache->sh->index = 0;
+    cache->sh->cursor = 0;
+
+    if (ngx_http_file_cache_sketch_init(cache, shm_zone->shm.size) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (cache->index.len && !ngx_test_config) {
+        ngx_http_file_cache_index_load(cache, shm_zone->shm.log);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_ram_init(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_file_cache_t  *ocache = data;
+
+    size_t                  len;
+    ngx_http_file_cache_t  *cache;
+
+    cache = shm_zone->data;
+
+    if (ocache) {
+        cache->ram = ocache->ram;
+        cache->ram_pool = ocache->ram_pool;
+
+        return NGX_OK;
+    }
+
+    cache->ram_pool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        cache->ram = cache->ram_pool->data;
+
+        return NGX_OK;
+    }
+
+    cache->ram = ngx_slab_alloc(cache->ram_pool,
+                                sizeof(ngx_http_file_cache_ram_t));
+    if (cache->ram == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache->ram_pool->data = cache->ram;
+
+    ngx_rbtree_init(&cache->ram->rbtree, &cache->ram->sentinel,
+                    ngx_http_file_cache_rbtree_insert_value);
+
+    ngx_queue_init(&cache->ram->queue);
+
+    cache->ram->size = 0;
+    cache->ram->count = 0;
+
+    len = sizeof(" in cache ram zone \"\"") + shm_zone->shm.name.len;
+
+    cache->ram_pool->log_ctx = ngx_slab_alloc(cache->ram_pool, len);
+    if (cache->ram_pool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(cache->ram_pool->log_ctx, " in cache ram zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    /* allocation failures are expected, the least recently used go */
+
+    cache->ram_pool->log_nomem = 0;
+
     return NGX_OK;
 }
 
@@ -212,6 +426,10 @@ ngx_http_file_cache_create(ngx_http_request_t *r)
     cln->handler = ngx_http_file_cache_cleanup;
     cln->data = c;
 
+    /* the response is going to be stored anyway */
+
+    c->admitted = 1;
+
     if (ngx_http_file_cache_exists(cache, c) == NGX_ERROR) {
         return NGX_ERROR;
     }
@@ -282,6 +500,10 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
         return ngx_http_file_cache_read(r, c);
     }
 
+    if (c->stream) {
+        return ngx_http_file_cache_stream_open(r, c);
+    }
+
     cache = c->file_cache;
 
     if (c->node == NULL) {
@@ -343,6 +565,14 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
         goto done;
     }
 
+    if (c->exists && cache->ram) {
+        rc = ngx_http_file_cache_ram_read(r, c);
+
+        if (rc != NGX_DECLINED) {
+            return rc;
+        }
+    }
+
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
     ngx_memzero(&of, sizeof(ngx_open_file_info_t));
@@ -402,8 +632,9 @@ done:
 static ngx_int_t
 ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_msec_t                 now, timer;
-    ngx_http_file_cache_t     *cache;
+    ngx_msec_t                    now, timer, poll;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
 
     if (!c->lock) {
         return NGX_DECLINED;
@@ -413,7 +644,8 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
 
     cache = c->file_cache;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    shard = ngx_http_file_cache_shard(cache, c->key);
+    ngx_http_file_cache_shard_lock(shard);
 
     timer = c->node->lock_time - now;
 
@@ -422,9 +654,12 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
         c->node->lock_time = now + c->lock_age;
         c->updating = 1;
         c->lock_time = c->node->lock_time;
+
+    } else {
+        ngx_http_file_cache_stream_attach(r, c);
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(&shard->mutex);
 
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http file cache lock u:%d wt:%M",
@@ -434,6 +669,10 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
         return NGX_DECLINED;
     }
 
+    if (c->stream) {
+        return ngx_http_file_cache_stream_open(r, c);
+    }
+
     if (c->lock_timeout == 0) {
         return NGX_HTTP_CACHE_SCARCE;
     }
@@ -449,8 +688,9 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
     }
 
     timer = c->wait_time - now;
+    poll = c->lock_stream ? NGX_HTTP_CACHE_STREAM_POLL : 500;
 
-    ngx_add_timer(&c->wait_event, (timer > 500) ? 500 : timer);
+    ngx_add_timer(&c->wait_event, (timer > poll) ? poll : timer);
 
     r->main->blocked++;
 
@@ -481,9 +721,10 @@ ngx_http_file_cache_lock_wait_handler(ngx_event_t *ev)
 static void
 ngx_http_file_cache_lock_wait(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_uint_t              wait;
-    ngx_msec_t              now, timer;
-    ngx_http_file_cache_t  *cache;
+    ngx_uint_t                    wait;
+    ngx_msec_t                    now, timer, poll;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
 
     now = ngx_current_msec;
 
@@ -499,18 +740,21 @@ ngx_http_file_cache_lock_wait(ngx_http_request_t *r, ngx_http_cache_t *c)
     cache = c->file_cache;
     wait = 0;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    shard = ngx_http_file_cache_shard(cache, c->key);
+    ngx_http_file_cache_shard_lock(shard);
 
     timer = c->node->lock_time - now;
 
     if (c->node->updating && (ngx_msec_int_t) timer > 0) {
-        wait = 1;
+        wait = ngx_http_file_cache_stream_attach(r, c) ? 0 : 1;
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(&shard->mutex);
 
     if (wait) {
-        ngx_add_timer(&c->wait_event, (timer > 500) ? 500 : timer);
+        poll = c->lock_stream ? NGX_HTTP_CACHE_STREAM_POLL : 500;
+
+        ngx_add_timer(&c->wait_event, (timer > poll) ? poll : timer);
         return;
     }
 
@@ -522,183 +766,631 @@ wakeup:
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
+/*
+ * A request waiting for the cache lock can stream the response
+ * from the temp file the lock holder is writing it to, see
+ * ngx_http_file_cache_stream_update().  The holder publishes the
+ * temp file name and the number of bytes written in the node, and
+ * the waiters poll for more data.
+ */
+
+/* called with the shard mutex held */
+
+static ngx_uint_t
+ngx_http_file_cache_stream_attach(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    u_char                        *p;
-    time_t                         now;
-    ssize_t                        n;
-    ngx_str_t                     *key;
-    ngx_int_t                      rc;
-    ngx_uint_t                     i;
-    ngx_http_file_cache_t         *cache;
-    ngx_http_file_cache_header_t  *h;
+    ngx_http_file_cache_stream_t  *stream;
 
-    n = ngx_http_file_cache_aio_read(r, c);
+    stream = c->node->stream;
 
-    if (n < 0) {
-        return n;
+    if (!c->lock_stream
+        || r != r->main
+        || stream == NULL
+        || stream->size < (off_t) stream->body_start)
+    {
+        return 0;
     }
 
-    if ((size_t) n < c->header_start) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                      "cache file \"%s\" is too small", c->file.name.data);
-        return NGX_DECLINED;
-    }
+    stream->refs++;
+    c->stream = stream;
 
-    h = (ngx_http_file_cache_header_t *) c->buf->pos;
+    return 1;
+}
 
-    if (h->version != NGX_HTTP_CACHE_VERSION) {
-        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
-                      "cache file \"%s\" version mismatch", c->file.name.data);
-        return NGX_DECLINED;
-    }
 
-    if (h->crc32 != c->crc32 || (size_t) h->header_start != c->header_start) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                      "cache file \"%s\" has md5 collision", c->file.name.data);
-        return NGX_DECLINED;
-    }
+static ngx_int_t
+ngx_http_file_cache_stream_open(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    ngx_fd_t                      fd;
+    ngx_int_t                     rc;
+    ngx_str_t                     name;
+    ngx_err_t                     err;
+    ngx_pool_cleanup_t           *cln;
+    ngx_pool_cleanup_file_t      *clnf;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
 
-    p = c->buf->pos + sizeof(ngx_http_file_cache_header_t)
-        + sizeof(ngx_http_file_cache_key);
+    cache = c->file_cache;
 
-    key = c->keys.elts;
-    for (i = 0; i < c->keys.nelts; i++) {
-        if (ngx_memcmp(p, key[i].data, key[i].len) != 0) {
-            ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                          "cache file \"%s\" has md5 collision",
-                          c->file.name.data);
-            return NGX_DECLINED;
-        }
+    name.len = ngx_strlen(c->stream->name);
 
-        p += key[i].len;
+    name.data = ngx_pnalloc(r->pool, name.len + 1);
+    if (name.data == NULL) {
+        return NGX_ERROR;
     }
 
-    if ((size_t) h->body_start > c->body_start) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                      "cache file \"%s\" has too long header",
-                      c->file.name.data);
-        return NGX_DECLINED;
-    }
+    ngx_memcpy(name.data, c->stream->name, name.len + 1);
 
-    if (h->vary_len > NGX_HTTP_CACHE_VARY_LEN) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                      "cache file \"%s\" has incorrect vary length",
-                      c->file.name.data);
-        return NGX_DECLINED;
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_pool_cleanup_file_t));
+    if (cln == NULL) {
+        return NGX_ERROR;
     }
 
-    if (h->vary_len) {
-        ngx_http_file_cache_vary(r, h->vary, h->vary_len, c->variant);
+    fd = ngx_open_file(name.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
 
-        if (ngx_memcmp(c->variant, h->variant, NGX_HTTP_CACHE_KEY_LEN) != 0) {
-            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                           "http file cache vary mismatch");
-            return ngx_http_file_cache_reopen(r, c);
+    if (fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
+
+        if (err != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
+                          ngx_open_file_n " \"%s\" failed", name.data);
         }
-    }
 
-    c->buf->last += n;
+        rc = NGX_DECLINED;
+        goto failed;
+    }
 
-    c->valid_sec = h->valid_sec;
-    c->updating_sec = h->updating_sec;
-    c->error_sec = h->error_sec;
-    c->last_modified = h->last_modified;
-    c->date = h->date;
-    c->valid_msec = h->valid_msec;
-    c->body_start = h->body_start;
-    c->etag.len = h->etag_len;
-    c->etag.data = h->etag;
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache stream: \"%V\", fd: %d", &name, fd);
 
-    r->cached = 1;
+    cln->handler = ngx_pool_cleanup_file;
+    clnf = cln->data;
 
-    cache = c->file_cache;
+    clnf->fd = fd;
+    clnf->name = name.data;
+    clnf->log = r->pool->log;
 
-    if (cache->sh->cold) {
+    /* the name is kept, it is the one the response will be cached under */
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+    c->file.fd = fd;
+    c->file.log = r->connection->log;
 
-        if (!c->node->exists) {
-            c->node->uses = 1;
-            c->node->body_start = c->body_start;
-            c->node->exists = 1;
-            c->node->uniq = c->uniq;
-            c->node->fs_size = c->fs_size;
+    c->buf = ngx_create_temp_buf(r->pool, c->body_start);
+    if (c->buf == NULL) {
+        return NGX_ERROR;
+    }
 
-            cache->sh->size += c->fs_size;
-        }
+    rc = ngx_http_file_cache_read(r, c);
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+    if (rc == NGX_OK || rc == NGX_AGAIN || c->stream == NULL) {
+        return rc;
     }
 
-    now = ngx_time();
-
-    if (c->valid_sec < now) {
-        c->stale_updating = c->valid_sec + c->updating_sec >= now;
-        c->stale_error = c->valid_sec + c->error_sec >= now;
+failed:
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+    shard = ngx_http_file_cache_shard(cache, c->key);
+    ngx_http_file_cache_shard_lock(shard);
 
-        if (c->node->updating) {
-            rc = NGX_HTTP_CACHE_UPDATING;
+    ngx_http_file_cache_stream_release(cache, c);
 
-        } else {
-            c->node->updating = 1;
-            c->updating = 1;
-            c->lock_time = c->node->lock_time;
-            rc = NGX_HTTP_CACHE_STALE;
-        }
+    ngx_shmtx_unlock(&shard->mutex);
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+    if (rc == NGX_DECLINED && fd == NGX_INVALID_FILE) {
 
-        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http file cache expired: %i %T %T",
-                       rc, c->valid_sec, now);
+        /* the response is already in the cache, or was not completed */
 
-        return rc;
+        return ngx_http_file_cache_open(r);
     }
 
-    return NGX_OK;
+    return rc;
 }
 
 
-static ssize_t
-ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
+static void
+ngx_http_file_cache_stream_handler(ngx_event_t *ev)
 {
-#if (NGX_HAVE_FILE_AIO || NGX_THREADS)
-    ssize_t                    n;
-    ngx_http_core_loc_conf_t  *clcf;
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
 
-    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
-#endif
+    r = ev->data;
+    c = r->connection;
 
-#if (NGX_HAVE_FILE_AIO)
+    ngx_http_set_log_request(c->log, r);
 
-    if (clcf->aio == NGX_HTTP_AIO_ON && ngx_file_aio) {
-        n = ngx_file_aio_read(&c->file, c->buf->pos, c->body_start, 0, r->pool);
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http file cache stream: \"%V?%V\"", &r->uri, &r->args);
 
-        if (n != NGX_AGAIN) {
-            c->reading = 0;
-            return n;
-        }
+    ngx_http_file_cache_stream(r);
 
-        c->reading = 1;
+    ngx_http_run_posted_requests(c);
+}
 
-        c->file.aio->data = r;
-        c->file.aio->handler = ngx_http_cache_aio_event_handler;
 
-        r->main->blocked++;
-        r->aio = 1;
+static void
+ngx_http_file_cache_stream_writer(ngx_http_request_t *r)
+{
+    ngx_event_t               *wev;
+    ngx_http_core_loc_conf_t  *clcf;
 
-        return NGX_AGAIN;
+    wev = r->connection->write;
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, NGX_ETIMEDOUT,
+                      "client timed out");
+        r->connection->timedout = 1;
+
+        ngx_http_finalize_request(r, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
     }
 
-#endif
+    if (wev->delayed || r->aio) {
+        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
-#if (NGX_THREADS)
+        if (!wev->delayed) {
+            ngx_add_timer(wev, clcf->send_timeout);
+        }
 
-    if (clcf->aio == NGX_HTTP_AIO_THREADS) {
+        if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+            ngx_http_finalize_request(r, NGX_ERROR);
+        }
+
+        return;
+    }
+
+    ngx_http_file_cache_stream(r);
+}
+
+
+static void
+ngx_http_file_cache_stream(ngx_http_request_t *r)
+{
+    ngx_int_t                  rc;
+    ngx_event_t               *wev;
+    ngx_http_cache_t          *c;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    c = r->cache;
+    wev = r->connection->write;
+
+    rc = ngx_http_file_cache_stream_send(r);
+
+    if (rc == NGX_AGAIN) {
+
+        if (r->buffered || r->connection->buffered) {
+
+            /* the client is slower than the upstream */
+
+            clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+            if (!wev->delayed) {
+                ngx_add_timer(wev, clcf->send_timeout);
+            }
+
+            if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+                ngx_http_finalize_request(r, NGX_ERROR);
+            }
+
+            return;
+        }
+
+        if (wev->timer_set && !wev->delayed) {
+            ngx_del_timer(wev);
+        }
+
+        ngx_add_timer(&c->wait_event, NGX_HTTP_CACHE_STREAM_POLL);
+
+        return;
+    }
+
+    if (c->wait_event.timer_set) {
+        ngx_del_timer(&c->wait_event);
+    }
+
+    r->write_event_handler = ngx_http_request_empty_handler;
+
+    ngx_http_finalize_request(r, rc);
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_stream_send(ngx_http_request_t *r)
+{
+    off_t                         size;
+    ngx_int_t                     rc;
+    ngx_buf_t                    *b;
+    ngx_uint_t                    done, error;
+    ngx_chain_t                   out;
+    ngx_http_cache_t             *c;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
+
+    c = r->cache;
+
+    if (r->buffered || r->connection->buffered) {
+        if (ngx_http_output_filter(r, NULL) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (r->buffered || r->connection->buffered) {
+            return NGX_AGAIN;
+        }
+    }
+
+    cache = c->file_cache;
+
+    shard = ngx_http_file_cache_shard(cache, c->key);
+    ngx_http_file_cache_shard_lock(shard);
+
+    size = c->stream->size;
+    done = c->stream->done;
+    error = c->stream->error;
+
+    /* the holder has exited abnormally, or lost the lock */
+
+    if (!done
+        && (c->node->stream != c->stream
+            || (ngx_msec_int_t) (c->node->lock_time - ngx_current_msec) <= 0))
+    {
+        error = 1;
+    }
+
+    ngx_shmtx_unlock(&shard->mutex);
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache stream size: %O s:%O d:%ui e:%ui",
+                   size, c->stream_sent, done, error);
+
+    if (error) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "cache lock stream \"%V\" was not completed",
+                      &c->file.name);
+        return NGX_ERROR;
+    }
+
+    if (size == c->stream_sent && !done) {
+        return NGX_AGAIN;
+    }
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (size > c->stream_sent) {
+        b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+        if (b->file == NULL) {
+            return NGX_ERROR;
+        }
+
+        b->file_pos = c->stream_sent;
+        b->file_last = size;
+        b->in_file = 1;
+
+        b->file->fd = c->file.fd;
+        b->file->name = c->file.name;
+        b->file->log = r->connection->log;
+
+        c->stream_sent = size;
+    }
+
+    if (done) {
+        b->last_buf = 1;
+        b->last_in_chain = 1;
+
+    } else {
+        b->flush = 1;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    rc = ngx_http_output_filter(r, &out);
+
+    if (rc == NGX_ERROR || done) {
+        return rc;
+    }
+
+    return NGX_AGAIN;
+}
+
+
+void
+ngx_http_file_cache_stream_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
+{
+    size_t                         len;
+    ngx_uint_t                     owner;
+    ngx_http_cache_t              *c;
+    ngx_http_file_cache_t         *cache;
+    ngx_http_file_cache_shard_t   *shard;
+    ngx_http_file_cache_stream_t  *stream;
+
+    c = r->cache;
+
+    if (!c->updating
+        || c->updated
+        || tf == NULL
+        || tf->file.fd == NGX_INVALID_FILE
+        || tf->offset < (off_t) c->body_start)
+    {
+        return;
+    }
+
+    if (c->stream && c->stream->size == tf->offset) {
+        return;
+    }
+
+    cache = c->file_cache;
+
+    shard = ngx_http_file_cache_shard(cache, c->key);
+    ngx_http_file_cache_shard_lock(shard);
+
+    owner = (c->node->lock_time == c->lock_time);
+
+    if (c->stream == NULL) {
+
+        if (!owner) {
+            goto done;
+        }
+
+        len = tf->file.name.len;
+
+        stream = ngx_slab_alloc(cache->shpool,
+                                sizeof(ngx_http_file_cache_stream_t) + len);
+        if (stream == NULL) {
+            goto done;
+        }
+
+        stream->body_start = c->body_start;
+        stream->refs = 1;
+        stream->done = 0;
+        stream->error = 0;
+
+        ngx_memcpy(stream->name, tf->file.name.data, len);
+        stream->name[len] = '\0';
+
+        c->node->stream = stream;
+        c->stream = stream;
+    }
+
+    c->stream->size = tf->offset;
+
+    if (owner) {
+
+        /* the lock does not age while the response makes progress */
+
+        c->node->lock_time = ngx_current_msec + c->lock_age;
+        c->lock_time = c->node->lock_time;
+    }
+
+done:
+
+    ngx_shmtx_unlock(&shard->mutex);
+}
+
+
+/* both are called with the shard mutex held */
+
+static void
+ngx_http_file_cache_stream_close(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c, ngx_uint_t error)
+{
+    if (error) {
+        c->stream->error = 1;
+
+    } else {
+        c->stream->done = 1;
+    }
+
+    if (c->node->stream == c->stream) {
+        c->node->stream = NULL;
+    }
+
+    ngx_http_file_cache_stream_release(cache, c);
+}
+
+
+static void
+ngx_http_file_cache_stream_release(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c)
+{
+    if (--c->stream->refs == 0) {
+        ngx_slab_free(cache->shpool, c->stream);
+    }
+
+    c->stream = NULL;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    u_char                        *p;
+    time_t                         now;
+    ssize_t                        n;
+    ngx_str_t                     *key;
+    ngx_int_t                      rc;
+    ngx_uint_t                     i;
+    ngx_http_file_cache_t         *cache;
+    ngx_http_file_cache_shard_t   *shard;
+    ngx_http_file_cache_header_t  *h;
+
+    n = ngx_http_file_cache_aio_read(r, c);
+
+    if (n < 0) {
+        return n;
+    }
+
+    if ((size_t) n < c->header_start) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      "cache file \"%s\" is too small", c->file.name.data);
+        return NGX_DECLINED;
+    }
+
+    h = (ngx_http_file_cache_header_t *) c->buf->pos;
+
+    if (h->version != NGX_HTTP_CACHE_VERSION) {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                      "cache file \"%s\" version mismatch", c->file.name.data);
+        return NGX_DECLINED;
+    }
+
+    if (h->crc32 != c->crc32 || (size_t) h->header_start != c->header_start) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      "cache file \"%s\" has md5 collision", c->file.name.data);
+        return NGX_DECLINED;
+    }
+
+    p = c->buf->pos + sizeof(ngx_http_file_cache_header_t)
+        + sizeof(ngx_http_file_cache_key);
+
+    key = c->keys.elts;
+    for (i = 0; i < c->keys.nelts; i++) {
+        if (ngx_memcmp(p, key[i].data, key[i].len) != 0) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                          "cache file \"%s\" has md5 collision",
+                          c->file.name.data);
+            return NGX_DECLINED;
+        }
+
+        p += key[i].len;
+    }
+
+    if ((size_t) h->body_start > c->body_start) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      "cache file \"%s\" has too long header",
+                      c->file.name.data);
+        return NGX_DECLINED;
+    }
+
+    if (h->vary_len > NGX_HTTP_CACHE_VARY_LEN) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      "cache file \"%s\" has incorrect vary length",
+                      c->file.name.data);
+        return NGX_DECLINED;
+    }
+
+    if (h->vary_len) {
+        ngx_http_file_cache_vary(r, h->vary, h->vary_len, c->variant);
+
+        if (ngx_memcmp(c->variant, h->variant, NGX_HTTP_CACHE_KEY_LEN) != 0) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http file cache vary mismatch");
+            return ngx_http_file_cache_reopen(r, c);
+        }
+    }
+
+    c->buf->last += n;
+
+    c->valid_sec = h->valid_sec;
+    c->updating_sec = h->updating_sec;
+    c->error_sec = h->error_sec;
+    c->last_modified = h->last_modified;
+    c->date = h->date;
+    c->valid_msec = h->valid_msec;
+    c->body_start = h->body_start;
+    c->etag.len = h->etag_len;
+    c->etag.data = h->etag;
+
+    r->cached = 1;
+
+    if (c->stream) {
+        return NGX_OK;
+    }
+
+    cache = c->file_cache;
+
+    if (cache->sh->cold) {
+
+        shard = ngx_http_file_cache_shard(cache, c->key);
+        ngx_http_file_cache_shard_lock(shard);
+
+        if (!c->node->exists) {
+            c->node->uses = 1;
+            c->node->body_start = c->body_start;
+            c->node->exists = 1;
+            c->node->uniq = c->uniq;
+            c->node->fs_size = c->fs_size;
+
+            (void) ngx_atomic_fetch_add(&cache->sh->size, c->fs_size);
+        }
+
+        ngx_shmtx_unlock(&shard->mutex);
+    }
+
+    now = ngx_time();
+
+    if (c->valid_sec < now) {
+        c->stale_updating = c->valid_sec + c->updating_sec >= now;
+        c->stale_error = c->valid_sec + c->error_sec >= now;
+
+        shard = ngx_http_file_cache_shard(cache, c->key);
+        ngx_http_file_cache_shard_lock(shard);
+
+        if (c->node->updating) {
+            rc = NGX_HTTP_CACHE_UPDATING;
+
+        } else {
+            c->node->updating = 1;
+            c->updating = 1;
+            c->lock_time = c->node->lock_time;
+            rc = NGX_HTTP_CACHE_STALE;
+        }
+
+        ngx_shmtx_unlock(&shard->mutex);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache expired: %i %T %T",
+                       rc, c->valid_sec, now);
+
+        return rc;
+    }
+
+    /* the whole response is already in the buffer */
+
+    if (cache->ram && n == c->length) {
+        ngx_http_file_cache_ram_store(cache, c->key, c->buf->pos, n);
+    }
+
+    return NGX_OK;
+}
+
+
+static ssize_t
+ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+#if (NGX_HAVE_FILE_AIO || NGX_THREADS)
+    ssize_t                    n;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+#endif
+
+#if (NGX_HAVE_FILE_AIO)
+
+    if (clcf->aio == NGX_HTTP_AIO_ON && ngx_file_aio) {
+        n = ngx_file_aio_read(&c->file, c->buf->pos, c->body_start, 0, r->pool);
+
+        if (n != NGX_AGAIN) {
+            c->reading = 0;
+            return n;
+        }
+
+        c->reading = 1;
+
+        c->file.aio->data = r;
+        c->file.aio->handler = ngx_http_cache_aio_event_handler;
+
+        r->main->blocked++;
+        r->aio = 1;
+
+        return NGX_AGAIN;
+    }
+
+#endif
+
+#if (NGX_THREADS)
+
+    if (clcf->aio == NGX_HTTP_AIO_THREADS) {
         c->file.thread_task = c->thread_task;
         c->file.thread_handler = ngx_http_cache_thread_handler;
         c->file.thread_ctx = r;
@@ -819,15 +1511,17 @@ ngx_http_cache_thread_event_handler(ngx_event_t *ev)
 static ngx_int_t
 ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 {
-    ngx_int_t                    rc;
-    ngx_http_file_cache_node_t  *fcn;
+    ngx_int_t                     rc;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *shard;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    shard = ngx_http_file_cache_shard(cache, c->key);
+    ngx_http_file_cache_shard_lock(shard);
 
     fcn = c->node;
 
     if (fcn == NULL) {
-        fcn = ngx_http_file_cache_lookup(cache, c->key);
+        fcn = ngx_http_file_cache_lookup(shard, c->key);
     }
 
     if (fcn) {
@@ -836,6 +1530,10 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
         if (c->node == NULL) {
             fcn->uses++;
             fcn->count++;
+
+            if (cache->admission) {
+                (void) ngx_http_file_cache_sketch(cache, shard, c->key);
+            }
         }
 
         if (fcn->error) {
@@ -866,19 +1564,36 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
         goto done;
     }
 
-    fcn = ngx_slab_calloc_locked(cache->shpool,
-                                 sizeof(ngx_http_file_cache_node_t));
+    /*
+     * keys not seen often enough recently do not get a node,
+     * and their responses are not written to the cache
+     */
+
+    if (cache->admission
+        && !cache->sh->cold
+        && !c->admitted
+        && ngx_http_file_cache_sketch(cache, shard, c->key)
+           < cache->admission)
+    {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache not admitted");
+
+        rc = NGX_AGAIN;
+        goto failed;
+    }
+
+    fcn = ngx_slab_calloc(cache->shpool, sizeof(ngx_http_file_cache_node_t));
     if (fcn == NULL) {
         ngx_http_file_cache_set_watermark(cache);
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        ngx_shmtx_unlock(&shard->mutex);
 
-        (void) ngx_http_file_cache_forced_expire(cache);
+        (void) ngx_http_file_cache_forced_expire(cache, NULL);
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_http_file_cache_shard_lock(shard);
 
-        fcn = ngx_slab_calloc_locked(cache->shpool,
-                                     sizeof(ngx_http_file_cache_node_t));
+        fcn = ngx_slab_calloc(cache->shpool,
+                              sizeof(ngx_http_file_cache_node_t));
         if (fcn == NULL) {
             ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
                           "could not allocate node%s", cache->shpool->log_ctx);
@@ -887,14 +1602,15 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
         }
     }
 
-    cache->sh->count++;
+    (void) ngx_atomic_fetch_add(&cache->sh->count, 1);
+    shard->count++;
 
     ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
 
     ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
                NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-    ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+    ngx_rbtree_insert(&shard->rbtree, &fcn->node);
 
     fcn->uses = 1;
     fcn->count = 1;
@@ -915,7 +1631,7 @@ done:
 
     fcn->expire = ngx_time() + cache->inactive;
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+    ngx_queue_insert_head(&shard->queue, &fcn->queue);
 
     c->uniq = fcn->uniq;
     c->error = fcn->error;
@@ -923,7 +1639,7 @@ done:
 
 failed:
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(&shard->mutex);
 
     return rc;
 }
@@ -965,7 +1681,7 @@ ngx_http_file_cache_name(ngx_http_request_t *r, ngx_path_t *path)
 
 
 static ngx_http_file_cache_node_t *
-ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key)
+ngx_http_file_cache_lookup(ngx_http_file_cache_shard_t *shard, u_char *key)
 {
     ngx_int_t                    rc;
     ngx_rbtree_key_t             node_key;
@@ -974,8 +1690,365 @@ ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key)
 
     ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
 
-    node = cache->sh->rbtree.root;
-    sentinel = cache->sh->rbtree.sentinel;
+    node = shard->rbtree.root;
+    sentinel = shard->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (node_key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (node_key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* node_key == node->key */
+
+        fcn = (ngx_http_file_cache_node_t *) node;
+
+        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                        NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+        if (rc == 0) {
+            return fcn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    /* not found */
+
+    return NULL;
+}
+
+
+/*
+ * the first two bytes of the key select the shard, the rest of
+ * the key is left for the tree and the admission sketch
+ */
+
+static ngx_http_file_cache_shard_t *
+ngx_http_file_cache_shard(ngx_http_file_cache_t *cache, u_char *key)
+{
+    return &cache->sh->shards[(key[0] << 8 | key[1]) % cache->sh->nshards];
+}
+
+
+static void
+ngx_http_file_cache_shard_lock(ngx_http_file_cache_shard_t *shard)
+{
+    if (!ngx_shmtx_trylock(&shard->mutex)) {
+        ngx_shmtx_lock(&shard->mutex);
+        shard->contended++;
+    }
+
+    shard->locks++;
+}
+
+
+static void
+ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t           **p;
+    ngx_http_file_cache_node_t   *cn, *cnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            cn = (ngx_http_file_cache_node_t *) node;
+            cnt = (ngx_http_file_cache_node_t *) temp;
+
+            p = (ngx_memcmp(cn->key, cnt->key,
+                            NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t))
+                 < 0)
+                    ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_ram_read(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    u_char                          *p;
+    ngx_str_t                       *key;
+    ngx_uint_t                       i;
+    ngx_http_file_cache_t           *cache;
+    ngx_http_file_cache_header_t    *h;
+    ngx_http_file_cache_ram_node_t  *rn;
+
+    cache = c->file_cache;
+
+    ngx_shmtx_lock(&cache->ram_pool->mutex);
+
+    rn = ngx_http_file_cache_ram_lookup(cache, c->key);
+
+    if (rn == NULL) {
+        ngx_shmtx_unlock(&cache->ram_pool->mutex);
+        return NGX_DECLINED;
+    }
+
+    h = (ngx_http_file_cache_header_t *) rn->data;
+
+    /* stale responses are left to the file, which has the actual header */
+
+    if (h->valid_sec < ngx_time()) {
+        ngx_shmtx_unlock(&cache->ram_pool->mutex);
+        return NGX_DECLINED;
+    }
+
+    c->buf = ngx_create_temp_buf(r->pool, rn->len);
+    if (c->buf == NULL) {
+        ngx_shmtx_unlock(&cache->ram_pool->mutex);
+        return NGX_ERROR;
+    }
+
+    c->buf->last = ngx_cpymem(c->buf->pos, rn->data, rn->len);
+
+    ngx_queue_remove(&rn->queue);
+    ngx_queue_insert_head(&cache->ram->queue, &rn->queue);
+
+    ngx_shmtx_unlock(&cache->ram_pool->mutex);
+
+    h = (ngx_http_file_cache_header_t *) c->buf->pos;
+
+    if (h->version != NGX_HTTP_CACHE_VERSION
+        || h->crc32 != c->crc32
+        || (size_t) h->header_start != c->header_start
+        || h->vary_len)
+    {
+        return NGX_DECLINED;
+    }
+
+    p = c->buf->pos + sizeof(ngx_http_file_cache_header_t)
+        + sizeof(ngx_http_file_cache_key);
+
+    key = c->keys.elts;
+    for (i = 0; i < c->keys.nelts; i++) {
+        if (ngx_memcmp(p, key[i].data, key[i].len) != 0) {
+            return NGX_DECLINED;
+        }
+
+        p += key[i].len;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache ram hit: %uz", c->buf->last - c->buf->pos);
+
+    c->valid_sec = h->valid_sec;
+    c->updating_sec = h->updating_sec;
+    c->error_sec = h->error_sec;
+    c->last_modified = h->last_modified;
+    c->date = h->date;
+    c->valid_msec = h->valid_msec;
+    c->body_start = h->body_start;
+    c->etag.len = h->etag_len;
+    c->etag.data = h->etag;
+
+    c->length = c->buf->last - c->buf->pos;
+    c->ram = 1;
+
+    r->cached = 1;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_file_cache_ram_add(ngx_http_request_t *r, ngx_temp_file_t *tf)
+{
+    u_char            *data;
+    size_t             len;
+    ssize_t            n;
+    ngx_http_cache_t  *c;
+
+    c = r->cache;
+    len = (size_t) tf->offset;
+
+    data = ngx_alloc(len, r->connection->log);
+    if (data == NULL) {
+        ngx_http_file_cache_ram_delete(c->file_cache, c->key);
+        return;
+    }
+
+    n = ngx_read_file(&tf->file, data, len, 0);
+
+    if (n == (ssize_t) len) {
+        ngx_http_file_cache_ram_store(c->file_cache, c->key, data, len);
+
+    } else {
+        ngx_http_file_cache_ram_delete(c->file_cache, c->key);
+    }
+
+    ngx_free(data);
+}
+
+
+static void
+ngx_http_file_cache_ram_store(ngx_http_file_cache_t *cache, u_char *key,
+    u_char *data, size_t len)
+{
+    size_t                           size;
+    ngx_uint_t                       n;
+    ngx_queue_t                     *q;
+    ngx_http_file_cache_header_t    *h;
+    ngx_http_file_cache_ram_node_t  *rn;
+
+    h = (ngx_http_file_cache_header_t *) data;
+
+    if (len > cache->ram_max_object
+        || len < sizeof(ngx_http_file_cache_header_t)
+        || h->vary_len)
+    {
+        /* an older copy of the key must not outlive its file */
+
+        ngx_http_file_cache_ram_delete(cache, key);
+        return;
+    }
+
+    ngx_shmtx_lock(&cache->ram_pool->mutex);
+
+    rn = ngx_http_file_cache_ram_lookup(cache, key);
+
+    if (rn) {
+        if (rn->len == len) {
+            ngx_memcpy(rn->data, data, len);
+
+            ngx_queue_remove(&rn->queue);
+            ngx_queue_insert_head(&cache->ram->queue, &rn->queue);
+
+            ngx_shmtx_unlock(&cache->ram_pool->mutex);
+            return;
+        }
+
+        ngx_http_file_cache_ram_free(cache, rn);
+    }
+
+    size = offsetof(ngx_http_file_cache_ram_node_t, data) + len;
+
+    for (n = 0; /* void */ ; n++) {
+
+        rn = ngx_slab_alloc_locked(cache->ram_pool, size);
+        if (rn) {
+            break;
+        }
+
+        if (n == 64 || ngx_queue_empty(&cache->ram->queue)) {
+            ngx_shmtx_unlock(&cache->ram_pool->mutex);
+            return;
+        }
+
+        q = ngx_queue_last(&cache->ram->queue);
+
+        ngx_http_file_cache_ram_free(cache,
+                      ngx_queue_data(q, ngx_http_file_cache_ram_node_t, queue));
+    }
+
+    ngx_memcpy((u_char *) &rn->node.key, key, sizeof(ngx_rbtree_key_t));
+    ngx_memcpy(rn->key, &key[sizeof(ngx_rbtree_key_t)],
+               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+    rn->len = len;
+    ngx_memcpy(rn->data, data, len);
+
+    ngx_rbtree_insert(&cache->ram->rbtree, &rn->node);
+    ngx_queue_insert_head(&cache->ram->queue, &rn->queue);
+
+    cache->ram->size += len;
+    cache->ram->count++;
+
+    ngx_shmtx_unlock(&cache->ram_pool->mutex);
+}
+
+
+static void
+ngx_http_file_cache_ram_delete(ngx_http_file_cache_t *cache, u_char *key)
+{
+    ngx_http_file_cache_ram_node_t  *rn;
+
+    ngx_shmtx_lock(&cache->ram_pool->mutex);
+
+    rn = ngx_http_file_cache_ram_lookup(cache, key);
+
+    if (rn) {
+        ngx_http_file_cache_ram_free(cache, rn);
+    }
+
+    ngx_shmtx_unlock(&cache->ram_pool->mutex);
+}
+
+
+/* called with the shard mutex held when a node or its file goes away */
+
+static void
+ngx_http_file_cache_ram_delete_node(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
+{
+    u_char  key[NGX_HTTP_CACHE_KEY_LEN];
+
+    if (cache->ram == NULL) {
+        return;
+    }
+
+    ngx_memcpy(key, (u_char *) &fcn->node.key, sizeof(ngx_rbtree_key_t));
+    ngx_memcpy(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+    ngx_http_file_cache_ram_delete(cache, key);
+}
+
+
+static void
+ngx_http_file_cache_ram_free(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_ram_node_t *rn)
+{
+    ngx_queue_remove(&rn->queue);
+    ngx_rbtree_delete(&cache->ram->rbtree, &rn->node);
+
+    cache->ram->size -= rn->len;
+    cache->ram->count--;
+
+    ngx_slab_free_locked(cache->ram_pool, rn);
+}
+
+
+static ngx_http_file_cache_ram_node_t *
+ngx_http_file_cache_ram_lookup(ngx_http_file_cache_t *cache, u_char *key)
+{
+    ngx_int_t                        rc;
+    ngx_rbtree_key_t                 node_key;
+    ngx_rbtree_node_t               *node, *sentinel;
+    ngx_http_file_cache_ram_node_t  *rn;
+
+    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
+
+    node = cache->ram->rbtree.root;
+    sentinel = cache->ram->rbtree.sentinel;
 
     while (node != sentinel) {
 
@@ -991,13 +2064,13 @@ ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key)
 
         /* node_key == node->key */
 
-        fcn = (ngx_http_file_cache_node_t *) node;
+        rn = (ngx_http_file_cache_ram_node_t *) node;
 
-        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], rn->key,
                         NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
         if (rc == 0) {
-            return fcn;
+            return rn;
         }
 
         node = (rc < 0) ? node->left : node->right;
@@ -1009,49 +2082,6 @@ ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key)
 }
 
 
-static void
-ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
-    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
-{
-    ngx_rbtree_node_t           **p;
-    ngx_http_file_cache_node_t   *cn, *cnt;
-
-    for ( ;; ) {
-
-        if (node->key < temp->key) {
-
-            p = &temp->left;
-
-        } else if (node->key > temp->key) {
-
-            p = &temp->right;
-
-        } else { /* node->key == temp->key */
-
-            cn = (ngx_http_file_cache_node_t *) node;
-            cnt = (ngx_http_file_cache_node_t *) temp;
-
-            p = (ngx_memcmp(cn->key, cnt->key,
-                            NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t))
-                 < 0)
-                    ? &temp->left : &temp->right;
-        }
-
-        if (*p == sentinel) {
-            break;
-        }
-
-        temp = *p;
-    }
-
-    *p = node;
-    node->parent = temp;
-    node->left = sentinel;
-    node->right = sentinel;
-    ngx_rbt_red(node);
-}
-
-
 static void
 ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary, size_t len,
     u_char *hash)
@@ -1207,7 +2237,8 @@ ngx_http_file_cache_vary_header(ngx_http_request_t *r, ngx_md5_t *md5,
 static ngx_int_t
 ngx_http_file_cache_reopen(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_http_file_cache_t  *cache;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
                    "http file cache reopen");
@@ -1221,12 +2252,17 @@ ngx_http_file_cache_reopen(ngx_http_request_t *r, ngx_http_cache_t *c)
 
     cache = c->file_cache;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    shard = ngx_http_file_cache_shard(cache, c->key);
+    ngx_http_file_cache_shard_lock(shard);
+
+    if (c->stream) {
+        ngx_http_file_cache_stream_release(cache, c);
+    }
 
     c->node->count--;
     c->node = NULL;
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(&shard->mutex);
 
     c->secondary = 1;
     c->file.name.len = 0;
@@ -1306,7 +2342,8 @@ ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf)
 static ngx_int_t
 ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_http_file_cache_t  *cache;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
 
     if (!c->secondary) {
         return NGX_OK;
@@ -1328,19 +2365,26 @@ ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http file cache main key");
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    shard = ngx_http_file_cache_shard(cache, c->key);
+    ngx_http_file_cache_shard_lock(shard);
 
     c->node->count--;
     c->node->updating = 0;
     c->node = NULL;
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(&shard->mutex);
 
     c->file.name.len = 0;
 
     ngx_memcpy(c->key, c->main, NGX_HTTP_CACHE_KEY_LEN);
 
-    if (ngx_http_file_cache_exists(cache, c) == NGX_ERROR) {
+    /* the response is stored under the main key, it needs a node */
+
+    c->admitted = 1;
+
+    if (ngx_http_file_cache_exists(cache, c) == NGX_ERROR
+        || c->node == NULL)
+    {
         return NGX_ERROR;
     }
 
@@ -1355,13 +2399,15 @@ ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
 void
 ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
 {
-    off_t                   fs_size;
-    ngx_int_t               rc;
-    ngx_file_uniq_t         uniq;
-    ngx_file_info_t         fi;
-    ngx_http_cache_t        *c;
-    ngx_ext_rename_file_t   ext;
-    ngx_http_file_cache_t  *cache;
+    off_t                         fs_size;
+    ngx_int_t                     rc;
+    ngx_uint_t                    updating;
+    ngx_file_uniq_t               uniq;
+    ngx_file_info_t               fi;
+    ngx_http_cache_t             *c;
+    ngx_ext_rename_file_t         ext;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
 
     c = r->cache;
 
@@ -1375,6 +2421,7 @@ ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
     cache = c->file_cache;
 
     c->updated = 1;
+    updating = c->updating;
     c->updating = 0;
 
     uniq = 0;
@@ -1407,14 +2454,26 @@ ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
         }
     }
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    if (cache->ram) {
+        if (rc == NGX_OK && tf->offset <= (off_t) cache->ram_max_object) {
+            ngx_http_file_cache_ram_add(r, tf);
+
+        } else {
+            ngx_http_file_cache_ram_delete(cache, c->key);
+        }
+    }
+
+    shard = ngx_http_file_cache_shard(cache, c->key);
+    ngx_http_file_cache_shard_lock(shard);
 
     c->node->count--;
     c->node->error = 0;
     c->node->uniq = uniq;
     c->node->body_start = c->body_start;
 
-    cache->sh->size += fs_size - c->node->fs_size;
+    (void) ngx_atomic_fetch_add(&cache->sh->size,
+                                (ngx_atomic_int_t) fs_size
+                                - (ngx_atomic_int_t) c->node->fs_size);
     c->node->fs_size = fs_size;
 
     if (rc == NGX_OK) {
@@ -1423,19 +2482,31 @@ ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
 
     c->node->updating = 0;
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    if (c->stream) {
+        if (updating) {
+            c->stream->size = tf->offset;
+            ngx_http_file_cache_stream_close(cache, c, rc != NGX_OK);
+
+        } else {
+            ngx_http_file_cache_stream_release(cache, c);
+        }
+    }
+
+    ngx_shmtx_unlock(&shard->mutex);
 }
 
 
 void
 ngx_http_file_cache_update_header(ngx_http_request_t *r)
 {
-    ssize_t                        n;
-    ngx_err_t                      err;
-    ngx_file_t                     file;
-    ngx_file_info_t                fi;
-    ngx_http_cache_t              *c;
-    ngx_http_file_cache_header_t   h;
+    ssize_t                          n;
+    ngx_err_t                        err;
+    ngx_file_t                       file;
+    ngx_file_info_t                  fi;
+    ngx_http_cache_t                *c;
+    ngx_http_file_cache_t           *cache;
+    ngx_http_file_cache_header_t     h;
+    ngx_http_file_cache_ram_node_t  *rn;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http file cache update header");
@@ -1550,6 +2621,20 @@ ngx_http_file_cache_update_header(ngx_http_request_t *r)
     (void) ngx_write_file(&file, (u_char *) &h,
                           sizeof(ngx_http_file_cache_header_t), 0);
 
+    cache = c->file_cache;
+
+    if (cache->ram) {
+        ngx_shmtx_lock(&cache->ram_pool->mutex);
+
+        rn = ngx_http_file_cache_ram_lookup(cache, c->key);
+
+        if (rn) {
+            ngx_memcpy(rn->data, &h, sizeof(ngx_http_file_cache_header_t));
+        }
+
+        ngx_shmtx_unlock(&cache->ram_pool->mutex);
+    }
+
 done:
 
     if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
@@ -1583,9 +2668,15 @@ ngx_http_cache_send(ngx_http_request_t *r)
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
-    if (b->file == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    if (!c->ram) {
+        b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+        if (b->file == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    if (c->stream) {
+        r->allow_ranges = 0;
     }
 
     rc = ngx_http_send_header(r);
@@ -1594,17 +2685,40 @@ ngx_http_cache_send(ngx_http_request_t *r)
         return rc;
     }
 
-    b->file_pos = c->body_start;
-    b->file_last = c->length;
+    if (c->stream) {
+        c->stream_sent = c->body_start;
+
+        c->wait_event.handler = ngx_http_file_cache_stream_handler;
+        c->wait_event.data = r;
+        c->wait_event.log = r->connection->log;
+
+        r->write_event_handler = ngx_http_file_cache_stream_writer;
+
+        ngx_http_file_cache_stream(r);
+
+        return NGX_DONE;
+    }
+
+    if (c->ram) {
+        b->pos = c->buf->pos + c->body_start;
+        b->last = c->buf->pos + c->length;
+
+        b->memory = (c->length - c->body_start) ? 1: 0;
+
+    } else {
+        b->file_pos = c->body_start;
+        b->file_last = c->length;
+
+        b->in_file = (c->length - c->body_start) ? 1: 0;
+
+        b->file->fd = c->file.fd;
+        b->file->name = c->file.name;
+        b->file->log = r->connection->log;
+    }
 
-    b->in_file = (c->length - c->body_start) ? 1: 0;
     b->last_buf = (r == r->main) ? 1: 0;
     b->last_in_chain = 1;
 
-    b->file->fd = c->file.fd;
-    b->file->name = c->file.name;
-    b->file->log = r->connection->log;
-
     out.buf = b;
     out.next = NULL;
 
@@ -1615,8 +2729,9 @@ ngx_http_cache_send(ngx_http_request_t *r)
 void
 ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
 {
-    ngx_http_file_cache_t       *cache;
-    ngx_http_file_cache_node_t  *fcn;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *shard;
 
     if (c->updated || c->node == NULL) {
         return;
@@ -1627,7 +2742,17 @@ ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
                    "http file cache free, fd: %d", c->file.fd);
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    shard = ngx_http_file_cache_shard(cache, c->key);
+    ngx_http_file_cache_shard_lock(shard);
+
+    if (c->stream) {
+        if (c->updating) {
+            ngx_http_file_cache_stream_close(cache, c, 1);
+
+        } else {
+            ngx_http_file_cache_stream_release(cache, c);
+        }
+    }
 
     fcn = c->node;
     fcn->count--;
@@ -1645,14 +2770,16 @@ ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
         }
 
     } else if (!fcn->exists && fcn->count == 0 && c->min_uses == 1) {
+        ngx_http_file_cache_ram_delete_node(cache, fcn);
         ngx_queue_remove(&fcn->queue);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
-        cache->sh->count--;
+        ngx_rbtree_delete(&shard->rbtree, &fcn->node);
+        ngx_slab_free(cache->shpool, fcn);
+        (void) ngx_atomic_fetch_add(&cache->sh->count, -1);
+        shard->count--;
         c->node = NULL;
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(&shard->mutex);
 
     c->updated = 1;
     c->updating = 0;
@@ -1669,320 +2796,661 @@ ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
                               tf->file.name.data);
             }
         }
-    }
+    }
+
+    if (c->wait_event.timer_set) {
+        ngx_del_timer(&c->wait_event);
+    }
+}
+
+
+static void
+ngx_http_file_cache_cleanup(void *data)
+{
+    ngx_http_cache_t  *c = data;
+
+    if (c->updated) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache cleanup");
+
+    if (c->updating && !c->background) {
+        ngx_log_error(NGX_LOG_ALERT, c->file.log, 0,
+                      "stalled cache updating, error:%ui", c->error);
+    }
+
+    ngx_http_file_cache_free(c, NULL);
+}
+
+
+/*
+ * a worker which failed to allocate a node passes no batch: the least
+ * recently used file is unlinked and its node is freed at once, so the
+ * allocation can be retried
+ */
+
+static time_t
+ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_batch_t *batch)
+{
+    u_char                       *p;
+    size_t                        len;
+    time_t                        wait, expire;
+    ngx_uint_t                    i, tries;
+    ngx_queue_t                  *q, *sentinel;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *shard;
+    u_char                        key[2 * NGX_HTTP_CACHE_KEY_LEN];
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache forced expire");
+
+    /* the least recently used node is at the tail of one of the shards */
+
+    shard = &cache->sh->shards[0];
+    expire = NGX_MAX_TIME_T_VALUE;
+
+    for (i = 0; i < cache->sh->nshards; i++) {
+        ngx_http_file_cache_shard_lock(&cache->sh->shards[i]);
+
+        q = ngx_http_file_cache_evict_last(&cache->sh->shards[i]);
+
+        if (q) {
+            fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+            if (fcn->expire < expire) {
+                expire = fcn->expire;
+                shard = &cache->sh->shards[i];
+            }
+        }
+
+        ngx_shmtx_unlock(&cache->sh->shards[i].mutex);
+    }
+
+    wait = 10;
+    tries = 20;
+    sentinel = NULL;
+
+    ngx_http_file_cache_shard_lock(shard);
+
+    for ( ;; ) {
+        q = ngx_http_file_cache_evict_last(shard);
+
+        if (q == NULL || q == sentinel) {
+            break;
+        }
+
+        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                  "http file cache forced expire: #%d %d %02xd%02xd%02xd%02xd",
+                  fcn->count, fcn->exists,
+                  fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+
+        if (fcn->count == 0) {
+            ngx_http_file_cache_evict(cache, shard, q, batch);
+            wait = 0;
+            break;
+        }
+
+        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
+                         sizeof(ngx_rbtree_key_t));
+        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+        (void) ngx_hex_dump(p, fcn->key, len);
+
+        /*
+         * abnormally exited workers may leave locked cache entries,
+         * and although it may be safe to remove them completely,
+         * we prefer to just move them to the top of the inactive queue
+         */
+
+        ngx_queue_remove(q);
+        fcn->expire = ngx_time() + cache->inactive;
+        ngx_queue_insert_head(&shard->queue, &fcn->queue);
+
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      "ignore long locked inactive cache entry %*s, count:%d",
+                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+
+        if (sentinel == NULL) {
+            sentinel = q;
+        }
+
+        if (--tries) {
+            continue;
+        }
+
+        wait = 1;
+        break;
+    }
+
+    ngx_shmtx_unlock(&shard->mutex);
+
+    return wait;
+}
+
+
+static time_t
+ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
+{
+    u_char                       *p;
+    size_t                        len;
+    time_t                        now, wait, min;
+    ngx_uint_t                    i, n;
+    ngx_msec_t                    elapsed;
+    ngx_queue_t                  *q;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *shard;
+    u_char                        key[2 * NGX_HTTP_CACHE_KEY_LEN];
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache expire");
+
+    now = ngx_time();
+    min = 10;
+
+    /* start from another shard each time to share the files limit */
+
+    n = cache->sh->cursor++;
+
+    for (i = 0; i < cache->sh->nshards; i++) {
+
+        shard = &cache->sh->shards[(n + i) % cache->sh->nshards];
+
+        ngx_http_file_cache_shard_lock(shard);
+
+        for ( ;; ) {
+
+            if (ngx_quit || ngx_terminate) {
+                wait = 1;
+                break;
+            }
+
+            q = ngx_http_file_cache_evict_last(shard);
+
+            if (q == NULL) {
+                wait = 10;
+                break;
+            }
+
+            fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+            wait = fcn->expire - now;
+
+            if (wait > 0) {
+                wait = wait > 10 ? 10 : wait;
+                break;
+            }
+
+            ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache expire: #%d %d %02xd%02xd%02xd%02xd",
+                       fcn->count, fcn->exists,
+                       fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+
+            if (fcn->count == 0) {
+                ngx_http_file_cache_evict(cache, shard, q,
+                                          cache->manager_batch);
+                goto next;
+            }
+
+            p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
+                             sizeof(ngx_rbtree_key_t));
+            len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+            (void) ngx_hex_dump(p, fcn->key, len);
+
+            /*
+             * abnormally exited workers may leave locked cache entries,
+             * and although it may be safe to remove them completely,
+             * we prefer to just move them to the top of the inactive queue
+             */
+
+            ngx_queue_remove(q);
+            fcn->expire = ngx_time() + cache->inactive;
+            ngx_queue_insert_head(&shard->queue, &fcn->queue);
+
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                       "ignore long locked inactive cache entry %*s, count:%d",
+                       (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+
+next:
+
+            if (++cache->files >= cache->manager_files) {
+                wait = 0;
+                break;
+            }
+
+            ngx_time_update();
+
+            elapsed = ngx_abs((ngx_msec_int_t)
+                              (ngx_current_msec - cache->last));
+
+            if (elapsed >= cache->manager_threshold) {
+                wait = 0;
+                break;
+            }
+        }
+
+        ngx_shmtx_unlock(&shard->mutex);
+
+        if (wait < min) {
+            min = wait;
+        }
 
-    if (c->wait_event.timer_set) {
-        ngx_del_timer(&c->wait_event);
+        if (min == 0 || ngx_quit || ngx_terminate) {
+            break;
+        }
     }
+
+    return min;
 }
 
 
-static void
-ngx_http_file_cache_cleanup(void *data)
+/*
+ * The cache manager does not delete the files of the evicted nodes
+ * one by one: the nodes are marked as being deleted and collected in
+ * a batch of up to manager_files entries, and then the batch is sorted
+ * by the file names, so the files of the same directory are unlinked
+ * together, and is unlinked either in the cache manager process or in
+ * a thread pool.  The number of files and bytes unlinked per second can
+ * be limited, as unlink storms on spinning disks slow down the workers.
+ */
+
+static ngx_int_t
+ngx_http_file_cache_batch_init(ngx_http_file_cache_t *cache)
 {
-    ngx_http_cache_t  *c = data;
+    u_char                       *p;
+    size_t                        len;
+    ngx_uint_t                    i, n;
+    ngx_path_t                   *path;
+    ngx_http_file_cache_batch_t  *batch;
 
-    if (c->updated) {
-        return;
-    }
+    n = ngx_max(cache->manager_files, 1);
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                   "http file cache cleanup");
+    path = cache->path;
+    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN + 1;
 
-    if (c->updating && !c->background) {
-        ngx_log_error(NGX_LOG_ALERT, c->file.log, 0,
-                      "stalled cache updating, error:%ui", c->error);
+    batch = ngx_alloc(sizeof(ngx_http_file_cache_batch_t)
+                      + n * (sizeof(ngx_http_file_cache_evict_t) + len),
+                      ngx_cycle->log);
+    if (batch == NULL) {
+        return NGX_ERROR;
     }
 
-    ngx_http_file_cache_free(c, NULL);
-}
+    ngx_memzero(batch, sizeof(ngx_http_file_cache_batch_t));
 
+    batch->cache = cache;
+    batch->evict = (ngx_http_file_cache_evict_t *) &batch[1];
+    batch->nalloc = n;
 
-static time_t
-ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
-{
-    u_char                      *name, *p;
-    size_t                       len;
-    time_t                       wait;
-    ngx_uint_t                   tries;
-    ngx_path_t                  *path;
-    ngx_queue_t                 *q, *sentinel;
-    ngx_http_file_cache_node_t  *fcn;
-    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+    p = (u_char *) &batch->evict[n];
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache forced expire");
+    for (i = 0; i < n; i++) {
+        batch->evict[i].name = p;
+        ngx_memcpy(p, path->name.data, path->name.len);
+        p += len;
+    }
 
-    path = cache->path;
-    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+#if (NGX_THREADS)
 
-    name = ngx_alloc(len + 1, ngx_cycle->log);
-    if (name == NULL) {
-        return 10;
-    }
+    batch->task.ctx = batch;
+    batch->task.handler = ngx_http_file_cache_evict_batch;
+    batch->task.event.data = batch;
+    batch->task.event.handler = ngx_http_file_cache_evict_done;
+    batch->task.event.log = ngx_cycle->log;
 
-    ngx_memcpy(name, path->name.data, path->name.len);
+#endif
 
-    wait = 10;
-    tries = 20;
-    sentinel = NULL;
+    cache->manager_batch = batch;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    return NGX_OK;
+}
 
-    for ( ;; ) {
-        if (ngx_queue_empty(&cache->sh->queue)) {
-            break;
-        }
 
-        q = ngx_queue_last(&cache->sh->queue);
+/* called with the shard mutex held */
 
-        if (q == sentinel) {
-            break;
-        }
+static ngx_queue_t *
+ngx_http_file_cache_evict_last(ngx_http_file_cache_shard_t *shard)
+{
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_node_t  *fcn;
 
+    for (q = ngx_queue_last(&shard->queue);
+         q != ngx_queue_sentinel(&shard->queue);
+         q = ngx_queue_prev(q))
+    {
         fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
 
-        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                  "http file cache forced expire: #%d %d %02xd%02xd%02xd%02xd",
-                  fcn->count, fcn->exists,
-                  fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
-
-        if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
-            wait = 0;
-            break;
+        if (!fcn->deleting) {
+            return q;
         }
+    }
 
-        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        (void) ngx_hex_dump(p, fcn->key, len);
+    return NULL;
+}
 
-        /*
-         * abnormally exited workers may leave locked cache entries,
-         * and although it may be safe to remove them completely,
-         * we prefer to just move them to the top of the inactive queue
-         */
 
-        ngx_queue_remove(q);
-        fcn->expire = ngx_time() + cache->inactive;
-        ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+/* called with the shard mutex held */
 
-        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                      "ignore long locked inactive cache entry %*s, count:%d",
-                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+static void
+ngx_http_file_cache_evict(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, ngx_queue_t *q,
+    ngx_http_file_cache_batch_t *batch)
+{
+    u_char                       *p;
+    size_t                        len;
+    ngx_path_t                   *path;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_evict_t  *evict;
 
-        if (sentinel == NULL) {
-            sentinel = q;
-        }
+    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
 
-        if (--tries) {
-            continue;
-        }
+    ngx_http_file_cache_ram_delete_node(cache, fcn);
 
-        wait = 1;
-        break;
+    if (!fcn->exists) {
+        ngx_queue_remove(q);
+        ngx_rbtree_delete(&shard->rbtree, &fcn->node);
+        ngx_slab_free(cache->shpool, fcn);
+        (void) ngx_atomic_fetch_add(&cache->sh->count, -1);
+        shard->count--;
+        return;
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    if (batch == NULL) {
+        ngx_http_file_cache_delete(cache, shard, fcn);
+        return;
+    }
 
-    ngx_free(name);
+    if (batch->nelts == batch->nalloc) {
+        return;
+    }
 
-    return wait;
+    (void) ngx_atomic_fetch_add(&cache->sh->size,
+                                - (ngx_atomic_int_t) fcn->fs_size);
+
+    evict = &batch->evict[batch->nelts++];
+
+    evict->node = fcn;
+    evict->shard = shard;
+
+    batch->size += fcn->fs_size;
+
+    path = cache->path;
+    p = evict->name + path->name.len + 1 + path->len;
+    p = ngx_hex_dump(p, (u_char *) &fcn->node.key, sizeof(ngx_rbtree_key_t));
+    len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+    p = ngx_hex_dump(p, fcn->key, len);
+    *p = '\0';
+
+    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+    ngx_create_hashed_filename(path, evict->name, len);
+
+    fcn->count++;
+    fcn->deleting = 1;
 }
 
 
-static time_t
-ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
-{
-    u_char                      *name, *p;
-    size_t                       len;
-    time_t                       now, wait;
-    ngx_path_t                  *path;
-    ngx_msec_t                   elapsed;
-    ngx_queue_t                 *q;
-    ngx_http_file_cache_node_t  *fcn;
-    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+/* called with the shard mutex held, which is released during unlink() */
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache expire");
+static void
+ngx_http_file_cache_delete(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, ngx_http_file_cache_node_t *fcn)
+{
+    u_char      *name, *p;
+    off_t        fs_size;
+    size_t       len;
+    ngx_path_t  *path;
 
     path = cache->path;
     len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
 
     name = ngx_alloc(len + 1, ngx_cycle->log);
     if (name == NULL) {
-        return 10;
+        return;
     }
 
+    fs_size = fcn->fs_size;
+
+    (void) ngx_atomic_fetch_add(&cache->sh->size, - (ngx_atomic_int_t) fs_size);
+
     ngx_memcpy(name, path->name.data, path->name.len);
 
-    now = ngx_time();
+    p = name + path->name.len + 1 + path->len;
+    p = ngx_hex_dump(p, (u_char *) &fcn->node.key, sizeof(ngx_rbtree_key_t));
+    p = ngx_hex_dump(p, fcn->key,
+                     NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+    *p = '\0';
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_create_hashed_filename(path, name, len);
 
-    for ( ;; ) {
+    fcn->count++;
+    fcn->deleting = 1;
+    ngx_shmtx_unlock(&shard->mutex);
 
-        if (ngx_quit || ngx_terminate) {
-            wait = 1;
-            break;
-        }
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache expire: \"%s\"", name);
 
-        if (ngx_queue_empty(&cache->sh->queue)) {
-            wait = 10;
-            break;
-        }
+    if (ngx_delete_file(name) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", name);
+    }
 
-        q = ngx_queue_last(&cache->sh->queue);
+    ngx_free(name);
 
-        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+    ngx_http_file_cache_shard_lock(shard);
 
-        wait = fcn->expire - now;
+    fcn->count--;
+    fcn->deleting = 0;
 
-        if (wait > 0) {
-            wait = wait > 10 ? 10 : wait;
-            break;
-        }
+    if (fcn->count == 0) {
+        ngx_queue_remove(&fcn->queue);
+        ngx_rbtree_delete(&shard->rbtree, &fcn->node);
+        ngx_slab_free(cache->shpool, fcn);
+        (void) ngx_atomic_fetch_add(&cache->sh->count, -1);
+        shard->count--;
+    }
 
-        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache expire: #%d %d %02xd%02xd%02xd%02xd",
-                       fcn->count, fcn->exists,
-                       fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+    (void) ngx_atomic_fetch_add(&cache->sh->evicted, 1);
+    (void) ngx_atomic_fetch_add(&cache->sh->evicted_size, fs_size);
+}
 
-        if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
-            goto next;
-        }
 
-        if (fcn->deleting) {
-            wait = 1;
-            break;
-        }
+static void
+ngx_http_file_cache_evict_flush(ngx_http_file_cache_t *cache)
+{
+    ngx_msec_t                    delay, t;
+    ngx_http_file_cache_batch_t  *batch;
 
-        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        (void) ngx_hex_dump(p, fcn->key, len);
+    batch = cache->manager_batch;
 
-        /*
-         * abnormally exited workers may leave locked cache entries,
-         * and although it may be safe to remove them completely,
-         * we prefer to just move them to the top of the inactive queue
-         */
+    if (batch->nelts == 0) {
+        return;
+    }
 
-        ngx_queue_remove(q);
-        fcn->expire = ngx_time() + cache->inactive;
-        ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+    ngx_qsort(batch->evict, (size_t) batch->nelts,
+              sizeof(ngx_http_file_cache_evict_t),
+              ngx_http_file_cache_evict_cmp);
 
-        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                      "ignore long locked inactive cache entry %*s, count:%d",
-                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+    delay = 0;
 
-next:
+    if (cache->manager_iops) {
+        delay = batch->nelts * 1000 / cache->manager_iops;
+    }
 
-        if (++cache->files >= cache->manager_files) {
-            wait = 0;
-            break;
-        }
+    if (cache->manager_rate) {
+        t = (ngx_msec_t) (batch->size * cache->bsize * 1000
+                          / cache->manager_rate);
+        delay = ngx_max(delay, t);
+    }
 
-        ngx_time_update();
+    cache->manager_next = ngx_current_msec + delay;
 
-        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache evict: %ui s:%O d:%M",
+                   batch->nelts, batch->size, delay);
 
-        if (elapsed >= cache->manager_threshold) {
-            wait = 0;
-            break;
+#if (NGX_THREADS)
+
+    if (cache->manager_thread_pool) {
+
+        if (ngx_thread_task_post(cache->manager_thread_pool, &batch->task)
+            == NGX_OK)
+        {
+            batch->busy = 1;
+            return;
         }
+
+        /* the queue is full, unlink the files in the process */
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+#endif
 
-    ngx_free(name);
+    ngx_http_file_cache_evict_batch(batch, ngx_cycle->log);
+}
 
-    return wait;
+
+static int ngx_libc_cdecl
+ngx_http_file_cache_evict_cmp(const void *one, const void *two)
+{
+    ngx_http_file_cache_evict_t  *first, *second;
+
+    first = (ngx_http_file_cache_evict_t *) one;
+    second = (ngx_http_file_cache_evict_t *) two;
+
+    return ngx_strcmp(first->name, second->name);
 }
 
 
+/* may be called in a thread */
+
 static void
-ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
-    u_char *name)
+ngx_http_file_cache_evict_batch(void *data, ngx_log_t *log)
 {
-    u_char                      *p;
-    size_t                       len;
-    ngx_path_t                  *path;
-    ngx_http_file_cache_node_t  *fcn;
+    ngx_http_file_cache_batch_t *batch = data;
 
-    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+    ngx_uint_t                    i;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_evict_t  *evict;
+    ngx_http_file_cache_shard_t  *shard;
 
-    if (fcn->exists) {
-        cache->sh->size -= fcn->fs_size;
+    cache = batch->cache;
 
-        path = cache->path;
-        p = name + path->name.len + 1 + path->len;
-        p = ngx_hex_dump(p, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        p = ngx_hex_dump(p, fcn->key, len);
-        *p = '\0';
+    for (i = 0; i < batch->nelts; i++) {
+        evict = &batch->evict[i];
 
-        fcn->count++;
-        fcn->deleting = 1;
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "http file cache expire: \"%s\"", evict->name);
 
-        len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
-        ngx_create_hashed_filename(path, name, len);
+        if (ngx_delete_file(evict->name) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                          ngx_delete_file_n " \"%s\" failed", evict->name);
+        }
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache expire: \"%s\"", name);
+        fcn = evict->node;
+        shard = evict->shard;
 
-        if (ngx_delete_file(name) == NGX_FILE_ERROR) {
-            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
-                          ngx_delete_file_n " \"%s\" failed", name);
-        }
+        ngx_http_file_cache_shard_lock(shard);
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
         fcn->count--;
         fcn->deleting = 0;
-    }
 
-    if (fcn->count == 0) {
-        ngx_queue_remove(q);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
-        cache->sh->count--;
+        if (fcn->count == 0) {
+            ngx_queue_remove(&fcn->queue);
+            ngx_rbtree_delete(&shard->rbtree, &fcn->node);
+            ngx_slab_free(cache->shpool, fcn);
+            (void) ngx_atomic_fetch_add(&cache->sh->count, -1);
+            shard->count--;
+        }
+
+        ngx_shmtx_unlock(&shard->mutex);
     }
+
+    (void) ngx_atomic_fetch_add(&cache->sh->evicted, batch->nelts);
+    (void) ngx_atomic_fetch_add(&cache->sh->evicted_size, batch->size);
+
+    batch->nelts = 0;
+    batch->size = 0;
+}
+
+
+#if (NGX_THREADS)
+
+static void
+ngx_http_file_cache_evict_done(ngx_event_t *ev)
+{
+    ngx_http_file_cache_batch_t  *batch;
+
+    batch = ev->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "http file cache evict done");
+
+    batch->busy = 0;
 }
 
+#endif
+
 
 static ngx_msec_t
 ngx_http_file_cache_manager(void *data)
 {
     ngx_http_file_cache_t  *cache = data;
 
-    off_t       size;
-    time_t      wait;
-    ngx_msec_t  elapsed, next;
-    ngx_uint_t  count, watermark;
+    off_t            size;
+    time_t           wait;
+    ngx_msec_t       elapsed, next;
+    ngx_uint_t       count, watermark;
+    ngx_time_t      *tp;
+    ngx_msec_int_t   delay;
+
+    if (cache->index.len
+        && !cache->sh->cold
+        && ngx_time() - cache->index_saved >= cache->index_interval)
+    {
+        ngx_http_file_cache_index_save(cache);
+        ngx_time_update();
+    }
 
     cache->last = ngx_current_msec;
     cache->files = 0;
 
+    if (cache->manager_batch == NULL
+        && ngx_http_file_cache_batch_init(cache) != NGX_OK)
+    {
+        next = 10000;
+        goto done;
+    }
+
+    /* the previous batch is still being unlinked by a thread */
+
+    if (cache->manager_batch->busy) {
+        next = cache->manager_sleep;
+        goto done;
+    }
+
+    /* the I/O budget of the previous batch is not yet spent */
+
+    delay = cache->manager_next - ngx_current_msec;
+
+    if (delay > 0) {
+        next = (ngx_msec_t) delay;
+        goto done;
+    }
+
     next = (ngx_msec_t) ngx_http_file_cache_expire(cache) * 1000;
 
     if (next == 0) {
         next = cache->manager_sleep;
-        goto done;
+        goto flush;
     }
 
     for ( ;; ) {
-        ngx_shmtx_lock(&cache->shpool->mutex);
-
         size = cache->sh->size;
         count = cache->sh->count;
         watermark = cache->sh->watermark;
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
-
         ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
                        "http file cache size: %O c:%ui w:%i",
                        size, count, (ngx_int_t) watermark);
@@ -1991,7 +3459,7 @@ ngx_http_file_cache_manager(void *data)
             break;
         }
 
-        wait = ngx_http_file_cache_forced_expire(cache);
+        wait = ngx_http_file_cache_forced_expire(cache, cache->manager_batch);
 
         if (wait > 0) {
             next = (ngx_msec_t) wait * 1000;
@@ -2017,8 +3485,44 @@ ngx_http_file_cache_manager(void *data)
         }
     }
 
+flush:
+
+    ngx_http_file_cache_evict_flush(cache);
+
+    ngx_time_update();
+
+    delay = cache->manager_next - ngx_current_msec;
+
+    if (delay > 0) {
+        next = ngx_max(next, (ngx_msec_t) delay);
+    }
+
+    /* the eviction lag is the time the cache stays above its limits */
+
+    if ((off_t) cache->sh->size >= cache->max_size
+        || cache->sh->count >= cache->sh->watermark)
+    {
+        if (cache->sh->over == 0) {
+            tp = ngx_timeofday();
+            cache->sh->over = (ngx_msec_t) (tp->sec * 1000 + tp->msec);
+        }
+
+    } else {
+        cache->sh->over = 0;
+    }
+
 done:
 
+    if (cache->index.len) {
+        wait = cache->index_saved + cache->index_interval - ngx_time();
+
+        if (wait < 1) {
+            wait = 1;
+        }
+
+        next = ngx_min(next, (ngx_msec_t) wait * 1000);
+    }
+
     elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
 
     ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
@@ -2090,6 +3594,15 @@ ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
 
     cache = ctx->data;
 
+    /* the index and its temporary copy may reside in the cache directory */
+
+    if (cache->index.len
+        && path->len >= cache->index.len
+        && ngx_strncmp(path->data, cache->index.data, cache->index.len) == 0)
+    {
+        return NGX_OK;
+    }
+
     if (ngx_http_file_cache_add_file(ctx, path) != NGX_OK) {
         (void) ngx_http_file_cache_delete_file(ctx, path);
     }
@@ -2117,12 +3630,30 @@ ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
 static ngx_int_t
 ngx_http_file_cache_manage_directory(ngx_tree_ctx_t *ctx, ngx_str_t *path)
 {
+    ngx_http_file_cache_t  *cache;
+
     if (path->len >= 5
         && ngx_strncmp(path->data + path->len - 5, "/temp", 5) == 0)
     {
         return NGX_DECLINED;
     }
 
+    cache = ctx->data;
+
+    /*
+     * files in the leaf directories that were not modified since
+     * the index snapshot was taken are already in the keys zone
+     */
+
+    if (cache->sh->index
+        && ctx->mtime < cache->sh->index
+        && path->len == cache->path->name.len + cache->path->len)
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                       "http file cache loader skip: \"%V\"", path);
+        return NGX_DECLINED;
+    }
+
     return NGX_OK;
 }
 
@@ -2180,96 +3711,558 @@ ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
     for (i = 0; i < NGX_HTTP_CACHE_KEY_LEN; i++) {
         n = ngx_hextoi(p, 2);
 
-        if (n == NGX_ERROR) {
-            return NGX_ERROR;
-        }
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        p += 2;
+
+        c.key[i] = (u_char) n;
+    }
+
+    return ngx_http_file_cache_add(cache, &c);
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
+{
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *shard;
+
+    shard = ngx_http_file_cache_shard(cache, c->key);
+    ngx_http_file_cache_shard_lock(shard);
+
+    fcn = ngx_http_file_cache_lookup(shard, c->key);
+
+    if (fcn == NULL) {
+
+        fcn = ngx_slab_calloc(cache->shpool,
+                              sizeof(ngx_http_file_cache_node_t));
+        if (fcn == NULL) {
+            ngx_http_file_cache_set_watermark(cache);
+
+            if (cache->fail_time != ngx_time()) {
+                cache->fail_time = ngx_time();
+                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                           "could not allocate node%s", cache->shpool->log_ctx);
+            }
+
+            ngx_shmtx_unlock(&shard->mutex);
+            return NGX_ERROR;
+        }
+
+        (void) ngx_atomic_fetch_add(&cache->sh->count, 1);
+        shard->count++;
+
+        ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+
+        ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
+                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+        ngx_rbtree_insert(&shard->rbtree, &fcn->node);
+
+        fcn->uses = 1;
+        fcn->exists = 1;
+        fcn->fs_size = c->fs_size;
+
+        (void) ngx_atomic_fetch_add(&cache->sh->size, c->fs_size);
+
+    } else {
+        ngx_queue_remove(&fcn->queue);
+    }
+
+    fcn->expire = ngx_time() + cache->inactive;
+
+    ngx_queue_insert_head(&shard->queue, &fcn->queue);
+
+    ngx_shmtx_unlock(&shard->mutex);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                   "http file cache delete: \"%s\"", path->data);
+
+    if (ngx_delete_file(path->data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ctx->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", path->data);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache)
+{
+    cache->sh->watermark = cache->sh->count - cache->sh->count / 8;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache watermark: %ui", cache->sh->watermark);
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_sketch_init(ngx_http_file_cache_t *cache, size_t size)
+{
+    ngx_uint_t                    i, width;
+    ngx_http_file_cache_shard_t  *shard;
+
+    if (cache->admission == 0 || cache->sh->shards[0].sketch) {
+        return NGX_OK;
+    }
+
+    /* about a counter per node the keys zone can hold */
+
+    for (width = 256; width * 2 * 128 <= size; width *= 2) { /* void */ }
+
+    /* the shards are a power of two or few, and take a slice each */
+
+    width /= cache->sh->nshards;
+
+    for (i = 256; i < width; i *= 2) { /* void */ }
+
+    width = ngx_min(i, 1 << 24);
+
+    for (i = 0; i < cache->sh->nshards; i++) {
+        shard = &cache->sh->shards[i];
+
+        /* 4-bit counters, two in a byte */
+
+        shard->sketch = ngx_slab_calloc(cache->shpool,
+                                      NGX_HTTP_CACHE_SKETCH_DEPTH * width / 2);
+        if (shard->sketch == NULL) {
+            return NGX_ERROR;
+        }
+
+        shard->sketch_samples = 0;
+    }
+
+    cache->sh->sketch_mask = width - 1;
+
+    return NGX_OK;
+}
+
+
+/*
+ * A count-min sketch of the recent request frequency of keys,
+ * with conservative update.  The key is an md5 hash, so its bytes
+ * are used as independent hashes for the sketch rows, skipping
+ * the first two bytes which select the shard.  Counters are 4 bits
+ * wide, two in a byte.  To let the frequencies decay, all counters
+ * are halved after a number of samples ten times the sketch width.
+ */
+
+static ngx_uint_t
+ngx_http_file_cache_sketch(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, u_char *key)
+{
+    u_char      *p, *last, *counter[NGX_HTTP_CACHE_SKETCH_DEPTH];
+    ngx_uint_t   i, n, min, hash, width, shift[NGX_HTTP_CACHE_SKETCH_DEPTH];
+
+    width = cache->sh->sketch_mask + 1;
+
+    min = NGX_HTTP_CACHE_SKETCH_MAX;
+
+    for (i = 0; i < NGX_HTTP_CACHE_SKETCH_DEPTH; i++) {
+        p = &key[2 + i * 3];
+        hash = (p[0] | p[1] << 8 | p[2] << 16) & cache->sh->sketch_mask;
+
+        counter[i] = &shard->sketch[(i * width + hash) >> 1];
+        shift[i] = (hash & 1) << 2;
+
+        n = (*counter[i] >> shift[i]) & 0x0f;
+
+        if (n < min) {
+            min = n;
+        }
+    }
+
+    if (min < NGX_HTTP_CACHE_SKETCH_MAX) {
+
+        for (i = 0; i < NGX_HTTP_CACHE_SKETCH_DEPTH; i++) {
+            if (((*counter[i] >> shift[i]) & 0x0f) == min) {
+                *counter[i] += (u_char) (1 << shift[i]);
+            }
+        }
+
+        min++;
+    }
+
+    if (++shard->sketch_samples >= 10 * width) {
+        shard->sketch_samples = 0;
+
+        last = shard->sketch + NGX_HTTP_CACHE_SKETCH_DEPTH * width / 2;
+
+        for (p = shard->sketch; p < last; p++) {
+            *p = (*p >> 1) & 0x77;
+        }
+    }
+
+    return min;
+}
+
+
+static void
+ngx_http_file_cache_index_load(ngx_http_file_cache_t *cache, ngx_log_t *log)
+{
+    off_t                                 offset, size;
+    ssize_t                               n;
+    ngx_uint_t                            i, k;
+    uint64_t                              count;
+    ngx_file_t                            file;
+    ngx_file_info_t                       fi;
+    ngx_http_cache_t                      c;
+    ngx_http_file_cache_index_entry_t    *entries;
+    ngx_http_file_cache_index_header_t    header;
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name = cache->index;
+    file.log = log;
+
+    file.fd = ngx_open_file(cache->index.data, NGX_FILE_RDONLY,
+                            NGX_FILE_OPEN, 0);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        if (ngx_errno != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                          ngx_open_file_n " \"%s\" failed", cache->index.data);
+        }
+
+        return;
+    }
+
+    entries = NULL;
+
+    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", cache->index.data);
+        goto done;
+    }
+
+    n = ngx_read_file(&file, (u_char *) &header, sizeof(header), 0);
+
+    if (n == NGX_ERROR) {
+        goto done;
+    }
+
+    if ((size_t) n != sizeof(header)
+        || header.magic != NGX_HTTP_CACHE_INDEX_MAGIC
+        || header.entry_size != sizeof(ngx_http_file_cache_index_entry_t)
+        || header.bsize != cache->bsize)
+    {
+        goto invalid;
+    }
+
+    for (i = 0; i < NGX_MAX_PATH_LEVEL; i++) {
+        if (header.level[i] != cache->path->level[i]) {
+            goto invalid;
+        }
+    }
+
+    size = ngx_file_size(&fi) - sizeof(header);
+
+    if (size % sizeof(ngx_http_file_cache_index_entry_t)
+        || size / sizeof(ngx_http_file_cache_index_entry_t) != header.count)
+    {
+        goto invalid;
+    }
+
+    entries = ngx_alloc(NGX_HTTP_CACHE_INDEX_BATCH
+                        * sizeof(ngx_http_file_cache_index_entry_t), log);
+    if (entries == NULL) {
+        goto done;
+    }
+
+    ngx_memzero(&c, sizeof(ngx_http_cache_t));
+
+    offset = sizeof(header);
+
+    for (count = header.count; count; count -= k) {
+
+        k = ngx_min(count, NGX_HTTP_CACHE_INDEX_BATCH);
+        size = k * sizeof(ngx_http_file_cache_index_entry_t);
+
+        n = ngx_read_file(&file, (u_char *) entries, size, offset);
+
+        if (n == NGX_ERROR) {
+            goto done;
+        }
+
+        if (n != size) {
+            goto invalid;
+        }
+
+        offset += n;
+
+        for (i = 0; i < k; i++) {
+            ngx_memcpy(c.key, entries[i].key, NGX_HTTP_CACHE_KEY_LEN);
+            c.fs_size = entries[i].fs_size;
+
+            if (ngx_http_file_cache_add(cache, &c) != NGX_OK) {
+                goto done;
+            }
+        }
+    }
+
+    /* the loader will only rescan directories modified since then */
+
+    cache->sh->index = header.time;
+
+    ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                  "http file cache: %V %uL entries loaded from \"%V\"",
+                  &cache->path->name, header.count, &cache->index);
+
+    goto done;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_WARN, log, 0,
+                  "cache index \"%V\" is invalid, ignored", &cache->index);
+
+done:
+
+    if (entries) {
+        ngx_free(entries);
+    }
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", cache->index.data);
+    }
+}
+
+
+static void
+ngx_http_file_cache_index_save(ngx_http_file_cache_t *cache)
+{
+    off_t                                 offset;
+    size_t                                size;
+    u_char                                key[NGX_HTTP_CACHE_KEY_LEN];
+    ngx_uint_t                            i, n, first;
+    ngx_file_t                            file;
+    ngx_rbtree_node_t                    *node, *last;
+    ngx_http_file_cache_node_t           *fcn;
+    ngx_http_file_cache_shard_t          *shard;
+    ngx_http_file_cache_index_entry_t    *entries;
+    ngx_http_file_cache_index_header_t    header;
+
+    cache->index_saved = ngx_time();
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name.len = cache->index.len + sizeof(".tmp") - 1;
+    file.log = ngx_cycle->log;
+
+    file.name.data = ngx_alloc(file.name.len + 1, ngx_cycle->log);
+    if (file.name.data == NULL) {
+        return;
+    }
+
+    ngx_sprintf(file.name.data, "%V.tmp%Z", &cache->index);
+
+    entries = ngx_alloc(NGX_HTTP_CACHE_INDEX_BATCH
+                        * sizeof(ngx_http_file_cache_index_entry_t),
+                        ngx_cycle->log);
+    if (entries == NULL) {
+        ngx_free(file.name.data);
+        return;
+    }
+
+    file.fd = ngx_open_file(file.name.data, NGX_FILE_WRONLY,
+                            NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", file.name.data);
+        goto done;
+    }
+
+    ngx_memzero(&header, sizeof(header));
+
+    header.magic = NGX_HTTP_CACHE_INDEX_MAGIC;
+    header.entry_size = sizeof(ngx_http_file_cache_index_entry_t);
+    header.bsize = cache->bsize;
+    header.time = cache->index_saved;
+
+    for (i = 0; i < NGX_MAX_PATH_LEVEL; i++) {
+        header.level[i] = (u_char) cache->path->level[i];
+    }
+
+    /*
+     * the tree of each shard is walked in key order, the mutex is
+     * released after each batch, and the walk is resumed from the
+     * last key seen
+     */
+
+    offset = sizeof(header);
+    shard = &cache->sh->shards[0];
+    first = 1;
+
+    for ( ;; ) {
+
+        ngx_http_file_cache_shard_lock(shard);
+
+        node = ngx_http_file_cache_index_next(shard, first ? NULL : key);
+        last = NULL;
+
+        for (i = 0, n = 0; node && i < NGX_HTTP_CACHE_INDEX_BATCH; i++) {
+
+            fcn = (ngx_http_file_cache_node_t *) node;
 
-        p += 2;
+            if (fcn->exists && !fcn->deleting) {
+                ngx_memcpy(entries[n].key, (u_char *) &node->key,
+                           sizeof(ngx_rbtree_key_t));
+                ngx_memcpy(&entries[n].key[sizeof(ngx_rbtree_key_t)],
+                           fcn->key,
+                           NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+                entries[n].fs_size = fcn->fs_size;
+                n++;
+            }
 
-        c.key[i] = (u_char) n;
-    }
+            last = node;
+            node = ngx_rbtree_next(&shard->rbtree, node);
+        }
 
-    return ngx_http_file_cache_add(cache, &c);
-}
+        if (last) {
+            fcn = (ngx_http_file_cache_node_t *) last;
 
+            ngx_memcpy(key, (u_char *) &last->key, sizeof(ngx_rbtree_key_t));
+            ngx_memcpy(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                       NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+        }
 
-static ngx_int_t
-ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
-{
-    ngx_http_file_cache_node_t  *fcn;
+        ngx_shmtx_unlock(&shard->mutex);
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+        first = 0;
 
-    fcn = ngx_http_file_cache_lookup(cache, c->key);
+        if (n) {
+            size = n * sizeof(ngx_http_file_cache_index_entry_t);
 
-    if (fcn == NULL) {
+            if (ngx_write_file(&file, (u_char *) entries, size, offset)
+                == NGX_ERROR)
+            {
+                goto failed;
+            }
 
-        fcn = ngx_slab_calloc_locked(cache->shpool,
-                                     sizeof(ngx_http_file_cache_node_t));
-        if (fcn == NULL) {
-            ngx_http_file_cache_set_watermark(cache);
+            offset += size;
+            header.count += n;
+        }
 
-            if (cache->fail_time != ngx_time()) {
-                cache->fail_time = ngx_time();
-                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                           "could not allocate node%s", cache->shpool->log_ctx);
+        if (node == NULL) {
+            if (++shard == &cache->sh->shards[cache->sh->nshards]) {
+                break;
             }
 
-            ngx_shmtx_unlock(&cache->shpool->mutex);
-            return NGX_ERROR;
+            first = 1;
         }
 
-        cache->sh->count++;
+        if (ngx_quit || ngx_terminate) {
+            goto failed;
+        }
+    }
 
-        ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+    if (ngx_write_file(&file, (u_char *) &header, sizeof(header), 0)
+        == NGX_ERROR)
+    {
+        goto failed;
+    }
 
-        ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
-                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", file.name.data);
+    }
+
+    if (ngx_rename_file(file.name.data, cache->index.data)
+        == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_rename_file_n " \"%s\" to \"%s\" failed",
+                      file.name.data, cache->index.data);
+        goto delete;
+    }
 
-        ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache index: \"%V\" %uL entries",
+                   &cache->index, header.count);
 
-        fcn->uses = 1;
-        fcn->exists = 1;
-        fcn->fs_size = c->fs_size;
+    goto done;
 
-        cache->sh->size += c->fs_size;
+failed:
 
-    } else {
-        ngx_queue_remove(&fcn->queue);
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", file.name.data);
     }
 
-    fcn->expire = ngx_time() + cache->inactive;
+delete:
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+    if (ngx_delete_file(file.name.data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", file.name.data);
+    }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+done:
 
-    return NGX_OK;
+    ngx_free(entries);
+    ngx_free(file.name.data);
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+static ngx_rbtree_node_t *
+ngx_http_file_cache_index_next(ngx_http_file_cache_shard_t *shard,
+    u_char *key)
 {
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-                   "http file cache delete: \"%s\"", path->data);
+    ngx_int_t                    rc;
+    ngx_rbtree_key_t             node_key;
+    ngx_rbtree_node_t           *node, *sentinel, *next;
+    ngx_http_file_cache_node_t  *fcn;
 
-    if (ngx_delete_file(path->data) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_CRIT, ctx->log, ngx_errno,
-                      ngx_delete_file_n " \"%s\" failed", path->data);
+    node = shard->rbtree.root;
+    sentinel = shard->rbtree.sentinel;
+
+    if (node == sentinel) {
+        return NULL;
     }
 
-    return NGX_OK;
-}
+    if (key == NULL) {
+        return ngx_rbtree_min(node, sentinel);
+    }
 
+    /* the first node with a key greater than the given one */
 
-static void
-ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache)
-{
-    cache->sh->watermark = cache->sh->count - cache->sh->count / 8;
+    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache watermark: %ui", cache->sh->watermark);
+    next = NULL;
+
+    while (node != sentinel) {
+
+        if (node_key != node->key) {
+            rc = (node_key < node->key) ? -1 : 1;
+
+        } else {
+            fcn = (ngx_http_file_cache_node_t *) node;
+
+            rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                            NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+        }
+
+        if (rc < 0) {
+            next = node;
+            node = node->left;
+
+        } else {
+            node = node->right;
+        }
+    }
+
+    return next;
 }
 
 
@@ -2299,6 +4292,72 @@ ngx_http_file_cache_valid(ngx_array_t *cache_valid, ngx_uint_t status)
 }
 
 
+ngx_int_t
+ngx_http_file_cache_stats(ngx_shm_zone_t *shm_zone,
+    ngx_http_file_cache_stats_t *stats, ngx_pool_t *pool)
+{
+    ngx_uint_t                    i;
+    ngx_msec_t                    over;
+    ngx_time_t                   *tp;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
+
+    if (shm_zone->init != ngx_http_file_cache_init) {
+        return NGX_DECLINED;
+    }
+
+    cache = shm_zone->data;
+
+    if (cache->sh == NULL) {
+        return NGX_DECLINED;
+    }
+
+    stats->size = (off_t) cache->sh->size * cache->bsize;
+    stats->count = cache->sh->count;
+
+    if (cache->max_size == NGX_MAX_OFF_T_VALUE / (off_t) cache->bsize) {
+        stats->max_size = 0;
+
+    } else {
+        stats->max_size = cache->max_size * cache->bsize;
+    }
+
+    stats->evicted = cache->sh->evicted;
+    stats->evicted_size = (off_t) cache->sh->evicted_size * cache->bsize;
+
+    over = cache->sh->over;
+
+    if (over) {
+        tp = ngx_timeofday();
+        stats->lag = (ngx_msec_t) (tp->sec * 1000 + tp->msec) - over;
+
+    } else {
+        stats->lag = 0;
+    }
+
+    stats->nshards = cache->sh->nshards;
+
+    stats->shards = ngx_palloc(pool,
+                               stats->nshards
+                               * sizeof(ngx_http_file_cache_shard_stats_t));
+    if (stats->shards == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* the counters are read without the locks */
+
+    for (i = 0; i < stats->nshards; i++) {
+        shard = &cache->sh->shards[i];
+
+        stats->shards[i].nodes = shard->count;
+        stats->shards[i].locks = shard->locks;
+        stats->shards[i].contended = shard->contended;
+    }
+
+    return NGX_OK;
+}
+
+
 char *
 ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
@@ -2312,6 +4371,10 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_int_t               loader_files, manager_files;
     ngx_msec_t              loader_sleep, manager_sleep, loader_threshold,
                             manager_threshold;
+    time_t                  index_interval;
+    ssize_t                 ram_size, ram_max_object;
+    ngx_int_t               admission, shards, manager_iops;
+    ssize_t                 manager_rate;
     ngx_uint_t              i, n, use_temp_path;
     ngx_array_t            *caches;
     ngx_http_file_cache_t  *cache, **ce;
@@ -2337,6 +4400,16 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     manager_files = 100;
     manager_sleep = 50;
     manager_threshold = 200;
+    manager_iops = 0;
+    manager_rate = 0;
+
+    index_interval = 300;
+
+    ram_size = 0;
+    ram_max_object = 16384;
+
+    admission = 0;
+    shards = 1;
 
     name.len = 0;
     size = 0;
@@ -2560,6 +4633,184 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "manager_iops=", 13) == 0) {
+
+            manager_iops = ngx_atoi(value[i].data + 13, value[i].len - 13);
+            if (manager_iops == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid manager_iops value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "manager_rate=", 13) == 0) {
+
+            s.len = value[i].len - 13;
+            s.data = value[i].data + 13;
+
+            manager_rate = ngx_parse_size(&s);
+            if (manager_rate == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid manager_rate value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "manager_threads=", 16) == 0) {
+
+#if (NGX_THREADS)
+
+            s.len = value[i].len - 16;
+            s.data = value[i].data + 16;
+
+            if (s.len == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid manager_threads value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            cache->manager_thread_pool = ngx_thread_pool_add(cf, &s);
+            if (cache->manager_thread_pool == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            ngx_thread_pool_helper(cache->manager_thread_pool);
+
+            continue;
+
+#else
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"manager_threads\" "
+                               "is unsupported on this platform");
+            return NGX_CONF_ERROR;
+#endif
+        }
+
+        if (ngx_strncmp(value[i].data, "index=", 6) == 0) {
+
+            cache->index.len = value[i].len - 6;
+            cache->index.data = value[i].data + 6;
+
+            if (cache->index.len == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid index value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (ngx_conf_full_name(cf->cycle, &cache->index, 0) != NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "index_interval=", 15) == 0) {
+
+            s.len = value[i].len - 15;
+            s.data = value[i].data + 15;
+
+            index_interval = ngx_parse_time(&s, 1);
+            if (index_interval == (time_t) NGX_ERROR || index_interval == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid index_interval value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "admission=", 10) == 0) {
+
+            admission = ngx_atoi(value[i].data + 10, value[i].len - 10);
+
+            if (admission == NGX_ERROR
+                || admission < 2
+                || admission > NGX_HTTP_CACHE_SKETCH_MAX)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid admission value \"%V\", "
+                                   "it must be between 2 and %d",
+                                   &value[i], NGX_HTTP_CACHE_SKETCH_MAX);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "shards=", 7) == 0) {
+
+            shards = ngx_atoi(value[i].data + 7, value[i].len - 7);
+
+            if (shards == NGX_ERROR
+                || shards < 1
+                || shards > NGX_HTTP_CACHE_MAX_SHARDS)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid shards value \"%V\", "
+                                   "it must be between 1 and %d",
+                                   &value[i], NGX_HTTP_CACHE_MAX_SHARDS);
+                return NGX_CONF_ERROR;
+            }
+
+#if !(NGX_HAVE_ATOMIC_OPS)
+
+            /* the cache size and count are only updated under a shard lock */
+
+            if (shards > 1) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "\"%V\" requires atomic operations, "
+                                   "which are not available on this platform",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+#endif
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "ram_zone=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            ram_size = ngx_parse_size(&s);
+
+            if (ram_size == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid ram zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (ram_size < (ssize_t) (8 * ngx_pagesize)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "ram zone \"%V\" is too small", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "ram_max_object=", 15) == 0) {
+
+            s.len = value[i].len - 15;
+            s.data = value[i].data + 15;
+
+            ram_max_object = ngx_parse_size(&s);
+
+            if (ram_max_object == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid ram_max_object value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid parameter \"%V\"", &value[i]);
         return NGX_CONF_ERROR;
@@ -2583,6 +4834,11 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     cache->manager_files = manager_files;
     cache->manager_sleep = manager_sleep;
     cache->manager_threshold = manager_threshold;
+    cache->manager_iops = manager_iops;
+    cache->manager_rate = manager_rate;
+    cache->index_interval = index_interval;
+    cache->admission = admission;
+    cache->shards = shards;
 
     if (ngx_add_path(cf, &cache->path) != NGX_OK) {
         return NGX_CONF_ERROR;
@@ -2603,6 +4859,36 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     cache->shm_zone->init = ngx_http_file_cache_init;
     cache->shm_zone->data = cache;
 
+    if (ram_size) {
+
+        if (ram_max_object > ram_size / 8) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"ram_max_object\" must be less than "
+                               "1/8 of the ram zone size");
+            return NGX_CONF_ERROR;
+        }
+
+        /* keys zone names cannot contain ":" */
+
+        s.len = name.len + sizeof(":ram") - 1;
+        s.data = ngx_pnalloc(cf->pool, s.len);
+        if (s.data == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_sprintf(s.data, "%V:ram", &name);
+
+        cache->ram_zone = ngx_shared_memory_add(cf, &s, ram_size, cmd->post);
+        if (cache->ram_zone == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        cache->ram_zone->init = ngx_http_file_cache_ram_init;
+        cache->ram_zone->data = cache;
+
+        cache->ram_max_object = ram_max_object;
+    }
+
     cache->use_temp_path = use_temp_path;
 
     cache->inactive = inactive;
@@ -9,6 +9,10 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 
+#if (NGX_HAVE_X86_SIMD)
+#include <immintrin.h>
+#endif
+
 
 static uint32_t  usual[] = {
     0xffffdbfe, /* 1111 1111 1111 1111  1101 1011 1111 1110 */
@@ -98,6 +102,78 @@ static uint32_t  usual[] = {
 #endif
 
 
+#if (NGX_HAVE_X86_SIMD)
+
+/*
+ * ngx_http_parse_skip() returns the first byte of the set or a position
+ * where the vector scan cannot proceed, the state machine continues
+ * byte by byte from there; the sets include the terminating null
+ */
+
+#define ngx_http_parse_skip(p, last, set)                                     \
+    ngx_http_parse_scan(p, last, set, sizeof(set ## _chars))
+
+
+static u_char *ngx_http_parse_scan_sse42(u_char *p, u_char *last,
+    u_char *set, size_t n);
+
+
+#define ngx_http_value_set_chars    " \r\n"
+#define ngx_http_uri_set_chars      " \r\n#"
+
+static u_char  ngx_http_value_set[16] = ngx_http_value_set_chars;
+static u_char  ngx_http_uri_set[16] = ngx_http_uri_set_chars;
+
+
+static ngx_inline u_char *
+ngx_http_parse_scan(u_char *p, u_char *last, u_char *set, size_t n)
+{
+    if (last - p < 16) {
+        return p;
+    }
+
+    if (ngx_cpu_features & NGX_CPU_SSE42) {
+        return ngx_http_parse_scan_sse42(p, last, set, n);
+    }
+
+    return p;
+}
+
+
+__attribute__((target("sse4.2")))
+static u_char *
+ngx_http_parse_scan_sse42(u_char *p, u_char *last, u_char *set, size_t n)
+{
+    int      i;
+    __m128i  s, v;
+
+    s = _mm_loadu_si128((__m128i *) set);
+
+    while (last - p >= 16) {
+        v = _mm_loadu_si128((__m128i *) p);
+
+        i = _mm_cmpestri(s, n, v, 16,
+                         _SIDD_UBYTE_OPS|_SIDD_CMP_EQUAL_ANY
+                         |_SIDD_LEAST_SIGNIFICANT);
+
+        if (i != 16) {
+            return p + i;
+        }
+
+        p += 16;
+    }
+
+    return p;
+}
+
+
+#else
+
+#define ngx_http_parse_skip(p, last, set)  (p)
+
+#endif
+
+
 /* gcc, icc, msvc and others compile these switches as an jump table */
 
 ngx_int_t
@@ -632,6 +708,7 @@ ngx_http_parse_request_line(ngx_http_request_t *r, ngx_buf_t *b)
         case sw_uri:
 
             if (usual[ch >> 5] & (1U << (ch & 0x1f))) {
+                p = ngx_http_parse_skip(p + 1, b->last, ngx_http_uri_set) - 1;
                 break;
             }
 
@@ -1031,6 +1108,10 @@ ngx_http_parse_header_line(ngx_http_request_t *r, ngx_buf_t *b,
                 goto done;
             case '\0':
                 return NGX_HTTP_PARSE_INVALID_HEADER;
+            default:
+                p = ngx_http_parse_skip(p + 1, b->last, ngx_http_value_set)
+                    - 1;
+                break;
             }
             break;
 
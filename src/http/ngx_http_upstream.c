@@ -881,6 +881,7 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
         c->lock = u->conf->cache_lock;
         c->lock_timeout = u->conf->cache_lock_timeout;
         c->lock_age = u->conf->cache_lock_age;
+        c->lock_stream = u->conf->cache_lock_stream;
 
         u->cache_status = NGX_HTTP_CACHE_MISS;
     }
@@ -4003,6 +4004,10 @@ ngx_http_upstream_process_request(ngx_http_request_t *r,
 
         if (u->cacheable) {
 
+            if (r->cache->lock_stream) {
+                ngx_http_file_cache_stream_update(r, p->temp_file);
+            }
+
             if (p->upstream_done) {
                 ngx_http_file_cache_update(r, p->temp_file);
 
@@ -77,6 +77,7 @@ typedef struct {
 } ngx_http_upstream_main_conf_t;
 
 typedef struct ngx_http_upstream_srv_conf_s  ngx_http_upstream_srv_conf_t;
+typedef struct ngx_http_upstream_conf_s  ngx_http_upstream_conf_t;
 
 typedef ngx_int_t (*ngx_http_upstream_init_pt)(ngx_conf_t *cf,
     ngx_http_upstream_srv_conf_t *us);
@@ -116,6 +117,7 @@ typedef struct {
 #define NGX_HTTP_UPSTREAM_DOWN          0x0010
 #define NGX_HTTP_UPSTREAM_BACKUP        0x0020
 #define NGX_HTTP_UPSTREAM_MAX_CONNS     0x0100
+#define NGX_HTTP_UPSTREAM_HTTP2         0x0200
 
 
 struct ngx_http_upstream_srv_conf_s {
@@ -134,6 +136,9 @@ struct ngx_http_upstream_srv_conf_s {
 #if (NGX_HTTP_UPSTREAM_ZONE)
     ngx_shm_zone_t                  *shm_zone;
 #endif
+
+    /* of the first location passing to the upstream */
+    ngx_http_upstream_conf_t        *conf;
 };
 
 
@@ -146,7 +151,7 @@ typedef struct {
 } ngx_http_upstream_local_t;
 
 
-typedef struct {
+struct ngx_http_upstream_conf_s {
     ngx_http_upstream_srv_conf_t    *upstream;
 
     ngx_msec_t                       connect_timeout;
@@ -204,6 +209,7 @@ typedef struct {
     ngx_flag_t                       cache_lock;
     ngx_msec_t                       cache_lock_timeout;
     ngx_msec_t                       cache_lock_age;
+    ngx_flag_t                       cache_lock_stream;
 
     ngx_flag_t                       cache_revalidate;
     ngx_flag_t                       cache_convert_head;
@@ -240,7 +246,7 @@ typedef struct {
 
     NGX_COMPAT_BEGIN(2)
     NGX_COMPAT_END
-} ngx_http_upstream_conf_t;
+};
 
 
 typedef struct {
@@ -391,6 +397,7 @@ struct ngx_http_upstream_s {
     unsigned                         buffering:1;
     unsigned                         keepalive:1;
     unsigned                         upgrade:1;
+    unsigned                         http2:1;
 
     unsigned                         request_sent:1;
     unsigned                         request_body_sent:1;
@@ -425,6 +432,24 @@ ngx_int_t ngx_http_upstream_hide_headers_hash(ngx_conf_t *cf,
     ngx_str_t *default_hide_headers, ngx_hash_init_t *hash);
 
 
+#if (NGX_HTTP_UPSTREAM_KEEPALIVE)
+
+typedef struct {
+    ngx_str_t                        name;
+    ngx_uint_t                       idle;
+    ngx_uint_t                       hits;
+    ngx_uint_t                       misses;
+    ngx_uint_t                       evicted;
+    ngx_uint_t                       prewarmed;
+} ngx_http_upstream_keepalive_stats_t;
+
+
+ngx_int_t ngx_http_upstream_keepalive_stats(ngx_cycle_t *cycle, ngx_uint_t n,
+    ngx_http_upstream_keepalive_stats_t *stats);
+
+#endif
+
+
 #define ngx_http_conf_upstream_srv_conf(uscf, module)                         \
     uscf->srv_conf[module.ctx_index]
 
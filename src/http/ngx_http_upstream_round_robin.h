@@ -14,6 +14,10 @@
 #include <ngx_http.h>
 
 
+/* set in ngx_http_upstream_rr_peer_t.down by active health checks */
+#define NGX_HTTP_UPSTREAM_PEER_UNHEALTHY  0x02
+
+
 typedef struct ngx_http_upstream_rr_peer_s   ngx_http_upstream_rr_peer_t;
 
 struct ngx_http_upstream_rr_peer_s {
@@ -40,6 +44,13 @@ struct ngx_http_upstream_rr_peer_s {
 
     ngx_uint_t                      down;
 
+    ngx_uint_t                      hc_fails;
+    ngx_uint_t                      hc_passes;
+    ngx_msec_t                      hc_next;
+
+    ngx_uint_t                      ewma;
+    ngx_msec_t                      ewma_stamp;
+
 #if (NGX_HTTP_SSL || NGX_COMPAT)
     void                           *ssl_session;
     int                             ssl_session_len;
@@ -51,7 +62,7 @@ struct ngx_http_upstream_rr_peer_s {
 
     ngx_http_upstream_rr_peer_t    *next;
 
-    NGX_COMPAT_BEGIN(32)
+    NGX_COMPAT_BEGIN(27)
     NGX_COMPAT_END
 };
 
@@ -275,6 +275,11 @@ ngx_http_v2_init(ngx_event_t *rev)
     h2c->concurrent_pushes = h2scf->concurrent_pushes;
     h2c->priority_limit = h2scf->concurrent_streams;
 
+    h2c->hpack_enc.size = NGX_HTTP_V2_TABLE_SIZE;
+    h2c->hpack_enc.limit = NGX_HTTP_V2_TABLE_SIZE;
+    h2c->hpack_enc.lowest = NGX_MAX_SIZE_T_VALUE;
+    h2c->hpack_enc.max = h2scf->hpack_table_size;
+
     h2c->pool = ngx_create_pool(h2scf->pool_size, h2c->connection->log);
     if (h2c->pool == NULL) {
         ngx_http_close_connection(c);
@@ -2092,7 +2097,7 @@ ngx_http_v2_state_settings_params(ngx_http_v2_connection_t *h2c, u_char *pos,
 
         case NGX_HTTP_V2_HEADER_TABLE_SIZE_SETTING:
 
-            h2c->table_update = 1;
+            ngx_http_v2_table_limit(h2c, value);
             break;
 
         default:
@@ -25,6 +25,9 @@
 #define NGX_HTTP_V2_MAX_FIELD                                                 \
     (127 + (1 << (NGX_HTTP_V2_INT_OCTETS - 1) * 7) - 1)
 
+#define NGX_HTTP_V2_TABLE_SIZE           4096
+#define NGX_HTTP_V2_MAX_TABLE_SIZE       65536
+
 #define NGX_HTTP_V2_STREAM_ID_SIZE       4
 
 #define NGX_HTTP_V2_FRAME_HEADER_SIZE    9
@@ -115,6 +118,31 @@ typedef struct {
 } ngx_http_v2_hpack_t;
 
 
+typedef struct {
+    ngx_uint_t                       hash;
+    ngx_uint_t                       name_hash;
+    ngx_str_t                        name;
+    ngx_str_t                        value;
+} ngx_http_v2_hpack_entry_t;
+
+
+typedef struct {
+    ngx_http_v2_hpack_entry_t       *entries;
+
+    ngx_uint_t                       added;
+    ngx_uint_t                       deleted;
+    ngx_uint_t                       allocated;
+
+    size_t                           size;
+    size_t                           free;
+    size_t                           limit;
+    size_t                           lowest;
+    size_t                           max;
+    u_char                          *storage;
+    u_char                          *pos;
+} ngx_http_v2_hpack_enc_t;
+
+
 struct ngx_http_v2_connection_s {
     ngx_connection_t                *connection;
     ngx_http_connection_t           *http_connection;
@@ -138,6 +166,7 @@ struct ngx_http_v2_connection_s {
     ngx_http_v2_state_t              state;
 
     ngx_http_v2_hpack_t              hpack;
+    ngx_http_v2_hpack_enc_t          hpack_enc;
 
     ngx_pool_t                      *pool;
 
@@ -306,7 +335,15 @@ ngx_int_t ngx_http_v2_add_header(ngx_http_v2_connection_t *h2c,
     ngx_http_v2_header_t *header);
 ngx_int_t ngx_http_v2_table_size(ngx_http_v2_connection_t *h2c, size_t size);
 
+void ngx_http_v2_table_limit(ngx_http_v2_connection_t *h2c, size_t size);
+u_char *ngx_http_v2_table_update(ngx_http_v2_connection_t *h2c, u_char *pos);
+u_char *ngx_http_v2_table_encode(ngx_http_v2_connection_t *h2c, u_char *pos,
+    ngx_uint_t index, ngx_str_t *name, ngx_str_t *value, u_char *tmp);
+u_char *ngx_http_v2_table_name(ngx_http_v2_connection_t *h2c, u_char *pos,
+    ngx_uint_t index);
 
+
+void ngx_http_v2_huff_decode_init(void);
 ngx_int_t ngx_http_v2_huff_decode(u_char *state, u_char *src, size_t len,
     u_char **dst, ngx_uint_t last, ngx_log_t *log);
 size_t ngx_http_v2_huff_encode(u_char *src, size_t len, u_char *dst,
@@ -370,6 +407,11 @@ size_t ngx_http_v2_huff_encode(u_char *src, size_t len, u_char *dst,
 #define ngx_http_v2_indexed(i)      (128 + (i))
 #define ngx_http_v2_inc_indexed(i)  (64 + (i))
 
+/* dynamic table size updates and names of never indexed fields */
+#define ngx_http_v2_table_update_size(h2c)                                    \
+    ((h2c)->hpack_enc.max ? 2 * NGX_HTTP_V2_INT_OCTETS + 4                    \
+                          : (h2c)->table_update)
+
 #define ngx_http_v2_write_name(dst, src, len, tmp)                            \
     ngx_http_v2_string_encode(dst, src, len, tmp, 1)
 #define ngx_http_v2_write_value(dst, src, len, tmp)                           \
@@ -413,6 +455,7 @@ size_t ngx_http_v2_huff_encode(u_char *src, size_t len, u_char *dst,
 
 u_char *ngx_http_v2_string_encode(u_char *dst, u_char *src, size_t len,
     u_char *tmp, ngx_uint_t lower);
+u_char *ngx_http_v2_write_int(u_char *pos, ngx_uint_t prefix, ngx_uint_t value);
 
 
 #endif /* _NGX_HTTP_V2_H_INCLUDED_ */
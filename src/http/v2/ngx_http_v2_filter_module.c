@@ -135,7 +135,7 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
 {
     u_char                     status, *pos, *start, *p, *tmp;
     size_t                     len, tmp_len;
-    ngx_str_t                  host, location;
+    ngx_str_t                  host, location, name, value;
     ngx_uint_t                 i, port, fin;
     ngx_list_part_t           *part;
     ngx_table_elt_t           *header;
@@ -147,6 +147,7 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
     ngx_http_core_loc_conf_t  *clcf;
     ngx_http_core_srv_conf_t  *cscf;
     u_char                     addr[NGX_SOCKADDR_STRLEN];
+    u_char                     code[3];
 
     static const u_char nginx[5] = "\x84\xaa\x63\x55\xe7";
 #if (NGX_HTTP_GZIP)
@@ -253,7 +254,7 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         }
     }
 
-    len = h2c->table_update ? 1 : 0;
+    len = ngx_http_v2_table_update_size(h2c);
 
     len += status ? 1 : 1 + ngx_http_v2_literal_size("418");
 
@@ -443,11 +444,9 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
 
     start = pos;
 
-    if (h2c->table_update) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, fc->log, 0,
-                       "http2 table size update: 0");
-        *pos++ = (1 << 5) | 0;
-        h2c->table_update = 0;
+    pos = ngx_http_v2_table_update(h2c, pos);
+    if (pos == NULL) {
+        return NGX_ERROR;
     }
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
@@ -457,6 +456,16 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
     if (status) {
         *pos++ = status;
 
+    } else if (h2c->hpack_enc.max) {
+        ngx_str_set(&name, ":status");
+
+        value.len = 3;
+        value.data = code;
+        ngx_sprintf(code, "%03ui", r->headers_out.status);
+
+        pos = ngx_http_v2_table_encode(h2c, pos, NGX_HTTP_V2_STATUS_INDEX,
+                                       &name, &value, tmp);
+
     } else {
         *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_STATUS_INDEX);
         *pos++ = NGX_HTTP_V2_ENCODE_RAW | 3;
@@ -480,9 +489,25 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                            "http2 output header: \"server: nginx\"");
         }
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_SERVER_INDEX);
+        if (h2c->hpack_enc.max) {
+            ngx_str_set(&name, "server");
+
+            if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_ON) {
+                ngx_str_set(&value, NGINX_VER);
+
+            } else if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_BUILD) {
+                ngx_str_set(&value, NGINX_VER_BUILD);
+
+            } else {
+                ngx_str_set(&value, "nginx");
+            }
+
+            pos = ngx_http_v2_table_encode(h2c, pos, NGX_HTTP_V2_SERVER_INDEX,
+                                           &name, &value, tmp);
+
+        } else if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_ON) {
+            *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_SERVER_INDEX);
 
-        if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_ON) {
             if (nginx_ver[0] == '\0') {
                 p = ngx_http_v2_write_value(nginx_ver, (u_char *) NGINX_VER,
                                             sizeof(NGINX_VER) - 1, tmp);
@@ -492,6 +517,8 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
             pos = ngx_cpymem(pos, nginx_ver, nginx_ver_len);
 
         } else if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_BUILD) {
+            *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_SERVER_INDEX);
+
             if (nginx_ver_build[0] == '\0') {
                 p = ngx_http_v2_write_value(nginx_ver_build,
                                             (u_char *) NGINX_VER_BUILD,
@@ -502,6 +529,7 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
             pos = ngx_cpymem(pos, nginx_ver_build, nginx_ver_build_len);
 
         } else {
+            *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_SERVER_INDEX);
             pos = ngx_cpymem(pos, nginx, sizeof(nginx));
         }
     }
@@ -511,13 +539,12 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"date: %V\"",
                        &ngx_cached_http_time);
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_DATE_INDEX);
+        pos = ngx_http_v2_table_name(h2c, pos, NGX_HTTP_V2_DATE_INDEX);
         pos = ngx_http_v2_write_value(pos, ngx_cached_http_time.data,
                                       ngx_cached_http_time.len, tmp);
     }
 
     if (r->headers_out.content_type.len) {
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_CONTENT_TYPE_INDEX);
 
         if (r->headers_out.content_type_len == r->headers_out.content_type.len
             && r->headers_out.charset.len)
@@ -548,8 +575,12 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"content-type: %V\"",
                        &r->headers_out.content_type);
 
-        pos = ngx_http_v2_write_value(pos, r->headers_out.content_type.data,
-                                      r->headers_out.content_type.len, tmp);
+        ngx_str_set(&name, "content-type");
+
+        pos = ngx_http_v2_table_encode(h2c, pos,
+                                       NGX_HTTP_V2_CONTENT_TYPE_INDEX,
+                                       &name, &r->headers_out.content_type,
+                                       tmp);
     }
 
     if (r->headers_out.content_length == NULL
@@ -559,7 +590,8 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"content-length: %O\"",
                        r->headers_out.content_length_n);
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_CONTENT_LENGTH_INDEX);
+        pos = ngx_http_v2_table_name(h2c, pos,
+                                     NGX_HTTP_V2_CONTENT_LENGTH_INDEX);
 
         p = pos;
         pos = ngx_sprintf(pos + 1, "%O", r->headers_out.content_length_n);
@@ -569,7 +601,8 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
     if (r->headers_out.last_modified == NULL
         && r->headers_out.last_modified_time != -1)
     {
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_LAST_MODIFIED_INDEX);
+        pos = ngx_http_v2_table_name(h2c, pos,
+                                     NGX_HTTP_V2_LAST_MODIFIED_INDEX);
 
         ngx_http_time(pos, r->headers_out.last_modified_time);
         len = sizeof("Wed, 31 Dec 1986 18:00:00 GMT") - 1;
@@ -590,7 +623,7 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"location: %V\"",
                        &r->headers_out.location->value);
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_LOCATION_INDEX);
+        pos = ngx_http_v2_table_name(h2c, pos, NGX_HTTP_V2_LOCATION_INDEX);
         pos = ngx_http_v2_write_value(pos, r->headers_out.location->value.data,
                                       r->headers_out.location->value.len, tmp);
     }
@@ -600,8 +633,17 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, fc->log, 0,
                        "http2 output header: \"vary: Accept-Encoding\"");
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_VARY_INDEX);
-        pos = ngx_cpymem(pos, accept_encoding, sizeof(accept_encoding));
+        if (h2c->hpack_enc.max) {
+            ngx_str_set(&name, "vary");
+            ngx_str_set(&value, "Accept-Encoding");
+
+            pos = ngx_http_v2_table_encode(h2c, pos, NGX_HTTP_V2_VARY_INDEX,
+                                           &name, &value, tmp);
+
+        } else {
+            *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_VARY_INDEX);
+            pos = ngx_cpymem(pos, accept_encoding, sizeof(accept_encoding));
+        }
     }
 #endif
 
@@ -634,13 +676,8 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         }
 #endif
 
-        *pos++ = 0;
-
-        pos = ngx_http_v2_write_name(pos, header[i].key.data,
-                                     header[i].key.len, tmp);
-
-        pos = ngx_http_v2_write_value(pos, header[i].value.data,
-                                      header[i].value.len, tmp);
+        pos = ngx_http_v2_table_encode(h2c, pos, 0, &header[i].key,
+                                       &header[i].value, tmp);
     }
 
     fin = r->header_only
@@ -975,7 +1012,9 @@ ngx_http_v2_push_resource(ngx_http_request_t *r, ngx_str_t *path,
 
             value = &(*h)->value;
 
-            len = 1 + NGX_HTTP_V2_INT_OCTETS + value->len;
+            /* a name index without indexing may take two octets */
+
+            len = 2 + NGX_HTTP_V2_INT_OCTETS + value->len;
 
             pos = ngx_pnalloc(r->pool, len);
             if (pos == NULL) {
@@ -984,14 +1023,14 @@ ngx_http_v2_push_resource(ngx_http_request_t *r, ngx_str_t *path,
 
             binary[i].data = pos;
 
-            *pos++ = ngx_http_v2_inc_indexed(ph[i].index);
+            pos = ngx_http_v2_table_name(h2c, pos, ph[i].index);
             pos = ngx_http_v2_write_value(pos, value->data, value->len, tmp);
 
             binary[i].len = pos - binary[i].data;
         }
     }
 
-    len = (h2c->table_update ? 1 : 0)
+    len = ngx_http_v2_table_update_size(h2c)
           + 1
           + 1 + NGX_HTTP_V2_INT_OCTETS + path->len
           + 1 + NGX_HTTP_V2_INT_OCTETS + r->schema.len;
@@ -1007,11 +1046,9 @@ ngx_http_v2_push_resource(ngx_http_request_t *r, ngx_str_t *path,
 
     start = pos;
 
-    if (h2c->table_update) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, fc->log, 0,
-                       "http2 table size update: 0");
-        *pos++ = (1 << 5) | 0;
-        h2c->table_update = 0;
+    pos = ngx_http_v2_table_update(h2c, pos);
+    if (pos == NULL) {
+        return NGX_ERROR;
     }
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, fc->log, 0,
@@ -1022,7 +1059,7 @@ ngx_http_v2_push_resource(ngx_http_request_t *r, ngx_str_t *path,
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
                    "http2 push header: \":path: %V\"", path);
 
-    *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_PATH_INDEX);
+    pos = ngx_http_v2_table_name(h2c, pos, NGX_HTTP_V2_PATH_INDEX);
     pos = ngx_http_v2_write_value(pos, path->data, path->len, tmp);
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
@@ -1037,7 +1074,7 @@ ngx_http_v2_push_resource(ngx_http_request_t *r, ngx_str_t *path,
         *pos++ = ngx_http_v2_indexed(NGX_HTTP_V2_SCHEME_HTTP_INDEX);
 
     } else {
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_SCHEME_HTTP_INDEX);
+        pos = ngx_http_v2_table_name(h2c, pos, NGX_HTTP_V2_SCHEME_HTTP_INDEX);
         pos = ngx_http_v2_write_value(pos, r->schema.data, r->schema.len, tmp);
     }
 
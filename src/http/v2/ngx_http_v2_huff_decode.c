@@ -18,10 +18,33 @@ typedef struct {
 } ngx_http_v2_huff_decode_code_t;
 
 
+/*
+ * the octets table is built from the 4-bit codes table and has
+ * an entry for each state and input octet:
+ *
+ *     bits 0-7    next state
+ *     bits 8-15   first symbol
+ *     bits 16-23  second symbol
+ *     bits 24-25  number of symbols emitted
+ *     bit 26      ending
+ *     bit 27      invalid code
+ */
+
+#define NGX_HTTP_V2_HUFF_EMIT_SHIFT     24
+#define NGX_HTTP_V2_HUFF_ENDING         0x04000000
+#define NGX_HTTP_V2_HUFF_INVALID        0x08000000
+
+
+static ngx_int_t ngx_http_v2_huff_decode_octet(u_char *state, u_char *ending,
+    u_char ch, u_char **dst, ngx_log_t *log);
 static ngx_inline ngx_int_t ngx_http_v2_huff_decode_bits(u_char *state,
     u_char *ending, ngx_uint_t bits, u_char **dst);
 
 
+static ngx_uint_t  ngx_http_v2_huff_decode_ready;
+static uint32_t    ngx_http_v2_huff_decode_octets[256][256];
+
+
 static ngx_http_v2_huff_decode_code_t  ngx_http_v2_huff_decode_codes[256][16] =
 {
     /* 0 */
@@ -2639,41 +2662,103 @@ static ngx_http_v2_huff_decode_code_t  ngx_http_v2_huff_decode_codes[256][16] =
 };
 
 
+void
+ngx_http_v2_huff_decode_init(void)
+{
+    u_char      *p, state, ending, sym[2];
+    uint32_t     code;
+    ngx_uint_t   i, ch;
+
+    if (ngx_http_v2_huff_decode_ready) {
+        return;
+    }
+
+    for (i = 0; i < 256; i++) {
+        for (ch = 0; ch < 256; ch++) {
+
+            state = (u_char) i;
+            ending = 0;
+            sym[0] = 0;
+            sym[1] = 0;
+            p = sym;
+
+            if (ngx_http_v2_huff_decode_bits(&state, &ending, ch >> 4, &p)
+                != NGX_OK
+                || ngx_http_v2_huff_decode_bits(&state, &ending, ch & 0xf, &p)
+                   != NGX_OK)
+            {
+                ngx_http_v2_huff_decode_octets[i][ch] =
+                                                      NGX_HTTP_V2_HUFF_INVALID;
+                continue;
+            }
+
+            code = state
+                   | (uint32_t) sym[0] << 8
+                   | (uint32_t) sym[1] << 16
+                   | (uint32_t) (p - sym) << NGX_HTTP_V2_HUFF_EMIT_SHIFT;
+
+            if (ending) {
+                code |= NGX_HTTP_V2_HUFF_ENDING;
+            }
+
+            ngx_http_v2_huff_decode_octets[i][ch] = code;
+        }
+    }
+
+    ngx_http_v2_huff_decode_ready = 1;
+}
+
+
 ngx_int_t
 ngx_http_v2_huff_decode(u_char *state, u_char *src, size_t len, u_char **dst,
     ngx_uint_t last, ngx_log_t *log)
 {
-    u_char  *end, ch, ending;
+    u_char    *end, *d, ch, ending, st;
+    uint32_t   code;
 
     ch = 0;
     ending = 1;
 
     end = src + len;
 
+    st = *state;
+    d = *dst;
+
     while (src != end) {
         ch = *src++;
 
-        if (ngx_http_v2_huff_decode_bits(state, &ending, ch >> 4, dst)
-            != NGX_OK)
-        {
-            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
-                           "http2 huffman decoding error at state %d: "
-                           "bad code 0x%Xd", *state, ch >> 4);
+        code = ngx_http_v2_huff_decode_octets[st][ch];
+
+        if (code & NGX_HTTP_V2_HUFF_INVALID) {
+            *state = st;
+            *dst = d;
+
+            /* logs the bad code */
+
+            (void) ngx_http_v2_huff_decode_octet(state, &ending, ch, dst, log);
 
             return NGX_ERROR;
         }
 
-        if (ngx_http_v2_huff_decode_bits(state, &ending, ch & 0xf, dst)
-            != NGX_OK)
-        {
-            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
-                           "http2 huffman decoding error at state %d: "
-                           "bad code 0x%Xd", *state, ch & 0xf);
+        switch (code >> NGX_HTTP_V2_HUFF_EMIT_SHIFT & 3) {
 
-            return NGX_ERROR;
+        case 2:
+            *d++ = (u_char) (code >> 8);
+            *d++ = (u_char) (code >> 16);
+            break;
+
+        case 1:
+            *d++ = (u_char) (code >> 8);
+            break;
         }
+
+        ending = (code & NGX_HTTP_V2_HUFF_ENDING) ? 1 : 0;
+        st = (u_char) code;
     }
 
+    *state = st;
+    *dst = d;
+
     if (last) {
         if (!ending) {
             ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
@@ -2691,6 +2776,30 @@ ngx_http_v2_huff_decode(u_char *state, u_char *src, size_t len, u_char **dst,
 
 
 
+static ngx_int_t
+ngx_http_v2_huff_decode_octet(u_char *state, u_char *ending, u_char ch,
+    u_char **dst, ngx_log_t *log)
+{
+    if (ngx_http_v2_huff_decode_bits(state, ending, ch >> 4, dst) != NGX_OK) {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "http2 huffman decoding error at state %d: "
+                       "bad code 0x%Xd", *state, ch >> 4);
+
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_v2_huff_decode_bits(state, ending, ch & 0xf, dst) != NGX_OK) {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "http2 huffman decoding error at state %d: "
+                       "bad code 0x%Xd", *state, ch & 0xf);
+
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
 static ngx_inline ngx_int_t
 ngx_http_v2_huff_decode_bits(u_char *state, u_char *ending, ngx_uint_t bits,
     u_char **dst)
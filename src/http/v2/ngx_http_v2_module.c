@@ -36,6 +36,8 @@ static char *ngx_http_v2_preread_size(ngx_conf_t *cf, void *post, void *data);
 static char *ngx_http_v2_streams_index_mask(ngx_conf_t *cf, void *post,
     void *data);
 static char *ngx_http_v2_chunk_size(ngx_conf_t *cf, void *post, void *data);
+static char *ngx_http_v2_hpack_table_size(ngx_conf_t *cf, void *post,
+    void *data);
 static char *ngx_http_v2_spdy_deprecated(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 
@@ -50,6 +52,8 @@ static ngx_conf_post_t  ngx_http_v2_streams_index_mask_post =
     { ngx_http_v2_streams_index_mask };
 static ngx_conf_post_t  ngx_http_v2_chunk_size_post =
     { ngx_http_v2_chunk_size };
+static ngx_conf_post_t  ngx_http_v2_hpack_table_size_post =
+    { ngx_http_v2_hpack_table_size };
 
 
 static ngx_command_t  ngx_http_v2_commands[] = {
@@ -117,6 +121,13 @@ static ngx_command_t  ngx_http_v2_commands[] = {
       offsetof(ngx_http_v2_srv_conf_t, streams_index_mask),
       &ngx_http_v2_streams_index_mask_post },
 
+    { ngx_string("http2_hpack_table_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_v2_srv_conf_t, hpack_table_size),
+      &ngx_http_v2_hpack_table_size_post },
+
     { ngx_string("http2_recv_timeout"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_msec_slot,
@@ -308,6 +319,8 @@ ngx_http_v2_variable(ngx_http_request_t *r,
 static ngx_int_t
 ngx_http_v2_module_init(ngx_cycle_t *cycle)
 {
+    ngx_http_v2_huff_decode_init();
+
     return NGX_OK;
 }
 
@@ -361,6 +374,7 @@ ngx_http_v2_create_srv_conf(ngx_conf_t *cf)
     h2scf->preread_size = NGX_CONF_UNSET_SIZE;
 
     h2scf->streams_index_mask = NGX_CONF_UNSET_UINT;
+    h2scf->hpack_table_size = NGX_CONF_UNSET_SIZE;
 
     h2scf->recv_timeout = NGX_CONF_UNSET_MSEC;
     h2scf->idle_timeout = NGX_CONF_UNSET_MSEC;
@@ -393,6 +407,9 @@ ngx_http_v2_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_uint_value(conf->streams_index_mask,
                               prev->streams_index_mask, 32 - 1);
 
+    ngx_conf_merge_size_value(conf->hpack_table_size, prev->hpack_table_size,
+                              NGX_HTTP_V2_TABLE_SIZE);
+
     ngx_conf_merge_msec_value(conf->recv_timeout,
                               prev->recv_timeout, 30000);
     ngx_conf_merge_msec_value(conf->idle_timeout,
@@ -599,6 +616,23 @@ ngx_http_v2_chunk_size(ngx_conf_t *cf, void *post, void *data)
 }
 
 
+static char *
+ngx_http_v2_hpack_table_size(ngx_conf_t *cf, void *post, void *data)
+{
+    size_t *sp = data;
+
+    if (*sp > NGX_HTTP_V2_MAX_TABLE_SIZE) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "the maximum hpack table size is %uz",
+                           (size_t) NGX_HTTP_V2_MAX_TABLE_SIZE);
+
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
 static char *
 ngx_http_v2_spdy_deprecated(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
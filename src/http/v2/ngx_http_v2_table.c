@@ -10,12 +10,20 @@
 #include <ngx_http.h>
 
 
-#define NGX_HTTP_V2_TABLE_SIZE  4096
-
-
 static ngx_int_t ngx_http_v2_table_account(ngx_http_v2_connection_t *h2c,
     size_t size);
 
+static ngx_uint_t ngx_http_v2_table_volatile(ngx_str_t *name);
+static void ngx_http_v2_table_resize(ngx_http_v2_hpack_enc_t *enc,
+    size_t size);
+static void ngx_http_v2_table_insert(ngx_http_v2_hpack_enc_t *enc,
+    ngx_str_t *name, ngx_str_t *value, ngx_uint_t hash, ngx_uint_t name_hash,
+    size_t size);
+static u_char *ngx_http_v2_table_copy(ngx_http_v2_hpack_enc_t *enc,
+    u_char *dst, u_char *src, size_t len, ngx_uint_t lower);
+static ngx_int_t ngx_http_v2_table_cmp(ngx_http_v2_hpack_enc_t *enc,
+    u_char *p, u_char *s, size_t len, ngx_uint_t lower);
+
 
 static ngx_http_v2_header_t  ngx_http_v2_static_table[] = {
     { ngx_string(":authority"), ngx_string("") },
@@ -86,6 +94,26 @@ static ngx_http_v2_header_t  ngx_http_v2_static_table[] = {
      / sizeof(ngx_http_v2_header_t))
 
 
+/*
+ * response header fields that either change with almost every response,
+ * or must not be kept by intermediaries; the encoder never adds them
+ * to the dynamic table
+ */
+
+static ngx_str_t  ngx_http_v2_volatile_headers[] = {
+    ngx_string("age"),
+    ngx_string("content-length"),
+    ngx_string("content-range"),
+    ngx_string("date"),
+    ngx_string("etag"),
+    ngx_string("expires"),
+    ngx_string("last-modified"),
+    ngx_string("location"),
+    ngx_string("set-cookie"),
+    ngx_null_string
+};
+
+
 ngx_str_t *
 ngx_http_v2_get_static_name(ngx_uint_t index)
 {
@@ -361,3 +389,350 @@ ngx_http_v2_table_size(ngx_http_v2_connection_t *h2c, size_t size)
 
     return NGX_OK;
 }
+
+
+void
+ngx_http_v2_table_limit(ngx_http_v2_connection_t *h2c, size_t size)
+{
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 client hpack table size: %uz", size);
+
+    h2c->hpack_enc.limit = size;
+
+    if (size < h2c->hpack_enc.lowest) {
+        h2c->hpack_enc.lowest = size;
+    }
+
+    h2c->table_update = 1;
+}
+
+
+u_char *
+ngx_http_v2_table_update(ngx_http_v2_connection_t *h2c, u_char *pos)
+{
+    size_t                    size;
+    ngx_http_v2_hpack_enc_t  *enc;
+
+    enc = &h2c->hpack_enc;
+
+    if (enc->max == 0) {
+
+        if (h2c->table_update) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                           "http2 table size update: 0");
+            *pos++ = (1 << 5) | 0;
+            h2c->table_update = 0;
+        }
+
+        return pos;
+    }
+
+    if (enc->storage == NULL) {
+        enc->allocated = enc->max / 32;
+
+        enc->entries = ngx_palloc(h2c->connection->pool,
+                                  sizeof(ngx_http_v2_hpack_entry_t)
+                                  * enc->allocated);
+        if (enc->entries == NULL) {
+            return NULL;
+        }
+
+        enc->storage = ngx_palloc(h2c->connection->pool, enc->max);
+        if (enc->storage == NULL) {
+            return NULL;
+        }
+
+        enc->pos = enc->storage;
+        enc->free = enc->size;
+    }
+
+    size = ngx_min(enc->max, enc->limit);
+
+    /*
+     * if the client has lowered its limit below the current size
+     * and then raised it again, the lowest value has to be signalled first
+     */
+
+    if (enc->lowest < enc->size && enc->lowest < size) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                       "http2 table size update: %uz", enc->lowest);
+
+        *pos = (1 << 5);
+        pos = ngx_http_v2_write_int(pos, ngx_http_v2_prefix(5), enc->lowest);
+
+        ngx_http_v2_table_resize(enc, enc->lowest);
+    }
+
+    if (size != enc->size) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                       "http2 table size update: %uz", size);
+
+        *pos = (1 << 5);
+        pos = ngx_http_v2_write_int(pos, ngx_http_v2_prefix(5), size);
+
+        ngx_http_v2_table_resize(enc, size);
+    }
+
+    enc->lowest = NGX_MAX_SIZE_T_VALUE;
+    h2c->table_update = 0;
+
+    return pos;
+}
+
+
+u_char *
+ngx_http_v2_table_encode(ngx_http_v2_connection_t *h2c, u_char *pos,
+    ngx_uint_t index, ngx_str_t *name, ngx_str_t *value, u_char *tmp)
+{
+    size_t                      size;
+    ngx_uint_t                  i, hash, name_hash, name_index;
+    ngx_http_v2_hpack_enc_t    *enc;
+    ngx_http_v2_hpack_entry_t  *entry;
+
+    enc = &h2c->hpack_enc;
+
+    if (enc->max == 0) {
+
+        if (index) {
+            *pos++ = ngx_http_v2_inc_indexed(index);
+
+        } else {
+            *pos++ = 0;
+            pos = ngx_http_v2_write_name(pos, name->data, name->len, tmp);
+        }
+
+        return ngx_http_v2_write_value(pos, value->data, value->len, tmp);
+    }
+
+    size = 32 + name->len + value->len;
+
+    if (size > enc->size || ngx_http_v2_table_volatile(name)) {
+
+        /* literal header field without indexing */
+
+        if (index) {
+            *pos = 0;
+            pos = ngx_http_v2_write_int(pos, ngx_http_v2_prefix(4), index);
+
+        } else {
+            *pos++ = 0;
+            pos = ngx_http_v2_write_name(pos, name->data, name->len, tmp);
+        }
+
+        return ngx_http_v2_write_value(pos, value->data, value->len, tmp);
+    }
+
+    name_hash = 0;
+
+    for (i = 0; i < name->len; i++) {
+        name_hash = ngx_hash(name_hash, ngx_tolower(name->data[i]));
+    }
+
+    hash = name_hash;
+
+    for (i = 0; i < value->len; i++) {
+        hash = ngx_hash(hash, value->data[i]);
+    }
+
+    name_index = index;
+
+    /* the table size limits the number of entries to scan */
+
+    for (i = enc->added; i != enc->deleted; /* void */) {
+        entry = &enc->entries[--i % enc->allocated];
+
+        if (entry->hash == hash
+            && entry->name.len == name->len
+            && entry->value.len == value->len
+            && ngx_http_v2_table_cmp(enc, entry->name.data, name->data,
+                                     name->len, 1)
+               == NGX_OK
+            && ngx_http_v2_table_cmp(enc, entry->value.data, value->data,
+                                     value->len, 0)
+               == NGX_OK)
+        {
+            index = NGX_HTTP_V2_STATIC_TABLE_ENTRIES + enc->added - i;
+
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                           "http2 table indexed: %ui", index);
+
+            *pos = ngx_http_v2_indexed(0);
+            return ngx_http_v2_write_int(pos, ngx_http_v2_prefix(7), index);
+        }
+
+        if (name_index == 0
+            && entry->name_hash == name_hash
+            && entry->name.len == name->len
+            && ngx_http_v2_table_cmp(enc, entry->name.data, name->data,
+                                     name->len, 1)
+               == NGX_OK)
+        {
+            name_index = NGX_HTTP_V2_STATIC_TABLE_ENTRIES + enc->added - i;
+        }
+    }
+
+    /* literal header field with incremental indexing */
+
+    if (name_index) {
+        *pos = ngx_http_v2_inc_indexed(0);
+        pos = ngx_http_v2_write_int(pos, ngx_http_v2_prefix(6), name_index);
+
+    } else {
+        *pos++ = ngx_http_v2_inc_indexed(0);
+        pos = ngx_http_v2_write_name(pos, name->data, name->len, tmp);
+    }
+
+    pos = ngx_http_v2_write_value(pos, value->data, value->len, tmp);
+
+    ngx_http_v2_table_insert(enc, name, value, hash, name_hash, size);
+
+    return pos;
+}
+
+
+u_char *
+ngx_http_v2_table_name(ngx_http_v2_connection_t *h2c, u_char *pos,
+    ngx_uint_t index)
+{
+    if (h2c->hpack_enc.max == 0) {
+        *pos++ = ngx_http_v2_inc_indexed(index);
+        return pos;
+    }
+
+    /* literal header field without indexing */
+
+    *pos = 0;
+
+    return ngx_http_v2_write_int(pos, ngx_http_v2_prefix(4), index);
+}
+
+
+static ngx_uint_t
+ngx_http_v2_table_volatile(ngx_str_t *name)
+{
+    ngx_str_t  *h;
+
+    for (h = ngx_http_v2_volatile_headers; h->len; h++) {
+
+        if (h->len == name->len
+            && ngx_strncasecmp(h->data, name->data, name->len) == 0)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+static void
+ngx_http_v2_table_resize(ngx_http_v2_hpack_enc_t *enc, size_t size)
+{
+    size_t                      used;
+    ngx_http_v2_hpack_entry_t  *entry;
+
+    used = enc->size - enc->free;
+
+    while (used > size) {
+        entry = &enc->entries[enc->deleted++ % enc->allocated];
+        used -= 32 + entry->name.len + entry->value.len;
+    }
+
+    enc->size = size;
+    enc->free = size - used;
+}
+
+
+static void
+ngx_http_v2_table_insert(ngx_http_v2_hpack_enc_t *enc, ngx_str_t *name,
+    ngx_str_t *value, ngx_uint_t hash, ngx_uint_t name_hash, size_t size)
+{
+    ngx_http_v2_hpack_entry_t  *entry;
+
+    while (size > enc->free) {
+        entry = &enc->entries[enc->deleted++ % enc->allocated];
+        enc->free += 32 + entry->name.len + entry->value.len;
+    }
+
+    enc->free -= size;
+
+    /*
+     * every entry takes at least 32 octets of the table size,
+     * so the ring of entries never overflows; and the storage
+     * never holds more than the table size of names and values
+     */
+
+    entry = &enc->entries[enc->added++ % enc->allocated];
+
+    entry->hash = hash;
+    entry->name_hash = name_hash;
+
+    entry->name.len = name->len;
+    entry->name.data = enc->pos;
+    enc->pos = ngx_http_v2_table_copy(enc, enc->pos, name->data, name->len, 1);
+
+    entry->value.len = value->len;
+    entry->value.data = enc->pos;
+    enc->pos = ngx_http_v2_table_copy(enc, enc->pos, value->data, value->len,
+                                      0);
+}
+
+
+static u_char *
+ngx_http_v2_table_copy(ngx_http_v2_hpack_enc_t *enc, u_char *dst,
+    u_char *src, size_t len, ngx_uint_t lower)
+{
+    size_t  avail;
+
+    avail = enc->storage + enc->max - dst;
+
+    if (avail < len) {
+
+        if (lower) {
+            ngx_strlow(dst, src, avail);
+
+        } else {
+            ngx_memcpy(dst, src, avail);
+        }
+
+        dst = enc->storage;
+        src += avail;
+        len -= avail;
+    }
+
+    if (lower) {
+        ngx_strlow(dst, src, len);
+
+    } else {
+        ngx_memcpy(dst, src, len);
+    }
+
+    return dst + len;
+}
+
+
+static ngx_int_t
+ngx_http_v2_table_cmp(ngx_http_v2_hpack_enc_t *enc, u_char *p, u_char *s,
+    size_t len, ngx_uint_t lower)
+{
+    u_char  c, *end;
+
+    end = enc->storage + enc->max;
+
+    while (len--) {
+
+        if (p == end) {
+            p = enc->storage;
+        }
+
+        c = lower ? ngx_tolower(*s) : *s;
+
+        if (*p++ != c) {
+            return NGX_DECLINED;
+        }
+
+        s++;
+    }
+
+    return NGX_OK;
+}
@@ -89,6 +89,11 @@ extern ssize_t sendfile(int s, int fd, int32_t *offset, size_t size);
 #endif
 
 
+#if (NGX_HAVE_IO_URING)
+#include <linux/io_uring.h>
+#endif
+
+
 #if (NGX_HAVE_SYS_EVENTFD_H)
 #include <sys/eventfd.h>
 #endif
@@ -99,11 +104,21 @@ typedef struct iocb  ngx_aiocb_t;
 #endif
 
 
+#if (NGX_HAVE_REUSEPORT_CBPF)
+#include <linux/filter.h>
+#endif
+
+
 #if (NGX_HAVE_CAPABILITIES)
 #include <linux/capability.h>
 #endif
 
 
+#if (NGX_HAVE_UDP_SEGMENT)
+#include <netinet/udp.h>
+#endif
+
+
 #define NGX_LISTEN_BACKLOG        511
 
 
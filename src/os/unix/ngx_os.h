@@ -61,6 +61,15 @@ ngx_chain_t *ngx_udp_unix_sendmsg_chain(ngx_connection_t *c, ngx_chain_t *in,
 #endif
 
 
+/* datagrams per recvmmsg() and sendmmsg() call */
+
+#if (NGX_HAVE_MMSG)
+#define NGX_UDP_BATCH         32
+#else
+#define NGX_UDP_BATCH         1
+#endif
+
+
 typedef struct {
     struct iovec  *iovs;
     ngx_uint_t     count;
@@ -1134,6 +1134,7 @@ ngx_cache_manager_process_cycle(ngx_cycle_t *cycle, void *data)
     ngx_cache_manager_ctx_t *ctx = data;
 
     void         *ident[4];
+    ngx_uint_t    i;
     ngx_event_t   ev;
 
     /*
@@ -1165,6 +1166,15 @@ ngx_cache_manager_process_cycle(ngx_cycle_t *cycle, void *data)
 
         if (ngx_terminate || ngx_quit) {
             ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0, "exiting");
+
+            /* let the thread pools finish the queued tasks */
+
+            for (i = 0; cycle->modules[i]; i++) {
+                if (cycle->modules[i]->exit_process) {
+                    cycle->modules[i]->exit_process(cycle);
+                }
+            }
+
             exit(0);
         }
 
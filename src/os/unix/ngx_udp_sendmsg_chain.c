@@ -10,19 +10,48 @@
 #include <ngx_event.h>
 
 
+/* the source address and the segment size control messages */
+
+#define NGX_UDP_MSG_CONTROL  128
+
+
+typedef struct {
+    struct msghdr   msg;
+    u_char          control[NGX_UDP_MSG_CONTROL];
+} ngx_udp_msg_t;
+
+
 static ngx_chain_t *ngx_udp_output_chain_to_iovec(ngx_iovec_t *vec,
     ngx_chain_t *in, ngx_log_t *log);
-static ssize_t ngx_sendmsg(ngx_connection_t *c, ngx_iovec_t *vec);
+static ssize_t ngx_sendmsg(ngx_connection_t *c, ngx_iovec_t *vec,
+    ngx_uint_t nvec);
+#if (NGX_HAVE_MMSG)
+static ssize_t ngx_sendmmsg(ngx_connection_t *c, ngx_iovec_t *vec,
+    ngx_uint_t nvec, size_t size);
+#endif
+static void ngx_udp_msg_init(ngx_connection_t *c, ngx_udp_msg_t *um,
+    struct iovec *iovs, ngx_uint_t count);
+#if (NGX_HAVE_UDP_SEGMENT)
+static ngx_uint_t ngx_udp_msg_segment(ngx_connection_t *c, ngx_udp_msg_t *um,
+    ngx_iovec_t *vec, ngx_uint_t nvec);
+#endif
 
 
+/*
+ * Up to NGX_UDP_BATCH datagrams ready in the chain are sent at once,
+ * as a single UDP_SEGMENT message if they are of the same size,
+ * or with sendmmsg() otherwise.
+ */
+
 ngx_chain_t *
 ngx_udp_unix_sendmsg_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
 {
     ssize_t        n;
     off_t          send;
-    ngx_chain_t   *cl;
+    ngx_uint_t     nvec, niovs;
+    ngx_chain_t   *cl, *next;
     ngx_event_t   *wev;
-    ngx_iovec_t    vec;
+    ngx_iovec_t    vec[NGX_UDP_BATCH];
     struct iovec   iovs[NGX_IOVS_PREALLOCATE];
 
     wev = c->write;
@@ -50,45 +79,60 @@ ngx_udp_unix_sendmsg_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
 
     send = 0;
 
-    vec.iovs = iovs;
-    vec.nalloc = NGX_IOVS_PREALLOCATE;
-
     for ( ;; ) {
 
-        /* create the iovec and coalesce the neighbouring bufs */
+        /* create the iovecs and coalesce the neighbouring bufs */
 
-        cl = ngx_udp_output_chain_to_iovec(&vec, in, c->log);
+        cl = in;
+        nvec = 0;
+        niovs = 0;
 
-        if (cl == NGX_CHAIN_ERROR) {
-            return NGX_CHAIN_ERROR;
-        }
+        while (cl && nvec < NGX_UDP_BATCH && send < limit) {
 
-        if (cl && cl->buf->in_file) {
-            ngx_log_error(NGX_LOG_ALERT, c->log, 0,
-                          "file buf in sendmsg "
-                          "t:%d r:%d f:%d %p %p-%p %p %O-%O",
-                          cl->buf->temporary,
-                          cl->buf->recycled,
-                          cl->buf->in_file,
-                          cl->buf->start,
-                          cl->buf->pos,
-                          cl->buf->last,
-                          cl->buf->file,
-                          cl->buf->file_pos,
-                          cl->buf->file_last);
+            vec[nvec].iovs = &iovs[niovs];
+            vec[nvec].nalloc = NGX_IOVS_PREALLOCATE - niovs;
 
-            ngx_debug_point();
+            next = ngx_udp_output_chain_to_iovec(&vec[nvec], cl, c->log);
 
-            return NGX_CHAIN_ERROR;
+            if (next == NGX_CHAIN_ERROR) {
+                return NGX_CHAIN_ERROR;
+            }
+
+            if (next && next->buf->in_file) {
+                ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                              "file buf in sendmsg "
+                              "t:%d r:%d f:%d %p %p-%p %p %O-%O",
+                              next->buf->temporary,
+                              next->buf->recycled,
+                              next->buf->in_file,
+                              next->buf->start,
+                              next->buf->pos,
+                              next->buf->last,
+                              next->buf->file,
+                              next->buf->file_pos,
+                              next->buf->file_last);
+
+                ngx_debug_point();
+
+                return NGX_CHAIN_ERROR;
+            }
+
+            if (next == cl) {
+                break;
+            }
+
+            send += vec[nvec].size;
+            niovs += vec[nvec].count;
+            nvec++;
+
+            cl = next;
         }
 
-        if (cl == in) {
+        if (nvec == 0) {
             return in;
         }
 
-        send += vec.size;
-
-        n = ngx_sendmsg(c, &vec);
+        n = ngx_sendmsg(c, vec, nvec);
 
         if (n == NGX_ERROR) {
             return NGX_CHAIN_ERROR;
@@ -166,6 +210,12 @@ ngx_udp_output_chain_to_iovec(ngx_iovec_t *vec, ngx_chain_t *in, ngx_log_t *log)
 
         } else {
             if (n == vec->nalloc) {
+
+                if (vec->nalloc < NGX_IOVS_PREALLOCATE) {
+                    /* no room left for the datagram in a batch */
+                    return cl;
+                }
+
                 ngx_log_error(NGX_LOG_ALERT, log, 0,
                               "too many parts in a datagram");
                 return NGX_CHAIN_ERROR;
@@ -197,35 +247,176 @@ ngx_udp_output_chain_to_iovec(ngx_iovec_t *vec, ngx_chain_t *in, ngx_log_t *log)
 
 
 static ssize_t
-ngx_sendmsg(ngx_connection_t *c, ngx_iovec_t *vec)
+ngx_sendmsg(ngx_connection_t *c, ngx_iovec_t *vec, ngx_uint_t nvec)
 {
-    ssize_t        n;
-    ngx_err_t      err;
-    struct msghdr  msg;
+    size_t          size;
+    ssize_t         n;
+    ngx_err_t       err;
+    ngx_uint_t      i;
+    ngx_udp_msg_t   um;
+#if (NGX_HAVE_MMSG)
+    ngx_uint_t      segmented;
+#endif
 
-#if (NGX_HAVE_MSGHDR_MSG_CONTROL)
+    size = 0;
 
-#if (NGX_HAVE_IP_SENDSRCADDR)
-    u_char         msg_control[CMSG_SPACE(sizeof(struct in_addr))];
-#elif (NGX_HAVE_IP_PKTINFO)
-    u_char         msg_control[CMSG_SPACE(sizeof(struct in_pktinfo))];
+    for (i = 0; i < nvec; i++) {
+        size += vec[i].size;
+    }
+
+    ngx_udp_msg_init(c, &um, vec[0].iovs, vec[0].count);
+
+#if (NGX_HAVE_MMSG)
+
+    segmented = 0;
+
+    if (nvec > 1) {
+
+#if (NGX_HAVE_UDP_SEGMENT)
+        segmented = ngx_udp_msg_segment(c, &um, vec, nvec);
 #endif
 
-#if (NGX_HAVE_INET6 && NGX_HAVE_IPV6_RECVPKTINFO)
-    u_char         msg_control6[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+        if (!segmented) {
+            return ngx_sendmmsg(c, vec, nvec, size);
+        }
+    }
+
 #endif
 
+eintr:
+
+    n = sendmsg(c->fd, &um.msg, 0);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "sendmsg: %z of %uz in %ui", n, size, nvec);
+
+    if (n == -1) {
+        err = ngx_errno;
+
+        switch (err) {
+        case NGX_EAGAIN:
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
+                           "sendmsg() not ready");
+            return NGX_AGAIN;
+
+        case NGX_EINTR:
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
+                           "sendmsg() was interrupted");
+            goto eintr;
+
+        default:
+
+#if (NGX_HAVE_MMSG)
+            if (segmented) {
+
+                /* e.g., the segment size exceeds the path MTU */
+
+                ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
+                               "sendmsg() with UDP_SEGMENT failed");
+
+                return ngx_sendmmsg(c, vec, nvec, size);
+            }
+#endif
+
+            c->write->error = 1;
+            ngx_connection_error(c, err, "sendmsg() failed");
+            return NGX_ERROR;
+        }
+    }
+
+#if (NGX_STAT_STUB)
+    (void) ngx_atomic_fetch_add(ngx_stat_udp_send_calls, 1);
+    (void) ngx_atomic_fetch_add(ngx_stat_udp_sent, nvec);
 #endif
 
-    ngx_memzero(&msg, sizeof(struct msghdr));
+    return n;
+}
+
+
+#if (NGX_HAVE_MMSG)
+
+static ssize_t
+ngx_sendmmsg(ngx_connection_t *c, ngx_iovec_t *vec, ngx_uint_t nvec,
+    size_t size)
+{
+    int              rc;
+    ssize_t          n;
+    ngx_err_t        err;
+    ngx_uint_t       i;
+    ngx_udp_msg_t    ums[NGX_UDP_BATCH];
+    struct mmsghdr   msgs[NGX_UDP_BATCH];
+
+    for (i = 0; i < nvec; i++) {
+        ngx_udp_msg_init(c, &ums[i], vec[i].iovs, vec[i].count);
+
+        msgs[i].msg_hdr = ums[i].msg;
+        msgs[i].msg_len = 0;
+    }
+
+eintr:
+
+    rc = sendmmsg(c->fd, msgs, nvec, 0);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "sendmmsg: %d of %ui, %uz", rc, nvec, size);
+
+    if (rc == -1) {
+        err = ngx_errno;
+
+        switch (err) {
+        case NGX_EAGAIN:
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
+                           "sendmmsg() not ready");
+            return NGX_AGAIN;
+
+        case NGX_EINTR:
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
+                           "sendmmsg() was interrupted");
+            goto eintr;
+
+        default:
+            c->write->error = 1;
+            ngx_connection_error(c, err, "sendmmsg() failed");
+            return NGX_ERROR;
+        }
+    }
+
+#if (NGX_STAT_STUB)
+    (void) ngx_atomic_fetch_add(ngx_stat_udp_send_calls, 1);
+    (void) ngx_atomic_fetch_add(ngx_stat_udp_sent, rc);
+#endif
+
+    /* only the datagrams sent are accounted */
+
+    n = 0;
+
+    for (i = 0; i < (ngx_uint_t) rc; i++) {
+        n += msgs[i].msg_len;
+    }
+
+    return n;
+}
+
+#endif
+
+
+static void
+ngx_udp_msg_init(ngx_connection_t *c, ngx_udp_msg_t *um, struct iovec *iovs,
+    ngx_uint_t count)
+{
+    struct msghdr  *msg;
+
+    msg = &um->msg;
+
+    ngx_memzero(msg, sizeof(struct msghdr));
 
     if (c->socklen) {
-        msg.msg_name = c->sockaddr;
-        msg.msg_namelen = c->socklen;
+        msg->msg_name = c->sockaddr;
+        msg->msg_namelen = c->socklen;
     }
 
-    msg.msg_iov = vec->iovs;
-    msg.msg_iovlen = vec->count;
+    msg->msg_iov = iovs;
+    msg->msg_iovlen = count;
 
 #if (NGX_HAVE_MSGHDR_MSG_CONTROL)
 
@@ -238,10 +429,10 @@ ngx_sendmsg(ngx_connection_t *c, ngx_iovec_t *vec)
             struct in_addr      *addr;
             struct sockaddr_in  *sin;
 
-            msg.msg_control = &msg_control;
-            msg.msg_controllen = sizeof(msg_control);
+            msg->msg_control = um->control;
+            msg->msg_controllen = CMSG_SPACE(sizeof(struct in_addr));
 
-            cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg = CMSG_FIRSTHDR(msg);
             cmsg->cmsg_level = IPPROTO_IP;
             cmsg->cmsg_type = IP_SENDSRCADDR;
             cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_addr));
@@ -259,10 +450,10 @@ ngx_sendmsg(ngx_connection_t *c, ngx_iovec_t *vec)
             struct in_pktinfo   *pkt;
             struct sockaddr_in  *sin;
 
-            msg.msg_control = &msg_control;
-            msg.msg_controllen = sizeof(msg_control);
+            msg->msg_control = um->control;
+            msg->msg_controllen = CMSG_SPACE(sizeof(struct in_pktinfo));
 
-            cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg = CMSG_FIRSTHDR(msg);
             cmsg->cmsg_level = IPPROTO_IP;
             cmsg->cmsg_type = IP_PKTINFO;
             cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
@@ -283,10 +474,10 @@ ngx_sendmsg(ngx_connection_t *c, ngx_iovec_t *vec)
             struct in6_pktinfo   *pkt6;
             struct sockaddr_in6  *sin6;
 
-            msg.msg_control = &msg_control6;
-            msg.msg_controllen = sizeof(msg_control6);
+            msg->msg_control = um->control;
+            msg->msg_controllen = CMSG_SPACE(sizeof(struct in6_pktinfo));
 
-            cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg = CMSG_FIRSTHDR(msg);
             cmsg->cmsg_level = IPPROTO_IPV6;
             cmsg->cmsg_type = IPV6_PKTINFO;
             cmsg->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
@@ -302,34 +493,95 @@ ngx_sendmsg(ngx_connection_t *c, ngx_iovec_t *vec)
     }
 
 #endif
+}
 
-eintr:
 
-    n = sendmsg(c->fd, &msg, 0);
+#if (NGX_HAVE_UDP_SEGMENT)
 
-    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                   "sendmsg: %z of %uz", n, vec->size);
+static ngx_uint_t
+ngx_udp_msg_segment(ngx_connection_t *c, ngx_udp_msg_t *um, ngx_iovec_t *vec,
+    ngx_uint_t nvec)
+{
+    int              family;
+    size_t           size, total;
+    uint16_t        *segment;
+    socklen_t        len;
+    ngx_uint_t       i;
+    struct msghdr   *msg;
+    struct cmsghdr  *cmsg;
+
+    /*
+     * the datagrams can be sent as segments of a single message
+     * if all of them but the last one are of the same size
+     */
+
+    size = vec[0].size;
+    total = 0;
 
-    if (n == -1) {
-        err = ngx_errno;
+    for (i = 0; i < nvec; i++) {
 
-        switch (err) {
-        case NGX_EAGAIN:
-            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
-                           "sendmsg() not ready");
-            return NGX_AGAIN;
+        if (vec[i].size > size
+            || (vec[i].size < size && i != nvec - 1)
+            || vec[i].size == 0)
+        {
+            return 0;
+        }
 
-        case NGX_EINTR:
-            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
-                           "sendmsg() was interrupted");
-            goto eintr;
+        total += vec[i].size;
+    }
 
-        default:
-            c->write->error = 1;
-            ngx_connection_error(c, err, "sendmsg() failed");
-            return NGX_ERROR;
+    if (total > 65507) {
+        return 0;
+    }
+
+    msg = &um->msg;
+
+    /*
+     * a connected upstream socket has no address in the connection,
+     * and the segments must not be sent as one datagram to AF_UNIX
+     */
+
+    if (msg->msg_name) {
+        family = ((struct sockaddr *) msg->msg_name)->sa_family;
+
+    } else {
+        len = sizeof(int);
+
+        if (getsockopt(c->fd, SOL_SOCKET, SO_DOMAIN, (void *) &family, &len)
+            == -1)
+        {
+            return 0;
         }
     }
 
-    return n;
+    if (family != AF_INET
+#if (NGX_HAVE_INET6)
+        && family != AF_INET6
+#endif
+       )
+    {
+        return 0;
+    }
+
+    cmsg = (struct cmsghdr *) (um->control + msg->msg_controllen);
+
+    cmsg->cmsg_level = SOL_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+
+    segment = (uint16_t *) CMSG_DATA(cmsg);
+    *segment = (uint16_t) size;
+
+    msg->msg_control = um->control;
+    msg->msg_controllen += CMSG_SPACE(sizeof(uint16_t));
+
+    /* the iovecs of the datagrams in a batch are adjacent */
+
+    for (i = 1; i < nvec; i++) {
+        msg->msg_iovlen += vec[i].count;
+    }
+
+    return 1;
 }
+
+#endif
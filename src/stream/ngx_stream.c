@@ -498,6 +498,7 @@ ngx_stream_optimize_servers(ngx_conf_t *cf, ngx_array_t *ports)
             ls->sndbuf = addr[i].opt.sndbuf;
 
             ls->wildcard = addr[i].opt.wildcard;
+            ls->connected = addr[i].opt.connected;
 
             ls->keepalive = addr[i].opt.so_keepalive;
 #if (NGX_HAVE_KEEPALIVE_TUNABLE)
@@ -512,6 +513,7 @@ ngx_stream_optimize_servers(ngx_conf_t *cf, ngx_array_t *ports)
 
 #if (NGX_HAVE_REUSEPORT)
             ls->reuseport = addr[i].opt.reuseport;
+            ls->reuseport_cpu = addr[i].opt.reuseport_cpu;
 #endif
 
             stport = ngx_palloc(cf->pool, sizeof(ngx_stream_port_t));
@@ -55,8 +55,10 @@ typedef struct {
     unsigned                       ipv6only:1;
 #endif
     unsigned                       reuseport:1;
+    unsigned                       reuseport_cpu:1;
     unsigned                       so_keepalive:2;
     unsigned                       proxy_protocol:1;
+    unsigned                       connected:1;
 #if (NGX_HAVE_KEEPALIVE_TUNABLE)
     int                            tcp_keepidle;
     int                            tcp_keepintvl;
@@ -628,6 +628,12 @@ ngx_stream_core_listen(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             ls->type = SOCK_DGRAM;
             continue;
         }
+
+        if (ngx_strcmp(value[i].data, "connected") == 0) {
+            ls->connected = 1;
+            ls->bind = 1;
+            continue;
+        }
 #endif
 
         if (ngx_strcmp(value[i].data, "bind") == 0) {
@@ -719,6 +725,19 @@ ngx_stream_core_listen(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strcmp(value[i].data, "reuseport=cpu") == 0) {
+#if (NGX_HAVE_REUSEPORT_CBPF)
+            ls->reuseport = 1;
+            ls->reuseport_cpu = 1;
+            ls->bind = 1;
+#else
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "reuseport=cpu is not supported "
+                               "on this platform, ignored");
+#endif
+            continue;
+        }
+
         if (ngx_strcmp(value[i].data, "ssl") == 0) {
 #if (NGX_STREAM_SSL)
             ngx_stream_ssl_conf_t  *sslcf;
@@ -859,6 +878,9 @@ ngx_stream_core_listen(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         if (ls->proxy_protocol) {
             return "\"proxy_protocol\" parameter is incompatible with \"udp\"";
         }
+
+    } else if (ls->connected) {
+        return "\"connected\" parameter requires \"udp\"";
     }
 
     als = cmcf->listen.elts;
@@ -33,6 +33,9 @@ typedef struct {
     ngx_flag_t                       proxy_protocol;
     ngx_stream_upstream_local_t     *local;
     ngx_flag_t                       socket_keepalive;
+#if (NGX_HAVE_SPLICE)
+    ngx_flag_t                       splice;
+#endif
 
 #if (NGX_STREAM_SSL)
     ngx_flag_t                       ssl_enable;
@@ -58,6 +61,24 @@ typedef struct {
 } ngx_stream_proxy_srv_conf_t;
 
 
+#if (NGX_HAVE_SPLICE)
+
+typedef struct {
+    ngx_fd_t                         fd[2];
+    size_t                           size;
+    size_t                           capacity;
+    ngx_uint_t                       active;  /* unsigned  active:1; */
+} ngx_stream_proxy_pipe_t;
+
+
+typedef struct {
+    /* indexed by from_upstream */
+    ngx_stream_proxy_pipe_t          pipe[2];
+} ngx_stream_proxy_ctx_t;
+
+#endif
+
+
 static void ngx_stream_proxy_handler(ngx_stream_session_t *s);
 static ngx_int_t ngx_stream_proxy_eval(ngx_stream_session_t *s,
     ngx_stream_proxy_srv_conf_t *pscf);
@@ -76,6 +97,12 @@ static void ngx_stream_proxy_process(ngx_stream_session_t *s,
     ngx_uint_t from_upstream, ngx_uint_t do_write);
 static ngx_int_t ngx_stream_proxy_test_finalize(ngx_stream_session_t *s,
     ngx_uint_t from_upstream);
+#if (NGX_HAVE_SPLICE)
+static ngx_int_t ngx_stream_proxy_splice_init(ngx_stream_session_t *s);
+static void ngx_stream_proxy_splice_cleanup(void *data);
+static ngx_int_t ngx_stream_proxy_splice(ngx_stream_session_t *s,
+    ngx_uint_t from_upstream);
+#endif
 static void ngx_stream_proxy_next_upstream(ngx_stream_session_t *s);
 static void ngx_stream_proxy_finalize(ngx_stream_session_t *s, ngx_uint_t rc);
 static u_char *ngx_stream_proxy_log_error(ngx_log_t *log, u_char *buf,
@@ -147,6 +174,17 @@ static ngx_command_t  ngx_stream_proxy_commands[] = {
       offsetof(ngx_stream_proxy_srv_conf_t, socket_keepalive),
       NULL },
 
+#if (NGX_HAVE_SPLICE)
+
+    { ngx_string("proxy_splice"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, splice),
+      NULL },
+
+#endif
+
     { ngx_string("proxy_connect_timeout"),
       NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_msec_slot,
@@ -898,6 +936,17 @@ ngx_stream_proxy_init_upstream(ngx_stream_session_t *s)
     u->upload_rate = ngx_stream_complex_value_size(s, pscf->upload_rate, 0);
     u->download_rate = ngx_stream_complex_value_size(s, pscf->download_rate, 0);
 
+#if (NGX_HAVE_SPLICE)
+
+    if (pscf->splice && pc->type == SOCK_STREAM) {
+        if (ngx_stream_proxy_splice_init(s) != NGX_OK) {
+            ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+            return;
+        }
+    }
+
+#endif
+
     u->connected = 1;
 
     pc->read->handler = ngx_stream_proxy_upstream_handler;
@@ -1508,6 +1557,10 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
     ngx_log_handler_pt            handler;
     ngx_stream_upstream_t        *u;
     ngx_stream_proxy_srv_conf_t  *pscf;
+#if (NGX_HAVE_SPLICE)
+    ngx_stream_proxy_ctx_t       *ctx;
+    ngx_stream_proxy_pipe_t      *p;
+#endif
 
     u = s->upstream;
 
@@ -1556,8 +1609,33 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
         send_action = "proxying and sending to upstream";
     }
 
+#if (NGX_HAVE_SPLICE)
+
+    p = NULL;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+
+    if (ctx && dst && ctx->pipe[from_upstream].fd[0] != NGX_INVALID_FILE) {
+        p = &ctx->pipe[from_upstream];
+    }
+
+#endif
+
     for ( ;; ) {
 
+#if (NGX_HAVE_SPLICE)
+
+        if (p && p->active) {
+            if (ngx_stream_proxy_splice(s, from_upstream) != NGX_OK) {
+                ngx_stream_proxy_finalize(s, NGX_STREAM_OK);
+                return;
+            }
+
+            break;
+        }
+
+#endif
+
         if (do_write && dst) {
 
             if (*out || *busy || dst->buffered) {
@@ -1580,6 +1658,22 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
             }
         }
 
+#if (NGX_HAVE_SPLICE)
+
+        if (p) {
+
+            /* switch to splicing once the buffered data are sent */
+
+            if (*out == NULL && *busy == NULL && !dst->buffered) {
+                p->active = 1;
+                continue;
+            }
+
+            break;
+        }
+
+#endif
+
         size = b->end - b->last;
 
         if (size && src->read->ready && !src->read->delayed
@@ -1691,6 +1785,254 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
 }
 
 
+#if (NGX_HAVE_SPLICE)
+
+static ngx_int_t
+ngx_stream_proxy_splice_init(ngx_stream_session_t *s)
+{
+    int                      size;
+    ngx_uint_t               i, enable[2];
+    ngx_connection_t        *c;
+    ngx_pool_cleanup_t      *cln;
+    ngx_stream_upstream_t   *u;
+    ngx_stream_proxy_ctx_t  *ctx;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+
+    if (ctx) {
+        return NGX_OK;
+    }
+
+    c = s->connection;
+    u = s->upstream;
+
+    /* the data are spliced unless they need to be seen or paced */
+
+    enable[0] = (u->upload_rate == 0);
+    enable[1] = (u->download_rate == 0);
+
+#if (NGX_STREAM_SSL)
+
+    if (c->ssl || u->peer.connection->ssl) {
+        return NGX_OK;
+    }
+
+#endif
+
+    if (!enable[0] && !enable[1]) {
+        return NGX_OK;
+    }
+
+    ctx = ngx_pcalloc(c->pool, sizeof(ngx_stream_proxy_ctx_t));
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->pipe[0].fd[0] = NGX_INVALID_FILE;
+    ctx->pipe[0].fd[1] = NGX_INVALID_FILE;
+    ctx->pipe[1].fd[0] = NGX_INVALID_FILE;
+    ctx->pipe[1].fd[1] = NGX_INVALID_FILE;
+
+    cln = ngx_pool_cleanup_add(c->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_stream_proxy_splice_cleanup;
+    cln->data = ctx;
+
+    ngx_stream_set_ctx(s, ctx, ngx_stream_proxy_module);
+
+    for (i = 0; i < 2; i++) {
+
+        if (!enable[i]) {
+            continue;
+        }
+
+        if (pipe2(ctx->pipe[i].fd, O_NONBLOCK|O_CLOEXEC) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, c->log, ngx_errno,
+                          "pipe2() failed, splicing is disabled");
+            ctx->pipe[i].fd[0] = NGX_INVALID_FILE;
+            ctx->pipe[i].fd[1] = NGX_INVALID_FILE;
+            continue;
+        }
+
+        size = 65536;
+
+#ifdef F_GETPIPE_SZ
+        size = fcntl(ctx->pipe[i].fd[0], F_GETPIPE_SZ);
+
+        if (size <= 0) {
+            size = 65536;
+        }
+#endif
+
+        ctx->pipe[i].capacity = size;
+
+        ngx_log_debug3(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                       "stream proxy splice pipe: %d:%d %uz",
+                       ctx->pipe[i].fd[0], ctx->pipe[i].fd[1],
+                       ctx->pipe[i].capacity);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_stream_proxy_splice_cleanup(void *data)
+{
+    ngx_stream_proxy_ctx_t  *ctx = data;
+
+    ngx_uint_t  i, j;
+
+    for (i = 0; i < 2; i++) {
+        for (j = 0; j < 2; j++) {
+            if (ctx->pipe[i].fd[j] != NGX_INVALID_FILE) {
+                (void) close(ctx->pipe[i].fd[j]);
+            }
+        }
+    }
+}
+
+
+/*
+ * The data are moved from the source socket to a pipe and from
+ * the pipe to the destination socket with splice(), so they are never
+ * copied to the user space.  The bytes in the pipe are accounted for as
+ * buffered on the destination connection.
+ */
+
+static ngx_int_t
+ngx_stream_proxy_splice(ngx_stream_session_t *s, ngx_uint_t from_upstream)
+{
+    off_t                    *received;
+    size_t                    size;
+    ssize_t                   n;
+    ngx_err_t                 err;
+    ngx_uint_t               *packets;
+    ngx_connection_t         *c, *src, *dst;
+    ngx_stream_upstream_t    *u;
+    ngx_stream_proxy_ctx_t   *ctx;
+    ngx_stream_proxy_pipe_t  *p;
+
+    c = s->connection;
+    u = s->upstream;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+    p = &ctx->pipe[from_upstream];
+
+    if (from_upstream) {
+        src = u->peer.connection;
+        dst = c;
+        received = &u->received;
+        packets = &u->responses;
+
+    } else {
+        src = c;
+        dst = u->peer.connection;
+        received = &s->received;
+        packets = &u->requests;
+    }
+
+    for ( ;; ) {
+
+        if (p->size && dst->write->ready) {
+
+            n = splice(p->fd[0], NULL, dst->fd, NULL, p->size,
+                       SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+            ngx_log_debug3(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                           "splice to %d: %z of %uz",
+                           dst->fd, n, p->size);
+
+            if (n == -1) {
+                err = ngx_socket_errno;
+
+                if (err != NGX_EAGAIN) {
+                    dst->write->error = 1;
+                    ngx_connection_error(dst, err, "splice() failed");
+                    return NGX_ERROR;
+                }
+
+                dst->write->ready = 0;
+
+            } else {
+                p->size -= n;
+                dst->sent += n;
+                continue;
+            }
+        }
+
+        size = p->capacity - p->size;
+
+        if (size && src->read->ready && !src->read->eof) {
+
+            n = splice(src->fd, NULL, p->fd[1], NULL, size,
+                       SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+            ngx_log_debug3(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                           "splice from %d: %z of %uz",
+                           src->fd, n, size);
+
+            if (n == -1) {
+                err = ngx_socket_errno;
+
+                if (err != NGX_EAGAIN) {
+                    src->read->error = 1;
+                    src->read->eof = 1;
+                    ngx_connection_error(src, err, "splice() failed");
+                    break;
+                }
+
+                /*
+                 * the pipe may be full before its capacity is used,
+                 * so the socket is only known to be drained if the pipe
+                 * is empty
+                 */
+
+                if (p->size == 0) {
+                    src->read->ready = 0;
+                }
+
+                break;
+            }
+
+            if (n == 0) {
+                src->read->eof = 1;
+                break;
+            }
+
+            if (from_upstream) {
+                if (u->state->first_byte_time == (ngx_msec_t) -1) {
+                    u->state->first_byte_time = ngx_current_msec
+                                                - u->start_time;
+                }
+            }
+
+            (*packets)++;
+            *received += n;
+            p->size += n;
+
+            continue;
+        }
+
+        break;
+    }
+
+    if (p->size) {
+        dst->buffered |= NGX_STREAM_WRITE_BUFFERED;
+
+    } else {
+        dst->buffered &= ~NGX_STREAM_WRITE_BUFFERED;
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
+
 static ngx_int_t
 ngx_stream_proxy_test_finalize(ngx_stream_session_t *s,
     ngx_uint_t from_upstream)
@@ -1722,7 +2064,9 @@ ngx_stream_proxy_test_finalize(ngx_stream_session_t *s,
             return NGX_DECLINED;
         }
 
-        if (pc == NULL || c->buffered || pc->buffered) {
+        if (pc == NULL || c->buffered || pc->buffered
+            || ngx_udp_connection_pending(c))
+        {
             return NGX_DECLINED;
         }
 
@@ -1977,6 +2321,10 @@ ngx_stream_proxy_create_srv_conf(ngx_conf_t *cf)
     conf->local = NGX_CONF_UNSET_PTR;
     conf->socket_keepalive = NGX_CONF_UNSET;
 
+#if (NGX_HAVE_SPLICE)
+    conf->splice = NGX_CONF_UNSET;
+#endif
+
 #if (NGX_STREAM_SSL)
     conf->ssl_enable = NGX_CONF_UNSET;
     conf->ssl_session_reuse = NGX_CONF_UNSET;
@@ -2034,6 +2382,10 @@ ngx_stream_proxy_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_value(conf->socket_keepalive,
                               prev->socket_keepalive, 0);
 
+#if (NGX_HAVE_SPLICE)
+    ngx_conf_merge_value(conf->splice, prev->splice, 0);
+#endif
+
 #if (NGX_STREAM_SSL)
 
     ngx_conf_merge_value(conf->ssl_enable, prev->ssl_enable, 0);
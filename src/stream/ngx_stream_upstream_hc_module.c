@@ -0,0 +1,593 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+
+typedef struct {
+    ngx_msec_t                          interval;
+    ngx_msec_t                          jitter;
+    ngx_msec_t                          timeout;
+    ngx_uint_t                          fails;
+    ngx_uint_t                          passes;
+    in_port_t                           port;
+
+    ngx_stream_upstream_srv_conf_t     *upstream;
+
+    /* per worker */
+    ngx_event_t                         event;
+} ngx_stream_upstream_hc_srv_conf_t;
+
+
+typedef struct {
+    ngx_array_t                         checks;
+} ngx_stream_upstream_hc_main_conf_t;
+
+
+typedef struct {
+    ngx_stream_upstream_hc_srv_conf_t  *conf;
+    ngx_stream_upstream_rr_peers_t     *peers;
+    ngx_stream_upstream_rr_peer_t      *peer;
+
+    ngx_peer_connection_t               pc;
+    ngx_sockaddr_t                      sockaddr;
+    ngx_str_t                           name;
+
+    ngx_pool_t                         *pool;
+} ngx_stream_upstream_hc_t;
+
+
+static void ngx_stream_upstream_hc_timer(ngx_event_t *ev);
+static void ngx_stream_upstream_hc_start(
+    ngx_stream_upstream_hc_srv_conf_t *hcf,
+    ngx_stream_upstream_rr_peers_t *peers,
+    ngx_stream_upstream_rr_peer_t *peer);
+static void ngx_stream_upstream_hc_handler(ngx_event_t *ev);
+static ngx_int_t ngx_stream_upstream_hc_test_connect(ngx_connection_t *c);
+static void ngx_stream_upstream_hc_done(ngx_stream_upstream_hc_t *hc,
+    ngx_uint_t ok);
+
+static void *ngx_stream_upstream_hc_create_main_conf(ngx_conf_t *cf);
+static void *ngx_stream_upstream_hc_create_srv_conf(ngx_conf_t *cf);
+static char *ngx_stream_upstream_health_check(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_stream_upstream_hc_init_process(ngx_cycle_t *cycle);
+
+
+static ngx_command_t  ngx_stream_upstream_hc_commands[] = {
+
+    { ngx_string("health_check"),
+      NGX_STREAM_UPS_CONF|NGX_CONF_ANY,
+      ngx_stream_upstream_health_check,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_stream_module_t  ngx_stream_upstream_hc_module_ctx = {
+    NULL,                                    /* preconfiguration */
+    NULL,                                    /* postconfiguration */
+
+    ngx_stream_upstream_hc_create_main_conf, /* create main configuration */
+    NULL,                                    /* init main configuration */
+
+    ngx_stream_upstream_hc_create_srv_conf,  /* create server configuration */
+    NULL                                     /* merge server configuration */
+};
+
+
+ngx_module_t  ngx_stream_upstream_hc_module = {
+    NGX_MODULE_V1,
+    &ngx_stream_upstream_hc_module_ctx,    /* module context */
+    ngx_stream_upstream_hc_commands,       /* module directives */
+    NGX_STREAM_MODULE,                     /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    ngx_stream_upstream_hc_init_process,   /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+/*
+ * A peer is claimed for a check by moving its next check time, see
+ * ngx_http_upstream_hc_module.c.  A check is a TCP connect.
+ */
+
+static void
+ngx_stream_upstream_hc_timer(ngx_event_t *ev)
+{
+    ngx_msec_t                          next;
+    ngx_msec_int_t                      left;
+    ngx_uint_t                          claim;
+    ngx_stream_upstream_rr_peer_t      *peer;
+    ngx_stream_upstream_rr_peers_t     *peers;
+    ngx_stream_upstream_hc_srv_conf_t  *hcf;
+
+    hcf = ev->data;
+
+    if (ngx_exiting || ngx_terminate) {
+        return;
+    }
+
+    next = hcf->interval;
+
+    for (peers = hcf->upstream->peer.data; peers; peers = peers->next) {
+
+        ngx_stream_upstream_rr_peers_rlock(peers);
+
+        for (peer = peers->peer; peer; peer = peer->next) {
+
+            if (peer->down & ~NGX_STREAM_UPSTREAM_PEER_UNHEALTHY) {
+                continue;
+            }
+
+            ngx_stream_upstream_rr_peer_lock(peers, peer);
+
+            left = peer->hc_next - ngx_current_msec;
+            claim = (left <= 0);
+
+            if (claim) {
+                left = hcf->interval;
+
+                if (hcf->jitter) {
+                    left += ngx_random() % hcf->jitter;
+                }
+
+                peer->hc_next = ngx_current_msec + left;
+            }
+
+            ngx_stream_upstream_rr_peer_unlock(peers, peer);
+
+            if ((ngx_msec_t) left < next) {
+                next = left;
+            }
+
+            if (claim) {
+                ngx_stream_upstream_hc_start(hcf, peers, peer);
+            }
+        }
+
+        ngx_stream_upstream_rr_peers_unlock(peers);
+    }
+
+    ngx_add_timer(ev, next);
+}
+
+
+static void
+ngx_stream_upstream_hc_start(ngx_stream_upstream_hc_srv_conf_t *hcf,
+    ngx_stream_upstream_rr_peers_t *peers, ngx_stream_upstream_rr_peer_t *peer)
+{
+    ngx_int_t                  rc;
+    ngx_log_t                 *log;
+    ngx_pool_t                *pool;
+    ngx_connection_t          *c;
+    ngx_stream_upstream_hc_t  *hc;
+
+    pool = ngx_create_pool(512, ngx_cycle->log);
+    if (pool == NULL) {
+        return;
+    }
+
+    hc = ngx_pcalloc(pool, sizeof(ngx_stream_upstream_hc_t));
+    if (hc == NULL) {
+        ngx_destroy_pool(pool);
+        return;
+    }
+
+    log = ngx_palloc(pool, sizeof(ngx_log_t));
+    if (log == NULL) {
+        ngx_destroy_pool(pool);
+        return;
+    }
+
+    *log = *ngx_cycle->log;
+
+    hc->name.data = ngx_pnalloc(pool, peer->name.len);
+    if (hc->name.data == NULL) {
+        ngx_destroy_pool(pool);
+        return;
+    }
+
+    hc->name.len = peer->name.len;
+    ngx_memcpy(hc->name.data, peer->name.data, peer->name.len);
+
+    ngx_memcpy(&hc->sockaddr, peer->sockaddr, peer->socklen);
+
+    if (hcf->port) {
+        ngx_inet_set_port(&hc->sockaddr.sockaddr, hcf->port);
+    }
+
+    hc->conf = hcf;
+    hc->peers = peers;
+    hc->peer = peer;
+    hc->pool = pool;
+
+    hc->pc.sockaddr = &hc->sockaddr.sockaddr;
+    hc->pc.socklen = peer->socklen;
+    hc->pc.name = &hc->name;
+    hc->pc.get = ngx_event_get_peer;
+    hc->pc.log = log;
+    hc->pc.log_error = NGX_ERROR_INFO;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, log, 0,
+                   "health check of %V", &hc->name);
+
+    rc = ngx_event_connect_peer(&hc->pc);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        ngx_stream_upstream_hc_done(hc, 0);
+        return;
+    }
+
+    c = hc->pc.connection;
+
+    c->data = hc;
+    c->pool = pool;
+
+    c->read->handler = ngx_stream_upstream_hc_handler;
+    c->write->handler = ngx_stream_upstream_hc_handler;
+
+    if (rc == NGX_OK) {
+        ngx_stream_upstream_hc_done(hc, 1);
+        return;
+    }
+
+    ngx_add_timer(c->write, hcf->timeout);
+}
+
+
+static void
+ngx_stream_upstream_hc_handler(ngx_event_t *ev)
+{
+    ngx_connection_t          *c;
+    ngx_stream_upstream_hc_t  *hc;
+
+    c = ev->data;
+    hc = c->data;
+
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "health check of %V timed out", &hc->name);
+        ngx_stream_upstream_hc_done(hc, 0);
+        return;
+    }
+
+    ngx_stream_upstream_hc_done(hc,
+                                ngx_stream_upstream_hc_test_connect(c)
+                                == NGX_OK);
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_hc_test_connect(ngx_connection_t *c)
+{
+    int        err;
+    socklen_t  len;
+
+#if (NGX_HAVE_KQUEUE)
+
+    if (ngx_event_flags & NGX_USE_KQUEUE_EVENT)  {
+        if (c->write->pending_eof || c->read->pending_eof) {
+            if (c->write->pending_eof) {
+                err = c->write->kq_errno;
+
+            } else {
+                err = c->read->kq_errno;
+            }
+
+            (void) ngx_connection_error(c, err,
+                                    "kevent() reported that connect() failed");
+            return NGX_ERROR;
+        }
+
+    } else
+#endif
+    {
+        err = 0;
+        len = sizeof(int);
+
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len)
+            == -1)
+        {
+            err = ngx_socket_errno;
+        }
+
+        if (err) {
+            (void) ngx_connection_error(c, err, "connect() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_stream_upstream_hc_done(ngx_stream_upstream_hc_t *hc, ngx_uint_t ok)
+{
+    ngx_str_t                          *host;
+    ngx_stream_upstream_rr_peer_t      *peer;
+    ngx_stream_upstream_rr_peers_t     *peers;
+    ngx_stream_upstream_hc_srv_conf_t  *hcf;
+
+    hcf = hc->conf;
+    peers = hc->peers;
+    peer = hc->peer;
+    host = &hcf->upstream->host;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_STREAM, hc->pc.log, 0,
+                   "health check of %V: %ui", &hc->name, ok);
+
+    if (hc->pc.connection) {
+        ngx_close_connection(hc->pc.connection);
+    }
+
+    ngx_stream_upstream_rr_peers_rlock(peers);
+    ngx_stream_upstream_rr_peer_lock(peers, peer);
+
+    if (ok) {
+        peer->hc_fails = 0;
+
+        if ((peer->down & NGX_STREAM_UPSTREAM_PEER_UNHEALTHY)
+            && ++peer->hc_passes >= hcf->passes)
+        {
+            peer->down &= ~NGX_STREAM_UPSTREAM_PEER_UNHEALTHY;
+            peer->hc_passes = 0;
+            peer->fails = 0;
+
+            ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                          "upstream server %V in upstream \"%V\" "
+                          "is healthy", &hc->name, host);
+        }
+
+    } else {
+        peer->hc_passes = 0;
+
+        if (!(peer->down & NGX_STREAM_UPSTREAM_PEER_UNHEALTHY)
+            && ++peer->hc_fails >= hcf->fails)
+        {
+            peer->down |= NGX_STREAM_UPSTREAM_PEER_UNHEALTHY;
+            peer->hc_fails = 0;
+
+            ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                          "upstream server %V in upstream \"%V\" "
+                          "is unhealthy", &hc->name, host);
+        }
+    }
+
+    ngx_stream_upstream_rr_peer_unlock(peers, peer);
+    ngx_stream_upstream_rr_peers_unlock(peers);
+
+    ngx_destroy_pool(hc->pool);
+}
+
+
+static void *
+ngx_stream_upstream_hc_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_stream_upstream_hc_main_conf_t  *hmcf;
+
+    hmcf = ngx_pcalloc(cf->pool, sizeof(ngx_stream_upstream_hc_main_conf_t));
+    if (hmcf == NULL) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&hmcf->checks, cf->pool, 4,
+                       sizeof(ngx_stream_upstream_hc_srv_conf_t *))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    return hmcf;
+}
+
+
+static void *
+ngx_stream_upstream_hc_create_srv_conf(ngx_conf_t *cf)
+{
+    ngx_stream_upstream_hc_srv_conf_t  *hcf;
+
+    hcf = ngx_pcalloc(cf->pool, sizeof(ngx_stream_upstream_hc_srv_conf_t));
+    if (hcf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     hcf->upstream = NULL;
+     */
+
+    return hcf;
+}
+
+
+static char *
+ngx_stream_upstream_health_check(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_stream_upstream_hc_srv_conf_t *hcf = conf;
+
+    ngx_int_t                             n;
+    ngx_str_t                            *value, s;
+    ngx_uint_t                            i;
+    ngx_stream_upstream_hc_srv_conf_t   **check;
+    ngx_stream_upstream_hc_main_conf_t   *hmcf;
+
+    if (hcf->upstream) {
+        return "is duplicate";
+    }
+
+    hcf->interval = 5000;
+    hcf->jitter = 0;
+    hcf->timeout = 1000;
+    hcf->fails = 1;
+    hcf->passes = 1;
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = &value[i].data[9];
+
+            hcf->interval = ngx_parse_time(&s, 0);
+
+            if (hcf->interval == (ngx_msec_t) NGX_ERROR
+                || hcf->interval == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "jitter=", 7) == 0) {
+
+            s.len = value[i].len - 7;
+            s.data = &value[i].data[7];
+
+            hcf->jitter = ngx_parse_time(&s, 0);
+
+            if (hcf->jitter == (ngx_msec_t) NGX_ERROR) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+
+            s.len = value[i].len - 8;
+            s.data = &value[i].data[8];
+
+            hcf->timeout = ngx_parse_time(&s, 0);
+
+            if (hcf->timeout == (ngx_msec_t) NGX_ERROR
+                || hcf->timeout == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "fails=", 6) == 0) {
+
+            n = ngx_atoi(&value[i].data[6], value[i].len - 6);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hcf->fails = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "passes=", 7) == 0) {
+
+            n = ngx_atoi(&value[i].data[7], value[i].len - 7);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hcf->passes = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "port=", 5) == 0) {
+
+            n = ngx_atoi(&value[i].data[5], value[i].len - 5);
+
+            if (n == NGX_ERROR || n < 1 || n > 65535) {
+                goto invalid;
+            }
+
+            hcf->port = (in_port_t) n;
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    hcf->upstream = ngx_stream_conf_get_module_srv_conf(cf,
+                                                 ngx_stream_upstream_module);
+
+    hmcf = ngx_stream_conf_get_module_main_conf(cf,
+                                                ngx_stream_upstream_hc_module);
+
+    check = ngx_array_push(&hmcf->checks);
+    if (check == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    *check = hcf;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_hc_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                            i;
+    ngx_event_t                          *ev;
+    ngx_stream_upstream_hc_srv_conf_t   **check;
+    ngx_stream_upstream_hc_main_conf_t   *hmcf;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    hmcf = ngx_stream_cycle_get_module_main_conf(cycle,
+                                               ngx_stream_upstream_hc_module);
+    if (hmcf == NULL) {
+        return NGX_OK;
+    }
+
+    check = hmcf->checks.elts;
+
+    for (i = 0; i < hmcf->checks.nelts; i++) {
+        ev = &check[i]->event;
+
+        ev->handler = ngx_stream_upstream_hc_timer;
+        ev->data = check[i];
+        ev->log = cycle->log;
+        ev->cancelable = 1;
+
+        /* spread the first checks of the workers */
+
+        ngx_add_timer(ev, ngx_random() % 100 + 1);
+    }
+
+    return NGX_OK;
+}
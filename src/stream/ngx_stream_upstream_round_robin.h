@@ -14,6 +14,10 @@
 #include <ngx_stream.h>
 
 
+/* set in ngx_stream_upstream_rr_peer_t.down by active health checks */
+#define NGX_STREAM_UPSTREAM_PEER_UNHEALTHY  0x02
+
+
 typedef struct ngx_stream_upstream_rr_peer_s   ngx_stream_upstream_rr_peer_t;
 
 struct ngx_stream_upstream_rr_peer_s {
@@ -40,6 +44,10 @@ struct ngx_stream_upstream_rr_peer_s {
 
     ngx_uint_t                       down;
 
+    ngx_uint_t                       hc_fails;
+    ngx_uint_t                       hc_passes;
+    ngx_msec_t                       hc_next;
+
     void                            *ssl_session;
     int                              ssl_session_len;
 
@@ -49,7 +57,7 @@ struct ngx_stream_upstream_rr_peer_s {
 
     ngx_stream_upstream_rr_peer_t   *next;
 
-    NGX_COMPAT_BEGIN(25)
+    NGX_COMPAT_BEGIN(22)
     NGX_COMPAT_END
 };
 